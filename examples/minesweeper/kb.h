@@ -15,44 +15,16 @@
 #include "game.h"
 #include "timer.h"
 
-namespace util {
-
-template<class Container, class ConstIterator>
-void Subsets(const ConstIterator first,
-             const ConstIterator last,
-             const size_t n,
-             const Container& current,
-             std::set<Container>* subsets) {
-  if (current.size() == n) {
-    subsets->insert(current);
-    return;
-  }
-  if (first == last ||
-      current.size() + static_cast<ssize_t>(std::distance(first, last)) < n) {
-    return;
-  }
-  Subsets(std::next(first), last, n, current, subsets);
-  Container current1 = current;
-  current1.push_back(*first);
-  Subsets(std::next(first), last, n, current1, subsets);
-}
-
-template<class Container>
-std::set<Container> Subsets(const Container& s, size_t n) {
-  std::set<Container> ss;
-  Subsets(s.begin(), s.end(), n, {}, &ss);
-  return ss;
-}
-
-}  // namespace util
-
-
 class KnowledgeBase {
  public:
-  KnowledgeBase(const Game* g, size_t max_k)
+  KnowledgeBase(const Game* g, size_t max_k,
+                limbo::Symbol::Factory* sf = limbo::Symbol::Factory::Instance(),
+                limbo::Term::Factory* tf = limbo::Term::Factory::Instance())
       : g_(g),
         max_k_(max_k),
-        solver_(limbo::Symbol::Factory::Instance(), limbo::Term::Factory::Instance()),
+        sf_(sf),
+        tf_(tf),
+        solver_(sf, tf),
         Bool(CreateSort()),
         XPos(CreateSort()),
         YPos(CreateSort()),
@@ -61,6 +33,7 @@ class KnowledgeBase {
         F(CreateName(Bool)),
 #endif
         MineF(CreateFunctionSymbol(Bool, 2)) {
+    limbo::Term::Factory::Scope scope(tf_);
     limbo::format::RegisterSort(Bool, "");
     limbo::format::RegisterSort(XPos, "");
     limbo::format::RegisterSort(YPos, "");
@@ -93,6 +66,7 @@ class KnowledgeBase {
   const limbo::Setup& setup() const { const_cast<KnowledgeBase&>(*this).UpdateSolver(); return solver().setup(); }
 
   limbo::internal::Maybe<bool> IsMine(Point p, int k) {
+    limbo::Term::Factory::Scope scope(tf_);
     t_.start();
     limbo::internal::Maybe<bool> r = limbo::internal::Nothing;
 #ifdef USE_DETERMINES
@@ -125,10 +99,12 @@ class KnowledgeBase {
 #else
     limbo::Formula::Ref yes_mine = limbo::Formula::Factory::Atomic(limbo::Clause{MineLit(true, p)});
     limbo::Formula::Ref no_mine = limbo::Formula::Factory::Atomic(limbo::Clause{MineLit(false, p)});
-    if (solver().Entails(k, *yes_mine, limbo::Solver::kConsistencyGuarantee)) {
+    const std::vector<limbo::Solver::Answer> rs =
+        solver().EntailsBatch(k, {yes_mine.get(), no_mine.get()}, limbo::Solver::kConsistencyGuarantee);
+    if (rs[0] == limbo::Solver::kYes) {
       assert(g_->mine(p));
       r = limbo::internal::Just(true);
-    } else if (solver().Entails(k, *no_mine, limbo::Solver::kConsistencyGuarantee)) {
+    } else if (rs[1] == limbo::Solver::kYes) {
       assert(!g_->mine(p));
       r = limbo::internal::Just(false);
     }
@@ -138,6 +114,7 @@ class KnowledgeBase {
   }
 
   void Sync() {
+    limbo::Term::Factory::Scope scope(tf_);
     for (size_t index = 0; index < g_->n_fields(); ++index) {
       if (!processed_[index]) {
         processed_[index] = Update(g_->to_point(index));
@@ -192,12 +169,8 @@ class KnowledgeBase {
       default: {
         const std::vector<Point>& ns = g_->neighbors_of(p);
         const int n = ns.size();
-        for (const std::vector<Point>& ps : util::Subsets(ns, n - m + 1)) {
-          Add(MineClause(true, ps));
-        }
-        for (const std::vector<Point>& ps : util::Subsets(ns, m + 1)) {
-          Add(MineClause(false, ps));
-        }
+        Add(limbo::Cardinality::AtLeast(m, MineClause(true, ns)));
+        Add(limbo::Cardinality::AtLeast(n - m, MineClause(false, ns)));
         Add(limbo::Clause{MineLit(false, p)});
         return true;
       }
@@ -212,17 +185,25 @@ class KnowledgeBase {
         fields.push_back(g_->to_point(index));
       }
     }
-    for (const std::vector<Point>& ps : util::Subsets(fields, n - m + 1)) {
-      Add(MineClause(true, ps));
-    }
-    for (const std::vector<Point>& ps : util::Subsets(fields, m + 1)) {
-      Add(MineClause(false, ps));
-    }
+    Add(limbo::Cardinality::AtLeast(m, MineClause(true, fields)));
+    Add(limbo::Cardinality::AtLeast(n - m, MineClause(false, fields)));
   }
 
   void Add(const limbo::Literal a) { return Add(limbo::Clause{a}); }
 
   void Add(const limbo::Clause& c) {
+    AddClosure(c);
+    clauses_.push_back(c);
+  }
+
+  // Counts of mines are stated as cardinality constraints instead of the
+  // clauses for all subsets of neighbours, which would be exponentially many.
+  void Add(const limbo::Cardinality& c) {
+    AddClosure(c.lits());
+    cards_.push_back(c);
+  }
+
+  void AddClosure(const limbo::Clause& c) {
 #ifdef USE_DETERMINES
     for (limbo::Literal a : c) {
       limbo::Term t = a.lhs();
@@ -232,42 +213,48 @@ class KnowledgeBase {
       }
     }
 #endif
-    clauses_.push_back(c);
   }
 
   void UpdateSolver() {
-    if (n_processed_clauses_ == clauses_.size()) {
+    limbo::Term::Factory::Scope scope(tf_);
+    if (n_processed_clauses_ == clauses_.size() && n_processed_cards_ == cards_.size()) {
       return;
     }
     solver_.grounder().AddClauses(clauses_.begin() + n_processed_clauses_, clauses_.end());
+    solver_.grounder().AddCardinalities(cards_.begin() + n_processed_cards_, cards_.end());
     n_processed_clauses_ = clauses_.size();
+    n_processed_cards_ = cards_.size();
   }
 
   limbo::Symbol::Sort CreateSort() const {
-    return limbo::Symbol::Factory::Instance()->CreateSort();
+    return sf_->CreateSort();
   }
 
   limbo::Symbol CreateFunctionSymbol(limbo::Symbol::Sort sort, limbo::Symbol::Arity arity) const {
-    return limbo::Symbol::Factory::Instance()->CreateFunction(sort, arity);
+    return sf_->CreateFunction(sort, arity);
   }
 
   limbo::Term CreateName(limbo::Symbol::Sort sort) const {
-    return limbo::Term::Factory::Instance()->CreateTerm(limbo::Symbol::Factory::Instance()->CreateName(sort));
+    return tf_->CreateTerm(sf_->CreateName(sort));
   }
 
   limbo::Term CreateVariable(limbo::Symbol::Sort sort) const {
-    return limbo::Term::Factory::Instance()->CreateTerm(limbo::Symbol::Factory::Instance()->CreateVariable(sort));
+    return tf_->CreateTerm(sf_->CreateVariable(sort));
   }
 
   limbo::Term CreateFunction(limbo::Symbol symbol, const limbo::Term::Vector& args) const {
-    return limbo::Term::Factory::Instance()->CreateTerm(symbol, args);
+    return tf_->CreateTerm(symbol, args);
   }
 
   const Game* g_;
   size_t max_k_;
+  limbo::Symbol::Factory* const sf_;
+  limbo::Term::Factory* const tf_;
 
   std::vector<limbo::Clause> clauses_;
-  size_t n_processed_clauses_;
+  size_t n_processed_clauses_ = 0;
+  std::vector<limbo::Cardinality> cards_;
+  size_t n_processed_cards_ = 0;
 
   limbo::Solver solver_;
 
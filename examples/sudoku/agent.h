@@ -5,6 +5,7 @@
 #define EXAMPLES_SUDOKU_AGENT_H_
 
 #include <iostream>
+#include <vector>
 
 #include <limbo/internal/maybe.h>
 
@@ -30,19 +31,24 @@ class KnowledgeBaseAgent : public Agent {
   KnowledgeBaseAgent(Game* g, KnowledgeBase* kb) : g_(g), kb_(kb) {}
 
   limbo::internal::Maybe<Result> Explore() override {
+    std::vector<Point> ps;
+    for (std::size_t x = 1; x <= 9; ++x) {
+      for (std::size_t y = 1; y <= 9; ++y) {
+        Point p(x, y);
+        if (g_->get(p) == 0) {
+          ps.push_back(p);
+        }
+      }
+    }
     for (int k = 0; k <= kb_->max_k(); ++k) {
-      for (std::size_t x = 1; x <= 9; ++x) {
-        for (std::size_t y = 1; y <= 9; ++y) {
-          Point p(x, y);
-          if (g_->get(p) == 0) {
-            const limbo::internal::Maybe<int> r = kb_->Val(p, k);
-            if (r) {
-              const int n = r.val;
-              kb_->Add(p, n);
-              g_->set(p, n);
-              return limbo::internal::Just(Result(p, n, k));
-            }
-          }
+      const std::vector<limbo::internal::Maybe<int>> rs = kb_->Vals(ps, k);
+      for (std::size_t i = 0; i < ps.size(); ++i) {
+        if (rs[i]) {
+          const Point p = ps[i];
+          const int n = rs[i].val;
+          kb_->Add(p, n);
+          g_->set(p, n);
+          return limbo::internal::Just(Result(p, n, k));
         }
       }
     }
@@ -5,6 +5,7 @@
 #define EXAMPLES_SUDOKU_KB_H_
 
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 #include <limbo/solver.h>
@@ -17,11 +18,16 @@
 
 class KnowledgeBase {
  public:
-  KnowledgeBase(const Game* g, int max_k)
+  KnowledgeBase(const Game* g, int max_k,
+                limbo::Symbol::Factory* sf = limbo::Symbol::Factory::Instance(),
+                limbo::Term::Factory* tf = limbo::Term::Factory::Instance())
       : max_k_(max_k),
-        solver_(limbo::Symbol::Factory::Instance(), limbo::Term::Factory::Instance()),
+        sf_(sf),
+        tf_(tf),
+        solver_(sf, tf),
         VAL_(CreateSort()),
         val_(CreateFunctionSymbol(VAL_, 2)) {
+    limbo::Term::Factory::Scope scope(tf_);
     limbo::format::RegisterSort(VAL_, "");
     limbo::format::RegisterSymbol(val_, "val");
     for (std::size_t i = 1; i <= 9; ++i) {
@@ -30,46 +36,30 @@ class KnowledgeBase {
       ss << i;
       limbo::format::RegisterSymbol(vals_.back().symbol(), ss.str());
     }
+    // Every row, column, and box is a permutation of the values.
     for (std::size_t x = 1; x <= 9; ++x) {
+      limbo::Term::Vector ts;
       for (std::size_t y = 1; y <= 9; ++y) {
-        for (std::size_t yy = 1; yy <= 9; ++yy) {
-          if (y != yy) {
-            Add(limbo::Literal::Neq(val(x, y), val(x, yy)));
-          }
-        }
+        ts.push_back(val(x, y));
       }
+      Add(ts);
     }
-    for (std::size_t x = 1; x <= 9; ++x) {
-      for (std::size_t xx = 1; xx <= 9; ++xx) {
-        for (std::size_t y = 1; y <= 9; ++y) {
-          if (x != xx) {
-            Add(limbo::Literal::Neq(val(x, y), val(xx, y)));
-          }
-        }
+    for (std::size_t y = 1; y <= 9; ++y) {
+      limbo::Term::Vector ts;
+      for (std::size_t x = 1; x <= 9; ++x) {
+        ts.push_back(val(x, y));
       }
+      Add(ts);
     }
     for (std::size_t i = 1; i <= 3; ++i) {
       for (std::size_t j = 1; j <= 3; ++j) {
+        limbo::Term::Vector ts;
         for (std::size_t x = 3*i-2; x <= 3*i; ++x) {
-          for (std::size_t xx = 3*i-2; xx <= 3*i; ++xx) {
-            for (std::size_t y = 3*j-2; y <= 3*j; ++y) {
-              for (std::size_t yy = 3*j-2; yy <= 3*j; ++yy) {
-                if (x != xx || y != yy) {
-                  Add(limbo::Literal::Neq(val(x, y), val(xx, yy)));
-                }
-              }
-            }
+          for (std::size_t y = 3*j-2; y <= 3*j; ++y) {
+            ts.push_back(val(x, y));
           }
         }
-      }
-    }
-    for (std::size_t x = 1; x <= 9; ++x) {
-      for (std::size_t y = 1; y <= 9; ++y) {
-        std::vector<limbo::Literal> lits;
-        for (std::size_t i = 1; i <= 9; ++i) {
-          lits.push_back(limbo::Literal::Eq(val(x, y), n(i)));
-        }
-        Add(limbo::Clause(lits.begin(), lits.end()));
+        Add(ts);
       }
     }
     for (std::size_t x = 1; x <= 9; ++x) {
@@ -88,9 +78,13 @@ class KnowledgeBase {
   const limbo::Solver& solver() const { const_cast<KnowledgeBase&>(*this).UpdateSolver(); return solver_; }
   const limbo::Setup& setup() const { const_cast<KnowledgeBase&>(*this).UpdateSolver(); return solver().setup(); }
 
-  void Add(Point p, int i) { Add(limbo::Clause{limbo::Literal::Eq(val(p), n(i))}); }
+  void Add(Point p, int i) {
+    limbo::Term::Factory::Scope scope(tf_);
+    Add(limbo::Clause{limbo::Literal::Eq(val(p), n(i))});
+  }
 
   limbo::internal::Maybe<int> Val(Point p, int k) {
+    limbo::Term::Factory::Scope scope(tf_);
     t_.start();
     UpdateSolver();
     const limbo::internal::Maybe<limbo::Term> r = solver().Determines(k, val(p));
@@ -112,18 +106,49 @@ class KnowledgeBase {
     return limbo::internal::Nothing;
   }
 
+  std::vector<limbo::internal::Maybe<int>> Vals(const std::vector<Point>& ps, int k) {
+    limbo::Term::Factory::Scope scope(tf_);
+    t_.start();
+    UpdateSolver();
+    limbo::Term::Vector ts;
+    for (const Point p : ps) {
+      ts.push_back(val(p));
+    }
+    const std::unordered_map<limbo::Term, limbo::Term> rs = solver().DeterminesAll(k, ts).names;
+    std::vector<limbo::internal::Maybe<int>> is(ps.size());
+    for (std::size_t j = 0; j < ts.size(); ++j) {
+      auto it = rs.find(ts[j]);
+      if (it != rs.end()) {
+        assert(!it->second.null());
+        for (std::size_t i = 1; i <= 9; ++i) {
+          if (it->second == n(i)) {
+            is[j] = limbo::internal::Just(static_cast<int>(i));
+          }
+        }
+      }
+    }
+    t_.stop();
+    return is;
+  }
+
   const Timer& timer() const { return t_; }
   void ResetTimer() { t_.reset(); }
 
  private:
   void Add(const limbo::Literal a) { return Add(limbo::Clause{a}); }
   void Add(const limbo::Clause& c) { clauses_.push_back(c); }
+  void Add(const limbo::Term::Vector& ts) {
+    alldiffs_.push_back(limbo::AllDifferent(ts.begin(), ts.end(), vals_.begin(), vals_.end()));
+  }
 
   void UpdateSolver() {
-    if (n_processed_clauses_ == clauses_.size()) {
+    limbo::Term::Factory::Scope scope(tf_);
+    if (n_processed_clauses_ == clauses_.size() && n_processed_alldiffs_ == alldiffs_.size()) {
       return;
     }
+    solver_.grounder().AddAllDifferents(alldiffs_.begin() + n_processed_alldiffs_, alldiffs_.end());
     solver_.grounder().AddClauses(clauses_.begin() + n_processed_clauses_, clauses_.end());
+    n_processed_alldiffs_ = alldiffs_.size();
     n_processed_clauses_ = clauses_.size();
   }
 
@@ -140,29 +165,33 @@ class KnowledgeBase {
   }
 
   limbo::Symbol::Sort CreateSort() const {
-    return limbo::Symbol::Factory::Instance()->CreateSort();
+    return sf_->CreateSort();
   }
 
   limbo::Symbol CreateFunctionSymbol(limbo::Symbol::Sort sort, limbo::Symbol::Arity arity) const {
-    return limbo::Symbol::Factory::Instance()->CreateFunction(sort, arity);
+    return sf_->CreateFunction(sort, arity);
   }
 
   limbo::Term CreateName(limbo::Symbol::Sort sort) const {
-    return limbo::Term::Factory::Instance()->CreateTerm(limbo::Symbol::Factory::Instance()->CreateName(sort));
+    return tf_->CreateTerm(sf_->CreateName(sort));
   }
 
   limbo::Term CreateVariable(limbo::Symbol::Sort sort) const {
-    return limbo::Term::Factory::Instance()->CreateTerm(limbo::Symbol::Factory::Instance()->CreateVariable(sort));
+    return tf_->CreateTerm(sf_->CreateVariable(sort));
   }
 
   limbo::Term CreateFunction(limbo::Symbol symbol, const limbo::Term::Vector& args) const {
-    return limbo::Term::Factory::Instance()->CreateTerm(symbol, args);
+    return tf_->CreateTerm(symbol, args);
   }
 
   int max_k_;
+  limbo::Symbol::Factory* const sf_;
+  limbo::Term::Factory* const tf_;
 
   std::vector<limbo::Clause> clauses_;
-  size_t n_processed_clauses_;
+  size_t n_processed_clauses_ = 0;
+  std::vector<limbo::AllDifferent> alldiffs_;
+  size_t n_processed_alldiffs_ = 0;
 
   limbo::Solver solver_;
 
@@ -87,6 +87,14 @@ struct Callback : public limbo::format::pdl::DefaultCallback {
       ctx->set_distribute(true);
     } else if (proc == "disable_distribute") {
       ctx->set_distribute(false);
+    } else if (proc == "enable_definitional") {
+      ctx->set_definitional(true);
+    } else if (proc == "disable_definitional") {
+      ctx->set_definitional(false);
+    } else if (proc == "enable_symmetry_pruning") {
+      ctx->kb().set_prune_symmetries(true);
+    } else if (proc == "disable_symmetry_pruning") {
+      ctx->kb().set_prune_symmetries(false);
     } else if (bs_(ctx, proc, args)) {
       // it's a call for Battleship
     } else if (su_(ctx, proc, args)) {
@@ -0,0 +1,117 @@
+// vim:filetype=cpp:textwidth=120:shiftwidth=2:softtabstop=2:expandtab
+// Copyright 2014-2017 Christoph Schwering
+// Licensed under the MIT license. See LICENSE file in the project root.
+//
+// An all-different constraint demands that a group of primitive terms take
+// pairwise different values from a given domain of names. It stands for the
+// clauses
+//   [t = n1 v ... v t = nM]   for every term t,
+//   [t != n v t' != n]        for every name n and distinct terms t, t',
+//   [t1 = n v ... v tK = n]   for every name n of the domain, provided there
+//                             are as many terms as names.
+// The last group is implied by the others by the pigeonhole principle, but
+// unit propagation would not find it.
+//
+// The literals t = n for all terms t and names n of the domain are kept as a
+// Clause, lits(), which is used to index the constraint like a clause. Setup
+// handles the constraint natively; see Setup::AddAllDifferent().
+
+#ifndef LIMBO_ALL_DIFFERENT_H_
+#define LIMBO_ALL_DIFFERENT_H_
+
+#include <cassert>
+
+#include <algorithm>
+#include <vector>
+
+#include <limbo/clause.h>
+#include <limbo/literal.h>
+#include <limbo/term.h>
+
+#include <limbo/internal/hash.h>
+#include <limbo/internal/ints.h>
+
+namespace limbo {
+
+class AllDifferent {
+ public:
+  typedef internal::size_t size_t;
+
+  AllDifferent() = default;
+
+  template<typename TermInputIt, typename NameInputIt>
+  AllDifferent(TermInputIt terms_first, TermInputIt terms_last, NameInputIt names_first, NameInputIt names_last)
+      : terms_(terms_first, terms_last), names_(names_first, names_last) {
+    Normalize(&terms_);
+    Normalize(&names_);
+    assert(std::all_of(names_.begin(), names_.end(), [](Term n) { return n.name(); }));
+    std::vector<Literal> lits;
+    lits.reserve(terms_.size() * names_.size());
+    for (const Term t : terms_) {
+      for (const Term n : names_) {
+        lits.push_back(Literal::Eq(t, n));
+      }
+    }
+    lits_ = Clause(lits.begin(), lits.end());
+  }
+
+  bool operator==(const AllDifferent& c) const { return terms_ == c.terms_ && names_ == c.names_; }
+  bool operator!=(const AllDifferent& c) const { return !(*this == c); }
+
+  internal::hash32_t hash() const { return lits_.hash(); }
+
+  const Term::Vector& terms() const { return terms_; }
+  const Term::Vector& names() const { return names_; }
+  const Clause& lits() const { return lits_; }
+
+  // With as many terms as names, every name is taken by some term.
+  bool permutation() const { return terms_.size() == names_.size(); }
+
+  bool ground()    const { return lits_.ground(); }
+  bool primitive() const { return lits_.primitive(); }
+
+  template<typename UnaryFunction>
+  AllDifferent Substitute(UnaryFunction theta, Term::Factory* tf) const {
+    Term::Vector terms;
+    Term::Vector names;
+    for (const Term t : terms_) {
+      terms.push_back(t.Substitute(theta, tf));
+    }
+    for (const Term n : names_) {
+      names.push_back(n.Substitute(theta, tf));
+    }
+    return AllDifferent(terms.begin(), terms.end(), names.begin(), names.end());
+  }
+
+  template<typename UnaryFunction>
+  void Traverse(UnaryFunction f) const { lits_.Traverse(f); }
+
+ private:
+  static void Normalize(Term::Vector* ts) {
+    std::sort(ts->begin(), ts->end());
+    ts->erase(std::unique(ts->begin(), ts->end()), ts->end());
+  }
+
+  Term::Vector terms_;
+  Term::Vector names_;
+  Clause lits_;
+};
+
+}  // namespace limbo
+
+
+namespace std {
+
+template<>
+struct hash<limbo::AllDifferent> {
+  limbo::internal::hash32_t operator()(const limbo::AllDifferent& c) const { return c.hash(); }
+};
+
+template<>
+struct equal_to<limbo::AllDifferent> {
+  bool operator()(const limbo::AllDifferent& a, const limbo::AllDifferent& b) const { return a == b; }
+};
+
+}  // namespace std
+
+#endif  // LIMBO_ALL_DIFFERENT_H_
@@ -0,0 +1,98 @@
+// vim:filetype=cpp:textwidth=120:shiftwidth=2:softtabstop=2:expandtab
+// Copyright 2014-2017 Christoph Schwering
+// Licensed under the MIT license. See LICENSE file in the project root.
+//
+// A cardinality constraint demands that at least k of a set of primitive
+// literals hold. Like clauses, cardinality constraints are immutable, and the
+// literals are stored as a Clause, so they form a set.
+//
+// AtMost(k, L) is represented as AtLeast(|L| - k, L'), where L' contains the
+// flipped literals of L. A constraint with k = 1 is just the clause L, and one
+// with k > |L| is unsatisfiable.
+//
+// A constraint with n literals stands for the C(n, n-k+1) clauses that
+// consist of n-k+1 of its literals. Setup handles the constraint natively,
+// that is, by counting the literals that are satisfied or falsified by the
+// unit clauses; see Setup::AddCardinality().
+
+#ifndef LIMBO_CARDINALITY_H_
+#define LIMBO_CARDINALITY_H_
+
+#include <cassert>
+
+#include <limbo/clause.h>
+#include <limbo/literal.h>
+
+#include <limbo/internal/hash.h>
+#include <limbo/internal/ints.h>
+#include <limbo/internal/iter.h>
+
+namespace limbo {
+
+class Cardinality {
+ public:
+  typedef internal::size_t size_t;
+
+  Cardinality() = default;
+
+  template<typename InputIt>
+  static Cardinality AtLeast(size_t k, InputIt first, InputIt last) {
+    return Cardinality(k, Clause(first, last));
+  }
+
+  static Cardinality AtLeast(size_t k, const Clause& c) { return Cardinality(k, c); }
+
+  template<typename InputIt>
+  static Cardinality AtMost(size_t k, InputIt first, InputIt last) {
+    auto r = internal::transform_range(first, last, [](Literal a) { return a.flip(); });
+    const Clause c(r.begin(), r.end());
+    return Cardinality(k <= c.size() ? c.size() - k : 0, c);
+  }
+
+  bool operator==(const Cardinality& c) const { return k_ == c.k_ && lits_ == c.lits_; }
+  bool operator!=(const Cardinality& c) const { return !(*this == c); }
+
+  internal::hash32_t hash() const { return lits_.hash() ^ internal::jenkins_hash(static_cast<internal::u32>(k_)); }
+
+  size_t k() const { return k_; }
+  const Clause& lits() const { return lits_; }
+
+  bool ground()    const { return lits_.ground(); }
+  bool primitive() const { return lits_.primitive(); }
+
+  // Trivially valid constraints demand nothing.
+  bool valid() const { return k_ == 0; }
+
+  template<typename UnaryFunction>
+  Cardinality Substitute(UnaryFunction theta, Term::Factory* tf) const {
+    return Cardinality(k_, lits_.Substitute(theta, tf));
+  }
+
+  template<typename UnaryFunction>
+  void Traverse(UnaryFunction f) const { lits_.Traverse(f); }
+
+ private:
+  Cardinality(size_t k, const Clause& lits) : k_(k), lits_(lits) {}
+
+  size_t k_ = 0;
+  Clause lits_;
+};
+
+}  // namespace limbo
+
+
+namespace std {
+
+template<>
+struct hash<limbo::Cardinality> {
+  limbo::internal::hash32_t operator()(const limbo::Cardinality& c) const { return c.hash(); }
+};
+
+template<>
+struct equal_to<limbo::Cardinality> {
+  bool operator()(const limbo::Cardinality& a, const limbo::Cardinality& b) const { return a == b; }
+};
+
+}  // namespace std
+
+#endif  // LIMBO_CARDINALITY_H_
@@ -394,6 +394,7 @@ next:
 
  private:
   friend class internal::array_iterator<Clause, Literal>;
+  friend class Snapshot;
   typedef internal::array_iterator<Clause, Literal> iterator;
   static constexpr size_t kArraySize = 5;
 
@@ -3,6 +3,11 @@
 // Licensed under the MIT license. See LICENSE file in the project root.
 //
 // Overloads some operators to provide a higher-level syntax for formulas.
+//
+// Context makes its Term::Factory current while it adds clauses. The
+// operators, however, do not know the factory of their terms, so formulas over
+// a factory other than the process-wide one must be built within a
+// Term::Factory::Scope.
 
 #ifndef LIMBO_FORMAT_CPP_SYNTAX_H_
 #define LIMBO_FORMAT_CPP_SYNTAX_H_
@@ -73,7 +78,8 @@ class HiFormula {
 
 class Context {
  public:
-  Context() : solver_(sf(), tf()) {}
+  Context() : Context(Symbol::Factory::Instance(), Term::Factory::Instance()) {}
+  Context(Symbol::Factory* sf, Term::Factory* tf) : sf_(sf), tf_(tf), solver_(sf, tf) {}
 
   Symbol::Sort CreateSort() {
     return sf()->CreateSort();
@@ -89,6 +95,7 @@ class Context {
   }
 
   void AddClause(const Formula& phi) {
+    Term::Factory::Scope scope(tf_);
     Formula::Ref psi = phi.NF(sf(), tf());
     internal::Maybe<Clause> c = psi->AsUnivClause();
     assert(c);
@@ -96,16 +103,22 @@ class Context {
   }
 
   void AddClause(const Clause& c) {
+    Term::Factory::Scope scope(tf_);
     solver_.grounder().AddClause(c);
   }
 
   Solver* solver() { return &solver_; }
   const Solver& solver() const { return solver_; }
 
-  Symbol::Factory* sf() { return Symbol::Factory::Instance(); }
-  Term::Factory* tf() { return Term::Factory::Instance(); }
+  template<typename UnaryFunction>
+  void Traverse(UnaryFunction f) const { solver_.Traverse(f); }
+
+  Symbol::Factory* sf() { return sf_; }
+  Term::Factory* tf() { return tf_; }
 
  private:
+  Symbol::Factory* const sf_;
+  Term::Factory* const tf_;
   Solver solver_;
 };
 
@@ -230,13 +230,42 @@ std::ostream& operator<<(std::ostream& os, const Clause& c) {
 #endif  // LIMBO_OUTPUT_CLAUSE
 #endif  // LIMBO_CLAUSE_H_
 
+#ifdef LIMBO_CARDINALITY_H_
+#ifndef LIMBO_CARDINALITY_OUTPUT
+#define LIMBO_CARDINALITY_OUTPUT
+std::ostream& operator<<(std::ostream& os, const Cardinality& c) {
+  return os << "\u2265" << c.k() << ' ' << c.lits();
+}
+#endif  // LIMBO_CARDINALITY_OUTPUT
+#endif  // LIMBO_CARDINALITY_H_
+
+#ifdef LIMBO_ALL_DIFFERENT_H_
+#ifndef LIMBO_ALL_DIFFERENT_OUTPUT
+#define LIMBO_ALL_DIFFERENT_OUTPUT
+std::ostream& operator<<(std::ostream& os, const AllDifferent& c) {
+  os << "\u2260";
+  print_range(os, c.terms(), "(", ")", ", ");
+  return print_range(os, c.names(), " \u2208 {", "}", ", ");
+}
+#endif  // LIMBO_ALL_DIFFERENT_OUTPUT
+#endif  // LIMBO_ALL_DIFFERENT_H_
+
 #ifdef LIMBO_SETUP_H_
 #ifndef LIMBO_SETUP_OUTPUT
 #define LIMBO_SETUP_OUTPUT
 std::ostream& operator<<(std::ostream& os, const Setup& s) {
   auto is = s.clauses();
   auto cs = internal::transform_range(is.begin(), is.end(), [&s](size_t i) { return s.clause(i); });
-  return print_range(os, cs, "{ ", "\n}", "\n, ");
+  print_range(os, cs, "{ ", "\n}", "\n, ");
+  if (!s.cardinalities().empty()) {
+    os << std::endl;
+    print_range(os, s.cardinalities(), "{ ", "\n}", "\n, ");
+  }
+  if (!s.all_differents().empty()) {
+    os << std::endl;
+    print_range(os, s.all_differents(), "{ ", "\n}", "\n, ");
+  }
+  return os;
 }
 #endif  // LIMBO_SETUP_OUTPUT
 #endif  // LIMBO_SETUP_H_
@@ -8,6 +8,10 @@
 // Results are announced through the Logger functor, which needs to implement
 // operator() for the structs defined in Logger. Logger itself is a minimal
 // implementation of a Logger, which ignores all log data.
+//
+// Context makes its Term::Factory current while it registers, adds, or queries
+// something and while it calls the Logger or Callback; Parser::Action::Run()
+// does the same for the whole action.
 
 #ifndef LIMBO_FORMAT_PDL_CONTEXT_H_
 #define LIMBO_FORMAT_PDL_CONTEXT_H_
@@ -102,9 +106,13 @@ struct DefaultCallback {
 template<typename Logger = DefaultLogger, typename Callback = DefaultCallback>
 class Context {
  public:
-  explicit Context(Logger p = Logger(), Callback c = Callback()) : logger_(p), callback_(c), kb_(sf(), tf()) {}
+  explicit Context(Logger p = Logger(), Callback c = Callback())
+      : Context(Symbol::Factory::Instance(), Term::Factory::Instance(), p, c) {}
+  Context(Symbol::Factory* sf, Term::Factory* tf, Logger p = Logger(), Callback c = Callback())
+      : sf_(sf), tf_(tf), logger_(p), callback_(c), kb_(sf, tf) {}
 
   void Call(const std::string& proc, const std::vector<Term>& args) {
+    Term::Factory::Scope scope(tf_);
     callback_(this, proc, args);
   }
 
@@ -139,6 +147,7 @@ class Context {
   }
 
   void RegisterVariable(const std::string& id, const std::string& sort_id) {
+    Term::Factory::Scope scope(tf_);
     if (IsRegisteredVariable(id))
       throw std::domain_error(id);
     const Symbol::Sort sort = LookupSort(sort_id);
@@ -149,6 +158,7 @@ class Context {
   }
 
   void RegisterName(const std::string& id, const std::string& sort_id) {
+    Term::Factory::Scope scope(tf_);
     if (IsRegisteredName(id))
       throw std::domain_error(id);
     const Symbol::Sort sort = LookupSort(sort_id);
@@ -169,6 +179,7 @@ class Context {
   }
 
   void RegisterMetaVariable(const std::string& id, Term t) {
+    Term::Factory::Scope scope(tf_);
     if (IsRegisteredMetaVariable(id))
       throw std::domain_error(id);
     meta_vars_.Register(id, t);
@@ -176,6 +187,7 @@ class Context {
   }
 
   void RegisterFormula(const std::string& id, const Formula& phi) {
+    Term::Factory::Scope scope(tf_);
     formulas_.Register(id, phi.Clone());
     logger_(DefaultLogger::RegisterFormulaData(id, phi));
   }
@@ -190,13 +202,18 @@ class Context {
   void set_distribute(bool b) { distribute_ = b; }
   bool distribute() const { return distribute_; }
 
+  void set_definitional(bool b) { definitional_ = b; }
+  bool definitional() const { return definitional_; }
+
   bool AddToKb(const Formula& alpha) {
-    const bool ok = kb_.Add(alpha);
+    Term::Factory::Scope scope(tf_);
+    const bool ok = kb_.Add(alpha, definitional_);
     logger_(DefaultLogger::AddToKbData(alpha, ok));
     return ok;
   }
 
   bool Query(const Formula& alpha) {
+    Term::Factory::Scope scope(tf_);
     const bool yes = kb_.Entails(alpha, distribute_);
     logger_(DefaultLogger::QueryData(kb_, alpha, yes));
     return yes;
@@ -205,8 +222,22 @@ class Context {
   KnowledgeBase& kb() { return kb_; }
   const KnowledgeBase& kb() const { return kb_; }
 
-  Symbol::Factory* sf() { return Symbol::Factory::Instance(); }
-  Term::Factory* tf() { return Term::Factory::Instance(); }
+  // Traverse() visits the terms of the registered variables, names,
+  // meta-variables, and formulas, and of the knowledge base; it serves as
+  // root for Term::Factory::Collect().
+  template<typename UnaryFunction>
+  void Traverse(UnaryFunction f) const {
+    Term::Factory::Scope scope(tf_);
+    auto traverse_term = [&f](Term t) { t.Traverse(f); };
+    vars_.Traverse(traverse_term);
+    names_.Traverse(traverse_term);
+    meta_vars_.Traverse(traverse_term);
+    formulas_.Traverse([&f](const Formula::Ref& alpha) { alpha->Traverse(f); });
+    kb_.Traverse(f);
+  }
+
+  Symbol::Factory* sf() { return sf_; }
+  Term::Factory* tf() { return tf_; }
 
   const Logger& logger() const { return logger_; }
         Logger* logger()       { return &logger_; }
@@ -223,10 +254,14 @@ class Context {
     void Register(const std::string& id, T&& val) { Unregister(id); r_.emplace(id, std::forward<T>(val)); }
     void Unregister(const std::string& id) { auto it = r_.find(id); if (it != r_.end()) { r_.erase(it); } }
     const T& Find(const std::string& id) const { auto it = r_.find(id); return it->second; }
+    template<typename UnaryFunction>
+    void Traverse(UnaryFunction f) const { for (const auto& p : r_) { f(p.second); } }
    private:
     std::map<std::string, T> r_;
   };
 
+  Symbol::Factory* const sf_;
+  Term::Factory* const   tf_;
   Logger                 logger_;
   Callback               callback_;
   Registry<Symbol::Sort> sorts_;
@@ -237,6 +272,7 @@ class Context {
   Registry<Formula::Ref> formulas_;
   KnowledgeBase          kb_;
   bool                   distribute_ = true;
+  bool                   definitional_ = false;
 };
 
 }  // namespace pdl
@@ -7,6 +7,8 @@
 // See the comment above Parser::start() and its callees for the grammar
 // definition. The Context template parameter is merely passed around to be
 // the argument of Parser::Action functors, as returned by Parser::Parse().
+// Action::Run() makes the Context's Term::Factory, ctx->tf(), current while
+// the action runs.
 
 #ifndef LIMBO_FORMAT_PDL_PARSER_H_
 #define LIMBO_FORMAT_PDL_PARSER_H_
@@ -107,6 +109,7 @@ class Parser {
     Action(NullaryFunction func) : base::shared_ptr(new function(func)) {}
 
     Result<T> Run(Context* ctx) const {
+      Term::Factory::Scope scope(ctx->tf());
       function* f = base::get();
       if (f) {
         return (*f)(ctx);
@@ -718,7 +721,8 @@ class Parser {
         return Success<>();
       } else {
         return Error<>(LIMBO_MSG("Couldn't add formula to KB; is it proper+ "
-                                "(i.e., its NF must be a universally quantified clause)?"));
+                                "(i.e., its NF must be a universally quantified clause, "
+                                "unless enable_definitional() was called)?"));
       }
     });
   }
@@ -8,6 +8,18 @@
 //
 // NF() rectifies a formula (that is, renames variables to make sure no variable
 // occurs freely and bound or bound by two different quantifiers).
+//
+// Clausify() is the definitional (Tseitin-style) alternative to NF() for
+// objective formulas that shall be stored as clauses. Instead of expecting the
+// normal form to be a single clause, it introduces a fresh function symbol for
+// every conjunction below a disjunction and a Skolem function for every
+// existential quantifier in positive position, so the resulting clauses are
+// linear in the size of the formula. Only the direction that implies the
+// formula is defined (Plaisted-Greenbaum), which suffices because every model
+// of the formula extends to a model of the clauses and every model of the
+// clauses satisfies the formula. Hence queries that do not mention the new
+// symbols are answered soundly; however, reasoning with a definition may cost
+// a split that the distributed clauses would not need.
 
 #ifndef LIMBO_FORMULA_H_
 #define LIMBO_FORMULA_H_
@@ -112,6 +124,7 @@ class Formula {
       UnaryFunction func_;
     };
     ISubstitute(FreeSubstitution(theta), tf);
+    ClearFreeVars();
   }
 
   template<typename UnaryFunction>
@@ -138,6 +151,8 @@ class Formula {
 
   internal::Maybe<Clause> AsUnivClause() const { return AsUnivClause(0); }
 
+  inline internal::Maybe<std::vector<Clause>> Clausify(Symbol::Factory* sf, Term::Factory* tf) const;
+
   virtual bool objective() const = 0;
   virtual bool subjective() const = 0;
   virtual bool quantified_in() const = 0;
@@ -165,6 +180,8 @@ class Formula {
 
   typedef std::unordered_map<Term, Term> TermMap;
 
+  class Clausifier;
+
   class QuantifierPrefix {
    public:
     void prepend_not() { prefix_.push_front(Element{kNot}); }
@@ -209,6 +226,7 @@ class Formula {
     // somewhere in the formula or is bound by another quantifier to the left
     // of the current position.
     Rectify(&tm, sf, tf);
+    ClearFreeVars();
   }
   virtual void Rectify(TermMap* tm, Symbol::Factory* sf, Term::Factory* tf) = 0;
 
@@ -221,6 +239,11 @@ class Formula {
   virtual internal::Maybe<Clause> AsUnivClause(size_t nots) const = 0;
 
  private:
+  // Substitutions and renamings invalidate the cached free variables.
+  void ClearFreeVars() const {
+    Traverse([](const Formula& alpha) { alpha.free_vars_ = internal::Nothing; return true; });
+  }
+
   Type type_;
   mutable internal::Maybe<SortedTermSet> free_vars_ = internal::Nothing;
 };
@@ -537,16 +560,21 @@ class Formula::Exists : public Formula {
   void ITraverse(const ITraversal<Formula>& f) const override { alpha_->ITraverse(f); f(*this); }
 
   void Rectify(TermMap* tm, Symbol::Factory* sf, Term::Factory* tf) override {
-    TermMap::const_iterator it = tm->find(x_);
+    TermMap::iterator it = tm->find(x_);
     if (it != tm->end()) {
+      // The previous binding is restored afterwards, but x_ stays in tm so
+      // that quantifiers further right rename it as well.
       const Term old_x = x_;
       const Term new_x = tf->CreateTerm(sf->CreateVariable(old_x.sort()));
-      tm->insert(it, std::make_pair(old_x, new_x));
+      const Term prev_x = it->second;
+      it->second = new_x;
       x_ = new_x;
+      alpha_->Rectify(tm, sf, tf);
+      (*tm)[old_x] = prev_x;
     } else {
       tm->insert(it, std::make_pair(x_, x_));
+      alpha_->Rectify(tm, sf, tf);
     }
-    alpha_->Rectify(tm, sf, tf);
   }
 
   std::pair<QuantifierPrefix, const Formula*> quantifier_prefix() const override {
@@ -897,6 +925,7 @@ class Formula::Bel : public Formula {
     ante_->ISubstitute(theta, tf);
     conse_->ISubstitute(theta, tf);
     not_ante_or_conse_->ISubstitute(theta, tf);
+    not_ante_or_conse_->ClearFreeVars();
   }
   void ITraverse(const ITraversal<Term>& f)    const override { ante_->ITraverse(f); conse_->ITraverse(f); }
   void ITraverse(const ITraversal<Literal>& f) const override { ante_->ITraverse(f); conse_->ITraverse(f); }
@@ -907,6 +936,8 @@ class Formula::Bel : public Formula {
     ante_->Rectify(tm, sf, tf);
     conse_->Rectify(tm, sf, tf);
     not_ante_or_conse_->Rectify(tm, sf, tf);
+    // not_ante_or_conse_ is not reached by ITraverse, so its cache is reset here.
+    not_ante_or_conse_->ClearFreeVars();
   }
 
   std::pair<QuantifierPrefix, const Formula*> quantifier_prefix() const override {
@@ -994,6 +1025,135 @@ class Formula::Guarantee : public Formula {
   Ref alpha_;
 };
 
+class Formula::Clausifier {
+ public:
+  Clausifier(Symbol::Factory* sf, Term::Factory* tf) : sf_(sf), tf_(tf) {}
+
+  // Adds clauses that imply alpha (if pos) or its negation (otherwise); free
+  // variables are universally quantified.
+  void Add(const Formula& alpha, bool pos) {
+    if (alpha.type() == kNot) {
+      Add(alpha.as_not().arg(), !pos);
+    } else if (alpha.type() == kOr && !pos) {
+      Add(alpha.as_or().lhs(), false);
+      Add(alpha.as_or().rhs(), false);
+    } else if (alpha.type() == kExists && !pos) {
+      Add(alpha.as_exists().arg(), false);
+    } else {
+      clauses_.push_back(Define(alpha, pos));
+    }
+  }
+
+  const std::vector<std::vector<Literal>>& clauses() const { return clauses_; }
+
+ private:
+  // Returns literals whose disjunction implies alpha (if pos) or its negation
+  // (otherwise). Every new symbol is defined by the clauses added meanwhile.
+  std::vector<Literal> Define(const Formula& alpha, bool pos) {
+    switch (alpha.type()) {
+      case kAtomic: {
+        const Clause& c = alpha.as_atomic().arg();
+        if (pos) {
+          return std::vector<Literal>(c.begin(), c.end());
+        } else if (c.unit()) {
+          return std::vector<Literal>{c.first().flip()};
+        } else {
+          const Literal d = NewDefinition(alpha.free_vars());
+          for (Literal a : c) {
+            clauses_.push_back(std::vector<Literal>{d.flip(), a.flip()});
+          }
+          return std::vector<Literal>{d};
+        }
+      }
+      case kNot:
+        return Define(alpha.as_not().arg(), !pos);
+      case kOr:
+        if (pos) {
+          std::vector<Literal> lits = Define(alpha.as_or().lhs(), true);
+          const std::vector<Literal> rhs = Define(alpha.as_or().rhs(), true);
+          lits.insert(lits.end(), rhs.begin(), rhs.end());
+          return lits;
+        } else {
+          const Literal d = NewDefinition(alpha.free_vars());
+          std::vector<const Formula*> conjuncts;
+          Conjuncts(alpha, &conjuncts);
+          for (const Formula* beta : conjuncts) {
+            std::vector<Literal> lits = Define(*beta, false);
+            lits.push_back(d.flip());
+            clauses_.push_back(std::move(lits));
+          }
+          return std::vector<Literal>{d};
+        }
+      case kExists:
+        if (pos) {
+          const Term x = alpha.as_exists().x();
+          Term::Vector args;
+          for (Term y : alpha.free_vars()) {
+            args.push_back(y);
+          }
+          const Term s = tf_->CreateTerm(sf_->CreateFunction(x.sort(), args.size()), args);
+          Ref beta = alpha.as_exists().arg().Clone();
+          beta->SubstituteFree(Term::Substitution(x, s), tf_);
+          return Define(*beta, true);
+        } else {
+          return Define(alpha.as_exists().arg(), false);
+        }
+      case kKnow:
+      case kCons:
+      case kBel:
+      case kGuarantee:
+        break;
+    }
+    assert(false);
+    return std::vector<Literal>();
+  }
+
+  // Collects the negated disjuncts of alpha, which is in negative position.
+  static void Conjuncts(const Formula& alpha, std::vector<const Formula*>* conjuncts) {
+    if (alpha.type() == kOr) {
+      Conjuncts(alpha.as_or().lhs(), conjuncts);
+      Conjuncts(alpha.as_or().rhs(), conjuncts);
+    } else {
+      conjuncts->push_back(&alpha);
+    }
+  }
+
+  Literal NewDefinition(const SortedTermSet& vars) {
+    if (true_.null()) {
+      true_ = tf_->CreateTerm(sf_->CreateName(sf_->CreateSort()));
+    }
+    Term::Vector args;
+    for (Term x : vars) {
+      args.push_back(x);
+    }
+    const Term d = tf_->CreateTerm(sf_->CreateFunction(true_.sort(), args.size()), args);
+    return Literal::Eq(d, true_);
+  }
+
+  Symbol::Factory* const sf_;
+  Term::Factory* const tf_;
+  Term true_ = Term();
+  std::vector<std::vector<Literal>> clauses_;
+};
+
+internal::Maybe<std::vector<Clause>> Formula::Clausify(Symbol::Factory* sf, Term::Factory* tf) const {
+  if (!objective()) {
+    return internal::Nothing;
+  }
+  Clausifier clausifier(sf, tf);
+  clausifier.Add(*NF(sf, tf, false), true);
+  std::vector<Clause> cs;
+  for (const std::vector<Literal>& lits : clausifier.clauses()) {
+    // Skolem terms may be nested in other terms, so the clause is flattened
+    // once more.
+    const internal::Maybe<Clause> c =
+        Factory::Atomic(Clause(lits.begin(), lits.end()))->Flatten(0, sf, tf)->AsUnivClause();
+    assert(c);
+    cs.push_back(c.val);
+  }
+  return internal::Just(std::move(cs));
+}
+
 Formula::Ref Formula::Factory::Atomic(const Clause& c)   { return Ref(new class Atomic(c)); }
 Formula::Ref Formula::Factory::Not(Ref alpha)            { return Ref(new class Not(std::move(alpha))); }
 Formula::Ref Formula::Factory::Or(Ref lhs, Ref rhs)    { return Ref(new class Or(std::move(lhs), std::move(rhs))); }
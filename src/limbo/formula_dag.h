@@ -0,0 +1,355 @@
+// vim:filetype=cpp:textwidth=120:shiftwidth=2:softtabstop=2:expandtab
+// Copyright 2017 Christoph Schwering
+// Licensed under the MIT license. See LICENSE file in the project root.
+//
+// A FormulaDag represents formulas as a directed acyclic graph of immutable
+// nodes. Structurally identical subformulas are represented by the same node
+// (hash-consing), so sharing a subformula amounts to copying a pointer, and
+// the free variables are computed only once per node.
+//
+// Nodes live as long as the FormulaDag that created them. They are allocated
+// in chunks and freed all at once when the FormulaDag is destroyed; the idea
+// is that a FormulaDag lives only for the duration of a query.
+//
+// FromFormula() and ToFormula() convert from and to Formula. Substitute()
+// replaces free occurrences of a variable or all occurrences of a name; its
+// results are memoized.
+//
+// A FormulaDag may be used from multiple threads concurrently. Creating a node
+// and looking up a memoized substitution are synchronized; the free variables
+// of a node are computed when it is created, so the nodes themselves are
+// immutable and can be read without locking.
+
+#ifndef LIMBO_FORMULA_DAG_H_
+#define LIMBO_FORMULA_DAG_H_
+
+#include <cassert>
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <limbo/clause.h>
+#include <limbo/formula.h>
+#include <limbo/term.h>
+
+#include <limbo/internal/hash.h>
+#include <limbo/internal/ints.h>
+#include <limbo/internal/maybe.h>
+
+namespace limbo {
+
+class FormulaDag {
+ public:
+  typedef internal::size_t size_t;
+  typedef Formula::Type Type;
+  typedef Formula::belief_level belief_level;
+  typedef Formula::SortedTermSet SortedTermSet;
+
+  class Node {
+   public:
+    Node(const Node&) = default;
+    Node& operator=(const Node&) = default;
+
+    Type type() const { return type_; }
+
+    const Clause& clause()                    const { assert(type_ == Formula::kAtomic); return c_; }
+    const Node& arg()                         const { assert(n_args() == 1); return *args_[0]; }
+    const Node& lhs()                         const { assert(type_ == Formula::kOr); return *args_[0]; }
+    const Node& rhs()                         const { assert(type_ == Formula::kOr); return *args_[1]; }
+    const Node& antecedent()                  const { assert(type_ == Formula::kBel); return *args_[0]; }
+    const Node& consequent()                  const { assert(type_ == Formula::kBel); return *args_[1]; }
+    const Node& not_antecedent_or_consequent() const { assert(type_ == Formula::kBel); return *args_[2]; }
+    Term x()                                  const { assert(type_ == Formula::kExists); return x_; }
+    belief_level k()                          const { return k_; }
+    belief_level l()                          const { assert(type_ == Formula::kBel); return l_; }
+
+    const SortedTermSet& free_vars() const { assert(free_vars_); return free_vars_.val; }
+
+    bool objective() const { return objective_; }
+    bool trivially_valid() const { return trivially_valid_; }
+    bool trivially_invalid() const { return trivially_invalid_; }
+
+    internal::hash32_t hash() const { return hash_; }
+
+   private:
+    friend class FormulaDag;
+
+    Node(Type type, const Clause& c, const Node* arg0, const Node* arg1, const Node* arg2,
+         Term x, belief_level k, belief_level l)
+        : type_(type), c_(c), args_{arg0, arg1, arg2}, x_(x), k_(k), l_(l) {
+      switch (type_) {
+        case Formula::kAtomic:
+          objective_ = true;
+          trivially_valid_ = c_.valid();
+          trivially_invalid_ = c_.invalid();
+          break;
+        case Formula::kNot:
+          objective_ = arg().objective_;
+          trivially_valid_ = arg().trivially_invalid_;
+          trivially_invalid_ = arg().trivially_valid_;
+          break;
+        case Formula::kOr:
+          objective_ = lhs().objective_ && rhs().objective_;
+          trivially_valid_ = lhs().trivially_valid_ || rhs().trivially_valid_;
+          trivially_invalid_ = lhs().trivially_invalid_ && rhs().trivially_invalid_;
+          break;
+        case Formula::kExists:
+        case Formula::kGuarantee:
+          objective_ = arg().objective_;
+          trivially_valid_ = arg().trivially_valid_;
+          trivially_invalid_ = arg().trivially_invalid_;
+          break;
+        case Formula::kKnow:
+          trivially_valid_ = arg().trivially_valid_;
+          break;
+        case Formula::kCons:
+          trivially_invalid_ = arg().trivially_invalid_;
+          break;
+        case Formula::kBel:
+          trivially_valid_ = not_antecedent_or_consequent().trivially_valid_;
+          break;
+      }
+      hash_ = internal::jenkins_hash(static_cast<internal::u32>(type_)) ^ c_.hash() ^ x_.hash() ^
+              internal::jenkins_hash(k_) ^ internal::jenkins_hash(l_ + 1);
+      for (size_t i = 0; i < n_args(); ++i) {
+        hash_ ^= internal::jenkins_hash(static_cast<internal::u32>(std::hash<const Node*>()(args_[i])) + i);
+      }
+    }
+
+    size_t n_args() const {
+      switch (type_) {
+        case Formula::kAtomic: return 0;
+        case Formula::kOr:     return 2;
+        case Formula::kBel:    return 3;
+        default:               return 1;
+      }
+    }
+
+    bool Equals(const Node& n) const {
+      return type_ == n.type_ && c_ == n.c_ && args_[0] == n.args_[0] && args_[1] == n.args_[1] &&
+             args_[2] == n.args_[2] && x_ == n.x_ && k_ == n.k_ && l_ == n.l_;
+    }
+
+    SortedTermSet FreeVars() const {
+      SortedTermSet ts;
+      if (type_ == Formula::kAtomic) {
+        c_.Traverse([&ts](Term x) { if (x.variable()) ts.insert(x); return true; });
+      } else {
+        for (size_t i = 0; i < n_args(); ++i) {
+          for (Term x : args_[i]->free_vars().values()) {
+            ts.insert(x);
+          }
+        }
+        if (type_ == Formula::kExists) {
+          ts.erase(x_);
+        }
+      }
+      return ts;
+    }
+
+    Type type_;
+    Clause c_;
+    const Node* args_[3];
+    Term x_;
+    belief_level k_;
+    belief_level l_;
+    bool objective_ = false;
+    bool trivially_valid_ = false;
+    bool trivially_invalid_ = false;
+    internal::hash32_t hash_;
+    internal::Maybe<SortedTermSet> free_vars_ = internal::Nothing;
+  };
+
+  typedef const Node* Ref;
+
+  explicit FormulaDag(Term::Factory* tf) : tf_(tf) {}
+  FormulaDag(const FormulaDag&) = delete;
+  FormulaDag& operator=(const FormulaDag&) = delete;
+  FormulaDag(FormulaDag&&) = delete;
+  FormulaDag& operator=(FormulaDag&&) = delete;
+
+  size_t n_nodes() const { std::unique_lock<std::mutex> lock(mutex_); return nodes_.size(); }
+
+  Ref Atomic(const Clause& c) { return Intern(Node(Formula::kAtomic, c, nullptr, nullptr, nullptr, Term(), 0, 0)); }
+  Ref Not(Ref alpha)          { return Intern(Node(Formula::kNot, Clause(), alpha, nullptr, nullptr, Term(), 0, 0)); }
+  Ref Or(Ref lhs, Ref rhs)    { return Intern(Node(Formula::kOr, Clause(), lhs, rhs, nullptr, Term(), 0, 0)); }
+  Ref Exists(Term x, Ref alpha) {
+    return Intern(Node(Formula::kExists, Clause(), alpha, nullptr, nullptr, x, 0, 0));
+  }
+  Ref Know(belief_level k, Ref alpha) {
+    return Intern(Node(Formula::kKnow, Clause(), alpha, nullptr, nullptr, Term(), k, 0));
+  }
+  Ref Cons(belief_level k, Ref alpha) {
+    return Intern(Node(Formula::kCons, Clause(), alpha, nullptr, nullptr, Term(), k, 0));
+  }
+  Ref Bel(belief_level k, belief_level l, Ref antecedent, Ref consequent) {
+    return Bel(k, l, antecedent, consequent, Or(Not(antecedent), consequent));
+  }
+  Ref Bel(belief_level k, belief_level l, Ref antecedent, Ref consequent, Ref not_antecedent_or_consequent) {
+    return Intern(Node(Formula::kBel, Clause(), antecedent, consequent, not_antecedent_or_consequent, Term(), k, l));
+  }
+  Ref Guarantee(Ref alpha) {
+    return Intern(Node(Formula::kGuarantee, Clause(), alpha, nullptr, nullptr, Term(), 0, 0));
+  }
+
+  Ref True()  { return Not(False()); }
+  Ref False() { return Atomic(Clause()); }
+
+  Ref FromFormula(const Formula& alpha) {
+    switch (alpha.type()) {
+      case Formula::kAtomic:
+        return Atomic(alpha.as_atomic().arg());
+      case Formula::kNot:
+        return Not(FromFormula(alpha.as_not().arg()));
+      case Formula::kOr:
+        return Or(FromFormula(alpha.as_or().lhs()), FromFormula(alpha.as_or().rhs()));
+      case Formula::kExists:
+        return Exists(alpha.as_exists().x(), FromFormula(alpha.as_exists().arg()));
+      case Formula::kKnow:
+        return Know(alpha.as_know().k(), FromFormula(alpha.as_know().arg()));
+      case Formula::kCons:
+        return Cons(alpha.as_cons().k(), FromFormula(alpha.as_cons().arg()));
+      case Formula::kBel:
+        return Bel(alpha.as_bel().k(), alpha.as_bel().l(),
+                   FromFormula(alpha.as_bel().antecedent()),
+                   FromFormula(alpha.as_bel().consequent()),
+                   FromFormula(alpha.as_bel().not_antecedent_or_consequent()));
+      case Formula::kGuarantee:
+        return Guarantee(FromFormula(alpha.as_guarantee().arg()));
+    }
+    assert(false);
+    return nullptr;
+  }
+
+  static Formula::Ref ToFormula(Ref alpha) {
+    switch (alpha->type()) {
+      case Formula::kAtomic:
+        return Formula::Factory::Atomic(alpha->clause());
+      case Formula::kNot:
+        return Formula::Factory::Not(ToFormula(&alpha->arg()));
+      case Formula::kOr:
+        return Formula::Factory::Or(ToFormula(&alpha->lhs()), ToFormula(&alpha->rhs()));
+      case Formula::kExists:
+        return Formula::Factory::Exists(alpha->x(), ToFormula(&alpha->arg()));
+      case Formula::kKnow:
+        return Formula::Factory::Know(alpha->k(), ToFormula(&alpha->arg()));
+      case Formula::kCons:
+        return Formula::Factory::Cons(alpha->k(), ToFormula(&alpha->arg()));
+      case Formula::kBel:
+        return Formula::Factory::Bel(alpha->k(), alpha->l(),
+                                     ToFormula(&alpha->antecedent()),
+                                     ToFormula(&alpha->consequent()),
+                                     ToFormula(&alpha->not_antecedent_or_consequent()));
+      case Formula::kGuarantee:
+        return Formula::Factory::Guarantee(ToFormula(&alpha->arg()));
+    }
+    assert(false);
+    return Formula::Ref();
+  }
+
+  // Substitutes sub for the free occurrences of the variable old, or for all
+  // occurrences of the name old.
+  Ref Substitute(Ref alpha, Term old, Term sub) {
+    assert(old.variable() || old.name());
+    if (old.variable() && !alpha->free_vars().contains(old)) {
+      return alpha;
+    }
+    const SubstitutionKey key{alpha, old, sub};
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto it = substitutions_.find(key);
+      if (it != substitutions_.end()) {
+        return it->second;
+      }
+    }
+    Ref beta = nullptr;
+    switch (alpha->type()) {
+      case Formula::kAtomic:
+        beta = Atomic(alpha->clause().Substitute(Term::Substitution(old, sub), tf_));
+        break;
+      case Formula::kExists:
+        beta = alpha->x() == old ? alpha : Exists(alpha->x(), Substitute(&alpha->arg(), old, sub));
+        break;
+      default: {
+        Ref args[3] = {nullptr, nullptr, nullptr};
+        for (size_t i = 0; i < alpha->n_args(); ++i) {
+          args[i] = Substitute(alpha->args_[i], old, sub);
+        }
+        beta = Intern(Node(alpha->type(), Clause(), args[0], args[1], args[2], Term(), alpha->k_, alpha->l_));
+        break;
+      }
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    substitutions_.insert(std::make_pair(key, beta));
+    return beta;
+  }
+
+  // Calls f for every term in the clauses of alpha. Shared nodes are visited
+  // only once.
+  template<typename UnaryFunction>
+  static void Traverse(Ref alpha, UnaryFunction f) {
+    std::unordered_set<Ref> seen;
+    Traverse(alpha, f, &seen);
+  }
+
+ private:
+  struct NodePtrHash {
+    internal::hash32_t operator()(const Node* n) const { return n->hash_; }
+  };
+
+  struct NodePtrEquals {
+    bool operator()(const Node* n1, const Node* n2) const { return n1->Equals(*n2); }
+  };
+
+  struct SubstitutionKey {
+    bool operator==(const SubstitutionKey& k) const { return alpha == k.alpha && old == k.old && sub == k.sub; }
+    Ref alpha;
+    Term old;
+    Term sub;
+  };
+
+  struct SubstitutionKeyHash {
+    internal::hash32_t operator()(const SubstitutionKey& k) const {
+      return k.alpha->hash_ ^ k.old.hash() ^ internal::jenkins_hash(k.sub.hash());
+    }
+  };
+
+  Ref Intern(const Node& n) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = index_.find(&n);
+    if (it != index_.end()) {
+      return *it;
+    }
+    nodes_.push_back(n);
+    Node* m = &nodes_.back();
+    m->free_vars_ = internal::Just(m->FreeVars());
+    return *index_.insert(m).first;
+  }
+
+  template<typename UnaryFunction>
+  static void Traverse(Ref alpha, UnaryFunction f, std::unordered_set<Ref>* seen) {
+    if (!seen->insert(alpha).second) {
+      return;
+    }
+    if (alpha->type() == Formula::kAtomic) {
+      alpha->clause().Traverse(f);
+    } else {
+      for (size_t i = 0; i < alpha->n_args(); ++i) {
+        Traverse(alpha->args_[i], f, seen);
+      }
+    }
+  }
+
+  Term::Factory* tf_;
+  mutable std::mutex mutex_;
+  std::deque<Node> nodes_;
+  std::unordered_set<const Node*, NodePtrHash, NodePtrEquals> index_;
+  std::unordered_map<SubstitutionKey, Ref, SubstitutionKeyHash> substitutions_;
+};
+
+}  // namespace limbo
+
+#endif  // LIMBO_FORMULA_DAG_H_
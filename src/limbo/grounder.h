@@ -6,10 +6,10 @@
 // variables in a proper+ knowledge base and in queries.
 //
 // The grounder incrementally builds up the setup whenever AddClause(),
-// PrepareForQuery(), or GuaranteeConsistency() are called. In particular,
-// the relevant standard names (including the additional names) are managed and
-// the clauses are regrounded accordingly. The Grounder is designed for fast
-// backtracking.
+// AddCardinality(), AddAllDifferent(), PrepareForQuery(), or
+// GuaranteeConsistency() are called. In particular, the relevant standard
+// names (including the additional names) are managed and the clauses are
+// regrounded accordingly. The Grounder is designed for fast backtracking.
 //
 // PrepareForQuery() should not be called before GuaranteeConsistency().
 // Otherwise their behaviour is undefined.
@@ -18,6 +18,17 @@
 // Grounder uses a temporary NamePool where names can be returned for later
 // re-use. This NamePool is public for it can also be used to handle free
 // variables in the representation theorem.
+//
+// The Grounder keeps track of which terms interact through a clause in the
+// setup, and which of these connected components of terms are mentioned in a
+// prepared-for query. InQueryComponent() tells whether a term belongs to such
+// a component. Terms from other components cannot affect the query except for
+// making the setup inconsistent.
+//
+// When a ThreadPool is set with set_thread_pool(), regrounding computes large
+// sets of groundings in parallel. The clauses are still added to the setup
+// sequentially and in the same order as without thread pool, so the resulting
+// setup is the same.
 
 
 #ifndef LIMBO_GROUNDER_H_
@@ -26,6 +37,7 @@
 #include <cassert>
 
 #include <algorithm>
+#include <iterator>
 #include <list>
 #include <memory>
 #include <queue>
@@ -35,6 +47,8 @@
 #include <utility>
 #include <vector>
 
+#include <limbo/all_different.h>
+#include <limbo/cardinality.h>
 #include <limbo/clause.h>
 #include <limbo/formula.h>
 #include <limbo/setup.h>
@@ -44,6 +58,8 @@
 #include <limbo/internal/ints.h>
 #include <limbo/internal/iter.h>
 #include <limbo/internal/maybe.h>
+#include <limbo/internal/threadpool.h>
+#include <limbo/internal/unionfind.h>
 
 namespace limbo {
 
@@ -80,6 +96,21 @@ class Grounder {
       return ts[i];
     }
 
+    Pool Clone() const {
+      Pool p(sf_, tf_);
+      p.terms_ = terms_;
+      return p;
+    }
+
+    template<typename UnaryFunction>
+    void Traverse(UnaryFunction f) const {
+      for (const Term::Vector& ts : terms_.values()) {
+        for (const Term t : ts) {
+          t.Traverse(f);
+        }
+      }
+    }
+
    private:
     Symbol::Factory* const sf_;
     Term::Factory* const tf_;
@@ -106,6 +137,7 @@ class Grounder {
 
    private:
     friend class Grounder;
+    friend class Snapshot;
 
     explicit Ungrounded(const T& val) : val(val) {}
   };
@@ -120,6 +152,8 @@ class Grounder {
 
     struct {
       Ungrounded<Clause>::Vector ungrounded;
+      std::vector<Cardinality> cardinalities;
+      std::vector<AllDifferent> all_differents;
       std::unique_ptr<Setup> full_setup;
       Setup::ShallowCopy shallow_setup;
     } clauses;
@@ -139,9 +173,12 @@ class Grounder {
       std::unordered_map<Term, std::unordered_set<Term>> map;  // grounded lhs-rhs index for clauses, prepared-for query
     } lhs_rhs;
     bool do_not_add_if_inconsistent = false;  // enabled for fix-literals
+    size_t n_component_changes = 0;           // state of components_ before this ply
+    internal::u64 id = 0;
 
    private:
     friend class Grounder;
+    friend class Snapshot;
 
     Ply() = default;
   };
@@ -294,6 +331,9 @@ class Grounder {
       return iterator(b, e, plus_iterator());
     }
 
+    // The plus-name that begin() borrowed from the pool, or the null term.
+    Term plus_name() const { return *n_it; }
+
    private:
     friend class Grounder;
 
@@ -380,8 +420,56 @@ class Grounder {
 
   NamePool& temp_name_pool() { return name_pool_; }
 
+  // The pool is not owned by the Grounder and must outlive its use.
+  void set_thread_pool(internal::ThreadPool* pool) { pool_ = pool; }
+  internal::ThreadPool* thread_pool() const { return pool_; }
+
   const Setup& setup() const { return plies_.empty() ? dummy_setup_ : last_ply().clauses.shallow_setup.setup(); }
 
+  // Traverse() visits all terms the grounder refers to, including those of
+  // its plies and name pools; it serves as root for Term::Factory::Collect().
+  template<typename UnaryFunction>
+  void Traverse(UnaryFunction f) const {
+    auto traverse_terms = [&f](const SortedTermSet& ts) { for (const Term t : ts) { t.Traverse(f); } };
+    for (const Ply& p : plies_) {
+      for (const Ungrounded<Clause>& uc : p.clauses.ungrounded) {
+        uc.val.Traverse(f);
+        traverse_terms(uc.vars);
+      }
+      for (const Cardinality& c : p.clauses.cardinalities) {
+        c.Traverse(f);
+      }
+      for (const AllDifferent& c : p.clauses.all_differents) {
+        c.Traverse(f);
+      }
+      if (p.clauses.full_setup) {
+        p.clauses.full_setup->Traverse(f);
+      }
+      for (const Ungrounded<Term>& ut : p.relevant.ungrounded) {
+        ut.val.Traverse(f);
+        traverse_terms(ut.vars);
+      }
+      traverse_terms(p.relevant.terms);
+      traverse_terms(p.names.mentioned);
+      traverse_terms(p.names.plus_max);
+      traverse_terms(p.names.plus_new);
+      traverse_terms(p.names.plus_mentioned);
+      for (const Ungrounded<Literal>& ua : p.lhs_rhs.ungrounded) {
+        ua.val.Traverse(f);
+        traverse_terms(ua.vars);
+      }
+      for (const auto& lhs_rhs : p.lhs_rhs.map) {
+        lhs_rhs.first.Traverse(f);
+        for (const Term t : lhs_rhs.second) {
+          t.Traverse(f);
+        }
+      }
+    }
+    components_.Traverse([&f](Term t) { t.Traverse(f); });
+    name_pool_.Traverse(f);
+    var_pool_.Traverse(f);
+  }
+
   // 1. AddClause(c):
   // New ply.
   // Add c to ungrounded_clauses.
@@ -471,84 +559,94 @@ class Grounder {
     return r;
   }
 
+  // 4. AddCardinality(c), AddAllDifferent(c):
+  // New ply.
+  // If c contains new names, add these to names and re-ground.
+  // Add c to the setup (unless it is irrelevant).
+  // Add f(.)=n, f(.)/=n pairs from c to lhs_rhs.
+  //
+  // Only ground constraints are supported, so c itself needs no grounding.
+  Setup::Result AddCardinality(const Cardinality& c, Undo* undo = nullptr) {
+    auto r = internal::singleton_range(c);
+    return AddConstraints(r.begin(), r.end(), undo);
+  }
+
+  template<typename InputIt>
+  Setup::Result AddCardinalities(InputIt first, InputIt last, Undo* undo = nullptr) {
+    return AddConstraints(first, last, undo);
+  }
+
+  Setup::Result AddAllDifferent(const AllDifferent& c, Undo* undo = nullptr) {
+    auto r = internal::singleton_range(c);
+    return AddConstraints(r.begin(), r.end(), undo);
+  }
+
+  template<typename InputIt>
+  Setup::Result AddAllDifferents(InputIt first, InputIt last, Undo* undo = nullptr) {
+    return AddConstraints(first, last, undo);
+  }
+
   void PrepareForQuery(const Term t, Undo* undo = nullptr) {
-    const Term x = var_pool_.Create(t.sort());
-    const Literal a = Literal::Eq(t, x);
-    const Formula::Ref phi = Formula::Factory::Atomic(Clause{a});
-    PrepareForQuery(*phi, undo);
-    var_pool_.Return(x);
+    PrepareForQuery(&t, &t + 1, undo);
   }
 
-  void PrepareForQuery(const Formula& phi, Undo* undo = nullptr) {
-    // New ply.
-    // Add new names in phi to names.
-    // Add variables to vars, generate plus-names.
-    // Re-ground.
-    // Add f(.)=n, f(.)/=n pairs from grounded phi to lhs_rhs.
-    Ply& p = new_ply();
-    phi.Traverse([this, &p](const Literal a) {
-      Ungrounded<Literal> ua(a.pos() ? a : a.flip());
-      a.Traverse([this, &p, &ua](const Term t) {
-        if (t.name()) {
-          if (!IsOccurringName(t)) {
-            if (IsPlusName(t)) {
-              p.names.plus_mentioned.insert(t);
-            } else {
-              p.names.mentioned.insert(t);
-            }
-          }
-        } else if (t.variable()) {
-          ua.vars.insert(t);
-        }
-        return true;
-      });
-      if (ua.val.lhs().function() && IsNewUngroundedLhsRhs(ua, Plies::kSinceSetup)) {
-        last_ply().lhs_rhs.ungrounded.insert(ua);
+  template<typename InputIt>
+  void PrepareForQuery(InputIt first, InputIt last, Undo* undo = nullptr) {
+    // Prepare for the terms in [first, last) in a single ply. One variable per
+    // sort suffices because the literals are grounded independently.
+    std::unordered_map<Symbol::Sort, Term> vars;
+    std::vector<Literal> as;
+    for (; first != last; ++first) {
+      const Term t = *first;
+      auto it = vars.find(t.sort());
+      if (it == vars.end()) {
+        it = vars.insert(std::make_pair(t.sort(), var_pool_.Create(t.sort()))).first;
       }
-      return true;
-    });
-    CreateNewPlusNames(p.names.plus_mentioned);
-    CreateMaxPlusNames(phi.n_vars());  // XXX or CreateNewPlusNames()?
-    Reground();
-    if (undo) {
-      *undo = Undo(this);
+      as.push_back(Literal::Eq(t, it->second));
     }
+    const Formula::Ref phi = Formula::Factory::Atomic(Clause(as.begin(), as.end()));
+    PrepareForQuery(*phi, undo);
+    for (const auto& p : vars) {
+      var_pool_.Return(p.second);
+    }
+  }
+
+  void PrepareForQuery(const Formula& phi, Undo* undo = nullptr) {
+    const Formula* phis[] = {&phi};
+    PrepareForFormulas(std::begin(phis), std::end(phis), undo);
+  }
+
+  void PrepareForQuery(const std::vector<const Formula*>& phis, Undo* undo = nullptr) {
+    PrepareForFormulas(phis.begin(), phis.end(), undo);
   }
 
   void GuaranteeConsistency(const Formula& alpha, Undo* undo) {
-    // Collect ungrounded terms from query.
-    // Close under terms in current setup.
-    Ply& p = new_ply();
-    p.relevant.filter = true;
-    alpha.Traverse([this, &p](const Term t) {
-      if (t.function()) {
-        Ungrounded<Term> ut(t);
-        t.Traverse([&ut](const Term x) { if (x.variable()) { ut.vars.insert(x); } return true; });
-        p.relevant.ungrounded.insert(ut);
-      }
-      return false;
-    });
-    for (const Ungrounded<Term>& u : p.relevant.ungrounded) {
-      for (const Term g : groundings(&u.val, &u.vars)) {
-        p.relevant.terms.insert(g);
-      }
-    }
-    CloseRelevanceUnderClauses(p.clauses.shallow_setup.setup().clauses(), Plies::kNew);
-    GroundNewSetup();
-    if (undo) {
-      *undo = Undo(this);
-    }
+    const Formula* alphas[] = {&alpha};
+    GuaranteeConsistencyForFormulas(std::begin(alphas), std::end(alphas), undo);
+  }
+
+  void GuaranteeConsistency(const std::vector<const Formula*>& alphas, Undo* undo) {
+    GuaranteeConsistencyForFormulas(alphas.begin(), alphas.end(), undo);
   }
 
   void GuaranteeConsistency(Term t, Undo* undo) {
-    // Add t to ungrounded terms from query.
+    GuaranteeConsistency(&t, &t + 1, undo);
+  }
+
+  template<typename InputIt>
+  void GuaranteeConsistency(InputIt first, InputIt last, Undo* undo) {
+    // Add terms to ungrounded terms from query.
     // Close under terms in current setup.
-    assert(t.primitive());
     Ply& p = new_ply();
     p.relevant.filter = true;
-    p.relevant.ungrounded.insert(Ungrounded<Term>(t));
-    p.relevant.terms.insert(t);
-    CloseRelevanceUnderClauses(p.clauses.shallow_setup.setup().clauses(), Plies::kNew);
+    for (; first != last; ++first) {
+      const Term t = *first;
+      assert(t.primitive());
+      p.relevant.ungrounded.insert(Ungrounded<Term>(t));
+      p.relevant.terms.insert(t);
+    }
+    const std::vector<Term> seeds(p.relevant.terms.begin(), p.relevant.terms.end());
+    CloseRelevance(seeds.begin(), seeds.end(), 0, Plies::kNew, true);
     GroundNewSetup();
     if (undo) {
       *undo = Undo(this);
@@ -559,6 +657,159 @@ class Grounder {
 
   void Consolidate() { MergePlies(true); }
 
+  // Clone() returns a grounder with the same clauses, names, lhs-rhs index,
+  // and components as this one, but without thread pool. It expects at most
+  // one ply, as after Consolidate(). The setup of the clone references the
+  // non-unit clauses of this grounder's setup instead of grounding them anew,
+  // like the setups of GuaranteeConsistency() do. So this grounder must not be
+  // changed or destroyed while the clone is alive; it may be cloned by several
+  // threads at once, though.
+  Grounder Clone() const {
+    assert(plies_.size() <= 1);
+    Grounder g(tf_, name_pool_.Clone(), var_pool_.Clone());
+    for (const Ply& p : plies_) {
+      assert(p.clauses.full_setup);
+      assert(!p.do_not_add_if_inconsistent);
+      g.plies_.push_back(Ply());
+      Ply& q = g.plies_.back();
+      q.id = ++g.last_ply_id_;
+      q.clauses.ungrounded = p.clauses.ungrounded;
+      q.clauses.cardinalities = p.clauses.cardinalities;
+      q.clauses.all_differents = p.clauses.all_differents;
+      q.clauses.full_setup = std::unique_ptr<Setup>(new Setup(*p.clauses.full_setup, [](const Clause&) { return true; }));
+      q.clauses.shallow_setup = q.clauses.full_setup->shallow_copy();
+      q.relevant = p.relevant;
+      q.names = p.names;
+      q.lhs_rhs = p.lhs_rhs;
+    }
+    g.components_ = components_;
+    g.components_.Commit();
+    return g;
+  }
+
+  // Retract() removes a clause or constraint that was added before, Forget()
+  // removes all clauses and constraints that mention one of the given terms
+  // or, in the case of variables, may do so after grounding, and RetractIf()
+  // removes those that satisfy the respective predicate. They return the
+  // number of removed clauses and constraints.
+  //
+  // The plies before the first one that holds a removed clause or constraint
+  // are kept. The later ones are popped and added anew, each with the clauses
+  // and constraints that remain in it, in the same order. So the groundings of
+  // the removed ones vanish along with the units derived from them, their
+  // lhs-rhs pairs, and names that occur nowhere else. An Undo of a re-added
+  // ply undoes its replacement. Plies of queries, consistency guarantees, and
+  // fix-literals cannot be added anew, though; if one of them would have to be
+  // popped, nothing is removed and 0 is returned.
+  size_t Retract(const Clause& c) {
+    return RetractIf([&c](const Clause& d) { return c == d; }, Never(), Never());
+  }
+
+  size_t Retract(const Cardinality& c) {
+    return RetractIf(Never(), [&c](const Cardinality& d) { return c == d; }, Never());
+  }
+
+  size_t Retract(const AllDifferent& c) {
+    return RetractIf(Never(), Never(), [&c](const AllDifferent& d) { return c == d; });
+  }
+
+  size_t Forget(const std::unordered_set<Term>& ts) {
+    auto mentions = [&ts](const Clause& c) { return c.any([&ts](Literal a) { return Matches(a.lhs(), ts); }); };
+    return RetractIf(mentions,
+                     [&mentions](const Cardinality& c) { return mentions(c.lits()); },
+                     [&mentions](const AllDifferent& c) { return mentions(c.lits()); });
+  }
+
+  template<typename ClausePredicate, typename CardinalityPredicate, typename AllDifferentPredicate>
+  size_t RetractIf(ClausePredicate clause_pred, CardinalityPredicate card_pred, AllDifferentPredicate alldiff_pred) {
+    struct Remainder {
+      std::vector<Clause> clauses;
+      std::vector<Cardinality> cards;
+      std::vector<AllDifferent> alldiffs;
+    };
+    std::vector<Remainder> remainders;  // of the first affected ply and the later ones
+    size_t n_kept = 0;
+    size_t n_removed = 0;
+    for (const Ply& p : plies_) {
+      Remainder r;
+      for (const Ungrounded<Clause>& uc : p.clauses.ungrounded) {
+        if (clause_pred(uc.val)) {
+          ++n_removed;
+        } else {
+          r.clauses.push_back(uc.val);
+        }
+      }
+      for (const Cardinality& c : p.clauses.cardinalities) {
+        if (card_pred(c)) {
+          ++n_removed;
+        } else {
+          r.cards.push_back(c);
+        }
+      }
+      for (const AllDifferent& c : p.clauses.all_differents) {
+        if (alldiff_pred(c)) {
+          ++n_removed;
+        } else {
+          r.alldiffs.push_back(c);
+        }
+      }
+      if (n_removed == 0) {
+        ++n_kept;
+      } else {
+        remainders.push_back(std::move(r));
+      }
+    }
+    if (n_removed == 0) {
+      return 0;
+    }
+    const bool replayable = std::all_of(std::next(plies_.begin(), n_kept), plies_.end(), [](const Ply& p) {
+      return !p.relevant.filter && p.lhs_rhs.ungrounded.empty() && !p.do_not_add_if_inconsistent;
+    });
+    if (!replayable) {
+      return 0;
+    }
+    while (plies_.size() > n_kept) {
+      pop_ply();
+    }
+    for (const Remainder& r : remainders) {
+      const size_t n_plies = plies_.size();
+      if (!r.clauses.empty() || (r.cards.empty() && r.alldiffs.empty())) {
+        AddClauses(r.clauses.begin(), r.clauses.end());
+      }
+      if (!r.cards.empty()) {
+        AddCardinalities(r.cards.begin(), r.cards.end());
+      }
+      if (!r.alldiffs.empty()) {
+        AddAllDifferents(r.alldiffs.begin(), r.alldiffs.end());
+      }
+      // Only consolidation mixes clauses and constraints in a ply, and it
+      // leaves a single ply, which is consolidated again.
+      if (n_plies == 0 && plies_.size() > 1) {
+        Consolidate();
+      }
+    }
+    return n_removed;
+  }
+
+  // True iff t is one of ts or, if t has variables as arguments, may become
+  // one of them by grounding.
+  static bool Matches(Term t, const std::unordered_set<Term>& ts) {
+    if (t.ground()) {
+      return ts.find(t) != ts.end();
+    }
+    return std::any_of(ts.begin(), ts.end(), [t](Term u) {
+      if (t.symbol() != u.symbol()) {
+        return false;
+      }
+      for (Symbol::Arity i = 0; i < t.arity(); ++i) {
+        if (t.arg(i) != u.arg(i) && !t.arg(i).variable()) {
+          return false;
+        }
+      }
+      return true;
+    });
+  }
+
   Literal Variablify(Literal a) {
     assert(a.ground());
     Term::Vector ns;
@@ -579,7 +830,35 @@ class Grounder {
   RhsNames rhs_names(Term t, Plies::Policy p = Plies::kSinceSetup) { return RhsNames(this, t, p); }
   Names names(Symbol::Sort sort, Plies::Policy p = Plies::kAll) const { return Names(this, sort, p); }
 
+  bool InQueryComponent(Term t) const { return components_.marked(t); }
+  bool Connected(Term t1, Term t2) const { return components_.connected(t1, t2); }
+
+  bool IsOccurringName(Term n) const {
+    assert(n.name());
+    for (const Ply& p : plies_) {
+      if (p.names.mentioned.contains(n) || p.names.plus_mentioned.contains(n)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Plies are identified by increasing ids. A ply id remains valid until the
+  // ply is undone; the ply id 0 is valid for the empty grounder.
+  typedef internal::u64 PlyId;
+  PlyId last_ply_id() const { return plies_.empty() ? 0 : last_ply().id; }
+  bool IsAlive(PlyId id) const {
+    return id == 0 || std::any_of(plies_.begin(), plies_.end(), [id](const Ply& p) { return p.id == id; });
+  }
+
  private:
+  friend class Snapshot;
+
+  struct Never {
+    template<typename T>
+    bool operator()(const T&) const { return false; }
+  };
+
   template<typename T>
   struct Groundings {
    public:
@@ -671,6 +950,8 @@ class Grounder {
     if (plies_.empty()) {
       plies_.push_back(Ply());
       Ply& p = plies_.back();
+      p.n_component_changes = components_.n_changes();
+      p.id = ++last_ply_id_;
       p.clauses.full_setup = std::unique_ptr<Setup>(new Setup());
       p.clauses.shallow_setup = p.clauses.full_setup->shallow_copy();
       return p;
@@ -678,6 +959,8 @@ class Grounder {
       Ply& last_p = last_ply();
       plies_.push_back(Ply());
       Ply& p = plies_.back();
+      p.n_component_changes = components_.n_changes();
+      p.id = ++last_ply_id_;
       p.clauses.shallow_setup = last_p.clauses.shallow_setup.setup().shallow_copy();
       p.relevant.filter = last_p.relevant.filter;
       return p;
@@ -701,6 +984,11 @@ class Grounder {
     for (const Term n : p.names.plus_new) {
       name_pool_.Return(n);
     }
+    if (plies_.size() == 1) {
+      components_.Clear();
+    } else {
+      components_.Undo(p.n_component_changes);
+    }
     plies_.pop_back();
   }
 
@@ -756,24 +1044,86 @@ class Grounder {
     return n_names;
   }
 
-  bool IsOccurringName(Term n) const {
+  bool IsPlusName(Term n) const {
     assert(n.name());
     for (const Ply& p : plies_) {
-      if (p.names.mentioned.contains(n) || p.names.plus_mentioned.contains(n)) {
+      if (p.names.plus_max.contains(n) || p.names.plus_new.contains(n)) {
         return true;
       }
     }
     return false;
   }
 
-  bool IsPlusName(Term n) const {
-    assert(n.name());
-    for (const Ply& p : plies_) {
-      if (p.names.plus_max.contains(n) || p.names.plus_new.contains(n)) {
+  template<typename InputIt>
+  void PrepareForFormulas(InputIt first, InputIt last, Undo* undo) {
+    // New ply.
+    // Add new names in the formulas to names.
+    // Add variables to vars, generate plus-names for the formula with the
+    // most variables of each sort, as each formula is evaluated on its own.
+    // Re-ground.
+    // Add f(.)=n, f(.)/=n pairs from grounded formulas to lhs_rhs.
+    Ply& p = new_ply();
+    Formula::SortCount n_vars;
+    for (; first != last; ++first) {
+      const Formula& phi = **first;
+      phi.Traverse([this, &p](const Literal a) {
+        Ungrounded<Literal> ua(a.pos() ? a : a.flip());
+        a.Traverse([this, &p, &ua](const Term t) {
+          if (t.name()) {
+            if (!IsOccurringName(t)) {
+              if (IsPlusName(t)) {
+                p.names.plus_mentioned.insert(t);
+              } else {
+                p.names.mentioned.insert(t);
+              }
+            }
+          } else if (t.variable()) {
+            ua.vars.insert(t);
+          }
+          return true;
+        });
+        if (ua.val.lhs().function() && IsNewUngroundedLhsRhs(ua, Plies::kSinceSetup)) {
+          last_ply().lhs_rhs.ungrounded.insert(ua);
+        }
         return true;
+      });
+      n_vars = Formula::SortCount::Zip(n_vars, phi.n_vars(), [](size_t a, size_t b) { return std::max(a, b); });
+    }
+    CreateNewPlusNames(p.names.plus_mentioned);
+    CreateMaxPlusNames(n_vars);  // XXX or CreateNewPlusNames()?
+    Reground();
+    if (undo) {
+      *undo = Undo(this);
+    }
+  }
+
+  template<typename InputIt>
+  void GuaranteeConsistencyForFormulas(InputIt first, InputIt last, Undo* undo) {
+    // Collect ungrounded terms from queries.
+    // Close under terms in current setup.
+    Ply& p = new_ply();
+    p.relevant.filter = true;
+    for (; first != last; ++first) {
+      (*first)->Traverse([this, &p](const Term t) {
+        if (t.function()) {
+          Ungrounded<Term> ut(t);
+          t.Traverse([&ut](const Term x) { if (x.variable()) { ut.vars.insert(x); } return true; });
+          p.relevant.ungrounded.insert(ut);
+        }
+        return false;
+      });
+    }
+    for (const Ungrounded<Term>& u : p.relevant.ungrounded) {
+      for (const Term g : groundings(&u.val, &u.vars)) {
+        p.relevant.terms.insert(g);
       }
     }
-    return false;
+    const std::vector<Term> seeds(p.relevant.terms.begin(), p.relevant.terms.end());
+    CloseRelevance(seeds.begin(), seeds.end(), 0, Plies::kNew, true);
+    GroundNewSetup();
+    if (undo) {
+      *undo = Undo(this);
+    }
   }
 
   void CreateMaxPlusNames(const Formula::SortCount& sc) {
@@ -831,6 +1181,7 @@ class Grounder {
   void UpdateLhsRhs(const Clause& c, Plies::Policy p) {
     for (const Literal a : c) {
       UpdateLhsRhs(a, p);
+      components_.Union(c.first().lhs(), a.lhs());
     }
   }
 
@@ -841,37 +1192,109 @@ class Grounder {
     }
   }
 
-  bool UpdateRelevantTerms(const Clause& c, Plies::Policy p) {
-    assert(c.ground());
-    assert(!c.valid());
-    if (c.any([this, p](const Literal a) { return !IsNewRelevantTerm(a.lhs(), p); })) {
-      c.all([this, p](const Literal a) {
-        UpdateRelevantTerms(a.lhs(), p);
-        return true;
-      });
-      return true;
-    } else {
-      return false;
+  template<typename InputIt>
+  void CloseRelevance(InputIt first_term, InputIt last_term, size_t first_clause, Plies::Policy p,
+                      bool with_constraints = false) {
+    // A clause is relevant if one of its terms is relevant, and then all its
+    // terms are relevant. We propagate relevance from the given relevant terms
+    // along the setup's index from terms to the clauses they occur in, so only
+    // the relevant clauses are visited, each at most once. Only the clauses
+    // from index first_clause on are considered. If with_constraints is set,
+    // the constraints of the setup are treated like the clauses of their
+    // literals.
+    const Setup& s = last_setup();
+    std::queue<Term> queue;
+    for (; first_term != last_term; ++first_term) {
+      queue.push(*first_term);
+    }
+    auto propagate = [this, p, &queue](const Clause& c) {
+      for (const Literal a : c) {
+        if (IsNewRelevantTerm(a.lhs(), p)) {
+          UpdateRelevantTerms(a.lhs(), p);
+          queue.push(a.lhs());
+        }
+      }
+    };
+    std::unordered_set<size_t> relevant_clauses;
+    std::unordered_set<size_t> relevant_cards;
+    std::unordered_set<size_t> relevant_alldiffs;
+    while (!queue.empty()) {
+      const Term t = queue.front();
+      queue.pop();
+      s.ForEachClauseMentioning(t, [&s, t, &propagate, &relevant_clauses](size_t i) {
+        if (relevant_clauses.find(i) != relevant_clauses.end()) {
+          return;
+        }
+        const Clause c = s.clause(i);
+        if (c.any([t](Literal a) { return a.lhs() == t; })) {
+          relevant_clauses.insert(i);
+          propagate(c);
+        }
+      }, first_clause);
+      if (with_constraints) {
+        s.ForEachCardinalityMentioning(t, [&s, &propagate, &relevant_cards](size_t i) {
+          if (relevant_cards.insert(i).second) {
+            propagate(s.cardinalities()[i].lits());
+          }
+        });
+        s.ForEachAllDifferentMentioning(t, [&s, &propagate, &relevant_alldiffs](size_t i) {
+          if (relevant_alldiffs.insert(i).second) {
+            propagate(s.all_differents()[i].lits());
+          }
+        });
+      }
     }
   }
 
-  template<typename ClauseRange>
-  void CloseRelevanceUnderClauses(ClauseRange r, Plies::Policy p) {
-    std::unordered_set<size_t> clauses;
-    for (size_t i : r) {
-      clauses.insert(i);
+  template<typename InputIt>
+  Setup::Result AddConstraints(InputIt first, InputIt last, Undo* undo) {
+    Ply& p = new_ply();
+    for (InputIt it = first; it != last; ++it) {
+      assert(it->ground());
+      it->Traverse([this, &p](Term t) {
+        if (t.name() && !IsOccurringName(t)) {
+          if (IsPlusName(t)) {
+            p.names.plus_mentioned.insert(t);
+          } else {
+            p.names.mentioned.insert(t);
+          }
+        }
+        return true;
+      });
     }
-rescan:
-    for (auto it = clauses.begin(); it != clauses.end(); ++it) {
-      const Clause c = last_ply().clauses.shallow_setup.setup().clause(*it);
-      bool relevant = UpdateRelevantTerms(c, p);
-      if (relevant) {
-        clauses.erase(it);
-        goto rescan;
+    CreateNewPlusNames(p.names.plus_mentioned);
+    Setup::Result r = Reground();
+    for (; first != last && r != Setup::kInconsistent; ++first) {
+      const Clause& lits = first->lits();
+      if (!lits.valid() && IsRelevantClause(lits, Plies::kSinceSetup)) {
+        if (p.relevant.filter) {
+          for (const Literal a : lits) {
+            UpdateRelevantTerms(a.lhs(), Plies::kSinceSetup);
+          }
+        }
+        update_result(&r, AddConstraint(*first));
+        UpdateLhsRhs(lits, Plies::kSinceSetup);
       }
+      StoreConstraint(&p, *first);
     }
+    for (size_t i : p.clauses.shallow_setup.new_clauses()) {
+      UpdateLhsRhs(last_setup().clause(i), Plies::kSinceSetup);
+    }
+    if (undo) {
+      *undo = Undo(this);
+    }
+    return r;
   }
 
+  Setup::Result AddConstraint(const Cardinality& c) {
+    return !c.valid() ? last_setup().AddCardinality(c) : Setup::kSubsumed;
+  }
+
+  Setup::Result AddConstraint(const AllDifferent& c) { return last_setup().AddAllDifferent(c); }
+
+  static void StoreConstraint(Ply* p, const Cardinality& c) { p->clauses.cardinalities.push_back(c); }
+  static void StoreConstraint(Ply* p, const AllDifferent& c) { p->clauses.all_differents.push_back(c); }
+
   bool InconsistencyCheck(const Ply& p, const Clause& c) {
     return !p.do_not_add_if_inconsistent || !c.unit() || !last_setup().Subsumes(Clause{c[0].flip()});
   }
@@ -897,6 +1320,10 @@ rescan:
   void ForEachNewGrounding(UnaryFunction range, UnaryPredicate pred, Setup::Result* add_result = nullptr) {
     typedef decltype(range(std::declval<Ply>()).begin()) iterator;
     typedef typename iterator::value_type::value_type value_type;
+    if (pool_ && pool_->n_threads() > 1) {
+      ForEachNewGroundingInParallel(range, pred, add_result);
+      return;
+    }
     for (const Ply& p : plies(Plies::kOld)) {
       for (const Ungrounded<value_type>& u : range(p)) {
         for (const Term x : u.vars) {
@@ -923,6 +1350,107 @@ rescan:
     }
   }
 
+  static constexpr size_t kMinParallelGroundings = 512;
+
+  // Enumerates the same groundings in the same order as ForEachNewGrounding().
+  // The groundings are split into equally sized chunks, one per thread, which
+  // are computed in parallel and then passed to pred sequentially. Every
+  // grounding is identified by the index of its ungrounded object, variable x,
+  // name n, and the rank of the assignment of the remaining variables.
+  template<typename UnaryFunction, typename UnaryPredicate>
+  void ForEachNewGroundingInParallel(UnaryFunction range, UnaryPredicate pred, Setup::Result* add_result) {
+    typedef decltype(range(std::declval<Ply>())) range_type;
+    static_assert(std::is_reference<range_type>::value, "range must not return a temporary");
+    typedef decltype(range(std::declval<Ply>()).begin()) iterator;
+    typedef typename iterator::value_type::value_type value_type;
+    struct Job {
+      const Ply* p;
+      const Ungrounded<value_type>* u;
+      Term x;
+      Term n;
+      size_t offset;
+      size_t size;
+    };
+    // Counting the names also makes sure that the per-sort maps of all plies
+    // have an entry for every sort, so the worker threads only read them.
+    internal::IntMap<Symbol::Sort, size_t> n_names;
+    auto n_groundings = [this, &n_names](const SortedTermSet& vars, Term x) {
+      size_t size = 1;
+      for (const Term y : vars) {
+        if (y != x) {
+          size_t& m = n_names[y.sort()];
+          if (m == 0) {
+            const Names ns = names(y.sort());
+            for (auto it = ns.begin(); it != ns.end(); ++it) {
+              ++m;
+            }
+          }
+          size *= m;
+        }
+      }
+      return size;
+    };
+    std::vector<Job> jobs;
+    size_t n_total = 0;
+    for (const Ply& p : plies(Plies::kOld)) {
+      for (const Ungrounded<value_type>& u : range(p)) {
+        for (const Term x : u.vars) {
+          const size_t size = n_groundings(u.vars, x);
+          for (const Term n : names(x.sort(), Plies::kNew)) {
+            jobs.push_back(Job{&p, &u, x, n, n_total, size});
+            n_total += size;
+          }
+        }
+      }
+    }
+    for (const Ungrounded<value_type>& u : range(last_ply())) {
+      const size_t size = n_groundings(u.vars, Term());
+      jobs.push_back(Job{&last_ply(), &u, Term(), Term(), n_total, size});
+      n_total += size;
+    }
+    const size_t n_chunks = n_total >= kMinParallelGroundings ? pool_->n_threads() : 1;
+    std::vector<std::vector<std::pair<value_type, const Ply*>>> chunks(n_chunks);
+    auto ground = [this, &jobs, &chunks, n_chunks, n_total](size_t i) {
+      const size_t begin = i * n_total / n_chunks;
+      const size_t end = (i + 1) * n_total / n_chunks;
+      std::vector<std::pair<value_type, const Ply*>>& chunk = chunks[i];
+      chunk.reserve(end - begin);
+      auto job = std::upper_bound(jobs.begin(), jobs.end(), begin,
+                                  [](size_t offset, const Job& j) { return offset < j.offset; });
+      assert(job != jobs.begin() || begin == end);
+      for (job = job != jobs.begin() ? std::prev(job) : job; job != jobs.end() && job->offset < end; ++job) {
+        const size_t first = std::max(begin, job->offset) - job->offset;
+        const size_t last = std::min(end, job->offset + job->size) - job->offset;
+        const Groundings<value_type> gs = groundings(&job->u->val, &job->u->vars, job->x, job->n);
+        auto it = gs.begin();
+        for (size_t j = 0; j < first; ++j) {
+          ++it;
+        }
+        for (size_t j = first; j < last; ++j, ++it) {
+          assert(it != gs.end());
+          chunk.push_back(std::make_pair(*it, job->p));
+        }
+      }
+    };
+    if (n_chunks == 1) {
+      ground(0);
+    } else {
+      pool_->ForEach(n_chunks, [this, &ground](size_t i) {
+        Term::Factory::Scope scope(tf_);
+        ground(i);
+      });
+    }
+    for (const std::vector<std::pair<value_type, const Ply*>>& chunk : chunks) {
+      for (const std::pair<value_type, const Ply*>& gp : chunk) {
+        assert(gp.first.ground());
+        pred(gp.first, *gp.second, add_result);
+        if (add_result && *add_result == Setup::kInconsistent) {
+          return;
+        }
+      }
+    }
+  }
+
   static void update_result(Setup::Result* add_result, Setup::Result r) {
     if (add_result) {
       switch (r) {
@@ -947,7 +1475,7 @@ rescan:
     Setup::Result add_result = Setup::kSubsumed;
     Ply& p = last_ply();
     ForEachNewGrounding(
-        [](const Ply& p) { return p.clauses.ungrounded; },
+        [](const Ply& p) -> const Ungrounded<Clause>::Vector& { return p.clauses.ungrounded; },
         [this](const Clause& c, const Ply& p, Setup::Result* add_result) {
           if (!c.valid() && InconsistencyCheck(p, c)) {
             const Setup::Result r = last_setup().AddClause(c);
@@ -960,11 +1488,20 @@ rescan:
     }
     if (p.relevant.filter) {
       ForEachNewGrounding(
-          [](const Ply& p) { return p.relevant.ungrounded; },
+          [](const Ply& p) -> const Ungrounded<Term>::Set& { return p.relevant.ungrounded; },
           [this](const Term t, const Ply&, Setup::Result*) {
             UpdateRelevantTerms(t, Plies::kSinceSetup);
           });
-      CloseRelevanceUnderClauses(p.clauses.shallow_setup.new_clauses(), Plies::kSinceSetup);
+      std::unordered_set<Term> seeds;
+      for (size_t i : p.clauses.shallow_setup.new_clauses()) {
+        const Clause c = last_setup().clause(i);
+        for (const Literal a : c) {
+          if (!IsNewRelevantTerm(a.lhs(), Plies::kSinceSetup)) {
+            seeds.insert(a.lhs());
+          }
+        }
+      }
+      CloseRelevance(seeds.begin(), seeds.end(), p.clauses.shallow_setup.first_new_non_unit(), Plies::kSinceSetup);
       std::vector<Clause> new_clauses;
       Setup& s = last_setup();
       for (size_t i : p.clauses.shallow_setup.new_clauses()) {
@@ -989,9 +1526,10 @@ rescan:
       UpdateLhsRhs(last_setup().clause(i), Plies::kSinceSetup);
     }
     ForEachNewGrounding(
-        [](const Ply& p) { return p.lhs_rhs.ungrounded; },
+        [](const Ply& p) -> const Ungrounded<Literal>::Set& { return p.lhs_rhs.ungrounded; },
         [this](const Literal a, const Ply&, Setup::Result*) {
           UpdateLhsRhs(a, Plies::kSinceSetup);
+          components_.Mark(a.lhs());
         });
     return add_result;
   }
@@ -1002,18 +1540,22 @@ rescan:
     assert(p.relevant.filter);
     assert(p.clauses.ungrounded.empty());
     assert(p.names.mentioned.all_empty() && p.names.plus_new.all_empty() && p.names.plus_max.all_empty());
+    // The new setup references the clauses of the old one, which remains
+    // unchanged until this ply is popped.
     const Setup& old_s = p.clauses.shallow_setup.setup();
-    std::unique_ptr<Setup> new_s(new Setup());
-    for (size_t i : old_s.clauses()) {
-      const Clause c = old_s.clause(i);
-      if (IsRelevantClause(c, Plies::kNew)) {
-        UpdateLhsRhs(c, Plies::kNew);
-        new_s->AddClause(c);
+    std::unique_ptr<Setup> new_s(new Setup(old_s, [this](const Clause& c) {
+      if (!IsRelevantClause(c, Plies::kNew)) {
+        return false;
       }
-    }
+      UpdateLhsRhs(c, Plies::kNew);
+      return true;
+    }));
     if (minimize) {
       new_s->Minimize();
     }
+    // The old shallow copy has no clauses of its own, so killing it leaves the
+    // referenced clauses intact.
+    p.clauses.shallow_setup.Kill();
     p.clauses.full_setup = std::move(new_s);
     p.clauses.shallow_setup = p.clauses.full_setup->shallow_copy();
   }
@@ -1029,6 +1571,12 @@ rescan:
     if (p == plies_.end()) {
       return;
     }
+    p->clauses.full_setup->Materialize();
+    // The merged ply is the only one, so the changes to the components cannot
+    // be undone anymore except by popping it, which clears them altogether.
+    components_.Commit();
+    p->n_component_changes = 0;
+    p->clauses.shallow_setup.Immortalize();
     bool after = false;
     for (auto it = plies_.begin(); it != plies_.end(); ++it) {
       assert(!it->do_not_add_if_inconsistent);
@@ -1038,13 +1586,17 @@ rescan:
       }
       p->clauses.ungrounded.insert(p->clauses.ungrounded.end(),
                                    it->clauses.ungrounded.begin(), it->clauses.ungrounded.end());
+      p->clauses.cardinalities.insert(p->clauses.cardinalities.end(),
+                                      it->clauses.cardinalities.begin(), it->clauses.cardinalities.end());
+      p->clauses.all_differents.insert(p->clauses.all_differents.end(),
+                                       it->clauses.all_differents.begin(), it->clauses.all_differents.end());
       p->names.mentioned.insert(it->names.mentioned);
       p->names.plus_max.insert(it->names.plus_max);
       p->names.plus_new.insert(it->names.plus_new);
       p->names.plus_mentioned.insert(it->names.plus_mentioned);
       if (after) {
         assert(!it->clauses.full_setup);
-        p->clauses.shallow_setup.Immortalize();
+        it->clauses.shallow_setup.Immortalize();
         p->relevant.ungrounded.insert(it->relevant.ungrounded.begin(), it->relevant.ungrounded.end());
         p->relevant.terms.insert(it->relevant.terms);
         p->lhs_rhs.ungrounded.insert(it->lhs_rhs.ungrounded.begin(), it->lhs_rhs.ungrounded.end());
@@ -1060,17 +1612,29 @@ rescan:
     }
     if (minimize) {
       p->clauses.full_setup->Minimize();
-      p->clauses.shallow_setup = p->clauses.full_setup->shallow_copy();
     }
-    plies_.erase(plies_.begin(), p);
-    plies_.erase(std::next(p), plies_.end());
+    p->clauses.shallow_setup = p->clauses.full_setup->shallow_copy();
+    // Plies are destroyed from last to first because shallow copies refer to
+    // setups of earlier plies.
+    while (std::next(p) != plies_.end()) {
+      plies_.pop_back();
+    }
+    while (p != plies_.begin()) {
+      plies_.erase(std::prev(p));
+    }
     assert(plies_.size() == 1);
   }
 
+  Grounder(Term::Factory* tf, NamePool&& name_pool, VariablePool&& var_pool)
+      : tf_(tf), name_pool_(std::move(name_pool)), var_pool_(std::move(var_pool)) {}
+
   Term::Factory* const tf_;
+  internal::ThreadPool* pool_ = nullptr;
   NamePool name_pool_;
   VariablePool var_pool_;
   Ply::List plies_;
+  internal::UnionFind<Term> components_;
+  internal::u64 last_ply_id_ = 0;
   Setup dummy_setup_;
 };
 
@@ -93,7 +93,7 @@ class IntMap {
   void Zip(const IntMap& m, BinaryFunction f) {
     size_t s = std::max(n_keys(), m.n_keys());
     for (size_t i = 0; i < s; ++i) {
-      vec_[i] = f(vec_[i], m[i]);
+      (*this)[i] = f((*this)[i], m[i]);
     }
   }
 
@@ -0,0 +1,126 @@
+// vim:filetype=cpp:textwidth=120:shiftwidth=2:softtabstop=2:expandtab
+// Copyright 2017 Christoph Schwering
+// Licensed under the MIT license. See LICENSE file in the project root.
+//
+// A fixed-size pool of worker threads to run data-parallel loops.
+//
+// ForEach(n, f) calls f(0), ..., f(n-1) and blocks until all calls have
+// returned. The calling thread participates in the work. The pool runs only
+// one loop at a time: if ForEach() is called while another loop is running,
+// be it from a different thread or from within f, the new loop is run
+// sequentially by the calling thread. This makes nesting safe.
+//
+// A pool with n_threads() == 1 spawns no threads at all.
+
+#ifndef LIMBO_INTERNAL_THREADPOOL_H_
+#define LIMBO_INTERNAL_THREADPOOL_H_
+
+#include <cassert>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <limbo/internal/ints.h>
+
+namespace limbo {
+namespace internal {
+
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t n_threads = std::thread::hardware_concurrency()) {
+    for (size_t i = 1; i < n_threads; ++i) {
+      workers_.emplace_back([this]() { Work(); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ThreadPool(ThreadPool&&) = delete;
+  ThreadPool& operator=(ThreadPool&&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& t : workers_) {
+      t.join();
+    }
+  }
+
+  size_t n_threads() const { return workers_.size() + 1; }
+
+  template<typename UnaryFunction>
+  void ForEach(size_t n, UnaryFunction f) {
+    std::unique_lock<std::mutex> busy(busy_, std::try_to_lock);
+    if (!busy.owns_lock() || workers_.empty() || n <= 1) {
+      for (size_t i = 0; i < n; ++i) {
+        f(i);
+      }
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      job_ = [&f](size_t i) { f(i); };
+      n_tasks_ = n;
+      next_task_ = 0;
+      n_running_ = workers_.size();
+      ++generation_;
+    }
+    wake_.notify_all();
+    RunTasks();
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return n_running_ == 0; });
+    job_ = nullptr;
+  }
+
+ private:
+  void Work() {
+    size_t seen_generation = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this, seen_generation]() { return stop_ || generation_ != seen_generation; });
+        if (stop_) {
+          return;
+        }
+        seen_generation = generation_;
+      }
+      RunTasks();
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        assert(n_running_ > 0);
+        --n_running_;
+      }
+      done_.notify_one();
+    }
+  }
+
+  void RunTasks() {
+    for (size_t i; (i = next_task_++) < n_tasks_; ) {
+      job_(i);
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::mutex busy_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  std::function<void(size_t)> job_;
+  size_t n_tasks_ = 0;
+  std::atomic<size_t> next_task_{0};
+  size_t n_running_ = 0;
+  size_t generation_ = 0;
+  bool stop_ = false;
+};
+
+}  // namespace internal
+}  // namespace limbo
+
+#endif  // LIMBO_INTERNAL_THREADPOOL_H_
@@ -0,0 +1,162 @@
+// vim:filetype=cpp:textwidth=120:shiftwidth=2:softtabstop=2:expandtab
+// Copyright 2017 Christoph Schwering
+// Licensed under the MIT license. See LICENSE file in the project root.
+//
+// A union-find structure whose operations can be undone. Every set carries a
+// mark, which is propagated by Union(). Elements are added implicitly by
+// Union() and Mark().
+//
+// Undo(n) reverts all changes since n_changes() returned n. To allow for that,
+// Find() does not compress paths; union by size keeps the trees shallow
+// nonetheless. Commit() drops the log of changes, which then cannot be undone
+// anymore, and Clear() removes all elements.
+
+#ifndef LIMBO_INTERNAL_UNIONFIND_H_
+#define LIMBO_INTERNAL_UNIONFIND_H_
+
+#include <cassert>
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <limbo/internal/ints.h>
+
+namespace limbo {
+namespace internal {
+
+template<typename T, typename Hash = std::hash<T>>
+class UnionFind {
+ public:
+  void Union(const T& x, const T& y) {
+    size_t i = Find(Node(x));
+    size_t j = Find(Node(y));
+    if (i == j) {
+      return;
+    }
+    if (size_[i] < size_[j]) {
+      std::swap(i, j);
+    }
+    changes_.push_back(Change(Change::kUnion, j, marked_[i]));
+    parent_[j] = i;
+    size_[i] += size_[j];
+    marked_[i] = marked_[i] || marked_[j];
+  }
+
+  void Mark(const T& x) {
+    const size_t i = Find(Node(x));
+    if (!marked_[i]) {
+      changes_.push_back(Change(Change::kMark, i, false));
+      marked_[i] = true;
+    }
+  }
+
+  template<typename UnaryFunction>
+  void Traverse(UnaryFunction f) const {
+    for (const T& x : elems_) {
+      f(x);
+    }
+  }
+
+  bool marked(const T& x) const {
+    auto it = index_.find(x);
+    return it != index_.end() && marked_[Find(it->second)];
+  }
+
+  bool connected(const T& x, const T& y) const {
+    auto it = index_.find(x);
+    auto jt = index_.find(y);
+    return x == y || (it != index_.end() && jt != index_.end() && Find(it->second) == Find(jt->second));
+  }
+
+  // The representative of x's set; x must be an element.
+  const T& representative(const T& x) const {
+    auto it = index_.find(x);
+    assert(it != index_.end());
+    return elems_[Find(it->second)];
+  }
+
+  size_t n_changes() const { return changes_.size(); }
+
+  void Commit() { std::vector<Change>().swap(changes_); }
+
+  void Clear() {
+    index_.clear();
+    elems_.clear();
+    parent_.clear();
+    size_.clear();
+    marked_.clear();
+    changes_.clear();
+  }
+
+  void Undo(size_t n) {
+    assert(n <= changes_.size());
+    while (changes_.size() > n) {
+      const Change& c = changes_.back();
+      switch (c.type) {
+        case Change::kNode:
+          assert(c.i + 1 == elems_.size());
+          index_.erase(elems_.back());
+          elems_.pop_back();
+          parent_.pop_back();
+          size_.pop_back();
+          marked_.pop_back();
+          break;
+        case Change::kUnion: {
+          const size_t i = parent_[c.i];
+          parent_[c.i] = c.i;
+          size_[i] -= size_[c.i];
+          marked_[i] = c.mark;
+          break;
+        }
+        case Change::kMark:
+          marked_[c.i] = c.mark;
+          break;
+      }
+      changes_.pop_back();
+    }
+  }
+
+ private:
+  struct Change {
+    enum Type { kNode, kUnion, kMark };
+    Change(Type type, size_t i, bool mark) : type(type), i(i), mark(mark) {}
+    Type type;
+    size_t i;   // new element, root that became a child, or marked root
+    bool mark;  // previous mark of the root
+  };
+
+  size_t Node(const T& x) {
+    auto it = index_.find(x);
+    if (it != index_.end()) {
+      return it->second;
+    }
+    const size_t i = elems_.size();
+    index_.insert(std::make_pair(x, i));
+    elems_.push_back(x);
+    parent_.push_back(i);
+    size_.push_back(1);
+    marked_.push_back(false);
+    changes_.push_back(Change(Change::kNode, i, false));
+    return i;
+  }
+
+  size_t Find(size_t i) const {
+    while (parent_[i] != i) {
+      i = parent_[i];
+    }
+    return i;
+  }
+
+  std::unordered_map<T, size_t, Hash> index_;
+  std::vector<T> elems_;
+  std::vector<size_t> parent_;
+  std::vector<size_t> size_;
+  std::vector<bool> marked_;
+  std::vector<Change> changes_;
+};
+
+}  // namespace internal
+}  // namespace limbo
+
+#endif  // LIMBO_INTERNAL_UNIONFIND_H_
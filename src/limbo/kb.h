@@ -10,7 +10,11 @@
 // clause; an objective sentence within Formula::Know() whose normal form is a
 // universally quantified clause; or a Formula::Bel() such that the normal form
 // of the material implication of antecedent and consequent is a universally
-// quantified clause. Semantically, knowledge base is only-known.
+// quantified clause. Semantically, knowledge base is only-known. With the
+// definitional flag, objective sentences (optionally within Formula::Know())
+// of any shape are accepted and stored as the clauses of
+// Formula::Clausify(), which introduces fresh symbols instead of requiring
+// the normal form to be a single clause.
 //
 // The optional Formula::Know() modality in formulas added to the knowledge base
 // is fully ignored, including the belief level (an unconditional knowledge base
@@ -21,18 +25,49 @@
 // spheres.
 //
 // Queries are not subject to any syntactic restrictions. Technically, they are
-// evaluated using variants of Levesque's representation theorem.
+// evaluated using variants of Levesque's representation theorem. The modal
+// operators are reduced on a FormulaDag that lives for the query, so the many
+// instances of subformulas that the representation theorem generates are
+// shared rather than copied. Since equal formulas are the same node, the
+// results of the representation theorem are memoized per query by sphere,
+// belief level and node; this pays off for nested modalities and for the
+// ground instances that different names lead to.
+//
+// Retract() removes a clause from the knowledge, and Forget() removes all
+// clauses and conditionals that mention one of the given terms or, in the case
+// of variables, may do so after grounding. Without conditionals, the clauses
+// are retracted from the single sphere; see Solver::Retract(). Otherwise the
+// system of spheres is constructed anew by the next query.
+//
+// When a ThreadPool is set with set_thread_pool(), the spheres for a
+// Formula::Bel() query are evaluated concurrently. Once the antecedent is
+// found to be trivially consistent in some sphere, the evaluation of the
+// subsequent spheres is cancelled, and the results are combined in sphere
+// order, so the answer is the same as without thread pool. The pool is also
+// used to construct the system of spheres: the plausibility checks of the
+// conditionals in each round run concurrently on snapshots of that round's
+// sphere.
+//
+// Like Solver, KnowledgeBase makes its Term::Factory current on the calling
+// thread for the duration of its public methods.
 
 #ifndef LIMBO_KB_H_
 #define LIMBO_KB_H_
 
 #include <cassert>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <limbo/clause.h>
 #include <limbo/formula.h>
+#include <limbo/formula_dag.h>
 #include <limbo/grounder.h>
 #include <limbo/literal.h>
 #include <limbo/solver.h>
@@ -41,6 +76,7 @@
 #include <limbo/internal/ints.h>
 #include <limbo/internal/iter.h>
 #include <limbo/internal/maybe.h>
+#include <limbo/internal/threadpool.h>
 
 namespace limbo {
 
@@ -62,11 +98,37 @@ class KnowledgeBase {
   KnowledgeBase& operator=(KnowledgeBase&&) = default;
 
   void Add(const Clause& c) {
+    Term::Factory::Scope scope(tf_);
     knowledge_.push_back(c);
     c.Traverse([this](Term t) { if (t.name()) names_.insert(t); return true; });
   }
 
-  bool Add(const Formula& alpha) {
+  bool Retract(const Clause& c) {
+    Term::Factory::Scope scope(tf_);
+    return Remove([&c](const Clause& d) { return c == d; },
+                  [](const Conditional&) { return false; },
+                  [&c](Solver* sphere) { sphere->Retract(c); }) > 0;
+  }
+
+  size_t Forget(const std::unordered_set<Term>& ts) {
+    Term::Factory::Scope scope(tf_);
+    auto mentions = [&ts](const Clause& c) {
+      return c.any([&ts](Literal a) { return Grounder::Matches(a.lhs(), ts); });
+    };
+    auto mentions_formula = [&ts](const Formula& alpha) {
+      bool r = false;
+      alpha.Traverse([&ts, &r](Term t) { r = r || (t.function() && Grounder::Matches(t, ts)); return !r; });
+      return r;
+    };
+    return Remove(mentions,
+                  [&mentions, &mentions_formula](const Conditional& b) {
+                    return mentions(b.not_ante_or_conse) || mentions_formula(*b.ante);
+                  },
+                  [&ts](Solver* sphere) { sphere->Forget(ts); });
+  }
+
+  bool Add(const Formula& alpha, bool definitional = false) {
+    Term::Factory::Scope scope(tf_);
     Formula::Ref beta = alpha.NF(sf_, tf_, false);
     bool assume_consistent = false;
     if (beta->type() == Formula::kGuarantee) {
@@ -83,22 +145,32 @@ class KnowledgeBase {
         return true;
       }
     } else {
-      internal::Maybe<Clause> c = (beta->type() == Formula::kKnow ? beta->as_know().arg() : *beta).AsUnivClause();
+      const Formula& gamma = beta->type() == Formula::kKnow ? beta->as_know().arg() : *beta;
+      internal::Maybe<Clause> c = gamma.AsUnivClause();
       if (c) {
         Add(c.val);
         return true;
       }
+      internal::Maybe<std::vector<Clause>> cs = definitional ? gamma.Clausify(sf_, tf_) : internal::Nothing;
+      if (cs) {
+        for (const Clause& c : cs.val) {
+          Add(c);
+        }
+        return true;
+      }
     }
     return false;
   }
 
   bool Entails(const Formula& sigma, bool distribute = true) {
+    Term::Factory::Scope scope(tf_);
     assert(sigma.subjective());
     assert(sigma.free_vars().all_empty());
     UpdateSpheres();
-    Formula::Ref phi = ReduceModalities(*sigma.NF(sf_, tf_, distribute));
+    Query q(tf_, spheres_.size());
+    const FormulaDag::Ref phi = ReduceModalities(&q, q.dag.FromFormula(*sigma.NF(sf_, tf_, distribute)));
     assert(phi->objective());
-    return objective_.Entails(0, *phi, Solver::kNoConsistencyGuarantee);
+    return objective_.Entails(0, *FormulaDag::ToFormula(phi), Solver::kNoConsistencyGuarantee);
   }
 
   sphere_index n_spheres() const { const_cast<KnowledgeBase&>(*this).UpdateSpheres(); return spheres_.size(); }
@@ -106,10 +178,51 @@ class KnowledgeBase {
   const Solver& sphere(sphere_index p) const { const_cast<KnowledgeBase&>(*this).UpdateSpheres(); return spheres_[p]; }
   const std::vector<Solver>& spheres() const { const_cast<KnowledgeBase&>(*this).UpdateSpheres(); return spheres_; }
 
+  void set_thread_pool(internal::ThreadPool* pool) { pool_ = pool; }
+  internal::ThreadPool* thread_pool() const { return pool_; }
+
+  void set_prune_symmetries(bool b) {
+    prune_symmetries_ = b;
+    objective_.set_prune_symmetries(b);
+    for (Solver& sphere : spheres_) {
+      sphere.set_prune_symmetries(b);
+    }
+  }
+  bool prune_symmetries() const { return prune_symmetries_; }
+
   const SortedTermSet& mentioned_names() const { return names_; }
   const TermSet& mentioned_names(Symbol::Sort sort) const { return names_[sort]; }
 
+  // Traverse() visits the terms of the knowledge, the conditionals, and the
+  // spheres; it serves as root for Term::Factory::Collect().
+  template<typename UnaryFunction>
+  void Traverse(UnaryFunction f) const {
+    Term::Factory::Scope scope(tf_);
+    for (const Clause& c : knowledge_) {
+      c.Traverse(f);
+    }
+    for (const Conditional& b : beliefs_) {
+      b.ante->Traverse(f);
+      b.ante->Traverse([&f](const Formula& alpha) {
+        if (alpha.type() == Formula::kExists) {
+          alpha.as_exists().x().Traverse(f);
+        }
+        return true;
+      });
+      b.not_ante_or_conse.Traverse(f);
+    }
+    for (const Term t : names_) {
+      t.Traverse(f);
+    }
+    for (const Solver& sphere : spheres_) {
+      sphere.Traverse(f);
+    }
+    objective_.Traverse(f);
+  }
+
  private:
+  friend class Snapshot;
+
   struct Conditional {
     belief_level k;
     belief_level l;
@@ -118,6 +231,40 @@ class KnowledgeBase {
     bool assume_consistent;
   };
 
+  enum ResType { kResEntails, kResConsistent };
+
+  struct ResKey {
+    bool operator==(const ResKey& r) const {
+      return type == r.type && k == r.k && guarantee == r.guarantee && phi == r.phi;
+    }
+    ResType type;
+    belief_level k;
+    size_t guarantee;
+    FormulaDag::Ref phi;
+  };
+
+  struct ResKeyHash {
+    internal::hash32_t operator()(const ResKey& r) const {
+      return r.phi->hash() ^ internal::jenkins_hash((static_cast<internal::u32>(r.guarantee) << 8) ^
+                                                    (r.k << 1) ^ r.type);
+    }
+  };
+
+  typedef std::unordered_map<ResKey, FormulaDag::Ref, ResKeyHash> ResMemo;
+
+  // The state of a single Entails() call: the DAG of its formulas and the
+  // memoized results of the representation theorem. The memo is per sphere
+  // so that spheres can be evaluated concurrently. Results obtained within
+  // a Formula::Guarantee() are keyed by that guarantee, since the spheres
+  // differ there.
+  struct Query {
+    Query(Term::Factory* tf, size_t n_spheres) : dag(tf), memo(n_spheres) {}
+    FormulaDag dag;
+    std::vector<ResMemo> memo;
+    size_t guarantee = 0;
+    size_t n_guarantees = 0;
+  };
+
   void Add(belief_level k,
            belief_level l,
            const Formula& antecedent,
@@ -128,7 +275,52 @@ class KnowledgeBase {
     not_antecedent_or_consequent.Traverse([this](Term t) { if (t.name()) names_.insert(t); return true; });
   }
 
+  // Removes the clauses and conditionals that satisfy the predicates. If the
+  // single sphere consists of the knowledge only, the processed clauses are
+  // removed from it by retract(); otherwise the spheres are reset.
+  template<typename ClausePredicate, typename ConditionalPredicate, typename SphereFunction>
+  size_t Remove(ClausePredicate clause_pred, ConditionalPredicate cond_pred, SphereFunction retract) {
+    size_t n_processed_knowledge = n_processed_knowledge_;
+    size_t j = 0;
+    for (size_t i = 0; i < knowledge_.size(); ++i) {
+      if (!clause_pred(knowledge_[i])) {
+        knowledge_[j++] = knowledge_[i];
+      } else if (i < n_processed_knowledge_) {
+        --n_processed_knowledge;
+      }
+    }
+    size_t n_removed = knowledge_.size() - j;
+    knowledge_.erase(knowledge_.begin() + j, knowledge_.end());
+    const auto it = std::remove_if(beliefs_.begin(), beliefs_.end(), cond_pred);
+    n_removed += std::distance(it, beliefs_.end());
+    beliefs_.erase(it, beliefs_.end());
+    if (n_removed == 0) {
+      return 0;
+    }
+    if (beliefs_.empty() && n_processed_beliefs_ == 0) {
+      assert(spheres_.size() == 1);
+      retract(&spheres_[0]);
+      n_processed_knowledge_ = n_processed_knowledge;
+    } else {
+      spheres_.clear();
+      spheres_.emplace_back(sf_, tf_);
+      spheres_[0].set_prune_symmetries(prune_symmetries_);
+      n_processed_knowledge_ = 0;
+      n_processed_beliefs_ = 0;
+    }
+    names_ = SortedTermSet();
+    for (const Clause& c : knowledge_) {
+      c.Traverse([this](Term t) { if (t.name()) names_.insert(t); return true; });
+    }
+    for (const Conditional& b : beliefs_) {
+      b.ante->Traverse([this](Term t) { if (t.name()) names_.insert(t); return true; });
+      b.not_ante_or_conse.Traverse([this](Term t) { if (t.name()) names_.insert(t); return true; });
+    }
+    return n_removed;
+  }
+
   void UpdateSpheres() {
+    Term::Factory::Scope scope(tf_);
     if (n_processed_beliefs_ == beliefs_.size() && n_processed_knowledge_ == knowledge_.size()) {
       return;
     }
@@ -147,6 +339,7 @@ class KnowledgeBase {
       do {
         last_n_done = n_done;
         Solver sphere(sf_, tf_);
+        sphere.set_prune_symmetries(prune_symmetries_);
         auto is = internal::filter_range(internal::int_iterator<size_t>(0),
                                          internal::int_iterator<size_t>(beliefs_.size()),
                                          [this, &done](size_t i) { return !done[i]; });
@@ -156,22 +349,33 @@ class KnowledgeBase {
                                             });
         auto cs = internal::join_ranges(knowledge_.cbegin(), knowledge_.cend(), bs.begin(), bs.end());
         sphere.grounder().AddClauses(cs.begin(), cs.end());
-        bool next_is_plausibility_consistent = true;
-        for (size_t i = 0; i < beliefs_.size(); ++i) {
-          const Conditional& c = beliefs_[i];
-          if (!done[i]) {
-            Grounder::Undo undo;
-            if (c.assume_consistent) {
-              sphere.grounder().GuaranteeConsistency(*c.ante, &undo);
+        std::vector<size_t> todo(is.begin(), is.end());
+        std::vector<char> possibly_consistent(todo.size(), false);
+        std::vector<char> necessarily_consistent(todo.size(), false);
+        if (pool_ && pool_->n_threads() > 1 && todo.size() > 1) {
+          // The checks of a round are independent of each other. Every worker
+          // clones the round's sphere, which stays untouched meanwhile, and
+          // draws the conditionals from a shared counter.
+          std::atomic<size_t> next(0);
+          pool_->ForEach(std::min(pool_->n_threads(), todo.size()), [&](size_t) {
+            Term::Factory::Scope scope(tf_);
+            Solver s = sphere.Clone();
+            for (size_t j; (j = next++) < todo.size(); ) {
+              CheckPlausibility(&s, beliefs_[todo[j]], &possibly_consistent[j], &necessarily_consistent[j]);
             }
-            const bool possibly_consistent = !sphere.Entails(c.k, *Formula::Factory::Not(c.ante->Clone()));
-            if (possibly_consistent) {
-              done[i] = true;
-              ++n_done;
-              const bool necessarily_consistent = sphere.Consistent(c.l, *c.ante);
-              if (!necessarily_consistent) {
-                next_is_plausibility_consistent = false;
-              }
+          });
+        } else {
+          for (size_t j = 0; j < todo.size(); ++j) {
+            CheckPlausibility(&sphere, beliefs_[todo[j]], &possibly_consistent[j], &necessarily_consistent[j]);
+          }
+        }
+        bool next_is_plausibility_consistent = true;
+        for (size_t j = 0; j < todo.size(); ++j) {
+          if (possibly_consistent[j]) {
+            done[todo[j]] = true;
+            ++n_done;
+            if (!necessarily_consistent[j]) {
+              next_is_plausibility_consistent = false;
             }
           }
         }
@@ -185,79 +389,155 @@ class KnowledgeBase {
     n_processed_knowledge_ = knowledge_.size();
   }
 
-  Formula::Ref ReduceModalities(const Formula& alpha) {
-    switch (alpha.type()) {
+  // The antecedent is cloned because the solver caches the free variables of
+  // the query formula, and the conditional may be checked by several threads.
+  void CheckPlausibility(Solver* sphere, const Conditional& c, char* possibly_consistent,
+                         char* necessarily_consistent) {
+    const Formula::Ref ante = c.ante->Clone();
+    Grounder::Undo undo;
+    if (c.assume_consistent) {
+      sphere->grounder().GuaranteeConsistency(*ante, &undo);
+    }
+    *possibly_consistent = !sphere->Entails(c.k, *Formula::Factory::Not(ante->Clone()));
+    if (*possibly_consistent) {
+      *necessarily_consistent = sphere->Consistent(c.l, *ante);
+    }
+  }
+
+  FormulaDag::Ref ReduceModalities(Query* q, FormulaDag::Ref alpha) {
+    switch (alpha->type()) {
       case Formula::kAtomic: {
-        return alpha.Clone();
+        return alpha;
       }
       case Formula::kNot: {
-        return Formula::Factory::Not(ReduceModalities(alpha.as_not().arg()));
+        return q->dag.Not(ReduceModalities(q, &alpha->arg()));
       }
       case Formula::kOr: {
-        return Formula::Factory::Or(ReduceModalities(alpha.as_or().lhs()), ReduceModalities(alpha.as_or().rhs()));
+        return q->dag.Or(ReduceModalities(q, &alpha->lhs()), ReduceModalities(q, &alpha->rhs()));
       }
       case Formula::kExists: {
-        return Formula::Factory::Exists(alpha.as_exists().x(), ReduceModalities(alpha.as_exists().arg()));
+        return q->dag.Exists(alpha->x(), ReduceModalities(q, &alpha->arg()));
       }
       case Formula::kKnow: {
         const sphere_index p = spheres_.size() - 1;
-        Formula::Ref phi = ReduceModalities(alpha.as_know().arg());
-        return ResEntails(p, alpha.as_know().k(), *phi);
+        const FormulaDag::Ref phi = ReduceModalities(q, &alpha->arg());
+        return ResEntails(q, p, alpha->k(), phi);
       }
       case Formula::kCons: {
         const sphere_index p = spheres_.size() - 1;
-        Formula::Ref phi = ReduceModalities(alpha.as_cons().arg());
-        return ResConsistent(p, alpha.as_cons().k(), *phi);
+        const FormulaDag::Ref phi = ReduceModalities(q, &alpha->arg());
+        return ResConsistent(q, p, alpha->k(), phi);
       }
       case Formula::kBel: {
-        const Formula::Ref ante = ReduceModalities(alpha.as_bel().antecedent());
-        const Formula::Ref not_ante_or_conse = ReduceModalities(alpha.as_bel().not_antecedent_or_consequent());
-        const belief_level k = alpha.as_bel().k();
-        const belief_level l = alpha.as_bel().l();
-        std::vector<Formula::Ref> consistent;
-        std::vector<Formula::Ref> entails;
-        for (sphere_index p = 0; p < spheres_.size(); ++p) {
-          consistent.push_back(ResConsistent(p, l, *ante));
-          entails.push_back(ResEntails(p, k, *not_ante_or_conse));
-          // The above calls to ResConsistent() and ResEntails() are potentially
-          // very expensive, so we should abort this loop when the subsequent
-          // spheres are clearly irrelevant.
-          if (consistent.back()->trivially_valid()) {
-            break;
+        const FormulaDag::Ref ante = ReduceModalities(q, &alpha->antecedent());
+        const FormulaDag::Ref not_ante_or_conse = ReduceModalities(q, &alpha->not_antecedent_or_consequent());
+        const belief_level k = alpha->k();
+        const belief_level l = alpha->l();
+        std::vector<FormulaDag::Ref> consistent;
+        std::vector<FormulaDag::Ref> entails;
+        if (pool_ && pool_->n_threads() > 1 && spheres_.size() > 1) {
+          ResSpheres(q, k, l, ante, not_ante_or_conse, &consistent, &entails);
+        } else {
+          for (sphere_index p = 0; p < spheres_.size(); ++p) {
+            consistent.push_back(ResConsistent(q, p, l, ante));
+            entails.push_back(ResEntails(q, p, k, not_ante_or_conse));
+            // The above calls to ResConsistent() and ResEntails() are potentially
+            // very expensive, so we should abort this loop when the subsequent
+            // spheres are clearly irrelevant.
+            if (consistent.back()->trivially_valid()) {
+              break;
+            }
           }
         }
-        Formula::Ref phi;
+        FormulaDag::Ref phi = nullptr;
         for (sphere_index p = 0; p < entails.size(); ++p) {
-          Formula::Ref conj = entails[p]->Clone();
-          for (sphere_index q = 0; q < p; ++q) {
-            conj = Formula::Factory::Or(consistent[q]->Clone(), std::move(conj));
+          FormulaDag::Ref conj = entails[p];
+          for (sphere_index r = 0; r < p; ++r) {
+            conj = q->dag.Or(consistent[r], conj);
           }
           if (!phi) {
-            phi = std::move(conj);
+            phi = conj;
           } else {
-            phi = Formula::Factory::Not(Formula::Factory::Or(Formula::Factory::Not(std::move(phi)),
-                                                             Formula::Factory::Not(std::move(conj))));
+            phi = q->dag.Not(q->dag.Or(q->dag.Not(phi), q->dag.Not(conj)));
           }
         }
         return phi;
       }
       case Formula::kGuarantee: {
         std::vector<Grounder::Undo> undos(spheres_.size());
-        const Formula& beta = alpha.as_guarantee().arg();
+        const FormulaDag::Ref beta = &alpha->arg();
+        const Formula::Ref beta_formula = FormulaDag::ToFormula(beta);
         for (sphere_index p = 0; p < spheres_.size(); ++p) {
-          spheres_[p].grounder().GuaranteeConsistency(beta, &undos[p]);
+          spheres_[p].grounder().GuaranteeConsistency(*beta_formula, &undos[p]);
         }
-        return ReduceModalities(beta);
+        const size_t guarantee = q->guarantee;
+        q->guarantee = ++q->n_guarantees;
+        const FormulaDag::Ref phi = ReduceModalities(q, beta);
+        q->guarantee = guarantee;
+        return phi;
       }
     }
     throw;
   }
 
-  Formula::Ref ResEntails(sphere_index p, belief_level k, const Formula& phi) {
+  // Evaluates the spheres of a Formula::Bel() concurrently. Each task works on
+  // its own sphere and memo. When the antecedent is trivially consistent in
+  // sphere p, the spheres after p are irrelevant: their tasks are skipped or
+  // cancelled through the budget, and their possibly incomplete memos are
+  // discarded.
+  void ResSpheres(Query* q,
+                  belief_level k,
+                  belief_level l,
+                  FormulaDag::Ref ante,
+                  FormulaDag::Ref not_ante_or_conse,
+                  std::vector<FormulaDag::Ref>* consistent,
+                  std::vector<FormulaDag::Ref>* entails) {
+    const size_t n = spheres_.size();
+    consistent->resize(n, nullptr);
+    entails->resize(n, nullptr);
+    std::atomic<size_t> last(n - 1);
+    std::unique_ptr<std::atomic<bool>[]> cancel(new std::atomic<bool>[n]);
+    for (sphere_index p = 0; p < n; ++p) {
+      cancel[p] = false;
+    }
+    pool_->ForEach(n, [&](sphere_index p) {
+      Term::Factory::Scope scope(tf_);
+      if (p > last) {
+        return;
+      }
+      Solver& sphere = spheres_[p];
+      const Solver::Budget budget = sphere.budget();
+      if (!budget.cancel) {
+        Solver::Budget b = budget;
+        b.cancel = &cancel[p];
+        sphere.set_budget(b);
+      }
+      (*consistent)[p] = ResConsistent(q, p, l, ante);
+      if ((*consistent)[p]->trivially_valid()) {
+        size_t r = last;
+        while (p < r && !last.compare_exchange_weak(r, p)) {
+        }
+        for (sphere_index r = p + 1; r < n; ++r) {
+          cancel[r] = true;
+        }
+      }
+      if (p <= last) {
+        (*entails)[p] = ResEntails(q, p, k, not_ante_or_conse);
+      }
+      sphere.set_budget(budget);
+    });
+    for (sphere_index p = last + 1; p < n; ++p) {
+      q->memo[p].clear();
+    }
+    consistent->resize(last + 1);
+    entails->resize(last + 1);
+  }
+
+  FormulaDag::Ref ResEntails(Query* q, sphere_index p, belief_level k, FormulaDag::Ref phi) {
     // If phi is just a literal (t = n) or (t = x) for primitive t, we can
     // use Solver::Determines to speed things up.
-    if (phi.type() == Formula::kAtomic) {
-      const Clause& c = phi.as_atomic().arg();
+    if (phi->type() == Formula::kAtomic) {
+      const Clause& c = phi->clause();
       if (c.unit()) {
         Literal a = c.first();
         // Currently we enable this only for (t = x) and not for (t = n), for
@@ -265,96 +545,104 @@ class KnowledgeBase {
         // to additional names for grounding.
         // TODO Make Grounder::PrepareForQuery() more efficient for (t = n).
         if (a.lhs().primitive() && a.pos() && a.rhs().variable()) {
+          const ResKey key{kResEntails, k, q->guarantee, phi};
+          auto it = q->memo[p].find(key);
+          if (it != q->memo[p].end()) {
+            return it->second;
+          }
           internal::Maybe<Term> r = spheres_[p].Determines(k, a.lhs());
+          FormulaDag::Ref psi = nullptr;
           if (a.rhs().name()) {
-            return bool_to_formula(r && (r.val.null() || r.val == a.rhs()));
+            psi = bool_to_formula(q, r && (r.val.null() || r.val == a.rhs()));
           } else if (a.rhs().variable()) {
             if (r) {
               if (r.val.null()) {
-                return bool_to_formula(true);
+                psi = bool_to_formula(q, true);
               } else {
-                return Formula::Factory::Atomic(Clause(Literal::Eq(a.rhs(), r.val)));
+                psi = q->dag.Atomic(Clause(Literal::Eq(a.rhs(), r.val)));
               }
             } else {
-              return bool_to_formula(false);
+              psi = bool_to_formula(q, false);
             }
           }
+          q->memo[p].insert(std::make_pair(key, psi));
+          return psi;
         }
       }
     }
-    auto if_no_free_vars = [k, this](Solver* sphere, const Formula& psi) {
-      return sphere->Entails(k, psi);
-    };
-    return Res(p, phi.Clone(), if_no_free_vars);
+    return Res(q, kResEntails, p, k, phi);
   }
 
-  Formula::Ref ResConsistent(sphere_index p, belief_level k, const Formula& phi) {
-    auto if_no_free_vars = [k, this](Solver* sphere, const Formula& psi) {
-      return sphere->Consistent(k, psi);
-    };
-    return Res(p, phi.Clone(), if_no_free_vars);
+  FormulaDag::Ref ResConsistent(Query* q, sphere_index p, belief_level k, FormulaDag::Ref phi) {
+    return Res(q, kResConsistent, p, k, phi);
   }
 
-  template<typename BinaryPredicate>
-  Formula::Ref Res(sphere_index p, Formula::Ref phi, BinaryPredicate if_no_free_vars) {
+  FormulaDag::Ref Res(Query* q, ResType type, sphere_index p, belief_level k, FormulaDag::Ref phi) {
+    // The names only depend on phi, so the result can be shared.
+    const ResKey key{type, k, q->guarantee, phi};
+    auto it = q->memo[p].find(key);
+    if (it != q->memo[p].end()) {
+      return it->second;
+    }
     SortedTermSet names = names_;
-    phi->Traverse([&names](Term t) { if (t.name()) names.insert(t); return true; });
-    return Res(p, std::move(phi), &names, if_no_free_vars);
+    FormulaDag::Traverse(phi, [&names](Term t) { if (t.name()) names.insert(t); return true; });
+    const FormulaDag::Ref psi = Res(q, type, p, k, phi, &names);
+    q->memo[p].insert(std::make_pair(key, psi));
+    return psi;
   }
 
-  template<typename BinaryPredicate>
-  Formula::Ref Res(sphere_index p, Formula::Ref phi, SortedTermSet* names, BinaryPredicate if_no_free_vars) {
+  FormulaDag::Ref Res(Query* q, ResType type, sphere_index p, belief_level k, FormulaDag::Ref phi,
+                      SortedTermSet* names) {
     if (phi->free_vars().all_empty()) {
-      const bool r = if_no_free_vars(&spheres_[p], *phi);
-      return bool_to_formula(r);
+      // Ground instances recur for different names and in different
+      // modalities, and their result is independent of names.
+      const ResKey key{type, k, q->guarantee, phi};
+      auto it = q->memo[p].find(key);
+      if (it != q->memo[p].end()) {
+        return it->second;
+      }
+      const Formula::Ref psi = FormulaDag::ToFormula(phi);
+      const bool r = type == kResEntails ? spheres_[p].Entails(k, *psi) : spheres_[p].Consistent(k, *psi);
+      const FormulaDag::Ref xi = bool_to_formula(q, r);
+      q->memo[p].insert(std::make_pair(key, xi));
+      return xi;
     }
     Term x = *phi->free_vars().begin();
-    Formula::Ref psi = ResOtherName(p, phi->Clone(), x, names, if_no_free_vars);
+    FormulaDag::Ref psi = ResOtherName(q, type, p, k, phi, x, names);
     for (Term n : (*names)[x.sort()]) {
-      Formula::Ref xi = ResName(p, phi->Clone(), x, n, names, if_no_free_vars);
-      psi = Formula::Factory::Not(Formula::Factory::Or(Formula::Factory::Not(std::move(xi)),
-                                                       Formula::Factory::Not(std::move(psi))));
+      FormulaDag::Ref xi = ResName(q, type, p, k, phi, x, n, names);
+      psi = q->dag.Not(q->dag.Or(q->dag.Not(xi), q->dag.Not(psi)));
     }
     return psi;
   }
 
-  template<typename BinaryPredicate>
-  Formula::Ref ResName(sphere_index p,
-                       Formula::Ref phi,
-                       Term x,
-                       Term n,
-                       SortedTermSet* names,
-                       BinaryPredicate if_no_free_vars) {
+  FormulaDag::Ref ResName(Query* q, ResType type, sphere_index p, belief_level k, FormulaDag::Ref phi,
+                          Term x, Term n, SortedTermSet* names) {
     // (x == n -> RES(p, phi^x_n)) in clausal form
-    phi->SubstituteFree(Term::Substitution(x, n), tf_);
-    phi = Res(p, std::move(phi), names, if_no_free_vars);
+    phi = q->dag.Substitute(phi, x, n);
+    phi = Res(q, type, p, k, phi, names);
     Literal if_not = Literal::Neq(x, n);
-    return Formula::Factory::Or(Formula::Factory::Atomic(Clause(if_not)), std::move(phi));
+    return q->dag.Or(q->dag.Atomic(Clause(if_not)), phi);
   }
 
-  template<typename BinaryPredicate>
-  Formula::Ref ResOtherName(sphere_index p,
-                            Formula::Ref phi,
-                            Term x,
-                            SortedTermSet* names,
-                            BinaryPredicate if_no_free_vars) {
+  FormulaDag::Ref ResOtherName(Query* q, ResType type, sphere_index p, belief_level k, FormulaDag::Ref phi,
+                               Term x, SortedTermSet* names) {
     // (x != n1 && ... && x != nK -> RES(p, phi^x_n0)^n0_x) in clausal form
     Term n0 = spheres_[p].grounder().temp_name_pool().Create(x.sort());
-    phi->SubstituteFree(Term::Substitution(x, n0), tf_);
+    phi = q->dag.Substitute(phi, x, n0);
     names->insert(n0);
-    phi = Res(p, std::move(phi), names, if_no_free_vars);
+    phi = Res(q, type, p, k, phi, names);
     names->erase(n0);
-    phi->SubstituteFree(Term::Substitution(n0, x), tf_);
+    phi = q->dag.Substitute(phi, n0, x);
     spheres_[p].grounder().temp_name_pool().Return(n0);
     const TermSet& ns = (*names)[x.sort()];
     const auto if_not = internal::transform_range(ns.begin(), ns.end(), [x](Term n) { return Literal::Eq(x, n); });
     const Clause c(ns.size(), if_not.begin(), if_not.end());
-    return Formula::Factory::Or(Formula::Factory::Atomic(c), std::move(phi));
+    return q->dag.Or(q->dag.Atomic(c), phi);
   }
 
-  static Formula::Ref bool_to_formula(bool b) {
-    Formula::Ref falsum = Formula::Factory::Atomic(Clause());
-    return b ? Formula::Factory::Not(std::move(falsum)) : std::move(falsum);
+  static FormulaDag::Ref bool_to_formula(Query* q, bool b) {
+    return b ? q->dag.True() : q->dag.False();
   }
 
   Symbol::Factory* sf_;
@@ -366,6 +654,8 @@ class KnowledgeBase {
   Solver objective_;
   size_t n_processed_knowledge_ = 0;
   size_t n_processed_beliefs_ = 0;
+  internal::ThreadPool* pool_ = nullptr;
+  bool prune_symmetries_ = false;
 };
 
 }  // namespace limbo
@@ -147,6 +147,8 @@ class Literal {
   }
 
  private:
+  friend class Snapshot;
+
   explicit Literal(Term lhs) {
     // Shall be the operator<-minimum of all Literals with lhs.
     data_ = static_cast<u64>(lhs.id());
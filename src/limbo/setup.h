@@ -33,6 +33,30 @@
 // to be transitively closed under the terms occurring in setup clauses. It
 // is the users responsibility to make sure this condition holds.
 //
+// A setup can also be constructed as a filtered view of another base setup.
+// It contains the clauses of the base setup that satisfy a given predicate.
+// Clauses with >= 2 literals are not copied but referenced, so the base setup
+// must not be modified or destroyed during the lifecycle of the view unless
+// Materialize() is called before. In the same way, a setup loaded with
+// Snapshot::LoadShared() references clauses in a read-only mapped file.
+//
+// Cardinality constraints are added with AddCardinality(). They are not
+// expanded into clauses but evaluated by counting how many of their literals
+// are satisfied or falsified by the unit clauses: a constraint that can only
+// be satisfied if all its remaining literals hold propagates these literals as
+// units, and one that cannot be satisfied anymore leads to the empty clause.
+// Subsumes() treats a constraint like the clauses it stands for, and the
+// literals of constraints take part in Consistent() and LocallyConsistent().
+// Like clauses, constraints are only appended, so ShallowCopy removes them
+// again.
+//
+// All-different constraints are added with AddAllDifferent() and handled in
+// the same way. When a term of such a constraint takes a name, the name is
+// excluded for the other terms. A term with a single remaining name takes it,
+// and so does a name that can only be taken by a single term if there are as
+// many names as terms. The constraint fails if there are fewer remaining names
+// than terms without a name.
+//
 // The setup is implemented using watched literals: the empty clause and unit
 // clauses are stored separately from clauses with >= 2 literals, and for each
 // of these non-degenerated clauses two literals that are not subsumed by any
@@ -61,10 +85,14 @@
 #include <cassert>
 
 #include <algorithm>
+#include <iterator>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include <limbo/all_different.h>
+#include <limbo/cardinality.h>
 #include <limbo/clause.h>
 #include <limbo/literal.h>
 #include <limbo/term.h>
@@ -131,21 +159,29 @@ class Setup {
 
     void Kill() {
       if (setup_) {
-        assert(data_.empty_clause + data_.n_clauses + data_.n_units == 0 || setup_->saved_-- > 0);
+        assert(data_.blank() || setup_->saved_-- > 0);
         setup_->empty_clause_ = data_.empty_clause;
-        setup_->units_.Resize(data_.n_units);
+        setup_->ResizeUnits(data_.n_units);
         setup_->clauses_.Resize(data_.n_clauses);
+        setup_->ResizeConstraints(data_.n_cards, data_.n_alldiffs);
         setup_ = nullptr;
       }
     }
 
-    void Immortalize() { setup_ = nullptr; }
+    void Immortalize() {
+      if (setup_) {
+        assert(data_.blank() || setup_->saved_-- > 0);
+        setup_ = nullptr;
+      }
+    }
 
     Setup& setup() { return *setup_; }
     const Setup& setup() const { return *setup_; }
 
     Result AddClause(Clause c) { return setup_->AddClause(c); }
     Result AddUnit(Literal a) { return setup_->AddUnit(a); }
+    Result AddCardinality(const Cardinality& c) { return setup_->AddCardinality(c); }
+    Result AddAllDifferent(const AllDifferent& c) { return setup_->AddAllDifferent(c); }
 
     void Minimize() {
       assert(data_.saved == setup_->saved_);
@@ -154,6 +190,9 @@ class Setup {
       assert(data_.n_units <= setup_->units_.size());
     }
 
+    // The index in setup().clauses() of the first new clause with >= 2 literals.
+    size_t first_new_non_unit() const { return setup_->empty_clause_ + setup_->units_.size() + data_.n_clauses; }
+
     ClauseRange<GlobalIndex> new_clauses() const {
       const size_t last =
           setup_->empty_clause_ - data_.empty_clause +
@@ -167,17 +206,23 @@ class Setup {
 
     struct Data {
       Data() = default;
-      Data(bool ec, size_t nc, size_t nu) : empty_clause(ec), n_clauses(nc), n_units(nu) {}
+      Data(bool ec, size_t nc, size_t nu, size_t nk, size_t nd)
+          : empty_clause(ec), n_clauses(nc), n_units(nu), n_cards(nk), n_alldiffs(nd) {}
+      bool blank() const { return !empty_clause && n_clauses + n_units + n_cards + n_alldiffs == 0; }
       bool empty_clause = false;
       size_t n_clauses = 0;
       size_t n_units = 0;
+      size_t n_cards = 0;
+      size_t n_alldiffs = 0;
 #ifndef NDEBUG
       size_t saved = 0;
 #endif
     };
 
-    explicit ShallowCopy(Setup* s) : setup_(s), data_(Data(s->empty_clause_, s->clauses_.size(), s->units_.size())) {
-      assert(data_.empty_clause + data_.n_clauses + data_.n_units == 0 || ++setup_->saved_ > 0);
+    explicit ShallowCopy(Setup* s)
+        : setup_(s),
+          data_(Data(s->empty_clause_, s->clauses_.size(), s->units_.size(), s->cards_.size(), s->alldiffs_.size())) {
+      assert(data_.blank() || ++setup_->saved_ > 0);
 #ifndef NDEBUG
       data_.saved = s->saved_;
 #endif
@@ -188,6 +233,45 @@ class Setup {
   };
 
   Setup() = default;
+
+  // The filtered view contains every clause c of base for which pred(c) holds.
+  // Clauses are visited in the order of base.clauses(). Unit propagation is
+  // complete for base, so a non-unit clause of base is not affected by the
+  // units in the view and can be referenced instead of copied. Cardinality
+  // and all-different constraints are copied if pred holds for the clause of
+  // their literals.
+  template<typename UnaryPredicate>
+  Setup(const Setup& base, UnaryPredicate pred) {
+    std::vector<Clause> changed;
+    for (size_t i : base.clauses()) {
+      const Clause c = base.clause(i);
+      if (!pred(c)) {
+        continue;
+      }
+      const size_t j = i - base.empty_clause_ - base.units_.size();
+      if (i >= base.empty_clause_ + base.units_.size() && base.clauses_[j].size() == c.size()) {
+        clauses_.Reference(&base.clauses_[j]);
+      } else if (c.size() >= 2) {
+        changed.push_back(c);
+      } else {
+        AddClause(c);
+      }
+    }
+    for (const Clause& c : changed) {
+      AddClause(c);
+    }
+    for (const Cardinality& c : base.cards_) {
+      if (pred(c.lits())) {
+        AddCardinality(c);
+      }
+    }
+    for (const AllDifferent& c : base.alldiffs_) {
+      if (pred(c.lits())) {
+        AddAllDifferent(c);
+      }
+    }
+  }
+
   Setup(const Setup&) = delete;
   Setup& operator=(const Setup&) = delete;
   Setup(Setup&&) = default;
@@ -195,6 +279,12 @@ class Setup {
 
   ShallowCopy shallow_copy() { return ShallowCopy(this); }
 
+  // Copies the clauses referenced from the base setup, if any.
+  void Materialize() { clauses_.Materialize(); }
+
+  // The number of clauses referenced from the base setup.
+  size_t n_references() const { return clauses_.n_references(); }
+
   void Minimize() {
     Minimize(0, 0);
     units_.SealOriginalUnits();  // units_.set() have been eliminated from all clauses, so not needed in AddUnit()
@@ -243,10 +333,73 @@ class Setup {
           }
         }
       }
+      const std::vector<size_t>& card_is = card_occs_[a.lhs()];
+      for (size_t i = 0; i < card_is.size() && !empty_clause_; ++i) {
+        UpdateCardinality(card_is[i], n_propagated);
+      }
+      const std::vector<size_t>& alldiff_is = alldiff_occs_[a.lhs()];
+      for (size_t i = 0; i < alldiff_is.size() && !empty_clause_; ++i) {
+        std::vector<Literal> derived;
+        empty_clause_ = !PropagateAllDifferent(alldiffs_[alldiff_is[i]], &derived);
+        for (size_t j = 0; j < derived.size() && !empty_clause_; ++j) {
+          empty_clause_ = units_.Add(derived[j]) == kInconsistent;
+        }
+      }
     }
     return empty_clause_ ? kInconsistent : r;
   }
 
+  Result AddCardinality(const Cardinality& c) {
+    assert(c.primitive());
+    units_.UnsealOriginalUnits();  // undo units_.SealOriginalUnits() called by Minimize()
+    if (empty_clause_) {
+      return kInconsistent;
+    }
+    std::vector<Literal> open;
+    const size_t n_satisfied = CountSatisfied(c, &open);
+    if (n_satisfied >= c.k()) {
+      return kSubsumed;
+    }
+    const size_t need = c.k() - n_satisfied;
+    if (need > open.size()) {
+      empty_clause_ = true;
+      return kInconsistent;
+    }
+    if (need == 1) {
+      const Clause d(open.begin(), open.end());
+      return !d.valid() ? AddClause(d) : kSubsumed;
+    }
+    StoreConstraint(c);
+    if (need == open.size()) {
+      for (const Literal a : open) {
+        if (AddUnit(a) == kInconsistent) {
+          return kInconsistent;
+        }
+      }
+    }
+    return kOk;
+  }
+
+  Result AddAllDifferent(const AllDifferent& c) {
+    assert(c.primitive());
+    units_.UnsealOriginalUnits();  // undo units_.SealOriginalUnits() called by Minimize()
+    if (empty_clause_) {
+      return kInconsistent;
+    }
+    StoreConstraint(c);
+    std::vector<Literal> derived;
+    if (!PropagateAllDifferent(c, &derived)) {
+      empty_clause_ = true;
+      return kInconsistent;
+    }
+    for (const Literal a : derived) {
+      if (AddUnit(a) == kInconsistent) {
+        return kInconsistent;
+      }
+    }
+    return kOk;
+  }
+
   bool Subsumes(const Clause& c) const {
     assert(c.ground());
     if (empty_clause_) {
@@ -266,7 +419,7 @@ class Setup {
     if (c.unit() && c.first().pos()) {
       return false;
     }
-    return ClausesSubsume(c);
+    return ClausesSubsume(c) || CardinalitiesSubsume(c) || AllDifferentsSubsume(c);
   }
 
   bool Consistent() const {
@@ -278,6 +431,14 @@ class Setup {
       const Clause c = clause(i);
       lits.insert(c.begin(), c.end());
     }
+    for (size_t i = 0; i < cards_.size(); ++i) {
+      std::vector<Literal> open;
+      OpenLiterals(i, &open);
+      lits.insert(open.begin(), open.end());
+    }
+    for (const AllDifferent& c : alldiffs_) {
+      InsertAllDifferentLiterals(c, &lits);
+    }
     return ConsistentSet(lits);
   }
 
@@ -300,13 +461,41 @@ class Setup {
         lits.insert(c.begin(), c.end());
       }
     }
+    for (size_t i = 0; i < cards_.size(); ++i) {
+      const Clause& d = cards_[i].lits();
+      if (
+#ifdef BLOOM
+          bs.PossiblyOverlaps(d.lhs_bloom()) &&
+#endif
+          std::any_of(d.begin(), d.end(), [&ts](Literal a) { return ts.find(a.lhs()) != ts.end(); })) {
+        std::vector<Literal> open;
+        OpenLiterals(i, &open);
+        lits.insert(open.begin(), open.end());
+      }
+    }
+    for (const AllDifferent& c : alldiffs_) {
+      const Term::Vector& cts = c.terms();
+      if (
+#ifdef BLOOM
+          bs.PossiblyOverlaps(c.lits().lhs_bloom()) &&
+#endif
+          std::any_of(cts.begin(), cts.end(), [&ts](Term t) { return ts.find(t) != ts.end(); })) {
+        InsertAllDifferentLiterals(c, &lits);
+      }
+    }
     return ConsistentSet(lits);
   }
 
   bool contains_empty_clause() const { return empty_clause_; }
 
   const std::unordered_set<Literal, Literal::LhsHash>& units() const { return units_.set(); }
-  const std::vector<Clause>& non_units() const { return clauses_.vec(); }
+  std::vector<Clause> non_units() const {
+    std::vector<Clause> cs;
+    for (size_t i = 0; i < clauses_.size(); ++i) {
+      cs.push_back(clauses_[i]);
+    }
+    return cs;
+  }
 
   internal::Maybe<Term> Determines(Term lhs) const {
     assert(lhs.primitive());
@@ -315,6 +504,39 @@ class Setup {
 
   ClauseRange<> clauses() const { return ClauseRange<>(empty_clause_ + units_.size() + clauses_.size()); }
 
+  const std::vector<Cardinality>& cardinalities() const { return cards_; }
+  const std::vector<AllDifferent>& all_differents() const { return alldiffs_; }
+
+  // ForEachClauseMentioning() calls f(i) for every index i >= first in
+  // clauses() of a clause with >= 2 literals that mentions t as left-hand side
+  // before unit propagation, so clause(i) may not mention t anymore.
+  // ForEachCardinalityMentioning() and ForEachAllDifferentMentioning() do the
+  // same for the indices in cardinalities() and all_differents(). They are
+  // backed by an index from terms to the clauses and constraints, so their
+  // cost is linear in the number of such occurrences of t.
+  template<typename UnaryFunction>
+  void ForEachClauseMentioning(Term t, UnaryFunction f, size_t first = 0) const {
+    const size_t offset = empty_clause_ + units_.size();
+    const std::vector<size_t>& is = clauses_.occurrences()[t];
+    for (auto it = std::lower_bound(is.begin(), is.end(), first > offset ? first - offset : 0); it != is.end(); ++it) {
+      f(offset + *it);
+    }
+  }
+
+  template<typename UnaryFunction>
+  void ForEachCardinalityMentioning(Term t, UnaryFunction f) const {
+    for (const size_t i : card_occs_[t]) {
+      f(i);
+    }
+  }
+
+  template<typename UnaryFunction>
+  void ForEachAllDifferentMentioning(Term t, UnaryFunction f) const {
+    for (const size_t i : alldiff_occs_[t]) {
+      f(i);
+    }
+  }
+
   Clause clause(size_t i) const {
     if (i == 0 && empty_clause_) {
       return Clause();
@@ -329,8 +551,25 @@ class Setup {
     return c;
   }
 
+  template<typename UnaryFunction>
+  void Traverse(UnaryFunction f) const {
+    for (size_t i = 0; i < units_.size(); ++i) {
+      units_[i].Traverse(f);
+    }
+    for (size_t i = 0; i < clauses_.size(); ++i) {
+      clauses_[i].Traverse(f);
+    }
+    for (const Cardinality& c : cards_) {
+      c.Traverse(f);
+    }
+    for (const AllDifferent& c : alldiffs_) {
+      c.Traverse(f);
+    }
+  }
+
  private:
   friend ShallowCopy;
+  friend class Snapshot;
 
   struct Watched {
     Watched() = default;
@@ -340,52 +579,143 @@ class Setup {
     Literal b;
   };
 
+  // Occurrences maps terms to the indices of the clauses or constraints that
+  // mention them as left-hand side, in ascending order.
+  class Occurrences {
+   public:
+    const std::vector<size_t>& operator[](Term t) const {
+      static const std::vector<size_t> kEmpty;
+      auto it = map_.find(t);
+      return it != map_.end() ? it->second : kEmpty;
+    }
+
+    void Add(const Clause& c, size_t i) {
+      for (const Literal a : c) {
+        std::vector<size_t>& is = map_[a.lhs()];
+        auto it = std::lower_bound(is.begin(), is.end(), i);
+        if (it == is.end() || *it != i) {
+          is.insert(it, i);
+        }
+      }
+    }
+
+    void Remove(const Clause& c, size_t i) {
+      for (const Literal a : c) {
+        auto m = map_.find(a.lhs());
+        if (m != map_.end()) {
+          std::vector<size_t>& is = m->second;
+          auto it = std::lower_bound(is.begin(), is.end(), i);
+          if (it != is.end() && *it == i) {
+            is.erase(it);
+          }
+        }
+      }
+    }
+
+   private:
+    std::unordered_map<Term, std::vector<size_t>> map_;
+  };
+
   class Clauses {
    public:
-    const Clause& operator[](size_t i) const { return clauses_[i]; }
-    Clause& operator[](size_t i) { return clauses_[i]; }
+    const Clause& operator[](size_t i) const { return i < refs_.size() ? *refs_[i] : clauses_[i - refs_.size()]; }
+
+    // Unlike operator[], which only reads, this copies referenced clauses.
+    Clause& mutable_clause(size_t i) {
+      if (i < refs_.size()) {
+        Materialize();
+      }
+      return clauses_[i - refs_.size()];
+    }
 
     Watched watched(size_t i) const { return watched_[i]; }
     Watched& watched(size_t i) { return watched_[i]; }
 
     void Add(const Clause& c) {
       assert(c.size() >= 2);
+      occs_.Add(c, size());
       watched_.push_back(Watched(c.first(), c.last()));
       clauses_.push_back(c);
     }
 
     void Add(Clause&& c) {
       assert(c.size() >= 2);
+      occs_.Add(c, size());
       watched_.push_back(Watched(c.first(), c.last()));
       clauses_.push_back(std::forward<Clause>(c));
     }
 
+    void Reference(const Clause* c) {
+      assert(c->size() >= 2);
+      assert(clauses_.empty());
+      occs_.Add(*c, size());
+      watched_.push_back(Watched(c->first(), c->last()));
+      refs_.push_back(c);
+    }
+
     void Watch(size_t i, Literal a, Literal b) {
       assert(a < b);
       watched_[i] = Watched(a, b);
     }
 
     size_t size() const {
-      assert(clauses_.size() == watched_.size());
-      return clauses_.size();
+      assert(refs_.size() + clauses_.size() == watched_.size());
+      return watched_.size();
     }
 
-    void Erase(size_t i) {
-      std::swap(clauses_[i], clauses_.back());
-      std::swap(watched_[i], watched_.back());
-      Resize(clauses_.size() - 1);
+    size_t n_references() const { return refs_.size(); }
+
+    const Occurrences& occurrences() const { return occs_; }
+
+    // Removes and returns the i-th clause, whose place the last one takes.
+    Clause Erase(size_t i) {
+      const size_t last = size() - 1;
+      occs_.Remove((*this)[i], i);
+      if (i != last) {
+        occs_.Remove((*this)[last], last);
+        occs_.Add((*this)[last], i);
+      }
+      Clause c = std::move(mutable_clause(i));
+      if (i != last) {
+        clauses_[i] = std::move(clauses_.back());
+        watched_[i] = watched_.back();
+      }
+      clauses_.pop_back();
+      watched_.pop_back();
+      return c;
     }
 
     void Resize(size_t n) {
-      clauses_.resize(n);
+      for (size_t i = size(); i > n; --i) {
+        occs_.Remove((*this)[i - 1], i - 1);
+      }
+      if (n < refs_.size()) {
+        refs_.resize(n);
+        clauses_.clear();
+      } else {
+        clauses_.resize(n - refs_.size());
+      }
       watched_.resize(n);
     }
 
-    const std::vector<Clause>& vec() const { return clauses_; }
+    void Materialize() {
+      if (!refs_.empty()) {
+        std::vector<Clause> cs;
+        cs.reserve(size());
+        for (const Clause* c : refs_) {
+          cs.push_back(*c);
+        }
+        std::move(clauses_.begin(), clauses_.end(), std::back_inserter(cs));
+        clauses_ = std::move(cs);
+        refs_.clear();
+      }
+    }
 
    private:
+    std::vector<const Clause*> refs_;  // clauses of a base setup or snapshot, which precede clauses_
     std::vector<Clause> clauses_;
     std::vector<Watched> watched_;
+    Occurrences occs_;
   };
 
   class Units {
@@ -398,6 +728,20 @@ class Setup {
     }
 
     Result Add(Literal a) {
+      const Result r = Check(a);
+      if (r != kOk) {
+        return r;
+      }
+      assert(set_.find(a) == set_.end());
+      assert(std::find(vec_.begin(), vec_.end(), a) == vec_.end());
+      set_.insert(a);
+      vec_.push_back(a);
+      return kOk;
+    }
+
+    // Returns kInconsistent if a is falsified by a unit, kSubsumed if a is
+    // satisfied by a unit, and kOk otherwise.
+    Result Check(Literal a) const {
       const auto orig_end = vec_.begin() + n_orig_;
       const auto orig_begin = std::lower_bound(vec_.begin(), orig_end, Literal::Min(a.lhs()));
       for (auto it = orig_begin; it != orig_end && a.lhs() == it->lhs(); ++it) {
@@ -419,10 +763,6 @@ class Setup {
           }
         }
       }
-      assert(set_.find(a) == set_.end());
-      assert(std::find(vec_.begin(), vec_.end(), a) == vec_.end());
-      set_.insert(a);
-      vec_.push_back(a);
       return kOk;
     }
 
@@ -478,8 +818,20 @@ class Setup {
       return internal::Nothing;
     }
 
+    // Replaces the units by vec, whose first n_orig units are sorted and
+    // sealed.
+    void Restore(std::vector<Literal>&& vec, size_t n_orig) {
+      assert(n_orig <= vec.size());
+      assert(std::is_sorted(vec.begin(), vec.begin() + n_orig));
+      vec_ = std::move(vec);
+      n_orig_ = n_orig;
+      set_.clear();
+      set_.insert(vec_.begin() + n_orig_, vec_.end());
+    }
+
     const std::vector<Literal>&                          vec() const { return vec_; }
     const std::unordered_set<Literal, Literal::LhsHash>& set() const { return set_; }
+    size_t                                               n_orig() const { return n_orig_; }
 
    private:
     std::vector<Literal> vec_;
@@ -487,6 +839,61 @@ class Setup {
     size_t n_orig_ = 0;
   };
 
+  // Cardinality constraints keep track of how many of their literals the
+  // units satisfy or falsify. decided[j] says whether the j-th literal is one
+  // of them.
+  struct CardinalityState {
+    std::vector<bool> decided;
+    size_t n_satisfied = 0;
+    size_t n_falsified = 0;
+  };
+
+  // CardinalityDecision records that the unit-th unit decided the lit-th
+  // literal of the card-th cardinality constraint, so that ResizeUnits() can
+  // undo it along with the unit.
+  struct CardinalityDecision {
+    CardinalityDecision(size_t unit, size_t card, size_t lit, bool satisfied)
+        : unit(unit), card(card), lit(lit), satisfied(satisfied) {}
+
+    size_t unit;
+    size_t card;
+    size_t lit;
+    bool satisfied;
+  };
+
+  void StoreConstraint(const Cardinality& c) {
+    CardinalityState s;
+    s.decided.resize(c.lits().size());
+    for (size_t j = 0; j < c.lits().size(); ++j) {
+      switch (units_.Check(c.lits()[j])) {
+        case kSubsumed:     s.decided[j] = true; ++s.n_satisfied; break;
+        case kInconsistent: s.decided[j] = true; ++s.n_falsified; break;
+        case kOk:           break;
+      }
+    }
+    card_occs_.Add(c.lits(), cards_.size());
+    cards_.push_back(c);
+    card_states_.push_back(std::move(s));
+  }
+
+  void StoreConstraint(const AllDifferent& c) {
+    alldiff_occs_.Add(c.lits(), alldiffs_.size());
+    alldiffs_.push_back(c);
+  }
+
+  void ResizeConstraints(size_t n_cards, size_t n_alldiffs) {
+    for (size_t i = cards_.size(); i > n_cards; --i) {
+      card_occs_.Remove(cards_[i - 1].lits(), i - 1);
+    }
+    for (size_t i = alldiffs_.size(); i > n_alldiffs; --i) {
+      alldiff_occs_.Remove(alldiffs_[i - 1].lits(), i - 1);
+    }
+    assert(card_trail_.empty() || card_trail_.back().card < n_cards);
+    cards_.erase(cards_.begin() + n_cards, cards_.end());
+    card_states_.erase(card_states_.begin() + n_cards, card_states_.end());
+    alldiffs_.erase(alldiffs_.begin() + n_alldiffs, alldiffs_.end());
+  }
+
   bool ClausesSubsume(const Clause& d) const {
     assert(d.size() >= 1 && (d.size() >= 2 || !d.first().pos()));
     for (size_t i = 0; i < clauses_.size(); ++i) {
@@ -501,6 +908,290 @@ class Setup {
     return false;
   }
 
+  // Returns the number of literals of c that are satisfied by the units and
+  // collects in open those that are neither satisfied nor falsified.
+  size_t CountSatisfied(const Cardinality& c, std::vector<Literal>* open) const {
+    size_t n_satisfied = 0;
+    for (const Literal a : c.lits()) {
+      switch (units_.Check(a)) {
+        case kSubsumed:     ++n_satisfied; break;
+        case kOk:           open->push_back(a); break;
+        case kInconsistent: break;
+      }
+    }
+    return n_satisfied;
+  }
+
+  // Like CountSatisfied(), but for the i-th cardinality constraint, whose
+  // counters are up to date once AddUnit() has processed all units.
+  size_t OpenLiterals(size_t i, std::vector<Literal>* open) const {
+    const Clause& lits = cards_[i].lits();
+    const CardinalityState& s = card_states_[i];
+    for (size_t j = 0; j < lits.size(); ++j) {
+      if (!s.decided[j]) {
+        open->push_back(lits[j]);
+      }
+    }
+    return s.n_satisfied;
+  }
+
+  // Counts the literals of the i-th cardinality constraint that the u-th unit
+  // decides. As the literals are sorted, those with the unit's left-hand side
+  // form a range.
+  void UpdateCardinality(size_t i, size_t u) {
+    const Literal a = units_[u];
+    const Clause& lits = cards_[i].lits();
+    CardinalityState& s = card_states_[i];
+    bool changed = false;
+    for (size_t j = std::lower_bound(lits.begin(), lits.end(), Literal::Min(a.lhs())) - lits.begin();
+         j < lits.size() && lits[j].lhs() == a.lhs(); ++j) {
+      if (s.decided[j]) {
+        continue;
+      }
+      const bool satisfied = a.Subsumes(lits[j]);
+      if (satisfied || Literal::Complementary(a, lits[j])) {
+        s.decided[j] = true;
+        ++(satisfied ? s.n_satisfied : s.n_falsified);
+        card_trail_.push_back(CardinalityDecision(u, i, j, satisfied));
+        changed = true;
+      }
+    }
+    if (changed) {
+      PropagateCardinality(i);
+    }
+  }
+
+  void PropagateCardinality(size_t i) {
+    const Cardinality& c = cards_[i];
+    const CardinalityState& s = card_states_[i];
+    if (s.n_satisfied >= c.k()) {
+      return;
+    }
+    const size_t need = c.k() - s.n_satisfied;
+    const size_t n_open = c.lits().size() - s.n_satisfied - s.n_falsified;
+    if (need > n_open) {
+      empty_clause_ = true;
+    } else if (need == n_open) {
+      for (size_t j = 0; j < s.decided.size() && !empty_clause_; ++j) {
+        if (!s.decided[j]) {
+          empty_clause_ = units_.Add(c.lits()[j]) == kInconsistent;
+        }
+      }
+    }
+  }
+
+  // Removes the units from the n-th on and undoes their decisions in the
+  // cardinality constraints.
+  void ResizeUnits(size_t n) {
+    for (; !card_trail_.empty() && card_trail_.back().unit >= n; card_trail_.pop_back()) {
+      const CardinalityDecision& d = card_trail_.back();
+      CardinalityState& s = card_states_[d.card];
+      s.decided[d.lit] = false;
+      --(d.satisfied ? s.n_satisfied : s.n_falsified);
+    }
+    units_.Resize(n);
+  }
+
+  // A constraint that needs k more of its n open literals stands for the
+  // clauses of n-k+1 open literals. One of these subsumes d iff n-k+1 open
+  // literals subsume a literal of d.
+  bool CardinalitiesSubsume(const Clause& d) const {
+    for (size_t i = 0; i < cards_.size(); ++i) {
+      const Cardinality& c = cards_[i];
+#ifdef BLOOM
+      if (!c.lits().lhs_bloom().PossiblyOverlaps(d.lhs_bloom())) {
+        continue;
+      }
+#endif
+      std::vector<Literal> open;
+      const size_t n_satisfied = OpenLiterals(i, &open);
+      if (n_satisfied >= c.k()) {
+        continue;
+      }
+      const size_t need = c.k() - n_satisfied;
+      const size_t n_subsuming = std::count_if(open.begin(), open.end(), [&d](Literal a) {
+        return Clause::Subsumes(a, d);
+      });
+      if (n_subsuming + need > open.size()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns for every term t and name n of c (in row-major order) whether the
+  // units satisfy t = n (kSubsumed), falsify it (kInconsistent), or neither
+  // (kOk).
+  std::vector<Result> Status(const AllDifferent& c) const {
+    std::vector<Result> status;
+    status.reserve(c.terms().size() * c.names().size());
+    for (const Term t : c.terms()) {
+      for (const Term n : c.names()) {
+        status.push_back(units_.Check(Literal::Eq(t, n)));
+      }
+    }
+    return status;
+  }
+
+  // Collects in derived the units that follow from c and returns false iff c
+  // cannot be satisfied anymore.
+  bool PropagateAllDifferent(const AllDifferent& c, std::vector<Literal>* derived) const {
+    const Term::Vector& ts = c.terms();
+    const Term::Vector& ns = c.names();
+    std::vector<Result> status = Status(c);
+    auto at = [&status, &ns](size_t i, size_t j) -> Result& { return status[i * ns.size() + j]; };
+    // A name that is taken by a term is excluded for all other terms.
+    for (size_t i = 0; i < ts.size(); ++i) {
+      for (size_t j = 0; j < ns.size(); ++j) {
+        if (at(i, j) != kSubsumed) {
+          continue;
+        }
+        for (size_t ii = 0; ii < ts.size(); ++ii) {
+          if (ii != i && at(ii, j) == kSubsumed) {
+            return false;
+          } else if (ii != i && at(ii, j) == kOk) {
+            at(ii, j) = kInconsistent;
+            derived->push_back(Literal::Neq(ts[ii], ns[j]));
+          }
+        }
+      }
+    }
+    // A term with a single remaining name takes it. The terms without a name
+    // need as many remaining names.
+    size_t n_unassigned = 0;
+    std::vector<bool> remaining(ns.size(), false);
+    for (size_t i = 0; i < ts.size(); ++i) {
+      size_t n_open = 0;
+      size_t last_open = 0;
+      bool assigned = false;
+      for (size_t j = 0; j < ns.size(); ++j) {
+        assigned |= at(i, j) == kSubsumed;
+        if (at(i, j) == kOk) {
+          ++n_open;
+          last_open = j;
+          remaining[j] = true;
+        }
+      }
+      if (assigned) {
+        continue;
+      }
+      ++n_unassigned;
+      if (n_open == 0) {
+        return false;
+      } else if (n_open == 1) {
+        derived->push_back(Literal::Eq(ts[i], ns[last_open]));
+      }
+    }
+    if (static_cast<size_t>(std::count(remaining.begin(), remaining.end(), true)) < n_unassigned) {
+      return false;
+    }
+    // With as many names as terms, a name with a single remaining term is
+    // taken by it.
+    if (c.permutation()) {
+      for (size_t j = 0; j < ns.size(); ++j) {
+        size_t n_possible = 0;
+        size_t last_possible = 0;
+        for (size_t i = 0; i < ts.size(); ++i) {
+          if (at(i, j) != kInconsistent) {
+            ++n_possible;
+            last_possible = i;
+          }
+        }
+        if (n_possible == 0) {
+          return false;
+        } else if (n_possible == 1 && at(last_possible, j) == kOk) {
+          derived->push_back(Literal::Eq(ts[last_possible], ns[j]));
+        }
+      }
+    }
+    return true;
+  }
+
+  // Checks the clauses c stands for, restricted to the literals that are not
+  // falsified by the units, except for those satisfied by the units.
+  bool AllDifferentsSubsume(const Clause& d) const {
+    for (const AllDifferent& c : alldiffs_) {
+#ifdef BLOOM
+      if (!c.lits().lhs_bloom().PossiblyOverlaps(d.lhs_bloom())) {
+        continue;
+      }
+#endif
+      const Term::Vector& ts = c.terms();
+      const Term::Vector& ns = c.names();
+      auto in_c = [&ts](Term t) { return std::binary_search(ts.begin(), ts.end(), t); };
+      if (!d.any([&in_c](Literal a) { return in_c(a.lhs()); })) {
+        continue;
+      }
+      // [t != n v t' != n]
+      for (auto it = d.begin(); it != d.end(); ++it) {
+        if (!it->pos() && in_c(it->lhs()) &&
+            std::any_of(std::next(it), d.end(), [&in_c, it](Literal b) {
+              return !b.pos() && b.rhs() == it->rhs() && b.lhs() != it->lhs() && in_c(b.lhs());
+            })) {
+          return true;
+        }
+      }
+      const std::vector<Result> status = Status(c);
+      auto at = [&status, &ns](size_t i, size_t j) { return status[i * ns.size() + j]; };
+      auto subsumes = [&d](Literal a) { return Clause::Subsumes(a, d); };
+      // [t = n1 v ... v t = nM]
+      for (size_t i = 0; i < ts.size(); ++i) {
+        bool satisfied = false;
+        bool all_subsume = true;
+        for (size_t j = 0; j < ns.size() && !satisfied && all_subsume; ++j) {
+          satisfied = at(i, j) == kSubsumed;
+          all_subsume = at(i, j) != kOk || subsumes(Literal::Eq(ts[i], ns[j]));
+        }
+        if (!satisfied && all_subsume) {
+          return true;
+        }
+      }
+      // [t1 = n v ... v tK = n]
+      if (c.permutation()) {
+        for (size_t j = 0; j < ns.size(); ++j) {
+          bool satisfied = false;
+          bool all_subsume = true;
+          for (size_t i = 0; i < ts.size() && !satisfied && all_subsume; ++i) {
+            satisfied = at(i, j) == kSubsumed;
+            all_subsume = at(i, j) != kOk || subsumes(Literal::Eq(ts[i], ns[j]));
+          }
+          if (!satisfied && all_subsume) {
+            return true;
+          }
+        }
+      }
+    }
+    return false;
+  }
+
+  // Inserts into lits the literals t = n of c that are not falsified by the
+  // units, and t' != n for every other term t' of c for each of them and for
+  // every t = n already in lits. Then lits is consistent only if no name is
+  // assigned to two terms of c.
+  void InsertAllDifferentLiterals(const AllDifferent& c, std::unordered_set<Literal, Literal::LhsHash>* lits) const {
+    const Term::Vector& ts = c.terms();
+    const Term::Vector& ns = c.names();
+    const std::vector<Result> status = Status(c);
+    for (size_t i = 0; i < ts.size(); ++i) {
+      for (size_t j = 0; j < ns.size(); ++j) {
+        if (status[i * ns.size() + j] != kInconsistent) {
+          lits->insert(Literal::Eq(ts[i], ns[j]));
+        }
+      }
+    }
+    std::vector<Literal> neqs;
+    for (const Literal a : *lits) {
+      if (a.pos() && std::binary_search(ts.begin(), ts.end(), a.lhs())) {
+        for (const Term t : ts) {
+          if (t != a.lhs()) {
+            neqs.push_back(Literal::Neq(t, a.rhs()));
+          }
+        }
+      }
+    }
+    lits->insert(neqs.begin(), neqs.end());
+  }
+
   static bool ConsistentSet(const std::unordered_set<Literal, Literal::LhsHash>& lits) {
     for (const Literal a : lits) {
       assert(lits.bucket_count() > 0);
@@ -522,7 +1213,7 @@ class Setup {
     assert(n_clauses + n_units > 0 || saved_ == 0);
     if (empty_clause_) {
       clauses_.Resize(n_clauses);
-      units_.Resize(n_units);
+      ResizeUnits(n_units);
       return;
     }
     for (size_t i = n_units; i < units_.size(); ++i) {
@@ -534,13 +1225,11 @@ class Setup {
       }
     }
     for (size_t i = clauses_.size(); i > n_clauses; --i) {
-      Clause c;
-      std::swap(c, clauses_[i - 1]);
+      Clause c = clauses_.Erase(i - 1);
       c.PropagateUnits(units_.set());
       assert(!c.empty());
       assert(c.size() >= 2 ||
              any_of(units_.vec().begin(), units_.vec().end(), [&c](Literal a) { return a.Subsumes(c.first()); }));
-      clauses_.Erase(i - 1);
       if (c.size() >= 2 && !Subsumes(c)) {
         clauses_.Add(c);
       }
@@ -550,6 +1239,12 @@ class Setup {
   bool empty_clause_ = false;
   Units units_;
   Clauses clauses_;
+  std::vector<Cardinality> cards_;
+  std::vector<AllDifferent> alldiffs_;
+  std::vector<CardinalityState> card_states_;
+  std::vector<CardinalityDecision> card_trail_;
+  Occurrences card_occs_;
+  Occurrences alldiff_occs_;
 #ifndef NDEBUG
   mutable size_t saved_ = 0;
 #endif
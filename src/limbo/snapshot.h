@@ -0,0 +1,1058 @@
+// vim:filetype=cpp:textwidth=120:shiftwidth=2:softtabstop=2:expandtab
+// Copyright 2017 Christoph Schwering
+// Licensed under the MIT license. See LICENSE file in the project root.
+//
+// A Snapshot is a binary image of a Solver or a KnowledgeBase together with
+// the Symbol::Factory and Term::Factory they work on. Loading a snapshot
+// restores that state without parsing and grounding: the term table is
+// rebuilt slot by slot so that every term keeps its id, and hence the
+// ungrounded clauses, the names, the lhs-rhs index, and the minimized setups
+// of the grounders can be copied back as they are.
+//
+// Save() consolidates the grounders first, so no Grounder::Undo may be alive.
+// Load() expects fresh factories and a Solver or KnowledgeBase that has been
+// constructed with them and not been used; it returns false if the input is
+// not a snapshot of this kind, was written by another version of the format
+// or on a machine with different byte order, or is corrupt, in which case the
+// factories and the Solver or KnowledgeBase are in an unspecified state.
+//
+// Settings such as the thread pool, symmetry pruning, promotion, and budgets
+// are not part of a snapshot, nor are the lemmas of a Solver.
+//
+// A snapshot starts with a fixed-size header, which consists of a magic
+// number, the format version kVersion, the kind of the snapshot, a byte order
+// mark, the length of the payload, and its checksum. Integers in the payload
+// are variable-length encoded, and clauses are copied as the arrays of
+// literals they are in memory.
+//
+// SaveShared() and LoadShared() are meant for several worker processes that
+// start from the same knowledge. SaveShared() additionally stores the clauses
+// of the grounded setups that fit into a Clause object without heap-allocated
+// literals, which typically are most clauses, as an array of Clause objects.
+// LoadShared() loads the snapshot from a Mapping of the file, and the setups
+// reference these clauses in the mapped pages instead of copying them, so all
+// workers share one copy in memory. Like the setups of Grounder plies, they
+// add their own clauses and units on top; only Minimize() and thus
+// Grounder::Consolidate() copy the referenced clauses. The term table and
+// the units of the setups are still loaded into every process. The Mapping
+// must outlive the Solver or KnowledgeBase, and the clause array depends on
+// the memory layout of Clause, so such a snapshot is only loaded by a program
+// built with the same compiler and with BLOOM set alike.
+
+#ifndef LIMBO_SNAPSHOT_H_
+#define LIMBO_SNAPSHOT_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstring>
+
+#include <algorithm>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <limbo/all_different.h>
+#include <limbo/cardinality.h>
+#include <limbo/clause.h>
+#include <limbo/formula.h>
+#include <limbo/grounder.h>
+#include <limbo/kb.h>
+#include <limbo/literal.h>
+#include <limbo/setup.h>
+#include <limbo/solver.h>
+#include <limbo/term.h>
+
+#include <limbo/internal/ints.h>
+
+namespace limbo {
+
+class Snapshot {
+ public:
+  typedef internal::size_t size_t;
+  typedef internal::u8 u8;
+  typedef internal::u32 u32;
+  typedef internal::u64 u64;
+
+  static constexpr u32 kMagic = 0x4f424d4c;  // "LMBO" in little endian
+  static constexpr u32 kVersion = 1;
+
+  static void Save(Symbol::Factory* sf, Term::Factory* tf, Solver* solver, std::ostream* os) {
+    Save(kSolver, sf, tf, solver, os);
+  }
+
+  static void Save(Symbol::Factory* sf, Term::Factory* tf, KnowledgeBase* kb, std::ostream* os) {
+    Save(kKnowledgeBase, sf, tf, kb, os);
+  }
+
+  static bool Load(std::istream* is, Symbol::Factory* sf, Term::Factory* tf, Solver* solver) {
+    return Load(kSolver, is, sf, tf, solver);
+  }
+
+  static bool Load(std::istream* is, Symbol::Factory* sf, Term::Factory* tf, KnowledgeBase* kb) {
+    return Load(kKnowledgeBase, is, sf, tf, kb);
+  }
+
+  // A Mapping maps a file read-only into memory, where the pages are shared
+  // with other processes that map the same file.
+  class Mapping {
+   public:
+    explicit Mapping(const std::string& path) {
+      const int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return;
+      }
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+          data_ = static_cast<const char*>(p);
+          size_ = st.st_size;
+        }
+      }
+      close(fd);
+    }
+
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+    Mapping(Mapping&&) = delete;
+    Mapping& operator=(Mapping&&) = delete;
+
+    ~Mapping() {
+      if (data_) {
+        munmap(const_cast<char*>(data_), size_);
+      }
+    }
+
+    bool ok() const { return data_; }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+   private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+  };
+
+  static void SaveShared(Symbol::Factory* sf, Term::Factory* tf, Solver* solver, std::ostream* os) {
+    SaveShared(kSolver, sf, tf, solver, os);
+  }
+
+  static void SaveShared(Symbol::Factory* sf, Term::Factory* tf, KnowledgeBase* kb, std::ostream* os) {
+    SaveShared(kKnowledgeBase, sf, tf, kb, os);
+  }
+
+  static bool LoadShared(const Mapping& m, Symbol::Factory* sf, Term::Factory* tf, Solver* solver) {
+    return LoadShared(kSolver, m, sf, tf, solver);
+  }
+
+  static bool LoadShared(const Mapping& m, Symbol::Factory* sf, Term::Factory* tf, KnowledgeBase* kb) {
+    return LoadShared(kKnowledgeBase, m, sf, tf, kb);
+  }
+
+ private:
+  enum Kind : u32 { kSolver = 1, kKnowledgeBase = 2, kShared = 4 };
+
+  static constexpr u32 kByteOrderMark = 0x01020304;
+  static constexpr u64 kChunkSize = 1 << 20;
+#ifdef BLOOM
+  static constexpr u32 kBloom = 1;
+#else
+  static constexpr u32 kBloom = 0;
+#endif
+
+  struct Header {
+    u32 magic;
+    u32 version;
+    u32 kind;
+    u32 byte_order_mark;
+    u64 payload_size;
+    u64 checksum;
+  };
+
+  // In shared snapshots, the Header is followed by a SharedHeader, the array
+  // of shared clauses, and then the payload.
+  struct SharedHeader {
+    u32 clause_size;
+    u32 bloom;
+    u64 n_clauses;
+  };
+
+  static constexpr size_t kSharedClausesOffset = sizeof(Header) + sizeof(SharedHeader);
+  static_assert(kSharedClausesOffset % alignof(Clause) == 0, "shared clauses are misaligned");
+
+  class Writer {
+   public:
+    explicit Writer(bool shared = false) : shared_(shared) {}
+
+    bool shared() const { return shared_; }
+
+    void PutInt(u64 x) {
+      for (; x >= 0x80; x >>= 7) {
+        buf_.push_back(static_cast<char>((x & 0x7f) | 0x80));
+      }
+      buf_.push_back(static_cast<char>(x));
+    }
+
+    void PutBool(bool b) { PutInt(b); }
+
+    void PutTerm(Term t) { PutInt(t.id()); }
+
+    template<typename InputIt>
+    void PutTerms(InputIt first, InputIt last) {
+      PutInt(std::distance(first, last));
+      for (; first != last; ++first) {
+        PutTerm(*first);
+      }
+    }
+
+    void PutLiteral(Literal a) { PutBytes(&a.data_, sizeof(a.data_)); }
+
+    void PutLiterals(const std::vector<Literal>& as) {
+      PutInt(as.size());
+      PutBytes(as.data(), as.size() * sizeof(Literal));
+    }
+
+    void PutClause(const Clause& c) {
+      PutInt(c.size_);
+      PutBytes(c.lits1_, c.size1() * sizeof(Literal));
+      PutBytes(c.lits2_.get(), c.size2() * sizeof(Literal));
+    }
+
+    void PutCardinality(const Cardinality& c) {
+      PutInt(c.k());
+      PutClause(c.lits());
+    }
+
+    void PutAllDifferent(const AllDifferent& c) {
+      PutTerms(c.terms().begin(), c.terms().end());
+      PutTerms(c.names().begin(), c.names().end());
+    }
+
+    void PutFormula(const Formula& alpha) {
+      PutInt(alpha.type());
+      switch (alpha.type()) {
+        case Formula::kAtomic:
+          PutClause(alpha.as_atomic().arg());
+          break;
+        case Formula::kNot:
+          PutFormula(alpha.as_not().arg());
+          break;
+        case Formula::kOr:
+          PutFormula(alpha.as_or().lhs());
+          PutFormula(alpha.as_or().rhs());
+          break;
+        case Formula::kExists:
+          PutTerm(alpha.as_exists().x());
+          PutFormula(alpha.as_exists().arg());
+          break;
+        case Formula::kKnow:
+          PutInt(alpha.as_know().k());
+          PutFormula(alpha.as_know().arg());
+          break;
+        case Formula::kCons:
+          PutInt(alpha.as_cons().k());
+          PutFormula(alpha.as_cons().arg());
+          break;
+        case Formula::kBel:
+          PutInt(alpha.as_bel().k());
+          PutInt(alpha.as_bel().l());
+          PutFormula(alpha.as_bel().antecedent());
+          PutFormula(alpha.as_bel().consequent());
+          PutFormula(alpha.as_bel().not_antecedent_or_consequent());
+          break;
+        case Formula::kGuarantee:
+          PutFormula(alpha.as_guarantee().arg());
+          break;
+      }
+    }
+
+    // Appends a copy of c, whose literals must all be stored in the Clause
+    // object itself, to the shared clauses.
+    void PutSharedClause(const Clause& c) {
+      assert(shared_ && c.size2() == 0);
+      alignas(Clause) char record[sizeof(Clause)] = {};
+      Clause* d = new (record) Clause(c);
+      shared_clauses_.append(record, sizeof(record));
+      d->~Clause();
+    }
+
+    const std::string& buffer() const { return buf_; }
+    const std::string& shared_clauses() const { return shared_clauses_; }
+    size_t n_shared_clauses() const { return shared_clauses_.size() / sizeof(Clause); }
+
+   private:
+    void PutBytes(const void* p, size_t n) {
+      if (n > 0) {
+        buf_.append(static_cast<const char*>(p), n);
+      }
+    }
+
+    const bool shared_;
+    std::string buf_;
+    std::string shared_clauses_;
+  };
+
+  // A Reader never reads beyond the payload and checks that every term it
+  // reads exists in the Term::Factory. Once it has encountered malformed data,
+  // ok() is false, and all further reads yield zeros, null terms, and empty
+  // clauses.
+  class Reader {
+   public:
+    Reader(const char* data, size_t size, const Term::Factory* tf) : data_(data), size_(size), tf_(tf) {}
+
+    bool ok() const { return ok_; }
+    bool at_end() const { return pos_ == size_; }
+
+    bool shared() const { return shared_clauses_; }
+    void set_shared_clauses(const Clause* clauses, size_t n) {
+      shared_clauses_ = clauses;
+      n_shared_clauses_ = n;
+    }
+
+    // Returns the n shared clauses from index first on.
+    const Clause* GetSharedClauses(size_t first, size_t n) {
+      if (!ok_ || !shared_clauses_ || first > n_shared_clauses_ || n > n_shared_clauses_ - first) {
+        Fail();
+        return nullptr;
+      }
+      return shared_clauses_ + first;
+    }
+
+    bool Fail() {
+      ok_ = false;
+      return false;
+    }
+
+    u64 GetInt() {
+      u64 x = 0;
+      for (size_t shift = 0; ok_ && pos_ < size_ && shift < 64; shift += 7) {
+        const u8 b = static_cast<u8>(data_[pos_++]);
+        x |= static_cast<u64>(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+          return x;
+        }
+      }
+      Fail();
+      return 0;
+    }
+
+    // Reads the number of elements that follow, each of which occupies at
+    // least min_bytes.
+    size_t GetSize(size_t min_bytes = 1) {
+      const u64 n = GetInt();
+      if (n > (size_ - pos_) / min_bytes) {
+        Fail();
+        return 0;
+      }
+      return n;
+    }
+
+    bool GetBool() { return GetInt() != 0; }
+
+    Term GetTerm() {
+      const u64 id = GetInt();
+      if (!ok_ || !Contains(tf_, id)) {
+        Fail();
+        return Term();
+      }
+      return Term(static_cast<u32>(id));
+    }
+
+    Term::Vector GetTerms() {
+      Term::Vector ts(GetSize());
+      for (Term& t : ts) {
+        t = GetTerm();
+      }
+      return ok_ ? ts : Term::Vector();
+    }
+
+    Literal GetLiteral() {
+      Literal a;
+      a.data_ = 0;
+      if (GetBytes(&a.data_, sizeof(a.data_)) && !Check(a)) {
+        Fail();
+        a.data_ = 0;
+      }
+      return a;
+    }
+
+    std::vector<Literal> GetLiterals() {
+      std::vector<Literal> as(GetSize(sizeof(Literal)));
+      if (!GetBytes(as.data(), as.size() * sizeof(Literal)) ||
+          !std::all_of(as.begin(), as.end(), [this](Literal a) { return Check(a); })) {
+        Fail();
+        as.clear();
+      }
+      return as;
+    }
+
+    // The literals are copied right into the clause. They were stored
+    // minimized, so only their order needs to be checked.
+    Clause GetClause() {
+      Clause c(GetSize(sizeof(Literal)));
+      if (!GetBytes(c.lits1_, c.size1() * sizeof(Literal)) ||
+          !GetBytes(c.lits2_.get(), c.size2() * sizeof(Literal))) {
+        return Clause();
+      }
+      for (size_t i = 0; i < c.size(); ++i) {
+        if (!Check(c[i]) || c[i].invalid() || (i > 0 && !(c[i-1] < c[i]))) {
+          Fail();
+          return Clause();
+        }
+      }
+#ifdef BLOOM
+      c.InitBloom();
+#endif
+      return c;
+    }
+
+    Cardinality GetCardinality() {
+      const size_t k = GetInt();
+      const Clause c = GetClause();
+      if (!c.primitive()) {
+        Fail();
+      }
+      return Cardinality::AtLeast(k, c);
+    }
+
+    AllDifferent GetAllDifferent() {
+      const Term::Vector ts = GetTerms();
+      const Term::Vector ns = GetTerms();
+      if (!ok_ ||
+          !std::all_of(ts.begin(), ts.end(), [](Term t) { return t.primitive(); }) ||
+          !std::all_of(ns.begin(), ns.end(), [](Term n) { return n.name(); })) {
+        Fail();
+        return AllDifferent();
+      }
+      return AllDifferent(ts.begin(), ts.end(), ns.begin(), ns.end());
+    }
+
+    // Returns nullptr if the formula is malformed.
+    Formula::Ref GetFormula() {
+      const u64 type = GetInt();
+      if (!ok_) {
+        return nullptr;
+      }
+      switch (type) {
+        case Formula::kAtomic: {
+          const Clause c = GetClause();
+          return ok_ ? Formula::Factory::Atomic(c) : nullptr;
+        }
+        case Formula::kNot: {
+          Formula::Ref alpha = GetFormula();
+          return alpha ? Formula::Factory::Not(std::move(alpha)) : nullptr;
+        }
+        case Formula::kOr: {
+          Formula::Ref alpha = GetFormula();
+          Formula::Ref beta = GetFormula();
+          return alpha && beta ? Formula::Factory::Or(std::move(alpha), std::move(beta)) : nullptr;
+        }
+        case Formula::kExists: {
+          const Term x = GetTerm();
+          Formula::Ref alpha = GetFormula();
+          return alpha && x.variable() ? Formula::Factory::Exists(x, std::move(alpha)) : nullptr;
+        }
+        case Formula::kKnow: {
+          const Formula::belief_level k = GetInt();
+          Formula::Ref alpha = GetFormula();
+          return alpha ? Formula::Factory::Know(k, std::move(alpha)) : nullptr;
+        }
+        case Formula::kCons: {
+          const Formula::belief_level k = GetInt();
+          Formula::Ref alpha = GetFormula();
+          return alpha ? Formula::Factory::Cons(k, std::move(alpha)) : nullptr;
+        }
+        case Formula::kBel: {
+          const Formula::belief_level k = GetInt();
+          const Formula::belief_level l = GetInt();
+          Formula::Ref alpha = GetFormula();
+          Formula::Ref beta = GetFormula();
+          Formula::Ref not_alpha_or_beta = GetFormula();
+          if (!alpha || !beta || !not_alpha_or_beta) {
+            return nullptr;
+          }
+          return Formula::Factory::Bel(k, l, std::move(alpha), std::move(beta), std::move(not_alpha_or_beta));
+        }
+        case Formula::kGuarantee: {
+          Formula::Ref alpha = GetFormula();
+          return alpha ? Formula::Factory::Guarantee(std::move(alpha)) : nullptr;
+        }
+      }
+      Fail();
+      return nullptr;
+    }
+
+   private:
+    bool GetBytes(void* p, size_t n) {
+      if (!ok_ || n > size_ - pos_) {
+        return Fail();
+      }
+      if (n > 0) {
+        std::memcpy(p, data_ + pos_, n);
+        pos_ += n;
+      }
+      return true;
+    }
+
+    bool Check(Literal a) const { return Contains(tf_, a.lhs().id()) && Contains(tf_, a.rhs().id()); }
+
+    const char* const data_;
+    const size_t size_;
+    const Term::Factory* const tf_;
+    size_t pos_ = 0;
+    bool ok_ = true;
+    const Clause* shared_clauses_ = nullptr;
+    size_t n_shared_clauses_ = 0;
+  };
+
+  static u64 Checksum(const char* data, size_t size) {
+    constexpr u64 kOffsetBasis = 0xcbf29ce484222325;
+    constexpr u64 kMagicPrime = 0x00000100000001b3;
+    u64 h = kOffsetBasis;
+    for (size_t i = 0; i < size; ++i) {
+      h ^= static_cast<u8>(data[i]);
+      h *= kMagicPrime;
+    }
+    return h;
+  }
+
+  template<typename T>
+  static void Save(Kind kind, Symbol::Factory* sf, Term::Factory* tf, T* x, std::ostream* os) {
+    Term::Factory::Scope scope(tf);
+    // Consolidation may create plus-names, so the factories are written after
+    // the solvers, but they precede them in the snapshot.
+    Writer body;
+    Write(&body, x);
+    Writer w;
+    Write(&w, *sf);
+    Write(&w, *tf);
+    const std::string buf = w.buffer() + body.buffer();
+    const Header h{kMagic, kVersion, kind, kByteOrderMark, buf.size(), Checksum(buf.data(), buf.size())};
+    os->write(reinterpret_cast<const char*>(&h), sizeof(h));
+    os->write(buf.data(), buf.size());
+  }
+
+  template<typename T>
+  static void SaveShared(Kind kind, Symbol::Factory* sf, Term::Factory* tf, T* x, std::ostream* os) {
+    Term::Factory::Scope scope(tf);
+    Writer body(true);
+    Write(&body, x);
+    Writer w;
+    Write(&w, *sf);
+    Write(&w, *tf);
+    const std::string buf = w.buffer() + body.buffer();
+    const Header h{kMagic, kVersion, kind | kShared, kByteOrderMark, buf.size(), Checksum(buf.data(), buf.size())};
+    const SharedHeader sh{sizeof(Clause), kBloom, body.n_shared_clauses()};
+    os->write(reinterpret_cast<const char*>(&h), sizeof(h));
+    os->write(reinterpret_cast<const char*>(&sh), sizeof(sh));
+    os->write(body.shared_clauses().data(), body.shared_clauses().size());
+    os->write(buf.data(), buf.size());
+  }
+
+  template<typename T>
+  static bool LoadShared(Kind kind, const Mapping& m, Symbol::Factory* sf, Term::Factory* tf, T* x) {
+    Term::Factory::Scope scope(tf);
+    Header h;
+    SharedHeader sh;
+    if (!m.ok() || m.size() < kSharedClausesOffset) {
+      return false;
+    }
+    std::memcpy(&h, m.data(), sizeof(h));
+    std::memcpy(&sh, m.data() + sizeof(h), sizeof(sh));
+    if (h.magic != kMagic || h.version != kVersion || h.kind != (kind | kShared) ||
+        h.byte_order_mark != kByteOrderMark || sh.clause_size != sizeof(Clause) || sh.bloom != kBloom ||
+        sh.n_clauses > (m.size() - kSharedClausesOffset) / sizeof(Clause) ||
+        h.payload_size != m.size() - kSharedClausesOffset - sh.n_clauses * sizeof(Clause)) {
+      return false;
+    }
+    const Clause* clauses = reinterpret_cast<const Clause*>(m.data() + kSharedClausesOffset);
+    const char* payload = m.data() + kSharedClausesOffset + sh.n_clauses * sizeof(Clause);
+    if (Checksum(payload, h.payload_size) != h.checksum) {
+      return false;
+    }
+    Reader r(payload, h.payload_size, tf);
+    if (!Read(&r, sf) || !Read(&r, tf) ||
+        !std::all_of(clauses, clauses + sh.n_clauses, [tf](const Clause& c) { return IsSharedClause(tf, c); })) {
+      return false;
+    }
+    r.set_shared_clauses(clauses, sh.n_clauses);
+    return Read(&r, x) && r.at_end();
+  }
+
+  // The shared clauses are not covered by the checksum but checked one by one:
+  // a well-formed shared clause has two to Clause::kArraySize literals over
+  // known terms and equals the clause built from them.
+  static bool IsSharedClause(const Term::Factory* tf, const Clause& c) {
+    if (c.size_ < 2 || c.size_ > Clause::kArraySize || c.lits2_) {
+      return false;
+    }
+    for (size_t i = 0; i < c.size_; ++i) {
+      if (!Contains(tf, c.lits1_[i].lhs().id()) || !Contains(tf, c.lits1_[i].rhs().id())) {
+        return false;
+      }
+    }
+    return c.primitive() && Clause(c.begin(), c.end()) == c;
+  }
+
+  template<typename T>
+  static bool Load(Kind kind, std::istream* is, Symbol::Factory* sf, Term::Factory* tf, T* x) {
+    Term::Factory::Scope scope(tf);
+    Header h;
+    if (!is->read(reinterpret_cast<char*>(&h), sizeof(h)) ||
+        h.magic != kMagic || h.version != kVersion || h.kind != kind || h.byte_order_mark != kByteOrderMark) {
+      return false;
+    }
+    // The payload is read in chunks so that a corrupt size fails at the end
+    // of the input instead of allocating the memory upfront.
+    std::string buf;
+    for (u64 n = 0; n < h.payload_size; ) {
+      const size_t chunk = std::min(h.payload_size - n, u64(kChunkSize));
+      buf.resize(n + chunk);
+      if (!is->read(&buf[n], chunk)) {
+        return false;
+      }
+      n += chunk;
+    }
+    if (Checksum(buf.data(), buf.size()) != h.checksum) {
+      return false;
+    }
+    Reader r(buf.data(), buf.size(), tf);
+    return Read(&r, sf) && Read(&r, tf) && Read(&r, x) && r.at_end();
+  }
+
+  static void Write(Writer* w, const Symbol::Factory& sf) {
+    w->PutInt(sf.last_sort_);
+    w->PutInt(sf.last_function_);
+    w->PutInt(sf.last_name_);
+    w->PutInt(sf.last_variable_);
+  }
+
+  static bool Read(Reader* r, Symbol::Factory* sf) {
+    sf->last_sort_ = static_cast<Symbol::Sort>(r->GetInt());
+    sf->last_function_ = static_cast<Symbol::Id>(r->GetInt());
+    sf->last_name_ = static_cast<Symbol::Id>(r->GetInt());
+    sf->last_variable_ = static_cast<Symbol::Id>(r->GetInt());
+    return r->ok();
+  }
+
+  // Every slot of the two heaps is stored as its symbol's kind, which is 0 for
+  // free slots, the symbol's id and sort, and the arguments.
+  static void Write(Writer* w, const Term::Factory& tf) {
+    for (const Term::Factory::Heap* heap : {&tf.name_heap_, &tf.variable_and_function_heap_}) {
+      w->PutInt(heap->size());
+      for (size_t i = 0; i < heap->size(); ++i) {
+        const Term::Data* d = (*heap)[i];
+        if (!d) {
+          w->PutInt(0);
+          continue;
+        }
+        w->PutInt(d->symbol.name() ? 1 : d->symbol.variable() ? 2 : 3);
+        w->PutInt(d->symbol.id());
+        w->PutInt(d->symbol.sort());
+        w->PutTerms(d->args.begin(), d->args.end());
+      }
+    }
+  }
+
+  static bool Read(Reader* r, Term::Factory* tf) {
+    if (tf->name_heap_.size() > 0 || tf->variable_and_function_heap_.size() > 0) {
+      return r->Fail();
+    }
+    for (const bool names : {true, false}) {
+      Term::Factory::Heap* heap = names ? &tf->name_heap_ : &tf->variable_and_function_heap_;
+      std::vector<size_t>* free = names ? &tf->free_name_slots_ : &tf->free_variable_and_function_slots_;
+      const size_t n = r->GetSize();
+      for (size_t i = 0; i < n && r->ok(); ++i) {
+        const u64 kind = r->GetInt();
+        if (kind == 0) {
+          heap->push_back(nullptr);
+          free->push_back(i);
+          continue;
+        }
+        const u64 id = r->GetInt();
+        const u64 sort = r->GetInt();
+        Term::Vector args(r->GetSize());
+        for (Term& t : args) {
+          const u64 arg_id = r->GetInt();
+          t = Term(static_cast<u32>(arg_id));
+          if (arg_id == 0 || arg_id > ~u32(0)) {
+            r->Fail();
+          }
+        }
+        if (!r->ok() || (kind == 1) != names || kind > 3 || id == 0 || id > (~u32(0) >> 2) ||
+            sort > Symbol::Sort(~0) || args.size() > Symbol::Arity(~0) || (kind != 3 && !args.empty())) {
+          return r->Fail();
+        }
+        const Symbol::Id sid = static_cast<Symbol::Id>(id);
+        const Symbol::Sort s = static_cast<Symbol::Sort>(sort);
+        const Symbol symbol =
+            kind == 1 ? Symbol::Factory::CreateName(sid, s) :
+            kind == 2 ? Symbol::Factory::CreateVariable(sid, s) :
+                        Symbol::Factory::CreateFunction(sid, s, static_cast<Symbol::Arity>(args.size()));
+        Term::Data* d = new Term::Data(symbol, args);
+        heap->push_back(d);
+        const u32 term_id = (static_cast<u32>(i + 1) << 1) | static_cast<u32>(names);
+        if (!tf->memory_[s].insert(std::make_pair(d, term_id)).second) {
+          return r->Fail();
+        }
+      }
+    }
+    for (size_t i = 0; i < tf->variable_and_function_heap_.size() && r->ok(); ++i) {
+      const Term::Data* d = tf->variable_and_function_heap_[i];
+      if (d && !std::all_of(d->args.begin(), d->args.end(), [tf](Term t) { return Contains(tf, t.id()); })) {
+        return r->Fail();
+      }
+    }
+    // CreateTerm() recycles the last free slot first.
+    std::reverse(tf->free_name_slots_.begin(), tf->free_name_slots_.end());
+    std::reverse(tf->free_variable_and_function_slots_.begin(), tf->free_variable_and_function_slots_.end());
+    return r->ok();
+  }
+
+  static bool Contains(const Term::Factory* tf, u64 id) {
+    if (id == 0 || id > ~u32(0)) {
+      return false;
+    }
+    const Term::Factory::Heap& heap = (id & 1) == 1 ? tf->name_heap_ : tf->variable_and_function_heap_;
+    const size_t i = (id >> 1) - 1;
+    return i < heap.size() && heap[i];
+  }
+
+  // In shared mode, the clauses without heap-allocated literals are shared and
+  // precede the others.
+  static void Write(Writer* w, const Setup& s) {
+    w->PutBool(s.empty_clause_);
+    w->PutLiterals(s.units_.vec());
+    w->PutInt(s.units_.n_orig());
+    std::vector<size_t> shared;
+    std::vector<size_t> owned;
+    for (size_t i = 0; i < s.clauses_.size(); ++i) {
+      (w->shared() && s.clauses_[i].size2() == 0 ? shared : owned).push_back(i);
+    }
+    if (w->shared()) {
+      w->PutInt(shared.size());
+      w->PutInt(w->n_shared_clauses());
+      for (const size_t i : shared) {
+        w->PutSharedClause(s.clauses_[i]);
+        w->PutLiteral(s.clauses_.watched(i).a);
+        w->PutLiteral(s.clauses_.watched(i).b);
+      }
+    }
+    w->PutInt(owned.size());
+    for (const size_t i : owned) {
+      w->PutClause(s.clauses_[i]);
+      w->PutLiteral(s.clauses_.watched(i).a);
+      w->PutLiteral(s.clauses_.watched(i).b);
+    }
+    w->PutInt(s.cards_.size());
+    for (const Cardinality& c : s.cards_) {
+      w->PutCardinality(c);
+    }
+    w->PutInt(s.alldiffs_.size());
+    for (const AllDifferent& c : s.alldiffs_) {
+      w->PutAllDifferent(c);
+    }
+  }
+
+  static bool Read(Reader* r, Setup* s) {
+    s->empty_clause_ = r->GetBool();
+    std::vector<Literal> units = r->GetLiterals();
+    const size_t n_orig = r->GetInt();
+    if (!r->ok() || n_orig > units.size() ||
+        !std::all_of(units.begin(), units.end(), [](Literal a) { return a.primitive(); }) ||
+        !std::is_sorted(units.begin(), units.begin() + n_orig)) {
+      return r->Fail();
+    }
+    s->units_.Restore(std::move(units), n_orig);
+    auto watchable = [](const Clause& c, Literal a, Literal b) {
+      return a < b && c.any([a](Literal x) { return x == a; }) && c.any([b](Literal x) { return x == b; });
+    };
+    if (r->shared()) {
+      const size_t n_shared = r->GetSize(2 * sizeof(Literal));
+      const Clause* shared = r->GetSharedClauses(r->GetInt(), n_shared);
+      for (size_t i = 0; i < n_shared && r->ok(); ++i) {
+        const Literal a = r->GetLiteral();
+        const Literal b = r->GetLiteral();
+        if (!r->ok() || !watchable(shared[i], a, b)) {
+          return r->Fail();
+        }
+        s->clauses_.Reference(&shared[i]);
+        s->clauses_.Watch(i, a, b);
+      }
+    }
+    const size_t n_clauses = r->GetSize();
+    for (size_t i = 0; i < n_clauses && r->ok(); ++i) {
+      Clause c = r->GetClause();
+      const Literal a = r->GetLiteral();
+      const Literal b = r->GetLiteral();
+      if (!r->ok() || c.size() < 2 || !c.primitive() || !watchable(c, a, b)) {
+        return r->Fail();
+      }
+      s->clauses_.Add(std::move(c));
+      s->clauses_.Watch(s->clauses_.size() - 1, a, b);
+    }
+    const size_t n_cards = r->GetSize();
+    for (size_t i = 0; i < n_cards && r->ok(); ++i) {
+      s->StoreConstraint(r->GetCardinality());
+    }
+    const size_t n_alldiffs = r->GetSize();
+    for (size_t i = 0; i < n_alldiffs && r->ok(); ++i) {
+      s->StoreConstraint(r->GetAllDifferent());
+    }
+    return r->ok();
+  }
+
+  static void WriteVars(Writer* w, const Formula::SortedTermSet& vars) { w->PutTerms(vars.begin(), vars.end()); }
+
+  template<typename T>
+  static Grounder::Ungrounded<T> ReadUngrounded(Reader* r, const T& val) {
+    Grounder::Ungrounded<T> u(val);
+    for (const Term x : r->GetTerms()) {
+      if (!x.variable()) {
+        r->Fail();
+        break;
+      }
+      u.vars.insert(x);
+    }
+    return u;
+  }
+
+  static bool ReadTerms(Reader* r, Formula::SortedTermSet* ts) {
+    for (const Term t : r->GetTerms()) {
+      ts->insert(t);
+    }
+    return r->ok();
+  }
+
+  template<typename Pool>
+  static void WritePool(Writer* w, const Pool& pool) {
+    Term::Vector ts;
+    pool.Traverse([&ts](Term t) { ts.push_back(t); return false; });
+    w->PutTerms(ts.begin(), ts.end());
+  }
+
+  template<typename Pool>
+  static bool ReadPool(Reader* r, Pool* pool, bool names) {
+    for (const Term t : r->GetTerms()) {
+      if (names ? !t.name() : !t.variable()) {
+        return r->Fail();
+      }
+      pool->Return(t);
+    }
+    return r->ok();
+  }
+
+  // After consolidation, the grounder consists of at most one ply.
+  static void Write(Writer* w, Grounder* g) {
+    if (!g->plies_.empty()) {
+      g->Consolidate();
+    }
+    assert(g->plies_.size() <= 1);
+    w->PutInt(g->plies_.size());
+    for (const Grounder::Ply& p : g->plies_) {
+      assert(p.clauses.full_setup);
+      assert(!p.do_not_add_if_inconsistent);
+      w->PutInt(p.clauses.ungrounded.size());
+      for (const Grounder::Ungrounded<Clause>& uc : p.clauses.ungrounded) {
+        w->PutClause(uc.val);
+        WriteVars(w, uc.vars);
+      }
+      w->PutInt(p.clauses.cardinalities.size());
+      for (const Cardinality& c : p.clauses.cardinalities) {
+        w->PutCardinality(c);
+      }
+      w->PutInt(p.clauses.all_differents.size());
+      for (const AllDifferent& c : p.clauses.all_differents) {
+        w->PutAllDifferent(c);
+      }
+      Write(w, *p.clauses.full_setup);
+      w->PutBool(p.relevant.filter);
+      w->PutInt(p.relevant.ungrounded.size());
+      for (const Grounder::Ungrounded<Term>& ut : p.relevant.ungrounded) {
+        w->PutTerm(ut.val);
+        WriteVars(w, ut.vars);
+      }
+      w->PutTerms(p.relevant.terms.begin(), p.relevant.terms.end());
+      w->PutTerms(p.names.mentioned.begin(), p.names.mentioned.end());
+      w->PutTerms(p.names.plus_max.begin(), p.names.plus_max.end());
+      w->PutTerms(p.names.plus_new.begin(), p.names.plus_new.end());
+      w->PutTerms(p.names.plus_mentioned.begin(), p.names.plus_mentioned.end());
+      w->PutInt(p.lhs_rhs.ungrounded.size());
+      for (const Grounder::Ungrounded<Literal>& ua : p.lhs_rhs.ungrounded) {
+        w->PutLiteral(ua.val);
+        WriteVars(w, ua.vars);
+      }
+      w->PutInt(p.lhs_rhs.map.size());
+      for (const auto& lhs_rhs : p.lhs_rhs.map) {
+        w->PutTerm(lhs_rhs.first);
+        w->PutTerms(lhs_rhs.second.begin(), lhs_rhs.second.end());
+      }
+    }
+    Term::Vector xs;
+    g->components_.Traverse([&xs](Term x) { xs.push_back(x); });
+    w->PutInt(xs.size());
+    for (const Term x : xs) {
+      w->PutTerm(x);
+      w->PutTerm(g->components_.representative(x));
+      w->PutBool(g->components_.marked(x));
+    }
+    WritePool(w, g->name_pool_);
+    WritePool(w, g->var_pool_);
+  }
+
+  static bool Read(Reader* r, Grounder* g) {
+    const size_t n_plies = r->GetSize();
+    if (!g->plies_.empty() || n_plies > 1) {
+      return r->Fail();
+    }
+    if (n_plies == 1) {
+      g->plies_.push_back(Grounder::Ply());
+      Grounder::Ply& p = g->plies_.back();
+      p.id = ++g->last_ply_id_;
+      const size_t n_clauses = r->GetSize();
+      for (size_t i = 0; i < n_clauses && r->ok(); ++i) {
+        p.clauses.ungrounded.push_back(ReadUngrounded(r, r->GetClause()));
+      }
+      const size_t n_cards = r->GetSize();
+      for (size_t i = 0; i < n_cards && r->ok(); ++i) {
+        p.clauses.cardinalities.push_back(r->GetCardinality());
+      }
+      const size_t n_alldiffs = r->GetSize();
+      for (size_t i = 0; i < n_alldiffs && r->ok(); ++i) {
+        p.clauses.all_differents.push_back(r->GetAllDifferent());
+      }
+      p.clauses.full_setup = std::unique_ptr<Setup>(new Setup());
+      if (!Read(r, p.clauses.full_setup.get())) {
+        return false;
+      }
+      p.clauses.shallow_setup = p.clauses.full_setup->shallow_copy();
+      p.relevant.filter = r->GetBool();
+      const size_t n_relevant = r->GetSize();
+      for (size_t i = 0; i < n_relevant && r->ok(); ++i) {
+        p.relevant.ungrounded.insert(ReadUngrounded(r, r->GetTerm()));
+      }
+      if (!ReadTerms(r, &p.relevant.terms) ||
+          !ReadTerms(r, &p.names.mentioned) ||
+          !ReadTerms(r, &p.names.plus_max) ||
+          !ReadTerms(r, &p.names.plus_new) ||
+          !ReadTerms(r, &p.names.plus_mentioned)) {
+        return false;
+      }
+      const size_t n_lhs_rhs = r->GetSize();
+      for (size_t i = 0; i < n_lhs_rhs && r->ok(); ++i) {
+        p.lhs_rhs.ungrounded.insert(ReadUngrounded(r, r->GetLiteral()));
+      }
+      const size_t n_lhs = r->GetSize();
+      for (size_t i = 0; i < n_lhs && r->ok(); ++i) {
+        const Term lhs = r->GetTerm();
+        const Term::Vector rhs = r->GetTerms();
+        p.lhs_rhs.map[lhs].insert(rhs.begin(), rhs.end());
+      }
+    }
+    const size_t n_elems = r->GetSize();
+    for (size_t i = 0; i < n_elems && r->ok(); ++i) {
+      const Term x = r->GetTerm();
+      const Term y = r->GetTerm();
+      const bool marked = r->GetBool();
+      if (r->ok()) {
+        g->components_.Union(x, y);
+        if (marked) {
+          g->components_.Mark(x);
+        }
+      }
+    }
+    return r->ok() && ReadPool(r, &g->name_pool_, true) && ReadPool(r, &g->var_pool_, false);
+  }
+
+  static void Write(Writer* w, Solver* s) {
+    s->AddPromotedLiterals();
+    Write(w, &s->grounder_);
+    w->PutInt(s->n_promoted_);
+    w->PutInt(s->promoted_.size());
+    for (const Clause& c : s->promoted_) {
+      w->PutClause(c);
+    }
+  }
+
+  static bool Read(Reader* r, Solver* s) {
+    if (!Read(r, &s->grounder_)) {
+      return false;
+    }
+    s->n_promoted_ = r->GetInt();
+    const size_t n_promoted = r->GetSize();
+    for (size_t i = 0; i < n_promoted && r->ok(); ++i) {
+      s->promoted_.insert(r->GetClause());
+    }
+    return r->ok();
+  }
+
+  static void Write(Writer* w, KnowledgeBase* kb) {
+    w->PutInt(kb->knowledge_.size());
+    for (const Clause& c : kb->knowledge_) {
+      w->PutClause(c);
+    }
+    w->PutInt(kb->n_processed_knowledge_);
+    w->PutInt(kb->beliefs_.size());
+    for (const KnowledgeBase::Conditional& b : kb->beliefs_) {
+      w->PutInt(b.k);
+      w->PutInt(b.l);
+      w->PutFormula(*b.ante);
+      w->PutClause(b.not_ante_or_conse);
+      w->PutBool(b.assume_consistent);
+    }
+    w->PutInt(kb->n_processed_beliefs_);
+    w->PutInt(kb->spheres_.size());
+    for (Solver& sphere : kb->spheres_) {
+      Write(w, &sphere);
+    }
+  }
+
+  // Add() collects the mentioned names.
+  static bool Read(Reader* r, KnowledgeBase* kb) {
+    if (!kb->knowledge_.empty() || !kb->beliefs_.empty()) {
+      return r->Fail();
+    }
+    const size_t n_knowledge = r->GetSize();
+    for (size_t i = 0; i < n_knowledge && r->ok(); ++i) {
+      kb->Add(r->GetClause());
+    }
+    kb->n_processed_knowledge_ = r->GetInt();
+    const size_t n_beliefs = r->GetSize();
+    for (size_t i = 0; i < n_beliefs && r->ok(); ++i) {
+      const KnowledgeBase::belief_level k = r->GetInt();
+      const KnowledgeBase::belief_level l = r->GetInt();
+      const Formula::Ref ante = r->GetFormula();
+      const Clause not_ante_or_conse = r->GetClause();
+      const bool assume_consistent = r->GetBool();
+      if (!ante) {
+        return r->Fail();
+      }
+      kb->Add(k, l, *ante, not_ante_or_conse, assume_consistent);
+    }
+    kb->n_processed_beliefs_ = r->GetInt();
+    const size_t n_spheres = r->GetSize();
+    if (!r->ok() || kb->n_processed_knowledge_ > kb->knowledge_.size() ||
+        kb->n_processed_beliefs_ > kb->beliefs_.size() || n_spheres == 0) {
+      return r->Fail();
+    }
+    kb->spheres_.clear();
+    for (size_t i = 0; i < n_spheres && r->ok(); ++i) {
+      kb->spheres_.emplace_back(kb->sf_, kb->tf_);
+      kb->spheres_.back().set_prune_symmetries(kb->prune_symmetries_);
+      Read(r, &kb->spheres_.back());
+    }
+    return r->ok();
+  }
+};
+
+}  // namespace limbo
+
+#endif  // LIMBO_SNAPSHOT_H_
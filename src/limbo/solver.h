@@ -14,10 +14,72 @@
 // evaluating queries with Entails(), Determines(), EntailsComplete(), or
 // Consistent().
 //
+// The public methods make the Solver's Term::Factory current on the calling
+// thread while they run; see Term::Factory::Scope. Terms and clauses passed to
+// them must be created with that factory.
+//
 // Splitting and assigning is done at a deterministic point, namely after
 // reducing the outermost logical operators with conjunctive meaning (negated
 // disjunction, double negation, negated existential).
 //
+// When set_split_query_components_only() is enabled, only terms that are
+// connected to the query through the clauses of the setup are split. Splitting
+// other terms could only derive the empty clause, which means that Entails()
+// and Determines() may then miss that the setup is inconsistent in unrelated
+// parts; this is a matter of completeness, not of soundness, but it changes
+// answers at belief levels k > 0. Fix() then assigns other terms only as long
+// as the setup is not consistent. By default, all terms are split.
+//
+// When a split literal turns out to be inconsistent, Split() learns a lemma:
+// the clause that negates the literal and the split literals it was assumed
+// with. Lemmas are only learned when the literal's name already occurred in
+// the setup. Then no new clauses were grounded, so the conflict arose in the
+// component of the literal's term, and only split literals from that component
+// are included. Lemmas are hence entailed by the clauses of the grounder, and
+// they are kept as long as the grounder plies they were learned from are
+// alive. Split() and Fix() skip literals that are refuted by a lemma. A split
+// literal with any other name stands for all names that do not occur with the
+// term, and this set may change in later queries, so no lemma mentions it.
+//
+// When promotion is enabled with set_promote_entailed_literals(), a ground
+// literal that Entails() or Determines() finds at belief level k > 0 is added
+// as a unit clause to the grounder. Later queries thus find it at belief level
+// 0. The literals promoted by a query are added in one ply at the beginning of
+// the next query, and the grounder is consolidated only after every
+// kPromotionPliesPerConsolidation such plies, as Grounder::Consolidate()
+// minimizes the whole setup. Since this adds and merges plies, the grounder
+// must not be in the scope of any Grounder::Undo when a query is evaluated in
+// this mode.
+//
+// Retract() and Forget() remove clauses from the grounder; see
+// Grounder::Retract() and Grounder::Forget(). Since promoted literals may have
+// been entailed only thanks to the removed clauses, they are removed as well.
+//
+// EntailsUpTo() and DeterminesUpTo() try increasing belief levels until the
+// query succeeds. The split tree of every level is recorded in a Frontier: a
+// node that succeeded at some level, or whose split literal was inconsistent,
+// is closed and also succeeds at all higher levels, so Split() does not visit
+// it again. Level l thus only extends the open nodes of level l-1 by one more
+// split. The grounding and the lemmas carry over as well.
+//
+// When symmetry pruning is enabled with set_prune_symmetries(), Entails() and
+// EntailsUpTo() first partition the split terms and the names of the setup
+// into classes of interchangeable ones: swapping two members of a class maps
+// the setup and the split names onto themselves and leaves the query
+// unchanged. Then Split() skips a term if an interchangeable term has already
+// failed, and a name if the split of the term with an interchangeable name has
+// already been explored, provided that the decisions taken so far do not tell
+// the two apart. Since splitting a name that did not occur before grounds new
+// clauses, the symmetries are no longer used below such a split.
+//
+// Every query is bounded by the Budget set with set_budget(), or by the one
+// passed to EntailsUpTo() or DeterminesUpTo(): a number of split literals, a
+// time limit, a deadline, and a cancellation flag. Split() and
+// Fix() check it at every branch and give up once it is exhausted; then
+// aborted() is true and a negative answer means "unknown." EntailsComplete()
+// answers false in this case. The batch queries mark the items they could not
+// decide as unknown in their results.
+//
 // In the special case that the set of clauses can be shown to be inconsistent
 // after the splits, Determines() returns the null term to indicate that [t=n]
 // is entailed by the clauses for arbitrary n.
@@ -27,10 +89,19 @@
 
 #include <cassert>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iterator>
+#include <limits>
 #include <list>
+#include <map>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
+#include <limbo/all_different.h>
+#include <limbo/cardinality.h>
 #include <limbo/formula.h>
 #include <limbo/grounder.h>
 #include <limbo/literal.h>
@@ -38,173 +109,844 @@
 #include <limbo/term.h>
 
 #include <limbo/internal/ints.h>
+#include <limbo/internal/iter.h>
 #include <limbo/internal/maybe.h>
 
 namespace limbo {
 
 class Solver {
  public:
+  typedef internal::size_t size_t;
+
   static constexpr bool kConsistencyGuarantee = true;
   static constexpr bool kNoConsistencyGuarantee = false;
 
+  // Budget bounds every query: the number of split literals, the time per
+  // query, an absolute deadline, and an external cancellation flag, which may
+  // be set from another thread.
+  struct Budget {
+    typedef std::chrono::steady_clock Clock;
+    Budget()
+        : max_splits(std::numeric_limits<size_t>::max()),
+          max_time(Clock::duration::max()),
+          deadline(Clock::time_point::max()) {}
+    size_t max_splits;
+    Clock::duration max_time;
+    Clock::time_point deadline;
+    const std::atomic<bool>* cancel = nullptr;
+  };
+
   Solver(Symbol::Factory* sf, Term::Factory* tf) : tf_(tf), grounder_(sf, tf) {}
   Solver(const Solver&) = delete;
   Solver& operator=(const Solver&) = delete;
   Solver(Solver&&) = default;
   Solver& operator=(Solver&&) = default;
 
+  // Clone() returns a solver with a Grounder::Clone() of this solver's
+  // grounder, the same promoted literals, and the same settings, but without
+  // lemmas. The restrictions of Grounder::Clone() apply.
+  Solver Clone() const {
+    Term::Factory::Scope scope(tf_);
+    Solver s(tf_, grounder_.Clone());
+    s.promote_ = promote_;
+    s.n_promoted_ = n_promoted_;
+    s.promoted_ = promoted_;
+    s.pending_promotions_ = pending_promotions_;
+    s.n_promotion_plies_ = n_promotion_plies_;
+    s.prune_symmetries_ = prune_symmetries_;
+    s.query_components_only_ = query_components_only_;
+    s.budget_ = budget_;
+    return s;
+  }
+
   Grounder& grounder() { return grounder_; }
   const Grounder& grounder() const { return grounder_; }
 
   const Setup& setup() const { return grounder_.setup(); }
 
+  // Traverse() visits the terms of the grounder, the lemmas, and the promoted
+  // literals; it serves as root for Term::Factory::Collect().
+  template<typename UnaryFunction>
+  void Traverse(UnaryFunction f) const {
+    Term::Factory::Scope scope(tf_);
+    grounder_.Traverse(f);
+    for (const Lemma& l : lemmas_) {
+      l.clause.Traverse(f);
+    }
+    for (const Clause& c : promoted_) {
+      c.Traverse(f);
+    }
+  }
+
+  void set_promote_entailed_literals(bool b) { promote_ = b; }
+  bool promote_entailed_literals() const { return promote_; }
+  size_t n_promoted_literals() const { return n_promoted_; }
+
+  // Retract() and Forget() return the number of removed clauses, not counting
+  // promoted literals. Like Grounder::RetractIf(), they remove nothing while a
+  // query ply is alive.
+  size_t Retract(const Clause& c) {
+    Term::Factory::Scope scope(tf_);
+    assert(decisions_.empty());
+    size_t n = 0;
+    auto clause_pred = [this, &c, &n](const Clause& d) {
+      if (c == d) {
+        ++n;
+        return true;
+      }
+      return promoted(d);
+    };
+    if (grounder_.RetractIf(clause_pred,
+                            [](const Cardinality&) { return false; },
+                            [](const AllDifferent&) { return false; }) == 0) {
+      return 0;
+    }
+    promoted_.clear();
+    pending_promotions_.clear();
+    n_promotion_plies_ = 0;
+    return n;
+  }
+
+  size_t Forget(const std::unordered_set<Term>& ts) {
+    Term::Factory::Scope scope(tf_);
+    assert(decisions_.empty());
+    auto mentions = [&ts](const Clause& c) {
+      return c.any([&ts](Literal a) { return Grounder::Matches(a.lhs(), ts); });
+    };
+    size_t n = 0;
+    auto clause_pred = [this, &mentions, &n](const Clause& c) {
+      if (mentions(c)) {
+        ++n;
+        return true;
+      }
+      return promoted(c);
+    };
+    auto lits_pred = [&mentions, &n](const Clause& c) {
+      if (mentions(c)) {
+        ++n;
+        return true;
+      }
+      return false;
+    };
+    if (grounder_.RetractIf(clause_pred,
+                            [&lits_pred](const Cardinality& c) { return lits_pred(c.lits()); },
+                            [&lits_pred](const AllDifferent& c) { return lits_pred(c.lits()); }) == 0) {
+      return 0;
+    }
+    promoted_.clear();
+    pending_promotions_.clear();
+    n_promotion_plies_ = 0;
+    return n;
+  }
+
+  void set_prune_symmetries(bool b) { prune_symmetries_ = b; }
+  bool prune_symmetries() const { return prune_symmetries_; }
+
+  void set_split_query_components_only(bool b) { query_components_only_ = b; }
+  bool split_query_components_only() const { return query_components_only_; }
+
+  void set_budget(const Budget& budget) { budget_ = budget; }
+  const Budget& budget() const { return budget_; }
+
+  // True iff the last query ran out of budget. A negative answer of that
+  // query then means "unknown." The batch queries EntailsBatch(),
+  // DeterminesAll(), and PossibleValues() report this per item instead.
+  bool aborted() const { return budget_exhausted_; }
+
+  // The answer for an item of a batch query. Positive answers remain valid
+  // when the budget is exhausted; the negative ones become kUnknown.
+  enum Answer { kNo, kYes, kUnknown };
+
   bool Entails(Formula::belief_level k, const Formula& phi, bool assume_consistent = false) {
+    Term::Factory::Scope scope(tf_);
     assert(phi.objective());
     assert(phi.free_vars().all_empty());
-    Grounder::Undo undo1;
-    if (assume_consistent) {
-      grounder_.GuaranteeConsistency(phi, &undo1);
+    AddPromotedLiterals();
+    ForgetInvalidLemmas();
+    StartBudget();
+    bool entailed;
+    {
+      Grounder::Undo undo1;
+      if (assume_consistent) {
+        grounder_.GuaranteeConsistency(phi, &undo1);
+      }
+      Grounder::Undo undo2;
+      grounder_.PrepareForQuery(phi, &undo2);
+      entailed = setup().Subsumes(Clause{}) || phi.trivially_valid();
+      if (!entailed) {
+        const Plan plan = Compile(phi);
+        if (prune_symmetries_) {
+          FindSymmetries(phi);
+        }
+        entailed = Split(k, [this, &plan]() { return Reduce(plan); }, [](bool r1, bool r2) { return r1 && r2; },
+                         true, false);
+        symmetry_classes_.clear();
+      }
+    }
+    if (promote_ && entailed && k > 0 && phi.type() == Formula::kAtomic) {
+      const Clause& c = phi.as_atomic().arg();
+      if (c.unit() && c.primitive()) {
+        Promote(c.first());
+      }
+    }
+    return entailed;
+  }
+
+  // EntailsBatch() is like calling Entails() for every formula, but prepares
+  // the grounder only once for all formulas and evaluates them in a single
+  // split tree. A formula drops out of a split as soon as one of its branches
+  // does not entail it. A formula whose answer is cut short by the budget is
+  // kUnknown.
+  std::vector<Answer> EntailsBatch(Formula::belief_level k,
+                                   const std::vector<const Formula*>& phis,
+                                   bool assume_consistent = false) {
+    Term::Factory::Scope scope(tf_);
+    StartBudget();
+    std::vector<Answer> entailed(phis.size(), kNo);
+    if (phis.empty()) {
+      return entailed;
+    }
+    AddPromotedLiterals();
+    ForgetInvalidLemmas();
+    {
+      Grounder::Undo undo1;
+      if (assume_consistent) {
+        grounder_.GuaranteeConsistency(phis, &undo1);
+      }
+      Grounder::Undo undo2;
+      grounder_.PrepareForQuery(phis, &undo2);
+      const bool inconsistent = setup().Subsumes(Clause{});
+      std::vector<size_t> goals;
+      std::vector<Plan> plans(phis.size());
+      for (size_t i = 0; i < phis.size(); ++i) {
+        assert(phis[i]->objective());
+        assert(phis[i]->free_vars().all_empty());
+        if (inconsistent || phis[i]->trivially_valid()) {
+          entailed[i] = kYes;
+        } else {
+          goals.push_back(i);
+          plans[i] = Compile(*phis[i]);
+        }
+      }
+      const std::vector<bool> rs =
+          SplitAll(k, goals,
+                   [this, &plans](size_t i) { return Reduce(plans[i]); },
+                   [](bool r1, bool r2) { return r1 && r2; },
+                   true, false);
+      for (size_t j = 0; j < goals.size(); ++j) {
+        entailed[goals[j]] = rs[j] ? kYes : budget_exhausted_ ? kUnknown : kNo;
+      }
+    }
+    if (promote_ && k > 0) {
+      for (size_t i = 0; i < phis.size(); ++i) {
+        if (entailed[i] == kYes && phis[i]->type() == Formula::kAtomic) {
+          const Clause& c = phis[i]->as_atomic().arg();
+          if (c.unit() && c.primitive()) {
+            Promote(c.first());
+          }
+        }
+      }
     }
-    Grounder::Undo undo2;
-    grounder_.PrepareForQuery(phi, &undo2);
-    const bool entailed = setup().Subsumes(Clause{}) || phi.trivially_valid() ||
-        Split(k, [this, &phi]() { return Reduce(phi); }, [](bool r1, bool r2) { return r1 && r2; }, true, false);
     return entailed;
   }
 
   internal::Maybe<Term> Determines(Formula::belief_level k, Term lhs, bool assume_consistent = false) {
+    Term::Factory::Scope scope(tf_);
     assert(lhs.primitive());
-    Grounder::Undo undo1;
-    if (assume_consistent) {
-      grounder_.GuaranteeConsistency(lhs, &undo1);
+    AddPromotedLiterals();
+    ForgetInvalidLemmas();
+    StartBudget();
+    internal::Maybe<Term> t;
+    {
+      Grounder::Undo undo1;
+      if (assume_consistent) {
+        grounder_.GuaranteeConsistency(lhs, &undo1);
+      }
+      Grounder::Undo undo2;
+      grounder_.PrepareForQuery(lhs, &undo2);
+      internal::Maybe<Term> inconsistent_result = internal::Just(Term());
+      internal::Maybe<Term> unsuccessful_result = internal::Nothing;
+      t = Split(k,
+                [this, lhs]() { return setup().Determines(lhs); },
+                MergeDetermined,
+                inconsistent_result, unsuccessful_result);
+    }
+    // Plus-names are not promoted because they stand for any other name.
+    if (promote_ && t && !t.val.null() && k > 0 && grounder_.IsOccurringName(t.val)) {
+      Promote(Literal::Eq(lhs, t.val));
+    }
+    return t;
+  }
+
+  // DeterminesAll() is equivalent to calling Determines() for every term, but
+  // prepares the grounder only once and evaluates all terms in a single split
+  // tree. The names map contains only the terms that are determined; the terms
+  // whose answer is cut short by the budget are unknown.
+  struct Determined {
+    std::unordered_map<Term, Term> names;
+    std::unordered_set<Term> unknown;
+  };
+
+  Determined DeterminesAll(Formula::belief_level k, const Term::Vector& terms, bool assume_consistent = false) {
+    Term::Factory::Scope scope(tf_);
+    StartBudget();
+    Determined ts;
+    if (terms.empty()) {
+      return ts;
+    }
+    AddPromotedLiterals();
+    ForgetInvalidLemmas();
+    {
+      Grounder::Undo undo1;
+      if (assume_consistent) {
+        grounder_.GuaranteeConsistency(terms.begin(), terms.end(), &undo1);
+      }
+      Grounder::Undo undo2;
+      grounder_.PrepareForQuery(terms.begin(), terms.end(), &undo2);
+      std::vector<size_t> goals(terms.size());
+      for (size_t i = 0; i < terms.size(); ++i) {
+        assert(terms[i].primitive());
+        goals[i] = i;
+      }
+      internal::Maybe<Term> inconsistent_result = internal::Just(Term());
+      internal::Maybe<Term> unsuccessful_result = internal::Nothing;
+      const std::vector<internal::Maybe<Term>> rs =
+          SplitAll(k, goals,
+                   [this, &terms](size_t i) { return setup().Determines(terms[i]); },
+                   MergeDetermined,
+                   inconsistent_result, unsuccessful_result);
+      for (size_t i = 0; i < terms.size(); ++i) {
+        if (rs[i]) {
+          ts.names[terms[i]] = rs[i].val;
+        } else if (budget_exhausted_) {
+          ts.unknown.insert(terms[i]);
+        }
+      }
+    }
+    if (promote_ && k > 0) {
+      for (const auto& p : ts.names) {
+        if (!p.second.null() && grounder_.IsOccurringName(p.second)) {
+          Promote(Literal::Eq(p.first, p.second));
+        }
+      }
+    }
+    return ts;
+  }
+
+  // EntailsUpTo() and DeterminesUpTo() evaluate the query at belief levels
+  // 0, ..., max_k until it succeeds and store the level in *k. The grounder
+  // is prepared only once, and lemmas learned at lower levels prune the splits
+  // at higher levels. Closed nodes of the split tree of level l-1 are not
+  // visited again at level l; see Frontier. The whole call is bounded by
+  // budget, which defaults to the one set with set_budget(). When the budget
+  // is exhausted, the query fails.
+  bool EntailsUpTo(Formula::belief_level max_k,
+                   const Formula& phi,
+                   Formula::belief_level* k = nullptr,
+                   bool assume_consistent = false) {
+    return EntailsUpTo(max_k, phi, budget_, k, assume_consistent);
+  }
+
+  bool EntailsUpTo(Formula::belief_level max_k,
+                   const Formula& phi,
+                   const Budget& budget,
+                   Formula::belief_level* k = nullptr,
+                   bool assume_consistent = false) {
+    Term::Factory::Scope scope(tf_);
+    assert(phi.objective());
+    assert(phi.free_vars().all_empty());
+    AddPromotedLiterals();
+    ForgetInvalidLemmas();
+    StartBudget(budget);
+    bool entailed = false;
+    Formula::belief_level l = 0;
+    {
+      Grounder::Undo undo1;
+      if (assume_consistent) {
+        grounder_.GuaranteeConsistency(phi, &undo1);
+      }
+      Grounder::Undo undo2;
+      grounder_.PrepareForQuery(phi, &undo2);
+      entailed = setup().Subsumes(Clause{}) || phi.trivially_valid();
+      const Plan plan = Compile(phi);
+      if (!entailed && prune_symmetries_) {
+        FindSymmetries(phi);
+      }
+      Frontier<bool> frontier;
+      for (; !entailed && l <= max_k && !budget_exhausted_; ++l) {
+        entailed = Split(l, [this, &plan]() { return Reduce(plan); }, [](bool r1, bool r2) { return r1 && r2; },
+                         true, false, &frontier);
+        if (entailed) {
+          break;
+        }
+      }
+      symmetry_classes_.clear();
+    }
+    if (entailed && k) {
+      *k = l;
+    }
+    if (promote_ && entailed && l > 0 && phi.type() == Formula::kAtomic) {
+      const Clause& c = phi.as_atomic().arg();
+      if (c.unit() && c.primitive()) {
+        Promote(c.first());
+      }
+    }
+    return entailed;
+  }
+
+  internal::Maybe<Term> DeterminesUpTo(Formula::belief_level max_k,
+                                       Term lhs,
+                                       Formula::belief_level* k = nullptr,
+                                       bool assume_consistent = false) {
+    return DeterminesUpTo(max_k, lhs, budget_, k, assume_consistent);
+  }
+
+  internal::Maybe<Term> DeterminesUpTo(Formula::belief_level max_k,
+                                       Term lhs,
+                                       const Budget& budget,
+                                       Formula::belief_level* k = nullptr,
+                                       bool assume_consistent = false) {
+    Term::Factory::Scope scope(tf_);
+    assert(lhs.primitive());
+    AddPromotedLiterals();
+    ForgetInvalidLemmas();
+    StartBudget(budget);
+    internal::Maybe<Term> t = internal::Nothing;
+    Formula::belief_level l = 0;
+    {
+      Grounder::Undo undo1;
+      if (assume_consistent) {
+        grounder_.GuaranteeConsistency(lhs, &undo1);
+      }
+      Grounder::Undo undo2;
+      grounder_.PrepareForQuery(lhs, &undo2);
+      internal::Maybe<Term> inconsistent_result = internal::Just(Term());
+      internal::Maybe<Term> unsuccessful_result = internal::Nothing;
+      Frontier<internal::Maybe<Term>> frontier;
+      for (; l <= max_k && !budget_exhausted_; ++l) {
+        t = Split(l, [this, lhs]() { return setup().Determines(lhs); }, MergeDetermined,
+                  inconsistent_result, unsuccessful_result, &frontier);
+        if (t) {
+          break;
+        }
+      }
+    }
+    if (t && k) {
+      *k = l;
+    }
+    if (promote_ && t && !t.val.null() && l > 0 && grounder_.IsOccurringName(t.val)) {
+      Promote(Literal::Eq(lhs, t.val));
     }
-    Grounder::Undo undo2;
-    grounder_.PrepareForQuery(lhs, &undo2);
-    internal::Maybe<Term> inconsistent_result = internal::Just(Term());
-    internal::Maybe<Term> unsuccessful_result = internal::Nothing;
-    internal::Maybe<Term> t = Split(k,
-                 [this, lhs]() { return setup().Determines(lhs); },
-                 [](internal::Maybe<Term> r1, internal::Maybe<Term> r2) {
-                   return r1 && r2 && r1.val == r2.val ? r1 :
-                          r1 && r2 && r1.val.null()    ? r2 :
-                          r1 && r2 && r2.val.null()    ? r1 :
-                                                         internal::Nothing;
-                 },
-                 inconsistent_result, unsuccessful_result);
     return t;
   }
 
   bool EntailsComplete(int k, const Formula& phi, bool assume_consistent = false) {
+    Term::Factory::Scope scope(tf_);
     assert(phi.objective());
     assert(phi.free_vars().all_empty());
     Formula::Ref psi = Formula::Factory::Not(phi.Clone());
-    return !Consistent(k, *psi, assume_consistent);
+    return !Consistent(k, *psi, assume_consistent) && !aborted();
   }
 
   bool Consistent(int k, const Formula& phi, bool assume_consistent = false) {
+    Term::Factory::Scope scope(tf_);
     assert(phi.objective());
     assert(phi.free_vars().all_empty());
+    AddPromotedLiterals();
+    ForgetInvalidLemmas();
+    StartBudget();
     Grounder::Undo undo1;
     if (assume_consistent) {
       grounder_.GuaranteeConsistency(phi, &undo1);
     }
     Grounder::Undo undo2;
     grounder_.PrepareForQuery(phi, &undo2);
-    return !phi.trivially_invalid() && Fix(k, [this, &phi]() { return Reduce(phi); });
+    if (phi.trivially_invalid()) {
+      return false;
+    }
+    const Plan plan = Compile(phi);
+    return Fix(k, [this, &plan]() { return Reduce(plan); });
+  }
+
+  // PossibleValues() returns the names n for which Consistent(k, t = n) holds.
+  // Only the names the grounder splits t over are enumerated, that is, the
+  // names that occur with t and t's plus-names; names excluded by unit clauses
+  // are dropped upfront and the remaining ones share a single search. Whether
+  // t may take any other name is reported by others: it holds iff
+  // Consistent(k, t = n) holds for a name n that occurs neither in the
+  // knowledge base nor in a query. The names whose answer is cut short by the
+  // budget are unknown, and so may be others.
+  struct Values {
+    std::unordered_set<Term> names;
+    std::unordered_set<Term> unknown;
+    Answer others = kNo;
+  };
+
+  Values PossibleValues(int k, Term t, bool assume_consistent = false) {
+    Term::Factory::Scope scope(tf_);
+    assert(t.primitive());
+    AddPromotedLiterals();
+    ForgetInvalidLemmas();
+    StartBudget();
+    Grounder::Undo undo1;
+    if (assume_consistent) {
+      grounder_.GuaranteeConsistency(t, &undo1);
+    }
+    Grounder::Undo undo2;
+    grounder_.PrepareForQuery(t, &undo2);
+    Values vs;
+    if (setup().Subsumes(Clause{})) {
+      return vs;
+    }
+    Term::Vector candidates;
+    {
+      // The plus-name borrowed by RhsNames goes back to the pool; it is covered
+      // by the extra goal for other names below.
+      const Grounder::RhsNames names = grounder_.rhs_names(t);
+      candidates.assign(names.begin(), names.end());
+      candidates.erase(std::remove(candidates.begin(), candidates.end(), names.plus_name()), candidates.end());
+    }
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [this, t](Term n) {
+      return setup().Subsumes(Clause{Literal::Neq(t, n)});
+    }), candidates.end());
+    const size_t others = candidates.size();
+    std::vector<size_t> open(candidates.size() + 1);
+    for (size_t i = 0; i < open.size(); ++i) {
+      open[i] = i;
+    }
+    FixAll(k, &open, [this, t, &candidates, others](size_t i) {
+      if (i == others) {
+        const internal::Maybe<Term> n = setup().Determines(t);
+        return n && !n.val.null() && std::find(candidates.begin(), candidates.end(), n.val) == candidates.end();
+      }
+      return setup().Subsumes(Clause{Literal::Eq(t, candidates[i])});
+    });
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      if (!std::binary_search(open.begin(), open.end(), i)) {
+        vs.names.insert(candidates[i]);
+      } else if (budget_exhausted_) {
+        vs.unknown.insert(candidates[i]);
+      }
+    }
+    vs.others = !std::binary_search(open.begin(), open.end(), others) ? kYes : budget_exhausted_ ? kUnknown : kNo;
+    return vs;
   }
 
  private:
+  friend class Snapshot;
+
 #ifdef FRIEND_TEST
   FRIEND_TEST(SolverTest, Constants);
+  FRIEND_TEST(SolverTest, Lemmas);
 #endif
 
-  typedef internal::size_t size_t;
   typedef Formula::SortedTermSet SortedTermSet;
 
-  bool Reduce(const Formula& phi) {
+  static constexpr size_t kMaxLemmas = 4096;
+
+  struct Lemma {
+    Lemma(Grounder::PlyId ply, const Clause& c) : ply(ply), clause(c) {}
+    Grounder::PlyId ply;  // last ply before the query the lemma was learned in
+    Clause clause;
+  };
+
+  static constexpr size_t kPromotionPliesPerConsolidation = 16;
+
+  void Promote(Literal a) {
+    assert(a.primitive());
+    assert(decisions_.empty());
+    if (!promoted(Clause{a}) && !setup().Subsumes(Clause{a})) {
+      pending_promotions_.push_back(Clause{a});
+      promoted_.insert(Clause{a});
+      ++n_promoted_;
+    }
+  }
+
+  void AddPromotedLiterals() {
+    assert(decisions_.empty());
+    if (pending_promotions_.empty()) {
+      return;
+    }
+    grounder_.AddClauses(pending_promotions_.begin(), pending_promotions_.end());
+    pending_promotions_.clear();
+    if (++n_promotion_plies_ >= kPromotionPliesPerConsolidation) {
+      grounder_.Consolidate();
+      n_promotion_plies_ = 0;
+    }
+  }
+
+  bool promoted(const Clause& c) const { return promoted_.find(c) != promoted_.end(); }
+
+  void ForgetInvalidLemmas() {
+    assert(decisions_.empty());
+    lemmas_ply_ = grounder_.last_ply_id();
+    const size_t n = lemmas_.size();
+    lemmas_.erase(std::remove_if(lemmas_.begin(), lemmas_.end(),
+                                 [this](const Lemma& l) { return !grounder_.IsAlive(l.ply); }),
+                  lemmas_.end());
+    if (lemmas_.size() != n) {
+      lemma_index_.clear();
+      for (size_t i = 0; i < lemmas_.size(); ++i) {
+        const Clause& c = lemmas_[i].clause;
+        for (const Literal a : c) {
+          lemma_index_[a].push_back(i);
+        }
+      }
+    }
+  }
+
+  void Learn(Literal a) {
+    if (lemmas_.size() >= kMaxLemmas) {
+      return;
+    }
+    std::vector<Literal> lits;
+    lits.push_back(a.flip());
+    for (const Literal b : decisions_) {
+      if (grounder_.Connected(a.lhs(), b.lhs())) {
+        if (std::find(fresh_decisions_.begin(), fresh_decisions_.end(), b) != fresh_decisions_.end()) {
+          return;
+        }
+        lits.push_back(b.flip());
+      }
+    }
+    const Clause c(lits.begin(), lits.end());
+    for (const Literal b : c) {
+      lemma_index_[b].push_back(lemmas_.size());
+    }
+    lemmas_.push_back(Lemma(lemmas_ply_, c));
+  }
+
+  bool Splittable(Term t) const { return !query_components_only_ || grounder_.InQueryComponent(t); }
+
+  // A lemma may mention a name that occurred only in the query it was learned
+  // in. Once that name is back in the pool and re-used as an additional name,
+  // the lemma says nothing about it.
+  bool Refuted(Literal a) const {
+    auto it = lemma_index_.find(a.flip());
+    if (it == lemma_index_.end() || !grounder_.IsOccurringName(a.rhs())) {
+      return false;
+    }
+    return std::any_of(it->second.begin(), it->second.end(), [this, a](size_t i) {
+      return lemmas_[i].clause.all([this, a](Literal b) {
+        return b == a.flip() || std::find(decisions_.begin(), decisions_.end(), b.flip()) != decisions_.end();
+      });
+    });
+  }
+
+  // Plan is a query compiled into negation normal form, which Reduce()
+  // evaluates at the leaves of the split tree. Compiling the query once avoids
+  // building new formulas for every negation and quantifier instance at every
+  // leaf. Nested conjunctions and disjunctions are flattened and their operands
+  // ordered by estimated cost, so evaluation short-circuits early. The nodes
+  // are stored in pre-order, and each node spans its subtree.
+  struct Plan {
+    enum Type { kClause, kAnd, kOr, kForall, kExists };
+
+    struct Node {
+      Node(Type type, Term x = Term()) : type(type), x(x) {}
+      explicit Node(const Clause& c) : type(kClause), clause(c), ground(c.ground()), valid(ground && c.valid()) {}
+
+      Type type;
+      size_t size = 1;  // number of nodes in the subtree
+      Clause clause;    // for kClause
+      Term x;           // for kForall, kExists
+      bool ground = true;
+      bool valid = false;
+    };
+
+    std::vector<Node> nodes;
+    size_t cost = 0;
+  };
+
+  typedef std::vector<std::pair<Term, Term>> Bindings;
+
+  Plan Compile(const Formula& phi, bool neg = false) {
     assert(phi.objective());
     switch (phi.type()) {
       case Formula::kAtomic: {
-        const Clause c = phi.as_atomic().arg();
-        assert(c.ground());
-        assert(c.valid() || c.primitive());
-        return c.valid() || setup().Subsumes(c);
-      }
-      case Formula::kNot: {
-        switch (phi.as_not().arg().type()) {
-          case Formula::kAtomic: {
-            const Clause c = phi.as_not().arg().as_atomic().arg();
-            return std::all_of(c.begin(), c.end(), [this](Literal a) {
-              Formula::Ref psi = Formula::Factory::Atomic(Clause{a.flip()});
-              return Reduce(*psi);
-            });
-          }
-          case Formula::kNot: {
-            return Reduce(phi.as_not().arg().as_not().arg());
-          }
-          case Formula::kOr: {
-            Formula::Ref left = Formula::Factory::Not(phi.as_not().arg().as_or().lhs().Clone());
-            Formula::Ref right = Formula::Factory::Not(phi.as_not().arg().as_or().rhs().Clone());
-            return Reduce(*left) && Reduce(*right);
-          }
-          case Formula::kExists: {
-            const Term x = phi.as_not().arg().as_exists().x();
-            const Formula& psi = phi.as_not().arg().as_exists().arg();
-            const SortedTermSet& xs = psi.free_vars();
-            if (xs.all_empty()) {
-              Formula::Ref xi = Formula::Factory::Not(psi.Clone());
-              return Reduce(*xi);
-            } else {
-              const Grounder::Names ns = grounder_.names(x.sort());
-              assert(ns.begin() != ns.end());
-              return std::all_of(ns.begin(), ns.end(), [this, &psi, x](const Term n) {
-                Formula::Ref xi = Formula::Factory::Not(psi.Clone());
-                xi->SubstituteFree(Term::Substitution(x, n), tf_);
-                return Reduce(*xi);
-              });
-            }
-          }
-          case Formula::kKnow:
-          case Formula::kCons:
-          case Formula::kBel:
-          case Formula::kGuarantee:
-            assert(false);
-            break;
+        if (neg) {
+          return Junction(Plan::kAnd, phi, neg);
         }
+        Plan plan;
+        plan.nodes.push_back(Plan::Node(phi.as_atomic().arg()));
+        plan.cost = 1;
+        return plan;
       }
-      case Formula::kOr: {
-        const Formula& left = phi.as_or().lhs();
-        const Formula& right = phi.as_or().rhs();
-        return Reduce(left) || Reduce(right);
-      }
+      case Formula::kNot:
+        return Compile(phi.as_not().arg(), !neg);
+      case Formula::kOr:
+        return Junction(neg ? Plan::kAnd : Plan::kOr, phi, neg);
       case Formula::kExists: {
         const Term x = phi.as_exists().x();
         const Formula& psi = phi.as_exists().arg();
-        const SortedTermSet& xs = psi.free_vars();
-        if (xs.all_empty()) {
-          return Reduce(psi);
-        } else {
-          const Grounder::Names ns = grounder_.names(x.sort());
-          assert(ns.begin() != ns.end());
-          return std::any_of(ns.begin(), ns.end(), [this, &psi, x](const Term n) {
-            Formula::Ref xi = psi.Clone();
-            xi->SubstituteFree(Term::Substitution(x, n), tf_);
-            return Reduce(*xi);
-          });
+        if (!psi.free_vars().contains(x)) {
+          return Compile(psi, neg);
         }
+        const Grounder::Names ns = grounder_.names(x.sort());
+        const Plan arg = Compile(psi, neg);
+        Plan plan;
+        plan.nodes.push_back(Plan::Node(neg ? Plan::kForall : Plan::kExists, x));
+        plan.nodes.insert(plan.nodes.end(), arg.nodes.begin(), arg.nodes.end());
+        plan.nodes.front().size = plan.nodes.size();
+        plan.cost = 1 + arg.cost * std::max<size_t>(1, std::distance(ns.begin(), ns.end()));
+        return plan;
       }
       case Formula::kKnow:
       case Formula::kCons:
       case Formula::kBel:
       case Formula::kGuarantee:
         assert(false);
-        return false;
+        break;
+    }
+    return Plan();
+  }
+
+  Plan Junction(Plan::Type type, const Formula& phi, bool neg) {
+    std::vector<Plan> args;
+    Flatten(type, phi, neg, &args);
+    if (args.size() == 1) {
+      return std::move(args.front());
+    }
+    std::stable_sort(args.begin(), args.end(), [](const Plan& p1, const Plan& p2) { return p1.cost < p2.cost; });
+    Plan plan;
+    plan.nodes.push_back(Plan::Node(type));
+    plan.cost = 1;
+    for (const Plan& arg : args) {
+      plan.nodes.insert(plan.nodes.end(), arg.nodes.begin(), arg.nodes.end());
+      plan.cost += arg.cost;
     }
-    throw;
+    plan.nodes.front().size = plan.nodes.size();
+    return plan;
   }
 
+  // Adds the operands of phi (negated if neg) with respect to type to args.
+  void Flatten(Plan::Type type, const Formula& phi, bool neg, std::vector<Plan>* args) {
+    switch (phi.type()) {
+      case Formula::kNot:
+        Flatten(type, phi.as_not().arg(), !neg, args);
+        return;
+      case Formula::kOr:
+        if ((type == Plan::kOr) != neg) {
+          Flatten(type, phi.as_or().lhs(), neg, args);
+          Flatten(type, phi.as_or().rhs(), neg, args);
+          return;
+        }
+        break;
+      case Formula::kAtomic:
+        if (type == Plan::kAnd && neg) {
+          for (const Literal a : phi.as_atomic().arg()) {
+            Plan plan;
+            plan.nodes.push_back(Plan::Node(Clause{a.flip()}));
+            plan.cost = 1;
+            args->push_back(std::move(plan));
+          }
+          return;
+        }
+        break;
+      default:
+        break;
+    }
+    args->push_back(Compile(phi, neg));
+  }
+
+  bool Reduce(const Plan& plan) {
+    Bindings bindings;
+    return Reduce(plan, 0, &bindings);
+  }
+
+  bool Reduce(const Plan& plan, size_t i, Bindings* bindings) {
+    const Plan::Node& node = plan.nodes[i];
+    switch (node.type) {
+      case Plan::kClause: {
+        if (node.ground) {
+          assert(node.valid || node.clause.primitive());
+          return node.valid || setup().Subsumes(node.clause);
+        }
+        const Clause c = node.clause.Substitute([bindings](Term t) {
+          for (auto it = bindings->rbegin(); it != bindings->rend(); ++it) {
+            if (it->first == t) {
+              return internal::Just(it->second);
+            }
+          }
+          return internal::Maybe<Term>(internal::Nothing);
+        }, tf_);
+        assert(c.ground());
+        assert(c.valid() || c.primitive());
+        return c.valid() || setup().Subsumes(c);
+      }
+      case Plan::kAnd:
+      case Plan::kOr: {
+        const bool conj = node.type == Plan::kAnd;
+        for (size_t j = i + 1; j < i + node.size; j += plan.nodes[j].size) {
+          if (Reduce(plan, j, bindings) != conj) {
+            return !conj;
+          }
+        }
+        return conj;
+      }
+      case Plan::kForall:
+      case Plan::kExists: {
+        const bool conj = node.type == Plan::kForall;
+        const Grounder::Names ns = grounder_.names(node.x.sort());
+        assert(ns.begin() != ns.end());
+        for (const Term n : ns) {
+          bindings->push_back(std::make_pair(node.x, n));
+          const bool r = Reduce(plan, i + 1, bindings);
+          bindings->pop_back();
+          if (r != conj) {
+            return !conj;
+          }
+        }
+        return conj;
+      }
+    }
+    assert(false);
+    return false;
+  }
+
+  // Frontier records the split tree across the levels of EntailsUpTo() and
+  // DeterminesUpTo(). Node 0 is the root, and a node's children are indexed by
+  // split literal. A node is closed once Split() succeeded below it or its
+  // literal was found inconsistent; the result then also holds at every higher
+  // level, because a split tree that succeeds still succeeds when its leaves
+  // are split further.
+  template<typename T>
+  class Frontier {
+   public:
+    Frontier() : nodes_(1) {}
+
+    size_t Child(size_t node, Literal a) {
+      auto it = nodes_[node].children.find(a);
+      if (it != nodes_[node].children.end()) {
+        return it->second;
+      }
+      const size_t child = nodes_.size();
+      nodes_[node].children[a] = child;
+      nodes_.emplace_back();
+      return child;
+    }
+
+    bool closed(size_t node) const { return nodes_[node].closed; }
+    const T& result(size_t node) const { return nodes_[node].result; }
+
+    void Close(size_t node, const T& result) {
+      nodes_[node].closed = true;
+      nodes_[node].result = result;
+    }
+
+   private:
+    struct Node {
+      std::unordered_map<Literal, size_t> children;
+      bool closed = false;
+      T result = T();
+    };
+
+    std::vector<Node> nodes_;
+  };
+
   template<typename T, typename GoalPredicate, typename MergeResultPredicate>
-  T Split(int k, GoalPredicate goal, MergeResultPredicate merge, T inconsistent_result, T unsuccessful_result) {
+  T Split(int k, GoalPredicate goal, MergeResultPredicate merge, T inconsistent_result, T unsuccessful_result,
+          Frontier<T>* frontier = nullptr, size_t node = 0) {
     if (setup().contains_empty_clause()) {
       return unsuccessful_result;
     }
@@ -212,27 +954,57 @@ class Solver {
       return goal();
     }
     bool recursed = false;
+    std::vector<Term> failed_terms;
     for (const Term t : grounder_.lhs_terms()) {
-      if (setup().Determines(t)) {
+      if (!Splittable(t) || setup().Determines(t) || Symmetric(t, failed_terms)) {
         continue;
       }
       auto merged_result = unsuccessful_result;
+      std::vector<Term> split_names;
       for (const Term n : grounder_.rhs_names(t)) {
-        Grounder::Undo undo;
-        const Setup::Result add_result = grounder_.AddClause(Clause{Literal::Eq(t, n)}, &undo);
-        if (add_result == Setup::kInconsistent) {
-          merged_result = !merged_result ? inconsistent_result : merge(merged_result, inconsistent_result);
+        if (Symmetric(n, split_names, t)) {
+          continue;
+        }
+        if (!symmetry_classes_.empty()) {
+          split_names.push_back(n);
+        }
+        const Literal a = Literal::Eq(t, n);
+        const size_t child = frontier ? frontier->Child(node, a) : 0;
+        if (frontier && frontier->closed(child)) {
+          const T& closed_result = frontier->result(child);
+          merged_result = !merged_result ? closed_result : merge(merged_result, closed_result);
           if (!merged_result) {
             goto next_term;
           }
           recursed = true;
           goto next_name;
         }
+        if (!SpendSplit()) {
+          return unsuccessful_result;
+        }
         {
-          const T split_result = Split(k-1, goal, merge, inconsistent_result, unsuccessful_result);
+          const bool fresh = !grounder_.IsOccurringName(n);
+          Grounder::Undo undo;
+          if (!AddSplitLiteral(a, fresh, &undo)) {
+            if (frontier) {
+              frontier->Close(child, inconsistent_result);
+            }
+            merged_result = !merged_result ? inconsistent_result : merge(merged_result, inconsistent_result);
+            if (!merged_result) {
+              goto next_term;
+            }
+            recursed = true;
+            goto next_name;
+          }
+          PushDecision(a, fresh);
+          const T split_result = Split(k-1, goal, merge, inconsistent_result, unsuccessful_result, frontier, child);
+          PopDecision(a, fresh);
           if (!split_result) {
             goto next_term;
           }
+          if (frontier) {
+            frontier->Close(child, split_result);
+          }
           merged_result = !merged_result ? split_result : merge(merged_result, split_result);
         }
         if (!merged_result) {
@@ -244,27 +1016,340 @@ next_name:
       }
       return merged_result;
 next_term:
-      {}
+      if (!symmetry_classes_.empty()) {
+        failed_terms.push_back(t);
+      }
     }
     return recursed ? unsuccessful_result : goal();
   }
 
+  static internal::Maybe<Term> MergeDetermined(internal::Maybe<Term> r1, internal::Maybe<Term> r2) {
+    return r1 && r2 && r1.val == r2.val ? r1 :
+           r1 && r2 && r1.val.null()    ? r2 :
+           r1 && r2 && r2.val.null()    ? r1 :
+                                          internal::Nothing;
+  }
+
+  // SplitAll() evaluates several goals in a single split tree. The result for
+  // each goal is the same as Split() would compute for that goal alone: a goal
+  // drops out of a term's split as soon as some branch fails for it, and only
+  // the goals that remain open proceed to the next term. The goals are given
+  // as indices passed to goal().
+  template<typename T, typename GoalPredicate, typename MergeResultPredicate>
+  std::vector<T> SplitAll(int k,
+                          const std::vector<size_t>& goals,
+                          GoalPredicate goal,
+                          MergeResultPredicate merge,
+                          T inconsistent_result,
+                          T unsuccessful_result) {
+    std::vector<T> results(goals.size(), unsuccessful_result);
+    if (setup().contains_empty_clause()) {
+      return results;
+    }
+    if (k == 0) {
+      for (size_t i = 0; i < goals.size(); ++i) {
+        results[i] = goal(goals[i]);
+      }
+      return results;
+    }
+    std::vector<bool> recursed(goals.size(), false);
+    std::vector<size_t> open(goals.size());
+    for (size_t i = 0; i < goals.size(); ++i) {
+      open[i] = i;
+    }
+    std::vector<T> merged_results(goals.size(), unsuccessful_result);
+    for (const Term t : grounder_.lhs_terms()) {
+      if (open.empty()) {
+        break;
+      }
+      if (!Splittable(t) || setup().Determines(t)) {
+        continue;
+      }
+      std::vector<size_t> alive = open;
+      for (const size_t i : alive) {
+        merged_results[i] = unsuccessful_result;
+      }
+      for (const Term n : grounder_.rhs_names(t)) {
+        if (alive.empty()) {
+          break;
+        }
+        if (!SpendSplit()) {
+          return results;
+        }
+        const Literal a = Literal::Eq(t, n);
+        const bool fresh = !grounder_.IsOccurringName(n);
+        Grounder::Undo undo;
+        if (!AddSplitLiteral(a, fresh, &undo)) {
+          alive.erase(std::remove_if(alive.begin(), alive.end(), [&](size_t i) {
+            auto&& merged_result = merged_results[i];  // proxy if T is bool
+            merged_result = !merged_result ? inconsistent_result : merge(merged_result, inconsistent_result);
+            recursed[i] = recursed[i] || static_cast<bool>(merged_result);
+            return !merged_result;
+          }), alive.end());
+          continue;
+        }
+        std::vector<size_t> sub_goals;
+        sub_goals.reserve(alive.size());
+        for (const size_t i : alive) {
+          sub_goals.push_back(goals[i]);
+        }
+        PushDecision(a, fresh);
+        const std::vector<T> split_results =
+            SplitAll(k-1, sub_goals, goal, merge, inconsistent_result, unsuccessful_result);
+        PopDecision(a, fresh);
+        size_t j = 0;
+        alive.erase(std::remove_if(alive.begin(), alive.end(), [&](size_t i) {
+          const T& split_result = split_results[j++];
+          if (!split_result) {
+            return true;
+          }
+          auto&& merged_result = merged_results[i];  // proxy if T is bool
+          merged_result = !merged_result ? split_result : merge(merged_result, split_result);
+          recursed[i] = recursed[i] || static_cast<bool>(merged_result);
+          return !merged_result;
+        }), alive.end());
+      }
+      for (const size_t i : alive) {
+        results[i] = merged_results[i];
+      }
+      open.erase(std::remove_if(open.begin(), open.end(), [&alive](size_t i) {
+        return std::binary_search(alive.begin(), alive.end(), i);
+      }), open.end());
+    }
+    for (const size_t i : open) {
+      results[i] = recursed[i] ? unsuccessful_result : goal(goals[i]);
+    }
+    return results;
+  }
+
+  // Adds the split literal a unless it is refuted by a lemma. Returns false if
+  // a is inconsistent; in that case a lemma is learned unless a is fresh.
+  bool AddSplitLiteral(Literal a, bool fresh, Grounder::Undo* undo) {
+    if (Refuted(a)) {
+      return false;
+    }
+    if (grounder_.AddClause(Clause{a}, undo) == Setup::kInconsistent) {
+      if (!fresh) {
+        Learn(a);
+      }
+      return false;
+    }
+    return true;
+  }
+
+  // FindSymmetries() fills symmetry_classes_ with the split terms and the names
+  // that occur in the setup, except for those mentioned by phi. Two terms or
+  // names are in the same class iff swapping them maps the clauses of the setup
+  // and the split names of the terms onto themselves. Since these
+  // transpositions compose, it suffices to compare each term or name with one
+  // representative per class, and only candidates with the same occurrences up
+  // to the swap are compared at all.
+  void FindSymmetries(const Formula& phi) {
+    symmetry_classes_.clear();
+    std::unordered_set<Symbol> query_symbols;
+    phi.Traverse([&query_symbols](Term t) { query_symbols.insert(t.symbol()); return true; });
+    // facts[0] are the clauses and cardinality constraints of the setup, where
+    // a clause is the constraint that at least one of its literals holds, and
+    // an all-different constraint is broken down into the constraints that
+    // every term takes one of the names and every name is taken by at most
+    // one (or, for permutations, exactly one) of the terms. facts[1] are the
+    // split literals t=n for the terms of the query component and their
+    // occurring split names.
+    std::vector<Cardinality> facts[2];
+    for (size_t i : setup().clauses()) {
+      facts[0].push_back(Cardinality::AtLeast(1, setup().clause(i)));
+    }
+    facts[0].insert(facts[0].end(), setup().cardinalities().begin(), setup().cardinalities().end());
+    for (const AllDifferent& c : setup().all_differents()) {
+      for (const Term t : c.terms()) {
+        auto r = internal::transform_range(c.names().begin(), c.names().end(), [t](Term n) {
+          return Literal::Eq(t, n);
+        });
+        facts[0].push_back(Cardinality::AtLeast(1, r.begin(), r.end()));
+      }
+      for (const Term n : c.names()) {
+        auto r = internal::transform_range(c.terms().begin(), c.terms().end(), [n](Term t) {
+          return Literal::Eq(t, n);
+        });
+        facts[0].push_back(Cardinality::AtMost(1, r.begin(), r.end()));
+        if (c.permutation()) {
+          facts[0].push_back(Cardinality::AtLeast(1, r.begin(), r.end()));
+        }
+      }
+    }
+    for (const Term t : grounder_.lhs_terms()) {
+      if (Splittable(t)) {
+        for (const Term n : grounder_.rhs_names(t)) {
+          if (grounder_.IsOccurringName(n)) {
+            facts[1].push_back(Cardinality::AtLeast(1, Clause{Literal::Eq(t, n)}));
+          }
+        }
+      }
+    }
+    const std::unordered_set<Cardinality> fact_sets[2] = {
+      std::unordered_set<Cardinality>(facts[0].begin(), facts[0].end()),
+      std::unordered_set<Cardinality>(facts[1].begin(), facts[1].end())
+    };
+    struct Occurrences {
+      std::vector<internal::u64> signature;
+      std::vector<std::pair<size_t, size_t>> facts;
+    };
+    std::unordered_map<Term, Occurrences> occurrences;
+    for (size_t f = 0; f < 2; ++f) {
+      for (size_t i = 0; i < facts[f].size(); ++i) {
+        const Clause& c = facts[f][i].lits();
+        const internal::u64 kind = (static_cast<internal::u64>(f) << 63) |
+                                   (static_cast<internal::u64>(c.size()) << 48) |
+                                   (static_cast<internal::u64>(facts[f][i].k() & 0x3) << 61);
+        for (const Literal a : c) {
+          const Term t = a.lhs();
+          if (Splittable(t) && query_symbols.find(t.symbol()) == query_symbols.end()) {
+            Occurrences& occ = occurrences[t];
+            occ.signature.push_back(kind | (static_cast<internal::u64>(a.pos()) << 46) | a.rhs().hash());
+            occ.facts.push_back(std::make_pair(f, i));
+          }
+          for (size_t j = 0; j <= t.arity(); ++j) {
+            const Term n = j == 0 ? a.rhs() : t.arg(j - 1);
+            if (n.name() && query_symbols.find(n.symbol()) == query_symbols.end()) {
+              Occurrences& occ = occurrences[n];
+              occ.signature.push_back(kind | (static_cast<internal::u64>(a.pos()) << 46) |
+                                      (static_cast<internal::u64>(j) << 38) | t.symbol().hash());
+              occ.facts.push_back(std::make_pair(f, i));
+            }
+          }
+        }
+      }
+    }
+    auto interchangeable = [this, &facts, &fact_sets, &occurrences](Term x, Term y) {
+      auto theta = [x, y](Term t) -> internal::Maybe<Term> {
+        return t == x ? internal::Just(y) : t == y ? internal::Just(x) : internal::Nothing;
+      };
+      for (const Term z : {x, y}) {
+        for (const std::pair<size_t, size_t>& fi : occurrences[z].facts) {
+          const Cardinality c = facts[fi.first][fi.second].Substitute(theta, tf_);
+          if (fact_sets[fi.first].find(c) == fact_sets[fi.first].end()) {
+            return false;
+          }
+        }
+      }
+      return true;
+    };
+    std::map<std::vector<internal::u64>, std::vector<Term>> representatives;
+    for (auto& p : occurrences) {
+      const Term t = p.first;
+      std::vector<internal::u64>& sig = p.second.signature;
+      std::sort(sig.begin(), sig.end());
+      sig.push_back((static_cast<internal::u64>(t.name()) << 32) | t.sort());
+      std::vector<Term>& reps = representatives[sig];
+      auto r = std::find_if(reps.begin(), reps.end(), [&interchangeable, t](Term r) { return interchangeable(r, t); });
+      size_t id;
+      if (r != reps.end()) {
+        id = symmetry_classes_[*r];
+      } else {
+        id = symmetry_classes_.size();
+        reps.push_back(t);
+      }
+      symmetry_classes_[t] = id;
+    }
+  }
+
+  // True iff x is interchangeable with some y from ys at the current node of
+  // the split tree: both are in the same symmetry class, and neither is
+  // mentioned by the decisions or by the term fixed.
+  bool Symmetric(Term x, const std::vector<Term>& ys, Term fixed = Term()) const {
+    if (symmetry_classes_.empty() || ys.empty() || !fresh_decisions_.empty()) {
+      return false;
+    }
+    auto it = symmetry_classes_.find(x);
+    if (it == symmetry_classes_.end()) {
+      return false;
+    }
+    auto distinguished = [this, fixed](Term z) {
+      return (!fixed.null() && fixed.Mentions(z)) ||
+          std::any_of(decisions_.begin(), decisions_.end(), [z](Literal a) {
+            return a.lhs().Mentions(z) || a.rhs() == z;
+          });
+    };
+    if (distinguished(x)) {
+      return false;
+    }
+    return std::any_of(ys.begin(), ys.end(), [this, it, &distinguished](Term y) {
+      auto jt = symmetry_classes_.find(y);
+      return jt != symmetry_classes_.end() && jt->second == it->second && !distinguished(y);
+    });
+  }
+
+  void PushDecision(Literal a, bool fresh) {
+    decisions_.push_back(a);
+    if (fresh) {
+      fresh_decisions_.push_back(a);
+    }
+  }
+
+  void PopDecision(Literal a, bool fresh) {
+    assert(decisions_.back() == a);
+    if (fresh) {
+      assert(fresh_decisions_.back() == a);
+      fresh_decisions_.pop_back();
+    }
+    decisions_.pop_back();
+  }
+
+  void StartBudget() { StartBudget(budget_); }
+
+  void StartBudget(const Budget& budget) {
+    splits_left_ = budget.max_splits;
+    deadline_ = budget.deadline;
+    if (budget.max_time != Budget::Clock::duration::max()) {
+      const Budget::Clock::time_point now = Budget::Clock::now();
+      if (budget.max_time < deadline_ - now) {
+        deadline_ = now + budget.max_time;
+      }
+    }
+    cancel_ = budget.cancel;
+    budget_exhausted_ = false;
+  }
+
+  // Returns false if no more literal may be split.
+  bool SpendSplit() {
+    if (!budget_exhausted_) {
+      budget_exhausted_ = splits_left_ == 0 ||
+          (cancel_ && cancel_->load(std::memory_order_relaxed)) ||
+          (deadline_ != Budget::Clock::time_point::max() && Budget::Clock::now() >= deadline_);
+      if (!budget_exhausted_) {
+        --splits_left_;
+      }
+    }
+    return !budget_exhausted_;
+  }
+
   template<typename GoalPredicate>
   bool Fix(int k, GoalPredicate goal) {
     if (setup().Subsumes(Clause{})) {
       return false;
     }
     if (k > 0) {
+      const bool all_terms = !query_components_only_ || !setup().Consistent();
       std::unordered_set<Literal> as;
       for (const Term t : grounder_.lhs_terms()) {
+        if (!all_terms && !grounder_.InQueryComponent(t)) {
+          continue;
+        }
         for (const Term n : grounder_.rhs_names(t)) {
+          if (!SpendSplit()) {
+            return false;
+          }
           {
             const Literal a = Literal::Eq(t, n);
-            Grounder::Undo undo;
-            const Setup::Result add_result = grounder_.AddClause(Clause{a}, &undo, true);
-            const bool succ = add_result != Setup::kSubsumed && Fix(k-1, goal);
-            if (succ) {
-              return true;
+            if (!Refuted(a)) {
+              Grounder::Undo undo;
+              const Setup::Result add_result = grounder_.AddClause(Clause{a}, &undo, true);
+              decisions_.push_back(a);
+              const bool succ = add_result != Setup::kSubsumed && Fix(k-1, goal);
+              decisions_.pop_back();
+              if (succ) {
+                return true;
+              }
             }
           }
           {
@@ -284,8 +1369,83 @@ next_term:
     return setup().Consistent() && goal();
   }
 
+  // FixAll() traverses the same tree as Fix() and removes from open every goal
+  // that holds at some consistent node. It stops when open is empty. Hence a
+  // goal remains in open iff Fix() would fail for it.
+  template<typename GoalPredicate>
+  void FixAll(int k, std::vector<size_t>* open, GoalPredicate goal) {
+    if (setup().Subsumes(Clause{})) {
+      return;
+    }
+    if (k > 0) {
+      const bool all_terms = !query_components_only_ || !setup().Consistent();
+      std::unordered_set<Literal> as;
+      for (const Term t : grounder_.lhs_terms()) {
+        if (!all_terms && !grounder_.InQueryComponent(t)) {
+          continue;
+        }
+        for (const Term n : grounder_.rhs_names(t)) {
+          if (!SpendSplit()) {
+            return;
+          }
+          {
+            const Literal a = Literal::Eq(t, n);
+            if (!Refuted(a)) {
+              Grounder::Undo undo;
+              const Setup::Result add_result = grounder_.AddClause(Clause{a}, &undo, true);
+              decisions_.push_back(a);
+              if (add_result != Setup::kSubsumed) {
+                FixAll(k-1, open, goal);
+              }
+              decisions_.pop_back();
+              if (open->empty()) {
+                return;
+              }
+            }
+          }
+          {
+            const Literal a = grounder_.Variablify(Literal::Eq(t, n));
+            if (!as.insert(a).second) {
+              Grounder::Undo undo;
+              const Setup::Result add_result = grounder_.AddClause(Clause{a}, &undo, true);
+              if (add_result != Setup::kSubsumed) {
+                FixAll(k-1, open, goal);
+              }
+              if (open->empty()) {
+                return;
+              }
+            }
+          }
+        }
+      }
+    }
+    if (setup().Consistent()) {
+      open->erase(std::remove_if(open->begin(), open->end(), goal), open->end());
+    }
+  }
+
+  Solver(Term::Factory* tf, Grounder&& grounder) : tf_(tf), grounder_(std::move(grounder)) {}
+
   Term::Factory* tf_;
   Grounder grounder_;
+  std::vector<Literal> decisions_;  // ground literals assumed by Split() and Fix()
+  std::vector<Literal> fresh_decisions_;  // literals in decisions_ whose names did not occur before Split()
+  std::vector<Lemma> lemmas_;
+  std::unordered_map<Literal, std::vector<size_t>> lemma_index_;
+  Grounder::PlyId lemmas_ply_ = 0;
+  bool promote_ = false;
+  size_t n_promoted_ = 0;
+  std::unordered_set<Clause> promoted_;
+  std::vector<Clause> pending_promotions_;  // promoted_ but not yet added to grounder_
+  size_t n_promotion_plies_ = 0;            // plies of promoted literals since the last consolidation
+  bool prune_symmetries_ = false;
+  bool query_components_only_ = false;
+  std::unordered_map<Term, size_t> symmetry_classes_;  // see FindSymmetries()
+  Budget budget_;
+  size_t splits_left_ = std::numeric_limits<size_t>::max();
+  Budget::Clock::time_point deadline_ = Budget::Clock::time_point::max();
+  const std::atomic<bool>* cancel_ = nullptr;
+  bool budget_exhausted_ = false;
 };
 
 }  // namespace limbo
@@ -25,6 +25,31 @@
 // In particular, exploits that Term::name() is encoded in Term::id(). That way
 // certain operations on Terms and Literals can be expressed as bitwise
 // operations on their integer representations.
+//
+// Term::Factory::CreateTerm() and the Symbol::Factory methods may be called
+// concurrently from multiple threads. Interned terms are never moved in
+// memory, so accessing existing terms does not require synchronization.
+//
+// Term::Factory::Collect() frees the terms that are not reachable from the
+// given roots, which can be anything with a Traverse() method for Terms, such
+// as Clauses, Setups, Grounders, Solvers, and KnowledgeBases. The ids of the
+// freed terms are recycled by later CreateTerm() calls, so a long-running
+// process that repeatedly creates and discards terms stays at steady-state
+// memory. The ids of live terms are left unchanged, for they are embedded in
+// Literals, hashes, and sorted containers throughout. Collect() must not run
+// concurrently with any other use of terms, and a term that is not reachable
+// from the roots must not be used afterwards. Symbols are plain integers that
+// own no memory, so Symbol::Factory has nothing to collect.
+//
+// Besides the process-wide instances, factories can be created and destroyed
+// like any other object, so that independent Solvers or KnowledgeBases can
+// work on separate term tables with their own lifetimes. Since a Term is just
+// an index, it is resolved by the Term::Factory that is current on the calling
+// thread: the one of the innermost live Term::Factory::Scope, or else the
+// process-wide instance. Hence a thread must keep a Scope alive while it works
+// with the terms of a factory instance. Solver, KnowledgeBase, and the format
+// Contexts open a Scope for the factory they were constructed with in their
+// public methods and in the tasks they hand to other threads.
 
 #ifndef LIMBO_TERM_H_
 #define LIMBO_TERM_H_
@@ -32,8 +57,10 @@
 #include <cassert>
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -90,17 +117,19 @@ class Symbol {
     Symbol CreateVariable(Sort sort)              { return CreateVariable(++last_variable_, sort); }
     Symbol CreateFunction(Sort sort, Arity arity) { return CreateFunction(++last_function_, sort, arity); }
 
-   private:
     Factory() = default;
     Factory(const Factory&) = delete;
     Factory& operator=(const Factory&) = delete;
     Factory(Factory&&) = delete;
     Factory& operator=(Factory&&) = delete;
 
-    Sort last_sort_ = 0;
-    Id last_function_ = 0;
-    Id last_name_ = 0;
-    Id last_variable_ = 0;
+   private:
+    friend class Snapshot;
+
+    std::atomic<Sort> last_sort_{0};
+    std::atomic<Id> last_function_{0};
+    std::atomic<Id> last_name_{0};
+    std::atomic<Id> last_variable_{0};
   };
 
   bool operator==(Symbol s) const {
@@ -189,6 +218,7 @@ class Term {
 
  private:
   friend class Literal;
+  friend class Snapshot;
 
   typedef internal::u32 u32;
 
@@ -229,7 +259,26 @@ struct Term::Data {
 
 class Term::Factory : private Singleton<Factory> {
  public:
+  // While a Scope is alive, Instance() returns its factory on this thread.
+  class Scope {
+   public:
+    explicit Scope(Factory* tf) : prev_(current()) { current() = tf; }
+    ~Scope() { current() = prev_; }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    Scope(Scope&&) = delete;
+    Scope& operator=(Scope&&) = delete;
+
+   private:
+    Factory* const prev_;
+  };
+
   static Factory* Instance() {
+    Factory* tf = current();
+    if (tf) {
+      return tf;
+    }
     if (instance == nullptr) {
       instance = std::unique_ptr<Factory>(new Factory());
     }
@@ -238,14 +287,11 @@ class Term::Factory : private Singleton<Factory> {
 
   static void Reset() { instance = nullptr; }
 
-  ~Factory() {
-    for (Data* data : name_heap_) {
-      delete data;
-    }
-    for (Data* data : variable_and_function_heap_) {
-      delete data;
-    }
-  }
+  Factory() = default;
+  Factory(const Factory&) = delete;
+  Factory& operator=(const Factory&) = delete;
+  Factory(Factory&&) = delete;
+  Factory& operator=(Factory&&) = delete;
 
   Term CreateTerm(Symbol symbol) {
     return CreateTerm(symbol, {});
@@ -254,43 +300,194 @@ class Term::Factory : private Singleton<Factory> {
   Term CreateTerm(Symbol symbol, const Vector& args) {
     assert(symbol.arity() == static_cast<Symbol::Arity>(args.size()));
     Data* d = new Data(symbol, args);
+    std::unique_lock<std::mutex> lock(mutex_);
     DataPtrSet* s = &memory_[symbol.sort()];
     auto it = s->find(d);
     if (it == s->end()) {
-      std::vector<Data*>* heap = symbol.name() ? &name_heap_ : &variable_and_function_heap_;
-      heap->push_back(d);
-      const u32 id = (static_cast<u32>(heap->size()) << 1) | static_cast<u32>(symbol.name());
+      Heap* heap = symbol.name() ? &name_heap_ : &variable_and_function_heap_;
+      std::vector<size_t>* free = symbol.name() ? &free_name_slots_ : &free_variable_and_function_slots_;
+      size_t i;
+      if (free->empty()) {
+        i = heap->size();
+        heap->push_back(d);
+      } else {
+        i = free->back();
+        free->pop_back();
+        heap->set(i, d);
+      }
+      const u32 id = (static_cast<u32>(i + 1) << 1) | static_cast<u32>(symbol.name());
       s->insert(std::make_pair(d, id));
       return Term(id);
     } else {
       const u32 id = it->second;
+      lock.unlock();
       delete d;
       return Term(id);
     }
   }
 
   const Data* get(u32 id) const {
-    if ((id & 1) == 1) {
-      return name_heap_[(id >> 1) - 1];
-    } else {
-      return variable_and_function_heap_[(id >> 1) - 1];
+    const Data* d = (id & 1) == 1 ? name_heap_[(id >> 1) - 1] : variable_and_function_heap_[(id >> 1) - 1];
+    assert(d);
+    return d;
+  }
+
+  // Marks a term and, recursively, its arguments as reachable. It returns
+  // false so that a Traverse() does not descend into the arguments again.
+  class Marker {
+   public:
+    bool operator()(Term t) const {
+      if (t.null()) {
+        return false;
+      }
+      const u32 id = t.id();
+      std::vector<bool>* marks = (id & 1) == 1 ? name_marks_ : variable_and_function_marks_;
+      const size_t i = (id >> 1) - 1;
+      if (!(*marks)[i]) {
+        (*marks)[i] = true;
+        for (const Term arg : owner_->get(id)->args) {
+          (*this)(arg);
+        }
+      }
+      return false;
     }
+
+   private:
+    friend class Factory;
+
+    Marker(const Factory* owner, std::vector<bool>* name_marks, std::vector<bool>* variable_and_function_marks)
+        : owner_(owner), name_marks_(name_marks), variable_and_function_marks_(variable_and_function_marks) {}
+
+    const Factory* const owner_;
+    std::vector<bool>* const name_marks_;
+    std::vector<bool>* const variable_and_function_marks_;
+  };
+
+  // Frees all terms that are not reachable from roots and returns their
+  // number.
+  template<typename... Roots>
+  size_t Collect(const Roots&... roots) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::vector<bool> name_marks(name_heap_.size(), false);
+    std::vector<bool> variable_and_function_marks(variable_and_function_heap_.size(), false);
+    const Marker marker(this, &name_marks, &variable_and_function_marks);
+    MarkRoots(marker, roots...);
+    return Sweep(name_marks, &name_heap_, &free_name_slots_) +
+        Sweep(variable_and_function_marks, &variable_and_function_heap_, &free_variable_and_function_slots_);
+  }
+
+  // The number of terms that are currently interned.
+  size_t n_terms() const {
+    return name_heap_.size() + variable_and_function_heap_.size() -
+        free_name_slots_.size() - free_variable_and_function_slots_.size();
   }
 
  private:
+  friend class Snapshot;
+
   struct DataPtrHash { internal::hash32_t operator()(const Term::Data* d) const { return d->hash(); } };
   struct DataPtrEquals { bool operator()(const Term::Data* a, const Term::Data* b) const { return *a == *b; } };
 
-  Factory() = default;
-  Factory(const Factory&) = delete;
-  Factory& operator=(const Factory&) = delete;
-  Factory(Factory&&) = delete;
-  Factory& operator=(Factory&&) = delete;
+  // Append-only sequence of Data pointers. Unlike std::vector, push_back()
+  // never moves existing elements, so get() needs no lock. Block i holds
+  // 2^(kFirstBlockBits + i) elements.
+  class Heap {
+   public:
+    Heap() = default;
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    ~Heap() {
+      for (size_t i = 0; i < size_; ++i) {
+        delete (*this)[i];
+      }
+      for (Data** block : blocks_) {
+        delete[] block;
+      }
+    }
+
+    size_t size() const { return size_; }
+
+    void set(size_t i, Data* d) {
+      assert(i < size_);
+      const size_t j = i + (size_t(1) << kFirstBlockBits);
+      const size_t b = log2(j);
+      blocks_[b - kFirstBlockBits][j - (size_t(1) << b)] = d;
+    }
+
+    Data* operator[](size_t i) const {
+      const size_t j = i + (size_t(1) << kFirstBlockBits);
+      const size_t b = log2(j);
+      return blocks_[b - kFirstBlockBits][j - (size_t(1) << b)];
+    }
+
+    void push_back(Data* d) {
+      const size_t j = size_ + (size_t(1) << kFirstBlockBits);
+      const size_t b = log2(j);
+      Data**& block = blocks_[b - kFirstBlockBits];
+      if (!block) {
+        block = new Data*[size_t(1) << b];
+      }
+      block[j - (size_t(1) << b)] = d;
+      ++size_;
+    }
+
+   private:
+    static constexpr size_t kFirstBlockBits = 10;
+    static constexpr size_t kBlocks = 33 - kFirstBlockBits;
+
+    static size_t log2(size_t j) {
+      assert(j > 0);
+#if defined(__GNUC__) || defined(__clang__)
+      return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(j);  // NOLINT
+#else
+      size_t b = 0;
+      while (j >>= 1) {
+        ++b;
+      }
+      return b;
+#endif
+    }
+
+    Data** blocks_[kBlocks] = {};
+    size_t size_ = 0;
+  };
+
+  static Factory*& current() {
+    static thread_local Factory* tf = nullptr;
+    return tf;
+  }
+
+  static void MarkRoots(const Marker&) {}
+
+  template<typename Root, typename... Roots>
+  static void MarkRoots(const Marker& marker, const Root& root, const Roots&... roots) {
+    root.Traverse(marker);
+    MarkRoots(marker, roots...);
+  }
+
+  size_t Sweep(const std::vector<bool>& marks, Heap* heap, std::vector<size_t>* free) {
+    size_t n = 0;
+    for (size_t i = 0; i < marks.size(); ++i) {
+      Data* d = (*heap)[i];
+      if (!marks[i] && d) {
+        memory_[d->symbol.sort()].erase(d);
+        heap->set(i, nullptr);
+        free->push_back(i);
+        delete d;
+        ++n;
+      }
+    }
+    return n;
+  }
 
   typedef std::unordered_map<Data*, u32, DataPtrHash, DataPtrEquals> DataPtrSet;
+  std::mutex mutex_;
   internal::IntMap<Symbol::Sort, DataPtrSet> memory_;
-  std::vector<Data*> name_heap_;
-  std::vector<Data*> variable_and_function_heap_;
+  Heap name_heap_;
+  Heap variable_and_function_heap_;
+  std::vector<size_t> free_name_slots_;
+  std::vector<size_t> free_variable_and_function_slots_;
 };
 
 struct Term::Substitution {
@@ -47,6 +47,54 @@ TEST(FormulaTest, substitution) {
   { auto psi = phi(x3,f2); psi->SubstituteFree(Term::Substitution(x3,n1), &tf); EXPECT_EQ(*psi, *phi(n1,f2)); }
 }
 
+TEST(FormulaTest, free_vars_after_substitution) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s1 = sf.CreateSort();
+  const Term n1 = tf.CreateTerm(sf.CreateName(s1));
+  const Term x1 = tf.CreateTerm(sf.CreateVariable(s1));
+  const Term x2 = tf.CreateTerm(sf.CreateVariable(s1));
+  const Term x3 = tf.CreateTerm(sf.CreateVariable(s1));
+  const Term f2 = tf.CreateTerm(sf.CreateFunction(s1, 2), {n1,x2});
+  auto psi = F::Not(F::Exists(x1, F::Atomic(Clause{Literal::Eq(x3,f2), Literal::Eq(x1,n1)})));
+  // The first call caches the free variables, which the substitution changes.
+  EXPECT_TRUE(psi->free_vars().contains(x3));
+  EXPECT_TRUE(psi->free_vars().contains(x2));
+  psi->SubstituteFree(Term::Substitution(x3,n1), &tf);
+  EXPECT_FALSE(psi->free_vars().contains(x3));
+  EXPECT_TRUE(psi->free_vars().contains(x2));
+  EXPECT_FALSE(psi->as_not().arg().free_vars().contains(x3));
+}
+
+TEST(Formula, Rectify) {
+  Context ctx;
+  auto BOOL = ctx.CreateSort();
+  auto True = ctx.CreateName(BOOL);                 REGISTER_SYMBOL(True);
+  auto HUMAN = ctx.CreateSort();
+  auto P = ctx.CreateFunction(BOOL, 1);             REGISTER_SYMBOL(P);
+  auto x = ctx.CreateVariable(HUMAN);               REGISTER_SYMBOL(x);
+  // Every quantifier binds a distinct variable which occurs in its scope.
+  auto rectified = [](const Formula& phi) {
+    std::vector<Term> xs;
+    bool ok = true;
+    phi.Traverse([&xs, &ok](const Formula& alpha) {
+      if (alpha.type() == Formula::kExists) {
+        const Term x = alpha.as_exists().x();
+        ok &= std::find(xs.begin(), xs.end(), x) == xs.end() && alpha.as_exists().arg().free_vars().contains(x);
+        xs.push_back(x);
+      }
+      return true;
+    });
+    return ok && xs.size() == 2;
+  };
+  EXPECT_TRUE(rectified(*(*(Ex(x, P(x) == True) || Ex(x, P(x) != True)))->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(rectified(*(*Ex(x, P(x) == True && Ex(x, P(x) != True)))->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(rectified(*(*Ex(x, Ex(x, P(x) != True) && P(x) == True))->NF(ctx.sf(), ctx.tf())));
+  // Under K and M, NF() relies on the free variables after the renaming.
+  EXPECT_TRUE(rectified(*F::Or(F::Know(1, *Ex(x, P(x) == True)), F::Cons(1, *Ex(x, P(x) != True)))
+                         ->NF(ctx.sf(), ctx.tf())));
+}
+
 TEST(Formula, NF) {
   Context ctx;
   Term::Factory& tf = *ctx.tf();
@@ -118,6 +166,67 @@ TEST(Formula, NF) {
                                                                  Literal::Eq(tf.CreateTerm(Q, {y}), True)
                                                                  }))))));
   }
+
+  {
+    // The second and the inner x are renamed, and the NF stays closed.
+    auto P = ctx.CreateFunction(BOOL, 1);    REGISTER_SYMBOL(P);
+    EXPECT_TRUE((*(Ex(x, P(x) == True) || Ex(x, P(x) != True)))->NF(ctx.sf(), ctx.tf())->free_vars().all_empty());
+    EXPECT_TRUE(F::Or(F::Know(1, *Ex(x, P(x) == True)), F::Cons(1, *Ex(x, P(x) != True)))
+                ->NF(ctx.sf(), ctx.tf())->free_vars().all_empty());
+    EXPECT_TRUE((*Ex(x, P(x) == True && Ex(x, P(x) != True)))->NF(ctx.sf(), ctx.tf())->free_vars().all_empty());
+  }
+}
+
+TEST(Formula, Clausify) {
+  Context ctx;
+  auto BOOL = ctx.CreateSort();
+  auto True = ctx.CreateName(BOOL);                 REGISTER_SYMBOL(True);
+  auto HUMAN = ctx.CreateSort();
+  auto Father = ctx.CreateFunction(HUMAN, 1);       REGISTER_SYMBOL(Father);
+  auto IsParentOf = ctx.CreateFunction(BOOL, 2);    REGISTER_SYMBOL(IsParentOf);
+  auto P = ctx.CreateFunction(BOOL, 0)();           REGISTER_SYMBOL(P);
+  auto Q = ctx.CreateFunction(BOOL, 0)();           REGISTER_SYMBOL(Q);
+  auto R = ctx.CreateFunction(BOOL, 0)();           REGISTER_SYMBOL(R);
+  auto x = ctx.CreateVariable(HUMAN);               REGISTER_SYMBOL(x);
+  auto y = ctx.CreateVariable(HUMAN);               REGISTER_SYMBOL(y);
+  {
+    // A universally quantified clause stays as it is.
+    auto cs = (*Fa(x, IsParentOf(Father(x), x) == True))->Clausify(ctx.sf(), ctx.tf());
+    EXPECT_TRUE(bool(cs));
+    EXPECT_EQ(cs.val.size(), 1u);
+    EXPECT_EQ(cs.val[0].size(), 2u);
+  }
+  {
+    // The conjunction is named by a fresh d, which implies both conjuncts.
+    auto cs = (*((P == True && Q == True) || R == True))->Clausify(ctx.sf(), ctx.tf());
+    EXPECT_TRUE(bool(cs));
+    EXPECT_EQ(cs.val.size(), 3u);
+    Term d = Term();
+    for (const Clause& c : cs.val) {
+      EXPECT_EQ(c.size(), 2u);
+      // (R || d) and (~d || P) and (~d || Q)
+      const bool r = std::any_of(c.begin(), c.end(), [R](Literal a) { return a.lhs() == R; });
+      for (Literal a : c) {
+        if (a.lhs() != P && a.lhs() != Q && a.lhs() != R) {
+          EXPECT_TRUE(d.null() || d == a.lhs());
+          EXPECT_NE(a.lhs().sort(), BOOL);
+          EXPECT_EQ(a.pos(), r);
+          d = a.lhs();
+        }
+      }
+    }
+    EXPECT_FALSE(d.null());
+  }
+  {
+    // Fa x Ex y is Skolemized, and the Skolem term is flattened.
+    auto cs = (*Fa(x, Ex(y, IsParentOf(y, x) == True)))->Clausify(ctx.sf(), ctx.tf());
+    EXPECT_TRUE(bool(cs));
+    EXPECT_EQ(cs.val.size(), 1u);
+    EXPECT_EQ(cs.val[0].size(), 2u);
+    const Clause& c = cs.val[0];
+    EXPECT_TRUE(std::all_of(c.begin(), c.end(), [](Literal a) { return a.quasiprimitive(); }));
+  }
+  EXPECT_FALSE(bool(Formula::Factory::Know(0, (*(P == True))->Clone())->Clausify(ctx.sf(), ctx.tf())));
 }
 
 }  // namespace limbo
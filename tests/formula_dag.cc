@@ -0,0 +1,87 @@
+// vim:filetype=cpp:textwidth=120:shiftwidth=2:softtabstop=2:expandtab
+// Copyright 2014 Christoph Schwering
+
+#include <gtest/gtest.h>
+
+#include <limbo/formula_dag.h>
+#include <limbo/format/output.h>
+
+namespace limbo {
+
+using namespace limbo::format;
+
+typedef Formula::Factory F;
+
+TEST(FormulaDagTest, sharing) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s1 = sf.CreateSort();
+  const Term n1 = tf.CreateTerm(sf.CreateName(s1));
+  const Term n2 = tf.CreateTerm(sf.CreateName(s1));
+  const Term x1 = tf.CreateTerm(sf.CreateVariable(s1));
+  const Term a = tf.CreateTerm(sf.CreateFunction(s1, 0), {});
+  FormulaDag dag(&tf);
+
+  const FormulaDag::Ref p = dag.Atomic(Clause{Literal::Eq(a,n1)});
+  const FormulaDag::Ref q = dag.Atomic(Clause{Literal::Eq(a,n2)});
+  EXPECT_EQ(p, dag.Atomic(Clause{Literal::Eq(a,n1)}));
+  EXPECT_NE(p, q);
+  EXPECT_EQ(dag.Or(p, q), dag.Or(p, q));
+  EXPECT_NE(dag.Or(p, q), dag.Or(q, p));
+  EXPECT_EQ(dag.Not(dag.Or(p, q)), dag.Not(dag.Or(p, q)));
+  EXPECT_EQ(dag.Know(1, p), dag.Know(1, p));
+  EXPECT_NE(dag.Know(1, p), dag.Know(2, p));
+  EXPECT_NE(dag.Know(1, p), dag.Cons(1, p));
+  EXPECT_EQ(dag.Exists(x1, p), dag.Exists(x1, p));
+  EXPECT_TRUE(dag.True()->trivially_valid());
+  EXPECT_TRUE(dag.False()->trivially_invalid());
+  EXPECT_TRUE(dag.Or(p, q)->objective());
+  EXPECT_FALSE(dag.Or(p, dag.Know(0, q))->objective());
+
+  const Formula::Ref alpha = F::Not(F::Exists(x1, F::Or(F::Atomic(Clause{Literal::Eq(a,x1)}),
+                                                         F::Know(1, F::Atomic(Clause{Literal::Neq(a,n1)})))));
+  const FormulaDag::Ref beta = dag.FromFormula(*alpha);
+  EXPECT_EQ(beta, dag.FromFormula(*alpha->Clone()));
+  EXPECT_EQ(*FormulaDag::ToFormula(beta), *alpha);
+}
+
+TEST(FormulaDagTest, substitution) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s1 = sf.CreateSort();
+  const Term n1 = tf.CreateTerm(sf.CreateName(s1));
+  const Term n2 = tf.CreateTerm(sf.CreateName(s1));
+  const Term x1 = tf.CreateTerm(sf.CreateVariable(s1));
+  const Term x2 = tf.CreateTerm(sf.CreateVariable(s1));
+  const Symbol f = sf.CreateFunction(s1, 1);
+  const Term f1 = tf.CreateTerm(f, {x1});
+  const Term f2 = tf.CreateTerm(f, {x2});
+  FormulaDag dag(&tf);
+
+  // f(x1) = x2 || Ex x1. f(x1) /= n1
+  const FormulaDag::Ref shared = dag.Exists(x1, dag.Atomic(Clause{Literal::Neq(f1,n1)}));
+  const FormulaDag::Ref phi = dag.Or(dag.Atomic(Clause{Literal::Eq(f1,x2)}), shared);
+  EXPECT_TRUE(phi->free_vars().contains(x1));
+  EXPECT_TRUE(phi->free_vars().contains(x2));
+  EXPECT_TRUE(shared->free_vars().all_empty());
+
+  // The bound occurrence of x1 is untouched and the node stays shared.
+  const FormulaDag::Ref psi = dag.Substitute(phi, x1, n2);
+  EXPECT_EQ(psi, dag.Or(dag.Atomic(Clause{Literal::Eq(tf.CreateTerm(f, {n2}),x2)}), shared));
+  EXPECT_EQ(&psi->rhs(), shared);
+  EXPECT_EQ(psi, dag.Substitute(phi, x1, n2));
+  EXPECT_EQ(dag.Substitute(shared, x1, n2), shared);
+
+  // Names are substituted everywhere.
+  const FormulaDag::Ref xi = dag.Substitute(psi, n1, x2);
+  EXPECT_EQ(&xi->rhs(), dag.Exists(x1, dag.Atomic(Clause{Literal::Neq(f1,x2)})));
+  EXPECT_TRUE(xi->free_vars().contains(x2));
+  EXPECT_EQ(dag.Substitute(dag.Atomic(Clause{Literal::Eq(f2,n1)}), x2, n1), dag.Atomic(Clause{Literal::Eq(tf.CreateTerm(f, {n1}),n1)}));
+
+  // Traverse() visits the shared subformula only once.
+  int n = 0;
+  FormulaDag::Traverse(dag.Or(shared, dag.Not(shared)), [&n, n1](Term t) { if (t == n1) ++n; return true; });
+  EXPECT_EQ(n, 1);
+}
+
+}  // namespace limbo
@@ -4,11 +4,14 @@
 #include <gtest/gtest.h>
 
 #include <unordered_set>
+#include <vector>
 
 #include <limbo/formula.h>
 #include <limbo/grounder.h>
 #include <limbo/format/output.h>
 
+#include <limbo/internal/threadpool.h>
+
 using limbo::format::operator<<;
 
 namespace limbo {
@@ -129,6 +132,92 @@ TEST(GrounderTest, Ground_SplitTerms_Names) {
   }
 }
 
+TEST(GrounderTest, ParallelReground) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s = sf.CreateSort();                   RegisterSort(s, "");
+  const Term x1 = tf.CreateTerm(sf.CreateVariable(s));      RegisterSymbol(x1.symbol(), "x1");
+  const Term x2 = tf.CreateTerm(sf.CreateVariable(s));      RegisterSymbol(x2.symbol(), "x2");
+  const Term x3 = tf.CreateTerm(sf.CreateVariable(s));      RegisterSymbol(x3.symbol(), "x3");
+  const Symbol a = sf.CreateFunction(s, 0);                 RegisterSymbol(a, "a");
+  const Symbol b = sf.CreateFunction(s, 0);                 RegisterSymbol(b, "b");
+  const Symbol f = sf.CreateFunction(s, 2);                 RegisterSymbol(f, "f");
+  const Symbol g = sf.CreateFunction(s, 1);                 RegisterSymbol(g, "g");
+  std::vector<Literal> as;
+  std::vector<Clause> cs;
+  for (int i = 0; i < 8; ++i) {
+    as.push_back(Literal::Eq(tf.CreateTerm(a), tf.CreateTerm(sf.CreateName(s))));
+    cs.push_back(Clause{Literal::Neq(tf.CreateTerm(b), tf.CreateTerm(sf.CreateName(s)))});
+  }
+  const Clause c = Clause{Literal::Neq(tf.CreateTerm(f, {x1, x2}), x3), Literal::Eq(tf.CreateTerm(g, {x3}), x1)};
+  Grounder gr(&sf, &tf);
+  gr.AddClause(Clause(as.begin(), as.end()));
+  auto ground = [&]() {
+    Grounder::Undo undo1;
+    gr.AddClause(c, &undo1);
+    Grounder::Undo undo2;
+    gr.AddClauses(cs.begin(), cs.end(), &undo2);
+    std::vector<Clause> s;
+    for (size_t i : gr.setup().clauses()) {
+      s.push_back(gr.setup().clause(i));
+    }
+    return s;
+  };
+  const std::vector<Clause> s1 = ground();
+  internal::ThreadPool pool(4);
+  gr.set_thread_pool(&pool);
+  const std::vector<Clause> s2 = ground();
+  EXPECT_GT(s1.size(), 512u);
+  EXPECT_EQ(s1, s2);
+}
+
+TEST(GrounderTest, RelevanceClosure) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s = sf.CreateSort();  RegisterSort(s, "");
+  const Term n = tf.CreateTerm(sf.CreateName(s));
+  const Term m = tf.CreateTerm(sf.CreateName(s));
+  std::vector<Term> ts;
+  for (int i = 0; i < 10; ++i) {
+    ts.push_back(tf.CreateTerm(sf.CreateFunction(s, 0)));
+  }
+  const Term a = ts[0], b = ts[1], c = ts[2], d = ts[3], e = ts[4], f = ts[5], g = ts[6], h = ts[7], i = ts[8], j = ts[9];
+  // a, b, c, d are chained by clauses, d, g, h by a cardinality constraint,
+  // h and i by an all-different constraint, i and j by a clause again.
+  const Clause ab{Literal::Eq(a, n), Literal::Eq(b, n)};
+  const Clause bc{Literal::Eq(b, n), Literal::Eq(c, n)};
+  const Clause cd{Literal::Eq(c, n), Literal::Eq(d, n)};
+  const Clause ef{Literal::Eq(e, n), Literal::Eq(f, n)};
+  const Clause ij{Literal::Eq(i, n), Literal::Eq(j, n)};
+  const Clause dgh{Literal::Eq(d, n), Literal::Eq(g, n), Literal::Eq(h, n)};
+  const Term hi[] = {h, i};
+  const Term nm[] = {n, m};
+  Grounder gr(&sf, &tf);
+  const std::vector<Clause> cs{ij, ef, cd, bc, ab};
+  gr.AddClauses(cs.begin(), cs.end());
+  gr.AddCardinality(Cardinality::AtLeast(2, dgh));
+  gr.AddAllDifferent(AllDifferent(std::begin(hi), std::end(hi), std::begin(nm), std::end(nm)));
+  {
+    Grounder::Undo undo;
+    gr.GuaranteeConsistency(a, &undo);
+    EXPECT_EQ(S(gr.setup()), ClauseSet({ab, bc, cd, ij}));
+    EXPECT_EQ(gr.setup().cardinalities().size(), 1u);
+    EXPECT_EQ(gr.setup().all_differents().size(), 1u);
+  }
+  {
+    Grounder::Undo undo;
+    gr.GuaranteeConsistency(j, &undo);
+    EXPECT_EQ(S(gr.setup()), ClauseSet({ab, bc, cd, ij}));
+  }
+  {
+    Grounder::Undo undo;
+    gr.GuaranteeConsistency(f, &undo);
+    EXPECT_EQ(S(gr.setup()), ClauseSet({ef}));
+    EXPECT_TRUE(gr.setup().cardinalities().empty());
+    EXPECT_TRUE(gr.setup().all_differents().empty());
+  }
+}
+
 #if 0
 TEST(GrounderTest, Ground_SplitTerms_Names) {
   Symbol::Factory& sf = *Symbol::Factory::Instance();
@@ -50,6 +50,26 @@ TEST(IntMapTest, general) {
   EXPECT_EQ(map[4], "four");
 }
 
+TEST(IntMapTest, Zip) {
+  IntMap<int, int> m1;
+  IntMap<int, int> m2;
+  m1[0] = 1;
+  m2[0] = 10;
+  m2[3] = 30;
+  const auto plus = [](int i, int j) { return i + j; };
+  // m2 has more keys than m1, so Zip() must grow m1.
+  m1.Zip(m2, plus);
+  EXPECT_EQ(m1.n_keys(), 4);
+  EXPECT_EQ(m1[0], 11);
+  EXPECT_EQ(m1[1], 0);
+  EXPECT_EQ(m1[3], 30);
+  m2.Zip(m1, plus);
+  EXPECT_EQ(m2.n_keys(), 4);
+  EXPECT_EQ(m2[0], 21);
+  EXPECT_EQ(m2[3], 60);
+  EXPECT_TRUE((IntMap<int, int>::Zip(m1, m2, plus) == IntMap<int, int>::Zip(m2, m1, plus)));
+}
+
 }  // namespace internal
 }  // namespace limbo
 
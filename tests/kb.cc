@@ -6,6 +6,8 @@
 #include <limbo/kb.h>
 #include <limbo/format/output.h>
 #include <limbo/format/cpp/syntax.h>
+#include <limbo/format/pdl/context.h>
+#include <limbo/format/pdl/parser.h>
 
 namespace limbo {
 
@@ -74,5 +76,257 @@ TEST(KnowledgeBaseTest, ECAI2016Sound_NoGuarantee) {
   EXPECT_TRUE(kb.Entails(*Formula::Factory::Bel(1, 1, *(Italian != T), *(Veggie != T))));
 }
 
+TEST(KnowledgeBaseTest, Definitional) {
+  Context ctx;
+  KnowledgeBase kb(ctx.sf(), ctx.tf());
+  auto Bool = ctx.CreateSort();                   RegisterSort(Bool, "");
+  auto Human = ctx.CreateSort();                  RegisterSort(Human, "");
+  auto T = ctx.CreateName(Bool);                  REGISTER_SYMBOL(T);
+  auto Rich = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(Rich);
+  auto Famous = ctx.CreateFunction(Bool, 0)();    REGISTER_SYMBOL(Famous);
+  auto Lucky = ctx.CreateFunction(Bool, 0)();     REGISTER_SYMBOL(Lucky);
+  auto Loves = ctx.CreateFunction(Bool, 2);       REGISTER_SYMBOL(Loves);
+  auto sue = ctx.CreateName(Human);               REGISTER_SYMBOL(sue);
+  auto x = ctx.CreateVariable(Human);             REGISTER_SYMBOL(x);
+  auto y = ctx.CreateVariable(Human);             REGISTER_SYMBOL(y);
+  EXPECT_FALSE(kb.Add(**((Rich == T && Famous == T) || Lucky == T)));
+  EXPECT_TRUE(kb.Add(**((Rich == T && Famous == T) || Lucky == T), true));
+  EXPECT_TRUE(kb.Add(**Fa(x, Ex(y, Loves(x, y) == T)), true));
+  EXPECT_FALSE(kb.Entails(*Formula::Factory::Know(0, *(Rich == T || Lucky == T))));
+  EXPECT_TRUE(kb.Entails(*Formula::Factory::Know(1, *(Rich == T || Lucky == T))));
+  EXPECT_TRUE(kb.Entails(*Formula::Factory::Know(1, *(Famous == T || Lucky == T))));
+  EXPECT_FALSE(kb.Entails(*Formula::Factory::Know(1, *(Rich == T))));
+  EXPECT_FALSE(kb.Entails(*Formula::Factory::Know(1, *(Lucky == T))));
+  EXPECT_TRUE(kb.Entails(*Formula::Factory::Know(1, *Ex(y, Loves(sue, y) == T))));
+  EXPECT_FALSE(kb.Entails(*Formula::Factory::Know(1, *Ex(y, Loves(sue, y) != T))));
+  EXPECT_FALSE(kb.Entails(*Formula::Factory::Know(1, *(Loves(sue, sue) == T))));
+}
+
+TEST(KnowledgeBaseTest, RetractAndForget) {
+  Context ctx;
+  KnowledgeBase kb(ctx.sf(), ctx.tf());
+  auto Bool = ctx.CreateSort();                   RegisterSort(Bool, "");
+  auto T = ctx.CreateName(Bool);                  REGISTER_SYMBOL(T);
+  auto Rich = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(Rich);
+  auto Famous = ctx.CreateFunction(Bool, 0)();    REGISTER_SYMBOL(Famous);
+  auto Lucky = ctx.CreateFunction(Bool, 0)();     REGISTER_SYMBOL(Lucky);
+  const Clause c = ( Rich == T || Lucky == T ).as_clause();
+  const Clause d = ( Lucky != T ).as_clause();
+  kb.Add(c);
+  kb.Add(d);
+  EXPECT_TRUE(kb.Entails(*Formula::Factory::Know(0, *(Rich == T))));
+  EXPECT_TRUE(kb.Retract(d));
+  EXPECT_FALSE(kb.Retract(d));
+  EXPECT_FALSE(kb.Entails(*Formula::Factory::Know(1, *(Rich == T))));
+  EXPECT_TRUE(kb.Entails(*Formula::Factory::Know(0, *(Rich == T || Lucky == T))));
+  // Forgetting Famous also removes the conditional, so Rich is no longer believed.
+  EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(0, 1, *(Famous == T), *(Rich == T))));
+  EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(0, 1, *(T == T), *(Famous == T))));
+  EXPECT_TRUE(kb.Entails(*Formula::Factory::Bel(0, 1, *(T == T), *(Rich == T))));
+  EXPECT_EQ(kb.Forget(std::unordered_set<Term>{Famous}), 2);
+  EXPECT_FALSE(kb.Entails(*Formula::Factory::Bel(0, 1, *(T == T), *(Rich == T))));
+  EXPECT_TRUE(kb.Entails(*Formula::Factory::Know(0, *(Rich == T || Lucky == T))));
+  EXPECT_EQ(kb.n_spheres(), 1);
+}
+
+TEST(KnowledgeBaseTest, SharedSubqueries) {
+  Context ctx;
+  KnowledgeBase kb(ctx.sf(), ctx.tf());
+  auto Bool = ctx.CreateSort();                   RegisterSort(Bool, "");
+  auto Food = ctx.CreateSort();                   RegisterSort(Food, "");
+  auto T = ctx.CreateName(Bool);                  REGISTER_SYMBOL(T);
+  auto Aussie = ctx.CreateFunction(Bool, 0)();    REGISTER_SYMBOL(Aussie);
+  auto Italian = ctx.CreateFunction(Bool, 0)();   REGISTER_SYMBOL(Italian);
+  auto Eats = ctx.CreateFunction(Bool, 1);        REGISTER_SYMBOL(Eats);
+  auto Meat = ctx.CreateFunction(Bool, 1);        REGISTER_SYMBOL(Meat);
+  auto Veggie = ctx.CreateFunction(Bool, 0)();    REGISTER_SYMBOL(Veggie);
+  auto roo = ctx.CreateName(Food);                REGISTER_SYMBOL(roo);
+  auto x = ctx.CreateVariable(Food);              REGISTER_SYMBOL(x);
+  Formula::belief_level k = 1;
+  Formula::belief_level l = 1;
+  EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(k, l, *(Aussie == T), *(Italian != T))));
+  EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(k, l, *(Italian == T), *(Aussie != T))));
+  EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(k, l, *(Aussie == T), *(Eats(roo) == T))));
+  EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(k, l, *(T == T), *(Italian == T || Veggie == T))));
+  EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(k, l, *(Italian != T), *(Aussie == T))));
+  EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(k, l, *(Meat(roo) != T), *(T != T))));
+  EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(k, l, *(~Fa(x, (Veggie == T && Meat(x) == T) >> (Eats(x) != T))), *(T != T))));
+  // Conjunctions and disjunctions repeat the subqueries and thus hit the memo
+  // of the representation theorem; the guaranteed variants must not share it.
+  std::vector<Formula::Ref> phis;
+  phis.push_back(Formula::Factory::Bel(1, 1, *(Italian != T), *(Veggie != T)));
+  phis.push_back(Formula::Factory::Bel(0, 1, *(Italian != T), *(Veggie != T)));
+  phis.push_back(Formula::Factory::Bel(1, 1, *(Aussie == T), *(Eats(roo) == T)));
+  phis.push_back(Formula::Factory::Know(1, *Ex(x, Meat(x) == T)));
+  phis.push_back(Formula::Factory::Cons(1, *Ex(x, Eats(x) != T)));
+  phis.push_back(Formula::Factory::Guarantee(Formula::Factory::Bel(1, 1, *(Italian != T), *(Veggie != T))));
+  phis.push_back(Formula::Factory::Guarantee(Formula::Factory::Know(1, *Ex(x, Meat(x) == T))));
+  std::vector<bool> rs;
+  for (const Formula::Ref& phi : phis) {
+    rs.push_back(kb.Entails(*phi));
+  }
+  EXPECT_TRUE(rs[0]);
+  for (size_t i = 0; i < phis.size(); ++i) {
+    for (size_t j = 0; j < phis.size(); ++j) {
+      const Formula::Ref phi = Formula::Factory::Not(Formula::Factory::Or(Formula::Factory::Not(phis[i]->Clone()),
+                                                                          Formula::Factory::Not(phis[j]->Clone())));
+      const Formula::Ref psi = Formula::Factory::Or(phis[i]->Clone(), phis[j]->Clone());
+      EXPECT_EQ(kb.Entails(*phi), rs[i] && rs[j]);
+      EXPECT_EQ(kb.Entails(*psi), rs[i] || rs[j]);
+    }
+  }
+}
+
+TEST(KnowledgeBaseTest, ThreadPool) {
+  Context ctx;
+  internal::ThreadPool pool(4);
+  KnowledgeBase kb1(ctx.sf(), ctx.tf());
+  KnowledgeBase kb2(ctx.sf(), ctx.tf());
+  kb2.set_thread_pool(&pool);
+  auto Bool = ctx.CreateSort();                   RegisterSort(Bool, "");
+  auto Food = ctx.CreateSort();                   RegisterSort(Food, "");
+  auto T = ctx.CreateName(Bool);                  REGISTER_SYMBOL(T);
+  auto Aussie = ctx.CreateFunction(Bool, 0)();    REGISTER_SYMBOL(Aussie);
+  auto Italian = ctx.CreateFunction(Bool, 0)();   REGISTER_SYMBOL(Italian);
+  auto Eats = ctx.CreateFunction(Bool, 1);        REGISTER_SYMBOL(Eats);
+  auto Meat = ctx.CreateFunction(Bool, 1);        REGISTER_SYMBOL(Meat);
+  auto Veggie = ctx.CreateFunction(Bool, 0)();    REGISTER_SYMBOL(Veggie);
+  auto roo = ctx.CreateName(Food);                REGISTER_SYMBOL(roo);
+  auto x = ctx.CreateVariable(Food);              REGISTER_SYMBOL(x);
+  for (KnowledgeBase* kb : {&kb1, &kb2}) {
+    EXPECT_TRUE(kb->Add(*Formula::Factory::Bel(1, 1, *(Aussie == T), *(Italian != T))));
+    EXPECT_TRUE(kb->Add(*Formula::Factory::Bel(1, 1, *(Italian == T), *(Aussie != T))));
+    EXPECT_TRUE(kb->Add(*Formula::Factory::Bel(1, 1, *(Aussie == T), *(Eats(roo) == T))));
+    EXPECT_TRUE(kb->Add(*Formula::Factory::Bel(1, 1, *(T == T), *(Italian == T || Veggie == T))));
+    EXPECT_TRUE(kb->Add(*Formula::Factory::Bel(1, 1, *(Italian != T), *(Aussie == T))));
+    EXPECT_TRUE(kb->Add(*Formula::Factory::Bel(1, 1, *(Meat(roo) != T), *(T != T))));
+    EXPECT_TRUE(kb->Add(*Formula::Factory::Bel(1, 1, *(~Fa(x, (Veggie == T && Meat(x) == T) >> (Eats(x) != T))), *(T != T))));
+  }
+  EXPECT_GT(kb2.n_spheres(), 1u);
+  EXPECT_EQ(kb1.n_spheres(), kb2.n_spheres());
+  std::vector<Formula::Ref> antes;
+  antes.push_back((*(T == T))->Clone());
+  antes.push_back((*(Italian != T))->Clone());
+  antes.push_back((*(Italian == T))->Clone());
+  antes.push_back((*(Aussie == T))->Clone());
+  antes.push_back((*(Aussie == T && Italian == T))->Clone());
+  antes.push_back((*Ex(x, Eats(x) == T))->Clone());
+  std::vector<Formula::Ref> conses;
+  conses.push_back((*(Veggie != T))->Clone());
+  conses.push_back((*(Veggie == T))->Clone());
+  conses.push_back((*(Eats(roo) == T))->Clone());
+  conses.push_back((*(Aussie != T || Italian != T))->Clone());
+  conses.push_back((*Ex(x, Meat(x) == T))->Clone());
+  for (KnowledgeBase::sphere_index p = 0; p < kb1.n_spheres(); ++p) {
+    for (const Formula::Ref& ante : antes) {
+      const Formula::Ref not_ante = Formula::Factory::Not(ante->Clone());
+      EXPECT_EQ(kb1.sphere(p).Entails(1, *not_ante), kb2.sphere(p).Entails(1, *not_ante));
+    }
+  }
+  size_t n_yes = 0;
+  for (Formula::belief_level k = 0; k <= 1; ++k) {
+    for (Formula::belief_level l = 0; l <= 1; ++l) {
+      for (const Formula::Ref& ante : antes) {
+        for (const Formula::Ref& conse : conses) {
+          const Formula::Ref phi = Formula::Factory::Bel(k, l, ante->Clone(), conse->Clone());
+          const bool r = kb1.Entails(*phi);
+          EXPECT_EQ(r, kb2.Entails(*phi));
+          n_yes += r;
+        }
+      }
+    }
+  }
+  EXPECT_GT(n_yes, 0u);
+}
+
+TEST(KnowledgeBaseTest, IndependentFactories) {
+  const size_t n_global_terms = Term::Factory::Instance()->n_terms();
+  internal::ThreadPool pool(4);
+  std::vector<bool> answers[2];
+  for (std::vector<bool>& as : answers) {
+    Symbol::Factory sf;
+    Term::Factory tf;
+    Term::Factory::Scope scope(&tf);
+    Context ctx(&sf, &tf);
+    KnowledgeBase kb(ctx.sf(), ctx.tf());
+    kb.set_thread_pool(&pool);
+    auto Bool = ctx.CreateSort();
+    auto Food = ctx.CreateSort();
+    auto T = ctx.CreateName(Bool);
+    auto Aussie = ctx.CreateFunction(Bool, 0)();
+    auto Italian = ctx.CreateFunction(Bool, 0)();
+    auto Eats = ctx.CreateFunction(Bool, 1);
+    auto Veggie = ctx.CreateFunction(Bool, 0)();
+    auto roo = ctx.CreateName(Food);
+    auto x = ctx.CreateVariable(Food);
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Aussie == T), *(Italian != T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Italian == T), *(Aussie != T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Aussie == T), *(Eats(roo) == T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(T == T), *(Italian == T || Veggie == T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Italian != T), *(Aussie == T))));
+    EXPECT_GT(kb.n_spheres(), 1u);
+    as.push_back(kb.Entails(*Formula::Factory::Bel(1, 1, *(Italian != T), *(Veggie != T))));
+    as.push_back(kb.Entails(*Formula::Factory::Bel(1, 1, *(T == T), *(Veggie == T))));
+    as.push_back(kb.Entails(*Formula::Factory::Bel(1, 1, *(Aussie == T), *Ex(x, Eats(x) == T))));
+    EXPECT_GT(tf.n_terms(), 0);
+  }
+  EXPECT_EQ(answers[0], answers[1]);
+  EXPECT_EQ(answers[0], std::vector<bool>({false, false, true}));
+  EXPECT_EQ(Term::Factory::Instance()->n_terms(), n_global_terms);
+}
+
+// Records the answers to the queries of a pdl::Context and ignores the rest.
+struct QueryLogger {
+  template<typename T>
+  void operator()(const T&) const {}
+  void operator()(const pdl::DefaultLogger::QueryData& d) { answers->push_back(d.yes); }
+  std::vector<bool>* answers;
+};
+
+TEST(KnowledgeBaseTest, IndependentFactories_noScope) {
+  // The pdl::Context registers its symbols for printing, whose ids clash with
+  // those of the process-wide factories.
+  UnregisterAll();
+  typedef pdl::Context<QueryLogger> PdlContext;
+  const std::string text =
+      "Sort FOOD\n"
+      "Sort BOOL\n"
+      "Name T -> BOOL\n"
+      "Name roo -> FOOD\n"
+      "Var x -> FOOD\n"
+      "Fun Aussie/0 -> BOOL\n"
+      "Fun Italian/0 -> BOOL\n"
+      "Fun Eats/1 -> BOOL\n"
+      "Fun Veggie/0 -> BOOL\n"
+      "KB: G Bel<1,1> Aussie = T ==> Italian != T\n"
+      "KB: G Bel<1,1> Italian = T ==> Aussie != T\n"
+      "KB: G Bel<1,1> Aussie = T ==> Eats(roo) = T\n"
+      "KB: G Bel<1,1> T = T ==> (Italian = T || Veggie = T)\n"
+      "KB: G Bel<1,1> Italian != T ==> Aussie = T\n"
+      "Bel<1,1> Italian != T ==> Veggie != T\n"
+      "Bel<1,1> T = T ==> Veggie = T\n"
+      "Bel<1,1> Aussie = T ==> Ex x Eats(x) = T\n";
+  const size_t n_global_terms = Term::Factory::Instance()->n_terms();
+  std::vector<bool> answers;
+  {
+    Symbol::Factory sf;
+    Term::Factory tf;
+    QueryLogger logger;
+    logger.answers = &answers;
+    PdlContext ctx(&sf, &tf, logger);
+    pdl::Parser<std::string::const_iterator, PdlContext> parser(text.begin(), text.end());
+    auto parse_result = parser.Parse();
+    ASSERT_TRUE(parse_result.successful()) << parse_result.str();
+    EXPECT_NE(Term::Factory::Instance(), &tf);
+    EXPECT_TRUE(parse_result.val.Run(&ctx).successful());
+    EXPECT_NE(Term::Factory::Instance(), &tf);
+    EXPECT_GT(ctx.kb().n_spheres(), 1u);
+    EXPECT_GT(tf.n_terms(), 0);
+  }
+  UnregisterAll();
+  EXPECT_EQ(answers, std::vector<bool>({false, false, true}));
+  EXPECT_EQ(Term::Factory::Instance()->n_terms(), n_global_terms);
+}
+
 }  // namespace limbo
 
@@ -76,5 +76,318 @@ TEST(SetupTest, Subsumes_Consistent_clauses) {
   }
 }
 
+TEST(SetupTest, FilteredView) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s1 = sf.CreateSort(); RegisterSort(s1, "");
+  const Term n = tf.CreateTerm(Symbol::Factory::CreateName(1, s1));
+  const Term m = tf.CreateTerm(Symbol::Factory::CreateName(2, s1));
+  const Term a = tf.CreateTerm(Symbol::Factory::CreateFunction(1, s1, 0), {});
+  const Term b = tf.CreateTerm(Symbol::Factory::CreateFunction(2, s1, 0), {});
+  const Term fn = tf.CreateTerm(Symbol::Factory::CreateFunction(3, s1, 1), {n});
+  const Term fm = tf.CreateTerm(Symbol::Factory::CreateFunction(3, s1, 1), {m});
+  const Term gn = tf.CreateTerm(Symbol::Factory::CreateFunction(4, s1, 1), {n});
+
+  limbo::Setup s0;
+  s0.AddClause(Clause({Literal::Neq(fn,n), Literal::Eq(fm,m)}));
+  s0.AddClause(Clause({Literal::Neq(gn,n), Literal::Eq(b,m)}));
+  s0.AddClause(Clause({Literal::Eq(a,n), Literal::Eq(fn,n)}));
+  s0.AddClause(Clause({Literal::Eq(b,n)}));
+  s0.Minimize();
+  const size_t n_clauses = dist(s0.clauses());
+  auto mentions_f = [fn, fm](const Clause& c) {
+    return c.any([fn, fm](Literal l) { return l.lhs() == fn || l.lhs() == fm; });
+  };
+  {
+    limbo::Setup s1(s0, mentions_f);
+    EXPECT_EQ(dist(s1.clauses()), 2);
+    EXPECT_EQ(s1.n_references(), 2u);
+    for (size_t i : s1.clauses()) {
+      EXPECT_TRUE(mentions_f(s1.clause(i)));
+      EXPECT_TRUE(s0.Subsumes(s1.clause(i)));
+    }
+    EXPECT_FALSE(s1.Subsumes(Clause({Literal::Eq(b,n)})));
+    EXPECT_FALSE(s1.Subsumes(Clause({Literal::Eq(fm,m)})));
+    {
+      limbo::Setup::ShallowCopy sc = s1.shallow_copy();
+      EXPECT_EQ(sc.AddUnit(Literal::Neq(a,n)), limbo::Setup::kOk);
+      EXPECT_TRUE(s1.Subsumes(Clause({Literal::Eq(fn,n)})));
+      EXPECT_TRUE(s1.Subsumes(Clause({Literal::Eq(fm,m)})));
+    }
+    EXPECT_EQ(dist(s1.clauses()), 2);
+    EXPECT_FALSE(s1.Subsumes(Clause({Literal::Eq(fm,m)})));
+    // Neither unit propagation nor subsumption copies the referenced clauses.
+    EXPECT_EQ(s1.n_references(), 2u);
+    s1.Materialize();
+    EXPECT_EQ(s1.n_references(), 0u);
+    EXPECT_EQ(dist(s1.clauses()), 2);
+    for (size_t i : s1.clauses()) {
+      EXPECT_TRUE(mentions_f(s1.clause(i)));
+    }
+  }
+  EXPECT_EQ(dist(s0.clauses()), n_clauses);
+}
+
+TEST(SetupTest, ForEachClauseMentioning) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s1 = sf.CreateSort(); RegisterSort(s1, "");
+  const Term n = tf.CreateTerm(Symbol::Factory::CreateName(1, s1));
+  const Term m = tf.CreateTerm(Symbol::Factory::CreateName(2, s1));
+  std::vector<Term> ts;
+  for (int i = 1; i <= 4; ++i) {
+    ts.push_back(tf.CreateTerm(Symbol::Factory::CreateFunction(i, s1, 0), {}));
+  }
+  // The index must agree with the clauses before unit propagation.
+  auto check = [&ts](const limbo::Setup& s) {
+    const std::vector<Clause> cs = s.non_units();
+    const size_t offset = dist(s.clauses()) - cs.size();
+    for (const Term t : ts) {
+      std::vector<size_t> expected;
+      for (size_t i = 0; i < cs.size(); ++i) {
+        if (cs[i].any([t](Literal a) { return a.lhs() == t; })) {
+          expected.push_back(offset + i);
+        }
+      }
+      std::vector<size_t> actual;
+      s.ForEachClauseMentioning(t, [&actual](size_t i) { actual.push_back(i); });
+      EXPECT_EQ(actual, expected);
+    }
+  };
+
+  limbo::Setup s0;
+  s0.AddClause(Clause({Literal::Eq(ts[0],n), Literal::Eq(ts[1],n)}));
+  s0.AddClause(Clause({Literal::Eq(ts[1],n), Literal::Eq(ts[2],n), Literal::Eq(ts[2],m)}));
+  s0.AddClause(Clause({Literal::Eq(ts[0],m), Literal::Eq(ts[3],n)}));
+  s0.AddClause(Clause({Literal::Eq(ts[2],n), Literal::Eq(ts[3],m)}));
+  check(s0);
+  {
+    limbo::Setup::ShallowCopy sc = s0.shallow_copy();
+    sc.AddClause(Clause({Literal::Eq(ts[1],m), Literal::Eq(ts[3],n)}));
+    sc.AddUnit(Literal::Neq(ts[0],n));
+    check(s0);
+    std::vector<size_t> is;
+    s0.ForEachClauseMentioning(ts[3], [&is](size_t i) { is.push_back(i); }, sc.first_new_non_unit());
+    EXPECT_EQ(is, std::vector<size_t>({sc.first_new_non_unit()}));
+  }
+  check(s0);
+  s0.AddUnit(Literal::Eq(ts[0],m));
+  s0.Minimize();
+  EXPECT_EQ(s0.non_units().size(), 1u);
+  check(s0);
+}
+
+TEST(SetupTest, Cardinality) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s1 = sf.CreateSort(); RegisterSort(s1, "");
+  const Term T = tf.CreateTerm(Symbol::Factory::CreateName(1, s1));
+  std::vector<Literal> ps;
+  for (int i = 1; i <= 5; ++i) {
+    ps.push_back(Literal::Eq(tf.CreateTerm(Symbol::Factory::CreateFunction(i, s1, 0), {}), T));
+  }
+  auto subsets = [&ps](size_t k) {
+    std::vector<Clause> cs;
+    for (unsigned int bits = 0; bits < (1u << ps.size()); ++bits) {
+      std::vector<Literal> c;
+      for (size_t i = 0; i < ps.size(); ++i) {
+        if (bits & (1u << i)) {
+          c.push_back(ps[i]);
+        }
+      }
+      if (c.size() == k) {
+        cs.push_back(Clause(c.begin(), c.end()));
+      }
+    }
+    return cs;
+  };
+
+  limbo::Setup s0;
+  EXPECT_EQ(s0.AddCardinality(Cardinality::AtLeast(2, ps.begin(), ps.end())), limbo::Setup::kOk);
+  EXPECT_EQ(s0.cardinalities().size(), 1);
+  EXPECT_EQ(dist(s0.clauses()), 0);
+  EXPECT_TRUE(s0.Consistent());
+  EXPECT_EQ(s0.AddCardinality(Cardinality::AtLeast(1, ps.begin(), ps.end())), limbo::Setup::kOk);
+  EXPECT_EQ(s0.AddCardinality(Cardinality::AtLeast(0, ps.begin(), ps.end())), limbo::Setup::kSubsumed);
+  // at least 2 of 5 stands for the clauses of 4 literals
+  for (const Clause& c : subsets(4)) {
+    EXPECT_TRUE(s0.Subsumes(c));
+  }
+  for (const Clause& c : subsets(3)) {
+    EXPECT_FALSE(s0.Subsumes(c));
+  }
+
+  {
+    limbo::Setup::ShallowCopy sc = s0.shallow_copy();
+    EXPECT_EQ(sc.AddUnit(ps[0].flip()), limbo::Setup::kOk);
+    EXPECT_TRUE(s0.Subsumes(Clause({ps[1], ps[2], ps[3]})));
+    EXPECT_FALSE(s0.Subsumes(Clause({ps[1], ps[2]})));
+    EXPECT_EQ(sc.AddUnit(ps[1].flip()), limbo::Setup::kOk);
+    EXPECT_EQ(sc.AddUnit(ps[2].flip()), limbo::Setup::kOk);
+    // only ps[3] and ps[4] are left to satisfy the constraint
+    EXPECT_TRUE(s0.Subsumes(Clause({ps[3]})));
+    EXPECT_TRUE(s0.Subsumes(Clause({ps[4]})));
+    EXPECT_TRUE(s0.Consistent());
+    {
+      limbo::Setup::ShallowCopy sc2 = s0.shallow_copy();
+      EXPECT_EQ(sc2.AddUnit(ps[3].flip()), limbo::Setup::kInconsistent);
+      EXPECT_FALSE(s0.Consistent());
+    }
+    EXPECT_TRUE(s0.Consistent());
+    EXPECT_TRUE(s0.Subsumes(Clause({ps[4]})));
+  }
+  EXPECT_FALSE(s0.Subsumes(Clause({ps[3]})));
+  EXPECT_FALSE(s0.Subsumes(Clause({ps[1], ps[2], ps[3]})));
+
+  {
+    limbo::Setup::ShallowCopy sc = s0.shallow_copy();
+    // at most 2 of 5 and at least 2 of 5 make exactly 2 of 5
+    EXPECT_EQ(sc.AddCardinality(Cardinality::AtMost(2, ps.begin(), ps.end())), limbo::Setup::kOk);
+    EXPECT_EQ(s0.cardinalities().size(), 2);
+    for (const Clause& c : subsets(3)) {
+      EXPECT_TRUE(s0.Subsumes(Clause({c[0].flip(), c[1].flip(), c[2].flip()})));
+    }
+    EXPECT_EQ(sc.AddUnit(ps[0]), limbo::Setup::kOk);
+    EXPECT_EQ(sc.AddUnit(ps[1]), limbo::Setup::kOk);
+    for (size_t i = 2; i < ps.size(); ++i) {
+      EXPECT_TRUE(s0.Subsumes(Clause({ps[i].flip()})));
+    }
+    EXPECT_EQ(sc.AddUnit(ps[2]), limbo::Setup::kInconsistent);
+  }
+  EXPECT_EQ(s0.cardinalities().size(), 1);
+  EXPECT_TRUE(s0.Consistent());
+  EXPECT_FALSE(s0.Subsumes(Clause({ps[2].flip()})));
+}
+
+TEST(SetupTest, Cardinality_undo) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s1 = sf.CreateSort(); RegisterSort(s1, "");
+  const Term n1 = tf.CreateTerm(Symbol::Factory::CreateName(1, s1));
+  const Term n2 = tf.CreateTerm(Symbol::Factory::CreateName(2, s1));
+  const Term f = tf.CreateTerm(Symbol::Factory::CreateFunction(1, s1, 0), {});
+  const Term g = tf.CreateTerm(Symbol::Factory::CreateFunction(2, s1, 0), {});
+  const Term h = tf.CreateTerm(Symbol::Factory::CreateFunction(3, s1, 0), {});
+  const Clause lits{Literal::Eq(f, n1), Literal::Eq(f, n2), Literal::Eq(g, n1), Literal::Eq(h, n1)};
+
+  limbo::Setup s0;
+  EXPECT_EQ(s0.AddCardinality(Cardinality::AtLeast(2, lits)), limbo::Setup::kOk);
+  {
+    // f = n1 satisfies one literal and falsifies another
+    limbo::Setup::ShallowCopy sc = s0.shallow_copy();
+    EXPECT_EQ(sc.AddUnit(Literal::Eq(f, n1)), limbo::Setup::kOk);
+    EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(g, n1), Literal::Eq(h, n1)})));
+    EXPECT_FALSE(s0.Subsumes(Clause({Literal::Eq(h, n1)})));
+    for (int i = 0; i < 2; ++i) {
+      limbo::Setup::ShallowCopy sc2 = s0.shallow_copy();
+      EXPECT_EQ(sc2.AddUnit(Literal::Neq(g, n1)), limbo::Setup::kOk);
+      EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(h, n1)})));
+    }
+    EXPECT_FALSE(s0.Subsumes(Clause({Literal::Eq(h, n1)})));
+    {
+      limbo::Setup::ShallowCopy sc2 = s0.shallow_copy();
+      EXPECT_EQ(sc2.AddUnit(Literal::Neq(g, n1)), limbo::Setup::kOk);
+      EXPECT_EQ(sc2.AddUnit(Literal::Neq(h, n1)), limbo::Setup::kInconsistent);
+      sc2.Minimize();
+      EXPECT_FALSE(s0.Consistent());
+    }
+    EXPECT_TRUE(s0.Consistent());
+    EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(g, n1), Literal::Eq(h, n1)})));
+  }
+  EXPECT_FALSE(s0.Subsumes(Clause({Literal::Eq(g, n1), Literal::Eq(h, n1)})));
+  {
+    // f is neither n1 nor n2, so g = n1 and h = n1 are left
+    limbo::Setup::ShallowCopy sc = s0.shallow_copy();
+    EXPECT_EQ(sc.AddUnit(Literal::Neq(f, n1)), limbo::Setup::kOk);
+    EXPECT_FALSE(s0.Subsumes(Clause({Literal::Eq(g, n1)})));
+    EXPECT_EQ(sc.AddUnit(Literal::Neq(f, n2)), limbo::Setup::kOk);
+    EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(g, n1)})));
+    EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(h, n1)})));
+    EXPECT_TRUE(s0.Consistent());
+  }
+  EXPECT_FALSE(s0.Subsumes(Clause({Literal::Eq(g, n1)})));
+}
+
+TEST(SetupTest, AllDifferent) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s1 = sf.CreateSort(); RegisterSort(s1, "");
+  std::vector<Term> ns;
+  std::vector<Term> ts;
+  for (int i = 1; i <= 3; ++i) {
+    ns.push_back(tf.CreateTerm(Symbol::Factory::CreateName(i, s1)));
+    ts.push_back(tf.CreateTerm(Symbol::Factory::CreateFunction(i, s1, 0), {}));
+  }
+  const Term m = tf.CreateTerm(Symbol::Factory::CreateName(4, s1));
+
+  limbo::Setup s0;
+  EXPECT_EQ(s0.AddAllDifferent(AllDifferent(ts.begin(), ts.end(), ns.begin(), ns.end())), limbo::Setup::kOk);
+  EXPECT_EQ(s0.all_differents().size(), 1);
+  EXPECT_EQ(dist(s0.clauses()), 0);
+  // the clauses the constraint stands for
+  EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(ts[0],ns[0]), Literal::Eq(ts[0],ns[1]), Literal::Eq(ts[0],ns[2])})));
+  EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(ts[0],ns[1]), Literal::Eq(ts[1],ns[1]), Literal::Eq(ts[2],ns[1])})));
+  EXPECT_TRUE(s0.Subsumes(Clause({Literal::Neq(ts[0],ns[0]), Literal::Neq(ts[2],ns[0])})));
+  EXPECT_TRUE(s0.Subsumes(Clause({Literal::Neq(ts[0],m), Literal::Neq(ts[1],m)})));
+  EXPECT_TRUE(s0.Subsumes(Clause({Literal::Neq(ts[0],m)})));
+  EXPECT_FALSE(s0.Subsumes(Clause({Literal::Eq(ts[0],ns[0]), Literal::Eq(ts[0],ns[1])})));
+  EXPECT_FALSE(s0.Subsumes(Clause({Literal::Neq(ts[0],ns[0]), Literal::Neq(ts[1],ns[1])})));
+
+  {
+    // ts[0] takes ns[0], which is excluded for ts[1] and ts[2]
+    limbo::Setup::ShallowCopy sc = s0.shallow_copy();
+    EXPECT_EQ(sc.AddUnit(Literal::Eq(ts[0],ns[0])), limbo::Setup::kOk);
+    EXPECT_TRUE(s0.Subsumes(Clause({Literal::Neq(ts[1],ns[0])})));
+    EXPECT_TRUE(s0.Subsumes(Clause({Literal::Neq(ts[2],ns[0])})));
+    EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(ts[1],ns[1]), Literal::Eq(ts[1],ns[2])})));
+    EXPECT_FALSE(s0.Subsumes(Clause({Literal::Eq(ts[1],ns[1])})));
+    {
+      // ts[1] cannot take ns[1], so it takes ns[2], and ns[1] is left for ts[2]
+      limbo::Setup::ShallowCopy sc2 = s0.shallow_copy();
+      EXPECT_EQ(sc2.AddUnit(Literal::Neq(ts[1],ns[1])), limbo::Setup::kOk);
+      EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(ts[1],ns[2])})));
+      EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(ts[2],ns[1])})));
+      EXPECT_TRUE(s0.Consistent());
+    }
+    EXPECT_FALSE(s0.Subsumes(Clause({Literal::Eq(ts[1],ns[2])})));
+    {
+      // only ts[2] can take ns[2]
+      limbo::Setup::ShallowCopy sc2 = s0.shallow_copy();
+      EXPECT_EQ(sc2.AddUnit(Literal::Neq(ts[1],ns[2])), limbo::Setup::kOk);
+      EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(ts[2],ns[2])})));
+      EXPECT_TRUE(s0.Subsumes(Clause({Literal::Eq(ts[1],ns[1])})));
+    }
+    {
+      limbo::Setup::ShallowCopy sc2 = s0.shallow_copy();
+      EXPECT_EQ(sc2.AddUnit(Literal::Eq(ts[1],ns[0])), limbo::Setup::kInconsistent);
+      EXPECT_FALSE(s0.Consistent());
+    }
+    EXPECT_FALSE(s0.Subsumes(Clause{}));
+  }
+  EXPECT_FALSE(s0.Subsumes(Clause({Literal::Neq(ts[1],ns[0])})));
+
+  {
+    // fewer names than terms
+    limbo::Setup::ShallowCopy sc = s0.shallow_copy();
+    EXPECT_EQ(sc.AddAllDifferent(AllDifferent(ts.begin(), ts.end(), ns.begin(), ns.begin() + 2)),
+              limbo::Setup::kInconsistent);
+  }
+  EXPECT_EQ(s0.all_differents().size(), 1);
+  EXPECT_FALSE(s0.Subsumes(Clause{}));
+
+  {
+    // three terms cannot take two remaining names
+    limbo::Setup s1;
+    std::vector<Term> ns_m = ns;
+    ns_m.push_back(m);
+    EXPECT_EQ(s1.AddAllDifferent(AllDifferent(ts.begin(), ts.end(), ns_m.begin(), ns_m.end())), limbo::Setup::kOk);
+    EXPECT_FALSE(s1.Subsumes(Clause({Literal::Eq(ts[0],ns[1]), Literal::Eq(ts[1],ns[1]), Literal::Eq(ts[2],ns[1])})));
+    for (size_t i = 0; i < ts.size(); ++i) {
+      EXPECT_EQ(s1.AddUnit(Literal::Neq(ts[i],ns[2])), limbo::Setup::kOk);
+      EXPECT_EQ(s1.AddUnit(Literal::Neq(ts[i],m)), i + 1 < ts.size() ? limbo::Setup::kOk : limbo::Setup::kInconsistent);
+    }
+  }
+}
+
 }  // namespace limbo
 
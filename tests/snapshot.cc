@@ -0,0 +1,254 @@
+// vim:filetype=cpp:textwidth=120:shiftwidth=2:softtabstop=2:expandtab
+// Copyright 2017 Christoph Schwering
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <limbo/snapshot.h>
+#include <limbo/format/cpp/syntax.h>
+
+namespace limbo {
+
+using namespace limbo::format::cpp;
+
+template<typename T>
+size_t length(T r) { return std::distance(r.begin(), r.end()); }
+
+TEST(SnapshotTest, Solver) {
+  Symbol::Factory sf;
+  Term::Factory tf;
+  std::stringstream ss;
+  Formula::Ref queries[4];
+  size_t n_clauses;
+  {
+    Term::Factory::Scope scope(&tf);
+    Context ctx(&sf, &tf);
+    Solver solver(ctx.sf(), ctx.tf());
+    auto Bool = ctx.CreateSort();
+    auto Food = ctx.CreateSort();
+    auto T = ctx.CreateName(Bool);
+    auto Aussie = ctx.CreateFunction(Bool, 0)();
+    auto Italian = ctx.CreateFunction(Bool, 0)();
+    auto Eats = ctx.CreateFunction(Bool, 1);
+    auto Meat = ctx.CreateFunction(Bool, 1);
+    auto Veggie = ctx.CreateFunction(Bool, 0)();
+    auto roo = ctx.CreateName(Food);
+    auto x = ctx.CreateVariable(Food);
+    solver.grounder().AddClause(( Meat(roo) == T ).as_clause());
+    solver.grounder().AddClause(( Meat(x) != T ||  Eats(x) != T ||  Veggie != T ).as_clause());
+    solver.grounder().AddClause(( Aussie != T ||  Italian != T ).as_clause());
+    solver.grounder().AddClause(( Aussie == T ||  Italian == T ).as_clause());
+    solver.grounder().AddClause(( Aussie != T ||  Eats(roo) == T ).as_clause());
+    solver.grounder().AddClause(( Italian == T ||  Veggie == T ).as_clause());
+    queries[0] = (Aussie != T)->NF(ctx.sf(), ctx.tf());
+    queries[1] = (Italian == T)->NF(ctx.sf(), ctx.tf());
+    queries[2] = Ex(x, Eats(x) == T)->NF(ctx.sf(), ctx.tf());
+    queries[3] = Ex(x, Meat(x) == T)->NF(ctx.sf(), ctx.tf());
+    EXPECT_FALSE(solver.Entails(0, *queries[0], Solver::kConsistencyGuarantee));
+    EXPECT_TRUE(solver.Entails(1, *queries[0], Solver::kConsistencyGuarantee));
+    Snapshot::Save(&sf, &tf, &solver, &ss);
+    n_clauses = length(solver.setup().clauses());
+  }
+
+  // Terms keep their ids, so the queries can be posed to the loaded solver.
+  Symbol::Factory sf2;
+  Term::Factory tf2;
+  Term::Factory::Scope scope(&tf2);
+  Solver solver(&sf2, &tf2);
+  ASSERT_TRUE(Snapshot::Load(&ss, &sf2, &tf2, &solver));
+  EXPECT_EQ(tf2.n_terms(), tf.n_terms());
+  EXPECT_EQ(length(solver.setup().clauses()), n_clauses);
+  EXPECT_FALSE(solver.setup().contains_empty_clause());
+
+  // New symbols do not collide with the loaded ones.
+  const Term n = tf2.CreateTerm(sf2.CreateName(0));
+  EXPECT_EQ(tf2.n_terms(), tf.n_terms() + 1);
+  EXPECT_TRUE(n.name());
+
+  EXPECT_FALSE(solver.Entails(0, *queries[0], Solver::kConsistencyGuarantee));
+  EXPECT_TRUE(solver.Entails(1, *queries[0], Solver::kConsistencyGuarantee));
+  EXPECT_TRUE(solver.Entails(1, *queries[1], Solver::kConsistencyGuarantee));
+  EXPECT_FALSE(solver.Entails(1, *queries[2], Solver::kConsistencyGuarantee));
+  EXPECT_TRUE(solver.Entails(0, *queries[3], Solver::kConsistencyGuarantee));
+}
+
+TEST(SnapshotTest, KnowledgeBase) {
+  Symbol::Factory sf;
+  Term::Factory tf;
+  std::stringstream ss;
+  Formula::Ref queries[4];
+  std::vector<bool> answers;
+  size_t n_spheres;
+  {
+    Term::Factory::Scope scope(&tf);
+    Context ctx(&sf, &tf);
+    KnowledgeBase kb(ctx.sf(), ctx.tf());
+    auto Bool = ctx.CreateSort();
+    auto Food = ctx.CreateSort();
+    auto T = ctx.CreateName(Bool);
+    auto Aussie = ctx.CreateFunction(Bool, 0)();
+    auto Italian = ctx.CreateFunction(Bool, 0)();
+    auto Eats = ctx.CreateFunction(Bool, 1);
+    auto Meat = ctx.CreateFunction(Bool, 1);
+    auto Veggie = ctx.CreateFunction(Bool, 0)();
+    auto roo = ctx.CreateName(Food);
+    auto x = ctx.CreateVariable(Food);
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Aussie == T), *(Italian != T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Italian == T), *(Aussie != T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Aussie == T), *(Eats(roo) == T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(T == T), *(Italian == T || Veggie == T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Italian != T), *(Aussie == T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Meat(roo) != T), *(T != T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(~Fa(x, (Veggie == T && Meat(x) == T) >> (Eats(x) != T))),
+                                              *(T != T))));
+    queries[0] = Formula::Factory::Bel(1, 1, *(Italian != T), *(Veggie != T));
+    queries[1] = Formula::Factory::Bel(1, 1, *(T == T), *(Veggie == T));
+    queries[2] = Formula::Factory::Bel(1, 1, *(Aussie == T), *Ex(x, Eats(x) == T));
+    queries[3] = Formula::Factory::Know(0, *(Meat(roo) == T));
+    for (const Formula::Ref& phi : queries) {
+      answers.push_back(kb.Entails(*phi));
+    }
+    n_spheres = kb.n_spheres();
+    EXPECT_GT(n_spheres, 1u);
+    Snapshot::Save(&sf, &tf, &kb, &ss);
+  }
+
+  Symbol::Factory sf2;
+  Term::Factory tf2;
+  Term::Factory::Scope scope(&tf2);
+  KnowledgeBase kb(&sf2, &tf2);
+  ASSERT_TRUE(Snapshot::Load(&ss, &sf2, &tf2, &kb));
+  EXPECT_EQ(kb.n_spheres(), n_spheres);
+  std::vector<bool> loaded_answers;
+  for (const Formula::Ref& phi : queries) {
+    loaded_answers.push_back(kb.Entails(*phi));
+  }
+  EXPECT_EQ(loaded_answers, answers);
+  EXPECT_EQ(answers, std::vector<bool>({true, false, true, true}));
+}
+
+TEST(SnapshotTest, Shared) {
+  const char* path = "snapshot_test.lmbo";
+  Symbol::Factory sf;
+  Term::Factory tf;
+  Formula::Ref queries[4];
+  std::vector<bool> answers;
+  {
+    Term::Factory::Scope scope(&tf);
+    Context ctx(&sf, &tf);
+    KnowledgeBase kb(ctx.sf(), ctx.tf());
+    auto Bool = ctx.CreateSort();
+    auto Food = ctx.CreateSort();
+    auto T = ctx.CreateName(Bool);
+    auto Aussie = ctx.CreateFunction(Bool, 0)();
+    auto Italian = ctx.CreateFunction(Bool, 0)();
+    auto Eats = ctx.CreateFunction(Bool, 1);
+    auto Meat = ctx.CreateFunction(Bool, 1);
+    auto Veggie = ctx.CreateFunction(Bool, 0)();
+    auto roo = ctx.CreateName(Food);
+    auto x = ctx.CreateVariable(Food);
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Aussie == T), *(Italian != T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Italian == T), *(Aussie != T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Aussie == T), *(Eats(roo) == T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(T == T), *(Italian == T || Veggie == T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Italian != T), *(Aussie == T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(Meat(roo) != T), *(T != T))));
+    EXPECT_TRUE(kb.Add(*Formula::Factory::Bel(1, 1, *(~Fa(x, (Veggie == T && Meat(x) == T) >> (Eats(x) != T))),
+                                              *(T != T))));
+    queries[0] = Formula::Factory::Bel(1, 1, *(Italian != T), *(Veggie != T));
+    queries[1] = Formula::Factory::Bel(1, 1, *(T == T), *(Veggie == T));
+    queries[2] = Formula::Factory::Bel(1, 1, *(Aussie == T), *Ex(x, Eats(x) == T));
+    queries[3] = Formula::Factory::Know(0, *(Meat(roo) == T));
+    for (const Formula::Ref& phi : queries) {
+      answers.push_back(kb.Entails(*phi));
+    }
+    std::ofstream ofs(path, std::ios::binary);
+    Snapshot::SaveShared(&sf, &tf, &kb, &ofs);
+  }
+
+  // Two workers with their own factories share the clauses of one mapping.
+  {
+    const Snapshot::Mapping m(path);
+    ASSERT_TRUE(m.ok());
+    for (int worker = 0; worker < 2; ++worker) {
+      Symbol::Factory sf2;
+      Term::Factory tf2;
+      Term::Factory::Scope scope(&tf2);
+      KnowledgeBase kb(&sf2, &tf2);
+      ASSERT_TRUE(Snapshot::LoadShared(m, &sf2, &tf2, &kb));
+      std::vector<bool> loaded_answers;
+      for (const Formula::Ref& phi : queries) {
+        loaded_answers.push_back(kb.Entails(*phi));
+      }
+      EXPECT_EQ(loaded_answers, answers);
+    }
+
+    // Shared snapshots are not loaded from streams, nor as another kind.
+    Symbol::Factory sf2;
+    Term::Factory tf2;
+    Term::Factory::Scope scope(&tf2);
+    Solver solver(&sf2, &tf2);
+    EXPECT_FALSE(Snapshot::LoadShared(m, &sf2, &tf2, &solver));
+    KnowledgeBase kb(&sf2, &tf2);
+    std::ifstream ifs(path, std::ios::binary);
+    EXPECT_FALSE(Snapshot::Load(&ifs, &sf2, &tf2, &kb));
+  }
+  std::remove(path);
+
+  const Snapshot::Mapping m(path);
+  EXPECT_FALSE(m.ok());
+  Symbol::Factory sf2;
+  Term::Factory tf2;
+  Term::Factory::Scope scope(&tf2);
+  KnowledgeBase kb(&sf2, &tf2);
+  EXPECT_FALSE(Snapshot::LoadShared(m, &sf2, &tf2, &kb));
+}
+
+TEST(SnapshotTest, Reject) {
+  Symbol::Factory sf;
+  Term::Factory tf;
+  std::string snapshot;
+  {
+    Term::Factory::Scope scope(&tf);
+    Context ctx(&sf, &tf);
+    Solver solver(ctx.sf(), ctx.tf());
+    auto Bool = ctx.CreateSort();
+    auto T = ctx.CreateName(Bool);
+    auto P = ctx.CreateFunction(Bool, 0)();
+    auto Q = ctx.CreateFunction(Bool, 0)();
+    solver.grounder().AddClause(( P == T || Q == T ).as_clause());
+    std::stringstream ss;
+    Snapshot::Save(&sf, &tf, &solver, &ss);
+    snapshot = ss.str();
+  }
+  auto load_solver = [](const std::string& s) {
+    Symbol::Factory sf;
+    Term::Factory tf;
+    Term::Factory::Scope scope(&tf);
+    Solver solver(&sf, &tf);
+    std::stringstream ss(s);
+    return Snapshot::Load(&ss, &sf, &tf, &solver);
+  };
+  auto load_kb = [](const std::string& s) {
+    Symbol::Factory sf;
+    Term::Factory tf;
+    Term::Factory::Scope scope(&tf);
+    KnowledgeBase kb(&sf, &tf);
+    std::stringstream ss(s);
+    return Snapshot::Load(&ss, &sf, &tf, &kb);
+  };
+  EXPECT_TRUE(load_solver(snapshot));
+  EXPECT_FALSE(load_kb(snapshot));
+  EXPECT_FALSE(load_solver(snapshot.substr(0, snapshot.size() - 1)));
+  EXPECT_FALSE(load_solver(""));
+  for (size_t i = 0; i < snapshot.size(); ++i) {
+    std::string s = snapshot;
+    s[i] ^= 0x10;
+    EXPECT_FALSE(load_solver(s)) << i;  // stale version, wrong kind, or checksum mismatch
+  }
+}
+
+}  // namespace limbo
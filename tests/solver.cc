@@ -3,6 +3,8 @@
 
 #include <gtest/gtest.h>
 
+#include <functional>
+
 #include <limbo/solver.h>
 #include <limbo/format/output.h>
 #include <limbo/format/cpp/syntax.h>
@@ -240,5 +242,710 @@ TEST(SolverTest, Constants) {
   }
 }
 
+TEST(SolverTest, Lemmas) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto SomeSort = ctx.sf()->CreateSort();  RegisterSort(SomeSort, "");
+  auto n1 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n1);
+  auto a = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(a);
+  auto b = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(b);
+  solver.grounder().AddClause(( a != n1 || b == n1 ).as_clause());
+  solver.grounder().AddClause(( a != n1 || b != n1 ).as_clause());
+  {
+    EXPECT_TRUE(solver.lemmas_.empty());
+    EXPECT_FALSE(solver.Determines(0, a, Solver::kNoConsistencyGuarantee));
+    solver.Determines(1, a, Solver::kNoConsistencyGuarantee);
+    ASSERT_EQ(solver.lemmas_.size(), 1);
+    EXPECT_EQ(solver.lemmas_[0].clause, Clause({Literal::Neq(a, n1)}));
+    solver.Determines(1, a, Solver::kNoConsistencyGuarantee);
+    EXPECT_EQ(solver.lemmas_.size(), 1);
+    EXPECT_TRUE(solver.Entails(1, *(a != n1)->NF(ctx.sf(), ctx.tf()), Solver::kNoConsistencyGuarantee));
+  }
+  {
+    Grounder::Undo undo;
+    solver.grounder().AddClause(( b == n1 ).as_clause(), &undo);
+    EXPECT_TRUE(solver.Entails(0, *(a != n1)->NF(ctx.sf(), ctx.tf()), Solver::kNoConsistencyGuarantee));
+    EXPECT_EQ(solver.lemmas_.size(), 1);
+  }
+}
+
+TEST(SolverTest, PromoteEntailedLiterals) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto SomeSort = ctx.sf()->CreateSort();  RegisterSort(SomeSort, "");
+  auto n1 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n1);
+  auto n2 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n2);
+  auto a = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(a);
+  auto b = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(b);
+  auto c = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(c);
+  solver.grounder().AddClause(( a != n1 || b == n1 ).as_clause());
+  solver.grounder().AddClause(( a != n1 || b != n1 ).as_clause());
+  solver.grounder().AddClause(( c == n1 || c == n2 ).as_clause());
+  solver.grounder().AddClause(( c != n1 || a == n1 ).as_clause());
+  solver.set_promote_entailed_literals(true);
+  EXPECT_FALSE(solver.Entails(0, *(a != n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_EQ(solver.n_promoted_literals(), 0);
+  EXPECT_TRUE(solver.Entails(1, *(a != n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_EQ(solver.n_promoted_literals(), 1);
+  EXPECT_TRUE(solver.Entails(0, *(a != n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Determines(0, c) && solver.Determines(0, c).val == n2);
+  EXPECT_TRUE(solver.Entails(1, *(a != n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_EQ(solver.n_promoted_literals(), 1);
+  // More promotions than fit into the plies before a consolidation.
+  std::vector<Formula::Ref> phis;
+  for (int i = 0; i < 40; ++i) {
+    auto d = ctx.CreateFunction(SomeSort, 0)();
+    auto e = ctx.CreateFunction(SomeSort, 0)();
+    solver.grounder().AddClause(( d != n1 || e == n1 ).as_clause());
+    solver.grounder().AddClause(( d != n1 || e != n1 ).as_clause());
+    phis.push_back((d != n1)->NF(ctx.sf(), ctx.tf()));
+  }
+  for (const Formula::Ref& phi : phis) {
+    EXPECT_FALSE(solver.Entails(0, *phi));
+    EXPECT_TRUE(solver.Entails(1, *phi));
+  }
+  EXPECT_EQ(solver.n_promoted_literals(), 1 + phis.size());
+  for (const Formula::Ref& phi : phis) {
+    EXPECT_TRUE(solver.Entails(0, *phi));
+  }
+}
+
+TEST(SolverTest, DeterminesAll) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto SomeSort = ctx.sf()->CreateSort();  RegisterSort(SomeSort, "");
+  auto n1 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n1);
+  auto n2 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n2);
+  auto a = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(a);
+  auto b = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(b);
+  auto c = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(c);
+  auto d = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(d);
+  solver.grounder().AddClause(( a != n1 || b == n1 ).as_clause());
+  solver.grounder().AddClause(( a != n1 || b != n1 ).as_clause());
+  solver.grounder().AddClause(( c == n1 || c == n2 ).as_clause());
+  solver.grounder().AddClause(( c != n1 || a == n1 ).as_clause());
+  solver.grounder().AddClause(( d == n1 || d == n2 ).as_clause());
+  solver.grounder().AddClause(( d != n2 || b == n2 ).as_clause());
+  const Term::Vector terms{a, b, c, d};
+  EXPECT_TRUE(solver.DeterminesAll(0, terms).names.empty());
+  EXPECT_EQ(solver.DeterminesAll(1, terms).names.size(), 1);
+  EXPECT_EQ(solver.DeterminesAll(1, terms).names[c], n2);
+  EXPECT_TRUE(solver.DeterminesAll(1, terms).unknown.empty());
+  for (int k = 0; k <= 3; ++k) {
+    for (bool assume_consistent : {false, true}) {
+      const std::unordered_map<Term, Term> ts = solver.DeterminesAll(k, terms, assume_consistent).names;
+      for (const Term t : terms) {
+        const internal::Maybe<Term> r = solver.Determines(k, t, assume_consistent);
+        EXPECT_EQ(ts.count(t) > 0, static_cast<bool>(r));
+        if (r) {
+          EXPECT_EQ(ts.at(t), r.val);
+        }
+      }
+    }
+  }
+}
+
+TEST(SolverTest, EntailsBatch) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto SomeSort = ctx.sf()->CreateSort();  RegisterSort(SomeSort, "");
+  auto n1 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n1);
+  auto n2 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n2);
+  auto x = ctx.CreateVariable(SomeSort);      REGISTER_SYMBOL(x);
+  auto a = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(a);
+  auto b = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(b);
+  auto c = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(c);
+  auto d = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(d);
+  solver.grounder().AddClause(( a != n1 || b == n1 ).as_clause());
+  solver.grounder().AddClause(( a != n1 || b != n1 ).as_clause());
+  solver.grounder().AddClause(( c == n1 || c == n2 ).as_clause());
+  solver.grounder().AddClause(( c != n1 || a == n1 ).as_clause());
+  solver.grounder().AddClause(( d == n1 || d == n2 ).as_clause());
+  std::vector<Formula::Ref> refs;
+  refs.push_back((a != n1)->NF(ctx.sf(), ctx.tf()));
+  refs.push_back((c == n2)->NF(ctx.sf(), ctx.tf()));
+  refs.push_back((c == n1)->NF(ctx.sf(), ctx.tf()));
+  refs.push_back((d == n1)->NF(ctx.sf(), ctx.tf()));
+  refs.push_back((d == n1 || d == n2)->NF(ctx.sf(), ctx.tf()));
+  refs.push_back((Ex(x, d == x))->NF(ctx.sf(), ctx.tf()));
+  refs.push_back((Fa(x, c == x || c != x))->NF(ctx.sf(), ctx.tf()));
+  std::vector<const Formula*> phis;
+  for (const Formula::Ref& phi : refs) {
+    phis.push_back(phi.get());
+  }
+  const Solver::Answer no = Solver::kNo;
+  const Solver::Answer yes = Solver::kYes;
+  EXPECT_EQ(solver.EntailsBatch(0, phis), std::vector<Solver::Answer>({no, no, no, no, yes, no, yes}));
+  EXPECT_EQ(solver.EntailsBatch(1, phis), std::vector<Solver::Answer>({yes, yes, no, no, yes, yes, yes}));
+  for (int k = 0; k <= 3; ++k) {
+    for (bool assume_consistent : {false, true}) {
+      const std::vector<Solver::Answer> rs = solver.EntailsBatch(k, phis, assume_consistent);
+      ASSERT_EQ(rs.size(), phis.size());
+      for (size_t i = 0; i < phis.size(); ++i) {
+        EXPECT_EQ(rs[i] == yes, solver.Entails(k, *phis[i], assume_consistent));
+      }
+    }
+  }
+}
+
+TEST(SolverTest, PossibleValues) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto SomeSort = ctx.sf()->CreateSort();  RegisterSort(SomeSort, "");
+  auto n1 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n1);
+  auto n2 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n2);
+  auto n3 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n3);
+  auto n4 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n4);
+  auto a = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(a);
+  auto b = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(b);
+  auto c = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(c);
+  auto d = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(d);
+  solver.grounder().AddClause(( a == n1 || a == n2 || a == n3 ).as_clause());
+  solver.grounder().AddClause(( a != n3 ).as_clause());
+  solver.grounder().AddClause(( a != n1 || b == n1 ).as_clause());
+  solver.grounder().AddClause(( a != n1 || b != n1 ).as_clause());
+  solver.grounder().AddClause(( c == n2 ).as_clause());
+  EXPECT_EQ(solver.PossibleValues(1, c).names, std::unordered_set<Term>({n2}));
+  EXPECT_EQ(solver.PossibleValues(1, a).names, std::unordered_set<Term>({n2}));
+  EXPECT_EQ(solver.PossibleValues(1, a).others, Solver::kNo);
+  EXPECT_TRUE(solver.PossibleValues(0, d).names.empty());
+  EXPECT_EQ(solver.PossibleValues(0, d).others, Solver::kNo);
+  {
+    // d is unconstrained, but it takes a split to make a consistent.
+    const Solver::Values vs = solver.PossibleValues(2, d);
+    EXPECT_EQ(vs.names.count(n1) + vs.names.count(n2) + vs.names.count(n3), 3u);
+    EXPECT_EQ(vs.others, Solver::kYes);
+    EXPECT_TRUE(vs.unknown.empty());
+  }
+  for (int k = 0; k <= 2; ++k) {
+    for (bool assume_consistent : {false, true}) {
+      for (const Term t : {a, b, c, d}) {
+        const Solver::Values vs = solver.PossibleValues(k, t, assume_consistent);
+        for (const Term n : {n1, n2, n3}) {
+          EXPECT_EQ(vs.names.count(n) > 0, solver.Consistent(k, *Formula::Factory::Atomic(Clause{Literal::Eq(t, n)}), assume_consistent));
+        }
+        // n4 occurs neither in the knowledge base nor with t.
+        EXPECT_EQ(vs.others == Solver::kYes,
+                  solver.Consistent(k, *Formula::Factory::Atomic(Clause{Literal::Eq(t, n4)}), assume_consistent));
+      }
+    }
+  }
+}
+
+TEST(SolverTest, UpTo) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto SomeSort = ctx.sf()->CreateSort();  RegisterSort(SomeSort, "");
+  auto n1 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n1);
+  auto n2 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n2);
+  auto a = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(a);
+  auto b = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(b);
+  auto c = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(c);
+  auto d = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(d);
+  solver.grounder().AddClause(( a != n1 || b == n1 ).as_clause());
+  solver.grounder().AddClause(( a != n1 || b != n1 ).as_clause());
+  solver.grounder().AddClause(( c == n1 || c == n2 ).as_clause());
+  solver.grounder().AddClause(( c != n1 || a == n1 ).as_clause());
+  solver.grounder().AddClause(( d == n2 ).as_clause());
+  Formula::belief_level k = 7;
+  EXPECT_TRUE(solver.EntailsUpTo(3, *(d == n2)->NF(ctx.sf(), ctx.tf()), &k));
+  EXPECT_EQ(k, 0);
+  EXPECT_TRUE(solver.EntailsUpTo(3, *(a != n1)->NF(ctx.sf(), ctx.tf()), &k));
+  EXPECT_EQ(k, 1);
+  k = 7;
+  EXPECT_FALSE(solver.EntailsUpTo(3, *(b == n1)->NF(ctx.sf(), ctx.tf()), &k));
+  EXPECT_EQ(k, 7);
+  EXPECT_TRUE(solver.DeterminesUpTo(3, d, &k) && solver.DeterminesUpTo(3, d).val == n2);
+  EXPECT_EQ(k, 0);
+  EXPECT_TRUE(solver.DeterminesUpTo(3, c, &k) && solver.DeterminesUpTo(3, c).val == n2);
+  EXPECT_EQ(k, 1);
+  EXPECT_FALSE(solver.DeterminesUpTo(3, b, &k));
+  Solver::Budget no_splits;
+  no_splits.max_splits = 0;
+  solver.set_budget(no_splits);
+  EXPECT_TRUE(solver.EntailsUpTo(3, *(d == n2)->NF(ctx.sf(), ctx.tf()), &k));
+  EXPECT_FALSE(solver.EntailsUpTo(3, *(a != n1)->NF(ctx.sf(), ctx.tf()), &k));
+  EXPECT_FALSE(solver.DeterminesUpTo(3, c, &k));
+  Solver::Budget no_time;
+  no_time.max_time = Solver::Budget::Clock::duration::zero();
+  solver.set_budget(no_time);
+  EXPECT_FALSE(solver.DeterminesUpTo(3, c, &k));
+  solver.set_budget(Solver::Budget());
+  EXPECT_TRUE(solver.Entails(1, *(a != n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Determines(1, c) && solver.Determines(1, c).val == n2);
+}
+
+TEST(SolverTest, UpTo_frontier) {
+  UnregisterAll();
+  auto setup = [](Context* ctx, HiTerm* g, HiTerm* T) {
+    auto Bool = ctx->sf()->CreateSort();
+    *T = ctx->CreateName(Bool);
+    auto x = ctx->CreateFunction(Bool, 0)();
+    auto y = ctx->CreateFunction(Bool, 0)();
+    *g = ctx->CreateFunction(Bool, 0)();
+    ctx->solver()->grounder().AddClause(( x == *T || y == *T || *g == *T ).as_clause());
+    ctx->solver()->grounder().AddClause(( x == *T || y != *T || *g == *T ).as_clause());
+    ctx->solver()->grounder().AddClause(( x != *T || y == *T || *g == *T ).as_clause());
+    ctx->solver()->grounder().AddClause(( x != *T || y != *T || *g == *T ).as_clause());
+  };
+  // The number of splits a query needs to run to completion.
+  auto splits = [&setup](std::function<bool(Context*, Formula*, const Solver::Budget&)> query) {
+    for (size_t n = 0; ; ++n) {
+      Context ctx;
+      HiTerm g, T;
+      setup(&ctx, &g, &T);
+      Solver::Budget budget;
+      budget.max_splits = n;
+      query(&ctx, &*(g == T)->NF(ctx.sf(), ctx.tf()), budget);
+      if (!ctx.solver()->aborted()) {
+        return n;
+      }
+    }
+  };
+  auto entails = [](Formula::belief_level k) {
+    return [k](Context* ctx, Formula* phi, const Solver::Budget& budget) {
+      ctx->solver()->set_budget(budget);
+      return ctx->solver()->Entails(k, *phi);
+    };
+  };
+  auto entails_up_to = [](Formula::belief_level k) {
+    return [k](Context* ctx, Formula* phi, const Solver::Budget& budget) {
+      return ctx->solver()->EntailsUpTo(k, *phi, budget);
+    };
+  };
+  // Level 2 only extends the nodes level 1 left open.
+  EXPECT_LT(splits(entails_up_to(2)), splits(entails(1)) + splits(entails(2)));
+  EXPECT_EQ(splits(entails_up_to(3)), splits(entails_up_to(2)));
+
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  HiTerm g, T;
+  setup(&ctx, &g, &T);
+  Solver::Budget budget;
+  budget.max_splits = splits(entails_up_to(2));
+  Formula::belief_level k = 7;
+  EXPECT_TRUE(solver.EntailsUpTo(3, *(g == T)->NF(ctx.sf(), ctx.tf()), budget, &k));
+  EXPECT_EQ(k, 2);
+  EXPECT_FALSE(solver.aborted());
+  // The budget is per call and leaves the solver's own budget untouched.
+  budget.max_splits = 0;
+  EXPECT_FALSE(solver.EntailsUpTo(3, *(g == T)->NF(ctx.sf(), ctx.tf()), budget, &k));
+  EXPECT_TRUE(solver.aborted());
+  EXPECT_FALSE(solver.DeterminesUpTo(3, g, budget, &k));
+  EXPECT_TRUE(solver.aborted());
+  EXPECT_TRUE(solver.DeterminesUpTo(3, g, &k) && solver.DeterminesUpTo(3, g).val == T);
+  EXPECT_EQ(k, 2);
+  EXPECT_FALSE(solver.aborted());
+}
+
+TEST(SolverTest, Budget) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto SomeSort = ctx.sf()->CreateSort();  RegisterSort(SomeSort, "");
+  auto n1 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n1);
+  auto n2 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n2);
+  auto a = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(a);
+  auto b = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(b);
+  auto c = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(c);
+  solver.grounder().AddClause(( a != n1 || b == n1 ).as_clause());
+  solver.grounder().AddClause(( a != n1 || b != n1 ).as_clause());
+  solver.grounder().AddClause(( c == n1 || c == n2 ).as_clause());
+  solver.grounder().AddClause(( c != n1 || a == n1 ).as_clause());
+  auto not_a = (a != n1)->NF(ctx.sf(), ctx.tf());
+  auto yes_a = (a == n1)->NF(ctx.sf(), ctx.tf());
+  std::atomic<bool> cancel(false);
+  Solver::Budget budget;
+  budget.cancel = &cancel;
+  solver.set_budget(budget);
+  EXPECT_TRUE(solver.Entails(1, *not_a));
+  EXPECT_FALSE(solver.aborted());
+  cancel = true;
+  EXPECT_FALSE(solver.Entails(1, *not_a));
+  EXPECT_TRUE(solver.aborted());
+  EXPECT_FALSE(solver.Determines(1, c));
+  EXPECT_TRUE(solver.aborted());
+  EXPECT_FALSE(solver.EntailsComplete(1, *not_a));
+  EXPECT_TRUE(solver.aborted());
+  EXPECT_EQ(solver.EntailsBatch(1, {not_a.get()}), std::vector<Solver::Answer>({Solver::kUnknown}));
+  {
+    const Solver::Determined ts = solver.DeterminesAll(1, {a, c});
+    EXPECT_TRUE(ts.names.empty());
+    EXPECT_EQ(ts.unknown, std::unordered_set<Term>({a, c}));
+  }
+  {
+    const Solver::Values vs = solver.PossibleValues(1, c);
+    EXPECT_TRUE(vs.names.empty());
+    EXPECT_TRUE(vs.unknown.count(n1) > 0 && vs.unknown.count(n2) > 0);
+    EXPECT_EQ(vs.others, Solver::kUnknown);
+  }
+  cancel = false;
+  EXPECT_EQ(solver.EntailsBatch(1, {not_a.get()}), std::vector<Solver::Answer>({Solver::kYes}));
+  EXPECT_TRUE(solver.EntailsComplete(1, *not_a));
+  EXPECT_FALSE(solver.EntailsComplete(1, *yes_a));
+  EXPECT_FALSE(solver.aborted());
+  budget.cancel = nullptr;
+  budget.deadline = Solver::Budget::Clock::now();
+  solver.set_budget(budget);
+  EXPECT_FALSE(solver.Entails(1, *not_a));
+  EXPECT_TRUE(solver.aborted());
+  EXPECT_TRUE(solver.Entails(0, *(c == n1 || c == n2)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_FALSE(solver.aborted());
+  budget.deadline = Solver::Budget::Clock::time_point::max();
+  budget.max_splits = 1000;
+  solver.set_budget(budget);
+  EXPECT_TRUE(solver.Determines(1, c) && solver.Determines(1, c).val == n2);
+  EXPECT_FALSE(solver.aborted());
+}
+
+TEST(SolverTest, CompiledQueries) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto SomeSort = ctx.sf()->CreateSort();  RegisterSort(SomeSort, "");
+  auto n1 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n1);
+  auto n2 = ctx.CreateName(SomeSort);         REGISTER_SYMBOL(n2);
+  auto x = ctx.CreateVariable(SomeSort);      REGISTER_SYMBOL(x);
+  auto a = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(a);
+  auto b = ctx.CreateFunction(SomeSort, 0)(); REGISTER_SYMBOL(b);
+  auto f = ctx.CreateFunction(SomeSort, 1);   REGISTER_SYMBOL(f);
+  solver.grounder().AddClause(( a == n1 ).as_clause());
+  solver.grounder().AddClause(( b == n1 || b == n2 ).as_clause());
+  solver.grounder().AddClause(( f(n1) == n2 ).as_clause());
+  for (int k = 0; k <= 1; ++k) {
+    EXPECT_TRUE(solver.Entails(k, *(~~(a == n1))->NF(ctx.sf(), ctx.tf())));
+    EXPECT_TRUE(solver.Entails(k, *(~(a != n1 || a == n2))->NF(ctx.sf(), ctx.tf())));
+    EXPECT_TRUE(solver.Entails(k, *Ex(x, a == x && f(x) == n2)->NF(ctx.sf(), ctx.tf())));
+    EXPECT_FALSE(solver.Entails(k, *Fa(x, f(x) == n2)->NF(ctx.sf(), ctx.tf())));
+    EXPECT_TRUE(solver.Entails(k, *Fa(x, a != x || f(x) == n2)->NF(ctx.sf(), ctx.tf())));
+    EXPECT_FALSE(solver.Entails(k, *Fa(x, a == x || f(x) != n2)->NF(ctx.sf(), ctx.tf())));
+  }
+  EXPECT_FALSE(solver.Entails(0, *(b == n1 || b == n2)->NF(ctx.sf(), ctx.tf())) &&
+               !solver.Entails(1, *(b == n1 || b == n2)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Entails(1, *Ex(x, b == x)->NF(ctx.sf(), ctx.tf())));
+}
+
+TEST(SolverTest, SymmetryPruning) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto Bool = ctx.sf()->CreateSort();          RegisterSort(Bool, "");
+  auto SomeSort = ctx.sf()->CreateSort();      RegisterSort(SomeSort, "");
+  auto T = ctx.CreateName(Bool);               REGISTER_SYMBOL(T);
+  auto e = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(e);
+  auto g = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(g);
+  auto h = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(h);
+  auto c = ctx.CreateFunction(SomeSort, 0)();  REGISTER_SYMBOL(c);
+  std::vector<decltype(e)> ds;
+  for (int i = 0; i < 8; ++i) {
+    ds.push_back(ctx.CreateFunction(Bool, 0)());
+    solver.grounder().AddClause(( ds.back() == T || e == T ).as_clause());
+    solver.grounder().AddClause(( ds.back() != T || g == T ).as_clause());
+  }
+  std::vector<decltype(T)> ns;
+  std::vector<Literal> c_is_n;
+  for (int i = 0; i < 6; ++i) {
+    ns.push_back(ctx.CreateName(SomeSort));
+    c_is_n.push_back(Literal::Eq(c, ns.back()));
+    solver.grounder().AddClause(( c != ns.back() || h == T ).as_clause());
+  }
+  solver.grounder().AddClause(Clause(c_is_n.begin(), c_is_n.end()));
+  std::vector<Formula::Ref> phis;
+  phis.push_back((e == T)->NF(ctx.sf(), ctx.tf()));
+  phis.push_back((e == T || g == T)->NF(ctx.sf(), ctx.tf()));
+  phis.push_back((h == T)->NF(ctx.sf(), ctx.tf()));
+  phis.push_back((ds[0] == T || e == T)->NF(ctx.sf(), ctx.tf()));
+  phis.push_back((ds[0] == T || ds[1] != T || e == T)->NF(ctx.sf(), ctx.tf()));
+  phis.push_back((c == ns[0] || h == T)->NF(ctx.sf(), ctx.tf()));
+  phis.push_back((c != ns[0] || c != ns[1])->NF(ctx.sf(), ctx.tf()));
+  for (int k = 0; k <= 2; ++k) {
+    for (const Formula::Ref& phi : phis) {
+      solver.set_prune_symmetries(false);
+      const bool r = solver.Entails(k, *phi);
+      solver.set_prune_symmetries(true);
+      EXPECT_EQ(solver.Entails(k, *phi), r);
+    }
+  }
+  // Interchangeable terms d_i fail alike, and interchangeable names n_i lead
+  // to the same branch, so only one of them is split.
+  Solver::Budget budget;
+  budget.max_splits = 6;
+  solver.set_budget(budget);
+  for (bool prune : {false, true}) {
+    solver.set_prune_symmetries(prune);
+    EXPECT_FALSE(solver.Entails(1, *phis[0]));
+    EXPECT_EQ(solver.aborted(), !prune);
+    EXPECT_EQ(solver.Entails(1, *phis[2]), prune);
+    EXPECT_EQ(solver.aborted(), !prune);
+  }
+}
+
+TEST(SolverTest, Cardinality) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto Bool = ctx.sf()->CreateSort();      RegisterSort(Bool, "");
+  auto T = ctx.CreateName(Bool);           REGISTER_SYMBOL(T);
+  auto p = ctx.CreateFunction(Bool, 0)();  REGISTER_SYMBOL(p);
+  auto q = ctx.CreateFunction(Bool, 0)();  REGISTER_SYMBOL(q);
+  auto r = ctx.CreateFunction(Bool, 0)();  REGISTER_SYMBOL(r);
+  auto s = ctx.CreateFunction(Bool, 0)();  REGISTER_SYMBOL(s);
+  // At least two of p, q, r; the first two imply s.
+  const Clause pqr = ( p == T || q == T || r == T ).as_clause();
+  EXPECT_EQ(solver.grounder().AddCardinality(Cardinality::AtLeast(2, pqr)), Setup::kOk);
+  solver.grounder().AddClause(( p != T || s == T ).as_clause());
+  solver.grounder().AddClause(( q != T || s == T ).as_clause());
+  EXPECT_TRUE(solver.Entails(0, *(p == T || q == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_FALSE(solver.Entails(0, *(p == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_FALSE(solver.Entails(0, *(s == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Entails(1, *(s == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Consistent(1, *(p != T)->NF(ctx.sf(), ctx.tf())));
+  // Without p, both q and r are propagated, which contradicts at most one.
+  solver.grounder().AddClause(( p != T ).as_clause());
+  EXPECT_TRUE(solver.Entails(0, *(q == T && r == T && s == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_EQ(solver.grounder().AddCardinality(Cardinality::AtMost(1, pqr.begin(), pqr.end())), Setup::kInconsistent);
+  EXPECT_TRUE(solver.Entails(0, *(p == T)->NF(ctx.sf(), ctx.tf())));
+}
+
+TEST(SolverTest, AllDifferent) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto SomeSort = ctx.sf()->CreateSort();      RegisterSort(SomeSort, "");
+  auto n1 = ctx.CreateName(SomeSort);          REGISTER_SYMBOL(n1);
+  auto n2 = ctx.CreateName(SomeSort);          REGISTER_SYMBOL(n2);
+  auto n3 = ctx.CreateName(SomeSort);          REGISTER_SYMBOL(n3);
+  auto a = ctx.CreateFunction(SomeSort, 0)();  REGISTER_SYMBOL(a);
+  auto b = ctx.CreateFunction(SomeSort, 0)();  REGISTER_SYMBOL(b);
+  auto c = ctx.CreateFunction(SomeSort, 0)();  REGISTER_SYMBOL(c);
+  const Term ts[] = {a, b, c};
+  const Term ns[] = {n1, n2, n3};
+  EXPECT_EQ(solver.grounder().AddAllDifferent(AllDifferent(std::begin(ts), std::end(ts), std::begin(ns), std::end(ns))),
+            Setup::kOk);
+  solver.grounder().AddClause(( a != n1 ).as_clause());
+  EXPECT_TRUE(solver.Entails(0, *(b == n1 || c == n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_FALSE(solver.Entails(0, *(b == n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_FALSE(solver.Entails(1, *(b == n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Entails(1, *(a == n2 || a == n3)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Consistent(1, *(b == n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_FALSE(solver.Consistent(1, *(b == n1 && c == n1)->NF(ctx.sf(), ctx.tf())));
+  // With a = n2 and b != n1, only n3 is left for b and only c can take n1.
+  solver.grounder().AddClause(( a == n2 ).as_clause());
+  solver.grounder().AddClause(( b != n1 ).as_clause());
+  EXPECT_TRUE(solver.Entails(0, *(b == n3 && c == n1)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Determines(0, c) && solver.Determines(0, c).val == n1);
+}
+
+TEST(SolverTest, QueryComponents) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto Bool = ctx.sf()->CreateSort();      RegisterSort(Bool, "");
+  auto T = ctx.CreateName(Bool);           REGISTER_SYMBOL(T);
+  auto f = ctx.CreateFunction(Bool, 0)();  REGISTER_SYMBOL(f);
+  auto g = ctx.CreateFunction(Bool, 0)();  REGISTER_SYMBOL(g);
+  auto h = ctx.CreateFunction(Bool, 0)();  REGISTER_SYMBOL(h);
+  // The component of g and h is inconsistent, but only a split reveals it.
+  solver.grounder().AddClause(( g == T || h == T ).as_clause());
+  solver.grounder().AddClause(( g == T || h != T ).as_clause());
+  solver.grounder().AddClause(( g != T || h == T ).as_clause());
+  solver.grounder().AddClause(( g != T || h != T ).as_clause());
+  EXPECT_FALSE(solver.split_query_components_only());
+  EXPECT_FALSE(solver.Entails(0, *(f == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Entails(1, *(f == T)->NF(ctx.sf(), ctx.tf())));
+  solver.set_split_query_components_only(true);
+  EXPECT_FALSE(solver.Entails(1, *(f == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Entails(1, *(g == T)->NF(ctx.sf(), ctx.tf())));
+  solver.set_split_query_components_only(false);
+  EXPECT_TRUE(solver.Entails(1, *(f == T)->NF(ctx.sf(), ctx.tf())));
+}
+
+TEST(SolverTest, RetractAndForget) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto Bool = ctx.sf()->CreateSort();          RegisterSort(Bool, "");
+  auto Human = ctx.sf()->CreateSort();         RegisterSort(Human, "");
+  auto T = ctx.CreateName(Bool);               REGISTER_SYMBOL(T);
+  auto p = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(p);
+  auto q = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(q);
+  auto r = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(r);
+  auto Loves = ctx.CreateFunction(Bool, 2);    REGISTER_SYMBOL(Loves);
+  auto sue = ctx.CreateName(Human);            REGISTER_SYMBOL(sue);
+  auto x = ctx.CreateVariable(Human);          REGISTER_SYMBOL(x);
+  solver.set_promote_entailed_literals(true);
+  const Clause pr = ( p == T || r == T ).as_clause();
+  const Clause pq = ( p != T || q == T ).as_clause();
+  const Clause rq = ( r != T || q == T ).as_clause();
+  solver.grounder().AddClause(pr);
+  solver.grounder().AddClause(pq);
+  solver.grounder().AddClause(rq);
+  solver.grounder().AddClause(( Loves(x, x) == T ).as_clause());
+  EXPECT_FALSE(solver.Entails(0, *(q == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Entails(1, *(q == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_EQ(solver.n_promoted_literals(), 1);
+  EXPECT_TRUE(solver.Entails(0, *(q == T)->NF(ctx.sf(), ctx.tf())));
+  // The promoted literal goes along with the clause it was entailed from.
+  EXPECT_EQ(solver.Retract(rq), 1);
+  EXPECT_EQ(solver.Retract(rq), 0);
+  EXPECT_FALSE(solver.Entails(0, *(q == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_FALSE(solver.Entails(1, *(q == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_TRUE(solver.Entails(0, *(Loves(sue, sue) == T)->NF(ctx.sf(), ctx.tf())));
+  // The groundings and the units derived from the forgotten clauses vanish.
+  solver.grounder().AddClause(( p == T ).as_clause());
+  EXPECT_TRUE(solver.setup().Subsumes(( q == T ).as_clause()));
+  EXPECT_EQ(solver.Forget(std::unordered_set<Term>{p, Loves(sue, sue)}), 4);
+  EXPECT_FALSE(solver.setup().Subsumes(( q == T ).as_clause()));
+  EXPECT_FALSE(solver.Entails(1, *(Loves(sue, sue) == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_FALSE(solver.setup().Subsumes(pr));
+}
+
+TEST(SolverTest, Retract_plies) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  Grounder& g = solver.grounder();
+  auto Bool = ctx.sf()->CreateSort();          RegisterSort(Bool, "");
+  auto T = ctx.CreateName(Bool);               REGISTER_SYMBOL(T);
+  auto p = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(p);
+  auto q = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(q);
+  auto r = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(r);
+  auto s = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(s);
+  const Clause pq = ( p != T || q == T ).as_clause();
+  const Clause pt = ( p == T ).as_clause();
+  const Clause qrs = ( q != T || r == T || s == T ).as_clause();
+  const Clause rs = ( r == T || s == T ).as_clause();
+  const Cardinality card = Cardinality::AtMost(1, rs.begin(), rs.end());
+  g.AddClause(pq);
+  const Grounder::PlyId ply1 = g.last_ply_id();
+  g.AddClause(pt);
+  const Grounder::PlyId ply2 = g.last_ply_id();
+  g.AddCardinality(card);
+  g.AddClause(qrs);
+  EXPECT_TRUE(solver.setup().Subsumes(rs));
+  // Only the plies from the one that held the retracted clause on are redone.
+  EXPECT_EQ(g.Retract(card), 1);
+  EXPECT_TRUE(g.IsAlive(ply1));
+  EXPECT_TRUE(g.IsAlive(ply2));
+  EXPECT_TRUE(solver.setup().Subsumes(rs));
+  EXPECT_EQ(solver.setup().cardinalities().size(), 0);
+  EXPECT_EQ(solver.Retract(pt), 1);
+  EXPECT_TRUE(g.IsAlive(ply1));
+  EXPECT_FALSE(g.IsAlive(ply2));
+  EXPECT_FALSE(solver.setup().Subsumes(rs));
+  EXPECT_TRUE(solver.setup().Subsumes(pq));
+  EXPECT_TRUE(solver.setup().Subsumes(qrs));
+  {
+    // An Undo of a redone ply undoes its replacement.
+    Grounder::Undo undo1;
+    Grounder::Undo undo2;
+    g.AddClause(pt, &undo1);
+    g.AddClause(( r != T ).as_clause(), &undo2);
+    EXPECT_TRUE(solver.setup().Subsumes(( s == T ).as_clause()));
+    EXPECT_EQ(solver.Retract(qrs), 1);
+    EXPECT_FALSE(solver.setup().Subsumes(( s == T ).as_clause()));
+    EXPECT_TRUE(solver.setup().Subsumes(( q == T ).as_clause()));
+  }
+  EXPECT_FALSE(solver.setup().Subsumes(( q == T ).as_clause()));
+  EXPECT_TRUE(solver.setup().Subsumes(pq));
+  {
+    // Nothing is removed while a query ply is alive.
+    Grounder::Undo undo;
+    g.PrepareForQuery(q, &undo);
+    EXPECT_EQ(solver.Retract(pq), 0);
+    EXPECT_TRUE(solver.setup().Subsumes(pq));
+  }
+  EXPECT_EQ(solver.Retract(pq), 1);
+  EXPECT_FALSE(solver.setup().Subsumes(pq));
+}
+
+TEST(SolverTest, Clone) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto Bool = ctx.sf()->CreateSort();          RegisterSort(Bool, "");
+  auto Human = ctx.sf()->CreateSort();         RegisterSort(Human, "");
+  auto T = ctx.CreateName(Bool);               REGISTER_SYMBOL(T);
+  auto p = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(p);
+  auto q = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(q);
+  auto r = ctx.CreateFunction(Bool, 0)();      REGISTER_SYMBOL(r);
+  auto Loves = ctx.CreateFunction(Bool, 2);    REGISTER_SYMBOL(Loves);
+  auto sue = ctx.CreateName(Human);            REGISTER_SYMBOL(sue);
+  auto x = ctx.CreateVariable(Human);          REGISTER_SYMBOL(x);
+  const Clause pqr = ( p == T || q == T || r == T ).as_clause();
+  solver.grounder().AddCardinality(Cardinality::AtLeast(2, pqr));
+  solver.grounder().AddClause(( p != T || Loves(x, sue) == T ).as_clause());
+  solver.grounder().AddClause(( q != T || Loves(sue, x) == T ).as_clause());
+  solver.grounder().AddClause(( Loves(x, x) != T || r == T ).as_clause());
+  solver.grounder().Consolidate();
+  std::vector<Formula::Ref> phis;
+  phis.push_back((p == T || q == T)->NF(ctx.sf(), ctx.tf()));
+  phis.push_back((Loves(sue, sue) == T)->NF(ctx.sf(), ctx.tf()));
+  phis.push_back((Ex(x, Loves(x, sue) == T))->NF(ctx.sf(), ctx.tf()));
+  phis.push_back((r == T)->NF(ctx.sf(), ctx.tf()));
+  std::vector<bool> entailed;
+  std::vector<bool> consistent;
+  for (int k = 0; k <= 2; ++k) {
+    for (const Formula::Ref& phi : phis) {
+      entailed.push_back(solver.Entails(k, *phi));
+      consistent.push_back(solver.Consistent(k, *phi));
+    }
+  }
+  {
+    // The solver must not be used while the clone references its clauses.
+    Solver clone = solver.Clone();
+    EXPECT_GT(clone.setup().n_references(), 0u);
+    size_t i = 0;
+    for (int k = 0; k <= 2; ++k) {
+      for (const Formula::Ref& phi : phis) {
+        EXPECT_EQ(clone.Entails(k, *phi), entailed[i]);
+        EXPECT_EQ(clone.Consistent(k, *phi), consistent[i]);
+        ++i;
+      }
+    }
+    // The clone grows on its own, and consolidation copies the referenced clauses.
+    clone.grounder().AddClause(( p != T ).as_clause());
+    EXPECT_TRUE(clone.Entails(0, *(q == T && r == T)->NF(ctx.sf(), ctx.tf())));
+    clone.grounder().Consolidate();
+    EXPECT_EQ(clone.setup().n_references(), 0u);
+    EXPECT_TRUE(clone.Entails(0, *(Loves(sue, sue) == T)->NF(ctx.sf(), ctx.tf())));
+  }
+  EXPECT_FALSE(solver.Entails(0, *(q == T && r == T)->NF(ctx.sf(), ctx.tf())));
+  EXPECT_FALSE(solver.Entails(0, *(Loves(sue, sue) == T)->NF(ctx.sf(), ctx.tf())));
+}
+
+TEST(SolverTest, Collect) {
+  UnregisterAll();
+  Context ctx;
+  Solver& solver = *ctx.solver();
+  auto Bool = ctx.sf()->CreateSort();          RegisterSort(Bool, "");
+  auto Human = ctx.sf()->CreateSort();         RegisterSort(Human, "");
+  auto T = ctx.CreateName(Bool);               REGISTER_SYMBOL(T);
+  auto Loves = ctx.CreateFunction(Bool, 2);    REGISTER_SYMBOL(Loves);
+  auto sue = ctx.CreateName(Human);            REGISTER_SYMBOL(sue);
+  auto x = ctx.CreateVariable(Human);          REGISTER_SYMBOL(x);
+  solver.grounder().AddClause(( Loves(x, sue) == T ).as_clause());
+  EXPECT_TRUE(solver.Entails(0, *Fa(x, Loves(x, sue) == T)->NF(ctx.sf(), ctx.tf())));
+  ctx.tf()->Collect(ctx, T, sue, x);
+  const size_t n_terms = ctx.tf()->n_terms();
+  // Every round mentions a new name, but forgetting and collecting it brings
+  // the term factory back to the same size.
+  for (int i = 0; i < 10; ++i) {
+    auto bob = ctx.CreateName(Human);
+    solver.grounder().AddClause(( Loves(bob, bob) == T ).as_clause());
+    EXPECT_TRUE(solver.Entails(0, *(Loves(bob, bob) == T && Loves(bob, sue) == T)->NF(ctx.sf(), ctx.tf())));
+    EXPECT_EQ(solver.Forget(std::unordered_set<Term>{Loves(bob, bob)}), 1);
+    EXPECT_GT(ctx.tf()->Collect(ctx, T, sue, x), 0);
+    EXPECT_EQ(ctx.tf()->n_terms(), n_terms);
+    EXPECT_TRUE(solver.Entails(0, *Fa(x, Loves(x, sue) == T)->NF(ctx.sf(), ctx.tf())));
+  }
+}
+
 }  // namespace limbo
 
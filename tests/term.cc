@@ -151,5 +151,60 @@ TEST(TermTest, Isomorphic) {
   { auto u = Term::Isomorphic(fn2n1, fn1n1); EXPECT_FALSE(bool(u)); }
 }
 
+TEST(TermTest, Collect) {
+  Symbol::Factory& sf = *Symbol::Factory::Instance();
+  Term::Factory& tf = *Term::Factory::Instance();
+  const Symbol::Sort s = sf.CreateSort();
+  const Symbol f = sf.CreateFunction(s, 1);
+  const Term n = tf.CreateTerm(sf.CreateName(s));
+  const Term fn = tf.CreateTerm(f, {n});
+  const Term ffn = tf.CreateTerm(f, {fn});
+  const Term m = tf.CreateTerm(sf.CreateName(s));
+  const Term x = tf.CreateTerm(sf.CreateVariable(s));
+  EXPECT_NE(tf.CreateTerm(f, {m}), tf.CreateTerm(f, {x}));
+  // Everything but ffn and its subterms is freed, including the terms of other tests.
+  EXPECT_GE(tf.Collect(ffn), 4);
+  EXPECT_EQ(tf.n_terms(), 3);
+  EXPECT_EQ(ffn.arg(0), fn);
+  EXPECT_EQ(fn.arg(0), n);
+  EXPECT_EQ(tf.CreateTerm(f, {n}), fn);
+  // The freed slots are recycled, so the number of terms stays the same.
+  for (int i = 0; i < 100; ++i) {
+    const Term t = tf.CreateTerm(f, {tf.CreateTerm(sf.CreateName(s))});
+    EXPECT_TRUE(t.function() && t.arg(0).name() && t != fn && t != ffn);
+    EXPECT_EQ(tf.n_terms(), 5);
+    EXPECT_EQ(tf.Collect(ffn, fn), 2);
+  }
+  EXPECT_EQ(tf.Collect(), 3);
+  EXPECT_EQ(tf.n_terms(), 0);
+}
+
+TEST(TermTest, Instances) {
+  Symbol::Factory sf;
+  Term::Factory tf1;
+  Term::Factory tf2;
+  const Symbol::Sort s = sf.CreateSort();
+  const Symbol f = sf.CreateFunction(s, 1);
+  {
+    Term::Factory::Scope scope1(&tf1);
+    EXPECT_EQ(Term::Factory::Instance(), &tf1);
+    const Term n = tf1.CreateTerm(sf.CreateName(s));
+    const Term fn = tf1.CreateTerm(f, {n});
+    {
+      Term::Factory::Scope scope2(&tf2);
+      EXPECT_EQ(Term::Factory::Instance(), &tf2);
+      const Term x = tf2.CreateTerm(sf.CreateVariable(s));
+      const Term fx = tf2.CreateTerm(f, {x});
+      EXPECT_TRUE(fx.function() && fx.arg(0) == x && x.variable());
+      EXPECT_EQ(tf2.n_terms(), 2);
+    }
+    EXPECT_EQ(Term::Factory::Instance(), &tf1);
+    EXPECT_TRUE(fn.function() && fn.arg(0) == n && n.name());
+    EXPECT_EQ(tf1.n_terms(), 2);
+  }
+  EXPECT_NE(Term::Factory::Instance(), &tf1);
+  EXPECT_NE(Term::Factory::Instance(), &tf2);
+}
+
 }  // namespace limbo
 
@@ -0,0 +1,65 @@
+// vim:filetype=cpp:textwidth=120:shiftwidth=2:softtabstop=2:expandtab
+// Copyright 2017 Christoph Schwering
+
+#include <gtest/gtest.h>
+
+#include <limbo/internal/unionfind.h>
+
+namespace limbo {
+namespace internal {
+
+TEST(UnionFindTest, general) {
+  UnionFind<int> uf;
+  EXPECT_FALSE(uf.connected(1, 2));
+  EXPECT_TRUE(uf.connected(1, 1));
+  uf.Union(1, 2);
+  uf.Union(3, 4);
+  EXPECT_TRUE(uf.connected(1, 2));
+  EXPECT_TRUE(uf.connected(3, 4));
+  EXPECT_FALSE(uf.connected(1, 3));
+  uf.Mark(4);
+  EXPECT_FALSE(uf.marked(1));
+  EXPECT_TRUE(uf.marked(3));
+  EXPECT_FALSE(uf.marked(5));
+  const size_t n = uf.n_changes();
+  uf.Union(2, 3);
+  uf.Union(5, 6);
+  EXPECT_TRUE(uf.connected(1, 4));
+  EXPECT_TRUE(uf.marked(1));
+  EXPECT_TRUE(uf.connected(5, 6));
+  uf.Undo(n);
+  EXPECT_FALSE(uf.connected(1, 4));
+  EXPECT_FALSE(uf.marked(1));
+  EXPECT_TRUE(uf.marked(4));
+  EXPECT_FALSE(uf.connected(5, 6));
+  uf.Undo(0);
+  EXPECT_FALSE(uf.connected(1, 2));
+  EXPECT_FALSE(uf.marked(4));
+}
+
+TEST(UnionFindTest, Commit) {
+  UnionFind<int> uf;
+  uf.Union(1, 2);
+  uf.Mark(2);
+  EXPECT_GT(uf.n_changes(), 0u);
+  uf.Commit();
+  EXPECT_EQ(uf.n_changes(), 0u);
+  EXPECT_TRUE(uf.connected(1, 2));
+  EXPECT_TRUE(uf.marked(1));
+  uf.Union(2, 3);
+  uf.Union(4, 5);
+  EXPECT_TRUE(uf.connected(1, 3));
+  uf.Undo(0);
+  EXPECT_TRUE(uf.connected(1, 2));
+  EXPECT_FALSE(uf.connected(1, 3));
+  EXPECT_FALSE(uf.connected(4, 5));
+  EXPECT_TRUE(uf.marked(1));
+  uf.Clear();
+  EXPECT_FALSE(uf.connected(1, 2));
+  EXPECT_FALSE(uf.marked(1));
+  EXPECT_EQ(uf.n_changes(), 0u);
+}
+
+}  // namespace internal
+}  // namespace limbo
+